@@ -7,23 +7,40 @@
 // first to include <windows.h> -- so we try to include it before everything
 // else.
 #include "util/asio.h"
+#include "bucket/BucketIndex.h"
 #include "bucket/BucketManager.h"
 #include "bucket/LedgerCmp.h"
+#include "bucket/MergeCheckpoint.h"
+#include "bucket/MergeScheduler.h"
 #include "crypto/Hex.h"
 #include "crypto/Random.h"
 #include "crypto/SHA.h"
 #include "main/Application.h"
+#include "util/BufferedFileWriter.h"
+#include "util/CompressedFile.h"
 #include "util/Fs.h"
 #include "util/Logging.h"
 #include "util/TmpDir.h"
+#include "util/make_unique.h"
 #include "util/XDRStream.h"
 #include "xdrpp/message.h"
+#include "database/BulkInserter.h"
 #include "database/Database.h"
+#include "ledger/AccountFrame.h"
 #include "ledger/EntryFrame.h"
 #include "ledger/LedgerDelta.h"
+#include "ledger/OfferFrame.h"
+#include "ledger/TrustFrame.h"
 #include "medida/medida.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <fstream>
+#include <iterator>
 #include <future>
+#include <mutex>
+#include <thread>
+#include <tuple>
 
 namespace stellar
 {
@@ -70,15 +87,78 @@ LedgerEntryKey(LedgerEntry const& e)
     return k;
 }
 
+static uint32_t
+readUint32(char const* p)
+{
+    return (uint32_t(uint8_t(p[0])) << 24) | (uint32_t(uint8_t(p[1])) << 16) |
+           (uint32_t(uint8_t(p[2])) << 8) | uint32_t(uint8_t(p[3]));
+}
+
+LedgerKeyXDR
+BucketEntryKeyXDR(char const* body, size_t size)
+{
+    // Past the BucketEntryType: the LedgerEntryType and an AccountID, then
+    // whatever else the key of that type holds.
+    size_t const accountKeySize = 4 + 4 + 32;
+    if (size < accountKeySize)
+    {
+        throw xdr::xdr_runtime_error("malformed bucket entry");
+    }
+    size_t keySize;
+    switch (readUint32(body + 4))
+    {
+    case ACCOUNT:
+        keySize = accountKeySize;
+        break;
+    case TRUSTLINE:
+        if (size < accountKeySize + 4)
+        {
+            throw xdr::xdr_runtime_error("malformed bucket entry");
+        }
+        keySize = accountKeySize + 4;
+        switch (readUint32(body + accountKeySize))
+        {
+        case CURRENCY_TYPE_NATIVE:
+            break;
+        case CURRENCY_TYPE_ALPHANUM:
+            keySize += 4 + 32;
+            break;
+        default:
+            throw xdr::xdr_runtime_error("malformed bucket entry");
+        }
+        break;
+    case OFFER:
+        keySize = accountKeySize + 8;
+        break;
+    default:
+        throw xdr::xdr_runtime_error("malformed bucket entry");
+    }
+    if (size < keySize)
+    {
+        throw xdr::xdr_runtime_error("malformed bucket entry");
+    }
+    return LedgerKeyXDR{body + 4, keySize - 4};
+}
+
+LedgerKey
+LedgerKeyFromXDR(LedgerKeyXDR const& k)
+{
+    LedgerKey key;
+    xdr::xdr_get g(k.mData, k.mData + k.mSize);
+    xdr::xdr_argpack_archive(g, key);
+    return key;
+}
+
 Bucket::Bucket(std::string const& filename, uint256 const& hash)
     : mFilename(filename), mHash(hash)
 {
     assert(filename.empty() || fs::exists(filename));
     if (!filename.empty())
     {
+        mCompressed = CompressedFileReader::isCompressed(filename);
         CLOG(TRACE, "Bucket")
             << "Bucket::Bucket() created, file exists : "
-            << mFilename;
+            << mFilename << (mCompressed ? " (compressed)" : "");
     }
 }
 
@@ -89,6 +169,7 @@ Bucket::~Bucket()
         CLOG(TRACE, "Bucket") << "Bucket::~Bucket removing file: "
                               << mFilename;
         std::remove(mFilename.c_str());
+        std::remove(getIndexFilename().c_str());
     }
 }
 
@@ -108,76 +189,340 @@ Bucket::getFilename() const
     return mFilename;
 }
 
+size_t
+Bucket::getSize() const
+{
+    if (mFilename.empty())
+    {
+        return 0;
+    }
+    if (mCompressed)
+    {
+        CompressedFileReader in;
+        in.open(mFilename);
+        return in.size();
+    }
+    std::ifstream in(mFilename, std::ifstream::binary | std::ifstream::ate);
+    if (!in)
+    {
+        throw std::runtime_error("failed to open bucket file: " + mFilename);
+    }
+    return static_cast<size_t>(in.tellg());
+}
+
+bool
+Bucket::isCompressed() const
+{
+    return mCompressed;
+}
+
+void
+Bucket::writeUncompressed(std::string const& filename) const
+{
+    size_t const chunk = 1 << 20;
+    BufferedFileWriter out;
+    out.open(filename);
+    if (mCompressed)
+    {
+        CompressedFileReader in;
+        in.open(mFilename);
+        size_t n;
+        do
+        {
+            n = in.read(out.reserve(chunk), chunk);
+            out.commit(n);
+        } while (n != 0);
+    }
+    else if (!mFilename.empty())
+    {
+        std::ifstream in(mFilename, std::ifstream::binary);
+        while (in)
+        {
+            in.read(out.reserve(chunk), chunk);
+            auto n = static_cast<size_t>(in.gcount());
+            out.commit(n);
+            if (n == 0)
+            {
+                break;
+            }
+        }
+    }
+    out.close(false);
+}
+
 void
 Bucket::setRetain(bool r)
 {
     mRetain = r;
 }
 
+void
+Bucket::setMappedInput(bool m)
+{
+    mMappedInput = m;
+}
+
+bool
+Bucket::isMappedInput() const
+{
+    return mMappedInput;
+}
+
+void
+Bucket::setIndex(std::shared_ptr<BucketIndex const> index)
+{
+    mIndex = index;
+}
+
+std::shared_ptr<BucketIndex const> const&
+Bucket::getIndex() const
+{
+    return mIndex;
+}
+
+std::string
+Bucket::getIndexFilename() const
+{
+    return mFilename + ".index";
+}
+
 /**
  * Helper class that reads from the file underlying a bucket, keeping the bucket
- * alive for the duration of its existence.
+ * alive for the duration of its existence. Reads compressed bucket files block
+ * by block; others either through a buffered stream or through a memory
+ * mapping of the file, depending on the bucket's `mappedInput` flag.
+ *
+ * An iterator can optionally be restricted to the byte range [begin, end) of
+ * the bucket's uncompressed contents, where both bounds are record boundaries;
+ * this is used to merge disjoint key ranges of the same buckets independently.
+ *
+ * Records are decoded lazily: an iterator only locates the key in the current
+ * record's XDR, and decodes the whole entry the first time it is dereferenced.
+ * Merges order, hash and copy records by their raw bytes (see `key` and
+ * `record`), and so never decode most entries at all.
  */
 class Bucket::InputIterator
 {
     std::shared_ptr<Bucket const> mBucket;
 
-    // Validity and current-value of the iterator is funneled into a pointer. If
-    // non-null, it points to mEntry.
-    BucketEntry const* mEntryPtr;
+    // The current record, if `mValid`: its XDR body, still in the input
+    // stream's buffer (or mapping), and the key within it. `mEntry` holds the
+    // decoded entry once `mDecoded`.
+    bool mValid{false};
+    char const* mBody{nullptr};
+    uint32_t mBodySize{0};
+    LedgerKeyXDR mKey{nullptr, 0};
+    bool mDecoded{false};
+    bool mCompressed;
+    bool mMapped;
+    size_t mEnd;
+    size_t mEntryPos{0};
     XDRInputFileStream mIn;
+    XDRInputMappedFileStream mMappedIn;
+    XDRInputCompressedFileStream mCompressedIn;
     BucketEntry mEntry;
 
     void
     loadEntry()
     {
-        if (mIn.readOne(mEntry))
+        mValid = false;
+        mDecoded = false;
+        mEntryPos = pos();
+        if (mEntryPos < mEnd)
         {
-            mEntryPtr = &mEntry;
+            mValid = mCompressed
+                         ? mCompressedIn.readRecord(mBody, mBodySize)
+                         : mMapped ? mMappedIn.readRecord(mBody, mBodySize)
+                                   : mIn.readRecord(mBody, mBodySize);
         }
-        else
+        if (mValid)
         {
-            mEntryPtr = nullptr;
+            mKey = BucketEntryKeyXDR(mBody, mBodySize);
         }
     }
 
+    bool
+    moreInput() const
+    {
+        return mCompressed ? bool(mCompressedIn)
+                           : mMapped ? bool(mMappedIn) : bool(mIn);
+    }
+
   public:
     operator bool() const
     {
-        return mEntryPtr != nullptr;
+        return mValid;
     }
 
     BucketEntry const& operator*()
     {
-        return *mEntryPtr;
+        assert(mValid);
+        if (!mDecoded)
+        {
+            xdr::xdr_get g(mBody, mBody + mBodySize);
+            xdr::xdr_argpack_archive(g, mEntry);
+            mDecoded = true;
+        }
+        return mEntry;
+    }
+
+    // The key of the current entry, in its encoding.
+    LedgerKeyXDR const&
+    key() const
+    {
+        assert(mValid);
+        return mKey;
+    }
+
+    // The XDR body of the current record, valid until the iterator moves.
+    char const*
+    record(uint32_t& size) const
+    {
+        assert(mValid);
+        size = mBodySize;
+        return mBody;
     }
 
-    InputIterator(std::shared_ptr<Bucket const> bucket)
-        : mBucket(bucket), mEntryPtr(nullptr)
+    // How the iterator reads its range, for the readahead of mapped files:
+    // front to back (SCAN), or skipping through it by seeks (SPARSE).
+    enum Access
+    {
+        SCAN,
+        SPARSE
+    };
+
+    InputIterator(std::shared_ptr<Bucket const> bucket, size_t begin = 0,
+                  size_t end = SIZE_MAX, Access access = SCAN)
+        : mBucket(bucket)
+        , mCompressed(bucket->mCompressed)
+        , mMapped(!mCompressed && bucket->mMappedInput)
+        , mEnd(end)
     {
         if (!mBucket->mFilename.empty())
         {
             CLOG(TRACE, "Bucket") << "Bucket::InputIterator opening file to read: "
-                               << mBucket->mFilename;
-            mIn.open(mBucket->mFilename);
-            loadEntry();
+                               << mBucket->mFilename
+                               << (mCompressed ? " (compressed)"
+                                               : mMapped ? " (mapped)" : "");
+            if (mCompressed)
+            {
+                mCompressedIn.open(mBucket->mFilename);
+            }
+            else if (mMapped)
+            {
+                mMappedIn.open(mBucket->mFilename);
+                adviseMapping(begin, end, access);
+            }
+            else
+            {
+                mIn.open(mBucket->mFilename);
+            }
+            seek(begin);
+        }
+    }
+
+    // Only a scan of the whole file is worth reading ahead in full: a ranged
+    // one (a partition, or the page of a point lookup) reads ahead just its
+    // range, and a sparse one as little as possible.
+    void
+    adviseMapping(size_t begin, size_t end, Access access)
+    {
+        if (access == SPARSE)
+        {
+            mMappedIn.advise(MappedFile::ADVICE_RANDOM);
+        }
+        else if (begin == 0 && end == SIZE_MAX)
+        {
+            mMappedIn.advise(MappedFile::ADVICE_SEQUENTIAL);
+            mMappedIn.advise(MappedFile::ADVICE_WILLNEED);
+        }
+        else if (end == SIZE_MAX)
+        {
+            mMappedIn.advise(MappedFile::ADVICE_SEQUENTIAL, begin);
+        }
+        else
+        {
+            mMappedIn.advise(MappedFile::ADVICE_WILLNEED, begin, end);
         }
     }
 
     ~InputIterator()
     {
         mIn.close();
+        mMappedIn.close();
+        mCompressedIn.close();
+    }
+
+    BucketIndex const*
+    getIndex() const
+    {
+        return mBucket->mIndex.get();
+    }
+
+    // Offset in the bucket's uncompressed contents of the record following
+    // the current one.
+    size_t
+    pos() const
+    {
+        return mCompressed ? mCompressedIn.pos()
+                           : mMapped ? mMappedIn.pos() : mIn.pos();
+    }
+
+    // Offset of the record holding the current entry, or the end of input if
+    // there is none: seeking there restores the iterator's position.
+    size_t
+    entryPos() const
+    {
+        return mEntryPos;
+    }
+
+    // Reposition to the record starting at offset `p` and load it.
+    void
+    seek(size_t p)
+    {
+        if (mBucket->mFilename.empty())
+        {
+            return;
+        }
+        if (mCompressed)
+        {
+            mCompressedIn.seek(p);
+        }
+        else if (mMapped)
+        {
+            mMappedIn.seek(p);
+        }
+        else
+        {
+            mIn.seek(p);
+        }
+        loadEntry();
+    }
+
+    // Step over the next record without decoding it, returning false at the
+    // end of input. Only used to sample record offsets; leaves the current
+    // value of the iterator stale.
+    bool
+    skipOne()
+    {
+        if (mBucket->mFilename.empty() || pos() >= mEnd)
+        {
+            return false;
+        }
+        return mCompressed ? mCompressedIn.skipOne()
+                           : mMapped ? mMappedIn.skipOne() : mIn.skipOne();
     }
 
     InputIterator& operator++()
     {
-        if (mIn)
+        if (moreInput())
         {
             loadEntry();
         }
         else
         {
-            mEntryPtr = nullptr;
+            mValid = false;
+            mEntryPos = pos();
         }
         return *this;
     }
@@ -186,66 +531,307 @@ class Bucket::InputIterator
 /**
  * Helper class that points to an output tempfile. Absorbs BucketEntries and
  * hashes them while writing to either destination. Produces a Bucket when done.
+ *
+ * When constructed with `hashing` false the output is one part of a larger
+ * bucket: it is not hashed, and is finished with `finishPart` rather than
+ * `getBucket`.
+ *
+ * When constructed with `compress` true the file is written in the
+ * block-compressed format. The hash, the index and the byte counts are those
+ * of the uncompressed records either way.
+ *
+ * An uncompressed output can be checkpointed (see MergeCheckpoint), and the
+ * output of an interrupted merge resumed from its checkpoint.
  */
 class Bucket::OutputIterator
 {
     std::string mFilename;
-    XDROutputFileStream mOut;
+    bool mCompressed;
+    XDROutputBufferedFileStream mOut;
+    XDROutputCompressedFileStream mCompressedOut;
     std::unique_ptr<SHA256> mHasher;
+    std::shared_ptr<BucketIndex> mIndex;
     size_t mBytesPut{0};
     size_t mObjectsPut{0};
 
+    bool
+    isOpen() const
+    {
+        return mCompressed ? bool(mCompressedOut) : bool(mOut);
+    }
+
+    void
+    close(bool durable)
+    {
+        if (mCompressed)
+        {
+            mCompressedOut.close(durable);
+        }
+        else
+        {
+            mOut.close(durable);
+        }
+    }
+
+    void
+    resume(MergeCheckpoint const& checkpoint, size_t expectedBytes)
+    {
+        auto bytesPut = static_cast<size_t>(checkpoint.mBytesPut);
+        XDRInputFileStream in;
+        in.open(mFilename);
+        BucketEntry e;
+        while (mBytesPut < bytesPut && in.readOne(e))
+        {
+            mIndex->add(e, BucketIndex::hashKey(e), mBytesPut);
+            mBytesPut = in.pos();
+            mObjectsPut++;
+        }
+        in.close();
+        if (mBytesPut != bytesPut || mObjectsPut != checkpoint.mObjectsPut)
+        {
+            throw std::runtime_error("merge output does not match checkpoint: " +
+                                     mFilename);
+        }
+        if (mHasher)
+        {
+            mHasher = SHA256::resume(checkpoint.mHashState);
+        }
+        mOut.reopen(mFilename, mBytesPut, expectedBytes, mHasher.get());
+    }
+
   public:
-    OutputIterator(std::string const& tmpDir)
-        : mFilename(randomBucketName(tmpDir))
-        , mHasher(SHA256::create())
+    // The entries put are added to `index`, which must be sized for them (see
+    // BucketIndex). `expectedBytes`, if not 0, is reserved for an uncompressed
+    // file (see Config::BUCKET_PREALLOCATE); the sum of the sizes of the
+    // inputs of a merge is an upper bound.
+    OutputIterator(std::string const& tmpDir,
+                   std::shared_ptr<BucketIndex> index, bool hashing = true,
+                   size_t expectedBytes = 0, bool compress = false)
+        : OutputIterator(randomBucketName(tmpDir), index, hashing,
+                         expectedBytes, compress, nullptr)
+    {
+    }
+
+    // As above, but write to `filename`. If `resumeFrom` is given, the file
+    // holds the output of a merge interrupted after writing the
+    // `resumeFrom->mBytesPut` bytes recorded there, and writing continues
+    // after them; the index of those bytes is rebuilt by reading them back.
+    // Throws std::runtime_error if they do not match the checkpoint.
+    OutputIterator(std::string const& filename,
+                   std::shared_ptr<BucketIndex> index, bool hashing,
+                   size_t expectedBytes, bool compress,
+                   MergeCheckpoint const* resumeFrom)
+        : mFilename(filename)
+        , mCompressed(compress)
+        , mHasher(hashing ? SHA256::create() : nullptr)
+        , mIndex(index)
     {
         CLOG(TRACE, "Bucket") << "Bucket::OutputIterator opening file to write: "
-                           << mFilename;
-        mOut.open(mFilename);
+                           << mFilename << (mCompressed ? " (compressed)" : "");
+        if (resumeFrom)
+        {
+            assert(!mCompressed);
+            resume(*resumeFrom, expectedBytes);
+        }
+        else if (mCompressed)
+        {
+            mCompressedOut.open(mFilename, 0, mHasher.get());
+        }
+        else
+        {
+            mOut.open(mFilename, expectedBytes, mHasher.get());
+        }
+    }
+
+    size_t
+    getBytesPut() const
+    {
+        return mBytesPut;
     }
 
     void
     put(BucketEntry const& e)
     {
-        mOut.writeOne(e, mHasher.get(), &mBytesPut);
+        put(e, BucketIndex::hashKey(e));
+    }
+
+    // As above, for callers that have already hashed the entry's key.
+    void
+    put(BucketEntry const& e, uint64_t keyHash)
+    {
+        mIndex->add(e, keyHash, mBytesPut);
+        if (mCompressed)
+        {
+            mCompressedOut.writeOne(e, &mBytesPut);
+        }
+        else
+        {
+            mOut.writeOne(e, &mBytesPut);
+        }
+        mObjectsPut++;
+    }
+
+    // Put the current entry of `in`, whose key hashes to `keyHash`, by copying
+    // its record as read rather than re-encoding the entry.
+    void
+    put(Bucket::InputIterator& in, uint64_t keyHash)
+    {
+        uint32_t size;
+        char const* body = in.record(size);
+        mIndex->add(in.key(), keyHash, mBytesPut);
+        if (mCompressed)
+        {
+            mCompressedOut.writeRecord(body, size, &mBytesPut);
+        }
+        else
+        {
+            mOut.writeRecord(body, size, &mBytesPut);
+        }
         mObjectsPut++;
     }
 
     std::shared_ptr<Bucket>
     getBucket(BucketManager& bucketManager)
     {
-        assert(mOut);
-        mOut.close();
+        assert(isOpen());
+        assert(mHasher);
         if (mObjectsPut == 0 || mBytesPut == 0)
         {
             assert(mObjectsPut == 0);
             assert(mBytesPut == 0);
             CLOG(DEBUG, "Bucket") << "Deleting empty bucket file " << mFilename;
+            close(false);
             std::remove(mFilename.c_str());
             return std::make_shared<Bucket>();
         }
+        // The file is renamed into the bucket directory on adoption; make its
+        // contents durable first, so a crash cannot leave a bucket that is
+        // named for its hash but holds something else.
+        close(true);
+        mIndex->finish(mBytesPut);
         return bucketManager.adoptFileAsBucket(mFilename, mHasher->finish(),
-                                            mObjectsPut, mBytesPut);
+                                            mObjectsPut, mBytesPut, mIndex);
+    }
+
+    // Make everything put so far durable, and record it in `checkpoint`.
+    void
+    checkpoint(MergeCheckpoint& checkpoint)
+    {
+        assert(isOpen());
+        assert(!mCompressed);
+        mOut.sync();
+        checkpoint.mBytesPut = mBytesPut;
+        checkpoint.mObjectsPut = mObjectsPut;
+        if (mHasher)
+        {
+            checkpoint.mHashState = mHasher->saveState();
+        }
+    }
+
+    // Close an unhashed part and return its filename; the caller takes over
+    // responsibility for the file. The part's index is left unfinished, to be
+    // appended to that of the bucket the part becomes a piece of. A `durable`
+    // part survives a crash once this returns.
+    std::string const&
+    finishPart(size_t& nObjects, size_t& nBytes,
+               std::shared_ptr<BucketIndex>& index, bool durable = false)
+    {
+        assert(isOpen());
+        assert(!mHasher);
+        close(durable);
+        nObjects = mObjectsPut;
+        nBytes = mBytesPut;
+        index = mIndex;
+        return mFilename;
     }
 };
 
-bool
-Bucket::containsBucketIdentity(BucketEntry const& id) const
+// Number of entries in `b`: as counted by its index, or else by walking its
+// records without decoding them.
+static size_t
+countEntries(std::shared_ptr<Bucket const> const& b)
 {
-    BucketEntryIdCmp cmp;
-    Bucket::InputIterator iter(shared_from_this());
+    if (b->getFilename().empty())
+    {
+        return 0;
+    }
+    if (b->getIndex())
+    {
+        return static_cast<size_t>(b->getIndex()->getKeyCount());
+    }
+    Bucket::InputIterator iter(b);
+    size_t n = 0;
+    do
+    {
+        ++n;
+    } while (iter.skipOne());
+    return n;
+}
+
+std::shared_ptr<BucketIndex>
+Bucket::buildIndex() const
+{
+    auto self = shared_from_this();
+    auto index = std::make_shared<BucketIndex>(countEntries(self));
+    Bucket::InputIterator iter(self);
+    size_t p = 0;
     while (iter)
     {
-        if (!(cmp(*iter, id) || cmp(id, *iter)))
+        index->add(*iter, BucketIndex::hashKey(*iter), p);
+        p = iter.pos();
+        ++iter;
+    }
+    index->finish(p);
+    return index;
+}
+
+bool
+Bucket::getBucketEntry(LedgerKey const& key, BucketEntry& entry) const
+{
+    if (mFilename.empty())
+    {
+        return false;
+    }
+    LedgerEntryIdCmp cmp;
+    size_t begin = 0, end = SIZE_MAX;
+    if (mIndex)
+    {
+        if (!mIndex->mayContain(key) || !mIndex->findPage(key, begin, end))
         {
-            return true;
+            return false;
         }
-        ++iter;
+    }
+    Bucket::InputIterator iter(shared_from_this(), begin, end);
+    for (; iter; ++iter)
+    {
+        auto const& e = *iter;
+        bool less = (e.type() == LIVEENTRY) ? cmp(e.liveEntry(), key)
+                                            : cmp(e.deadEntry(), key);
+        if (less)
+        {
+            continue;
+        }
+        bool greater = (e.type() == LIVEENTRY) ? cmp(key, e.liveEntry())
+                                               : cmp(key, e.deadEntry());
+        if (greater)
+        {
+            break;
+        }
+        entry = e;
+        return true;
     }
     return false;
 }
 
+bool
+Bucket::containsBucketIdentity(BucketEntry const& id) const
+{
+    BucketEntry e;
+    return getBucketEntry(id.type() == LIVEENTRY ? LedgerEntryKey(id.liveEntry())
+                                                 : id.deadEntry(),
+                          e);
+}
+
 std::pair<size_t, size_t>
 Bucket::countLiveAndDeadEntries() const
 {
@@ -273,14 +859,12 @@ Bucket::apply(Database& db) const
     {
         return;
     }
-    BucketEntry entry;
     LedgerHeader lh; // buckets, by definition are independent from the header
     LedgerDelta delta(lh);
-    XDRInputFileStream in;
-    in.open(getFilename());
-    while (in)
+    Bucket::InputIterator iter(shared_from_this());
+    while (iter)
     {
-        in.readOne(entry);
+        BucketEntry const& entry = *iter;
         if (entry.type() == LIVEENTRY)
         {
             EntryFrame::pointer ep = EntryFrame::FromXDR(entry.liveEntry());
@@ -290,139 +874,1033 @@ Bucket::apply(Database& db) const
         {
             EntryFrame::storeDelete(delta, db, entry.deadEntry());
         }
+        ++iter;
     }
 }
 
-std::shared_ptr<Bucket>
-Bucket::fresh(BucketManager& bucketManager, std::vector<LedgerEntry> const& liveEntries,
-              std::vector<LedgerKey> const& deadEntries)
+static LedgerEntryType
+bucketEntryType(BucketEntry const& e)
 {
-    std::vector<BucketEntry> live, dead, combined;
-    live.reserve(liveEntries.size());
-    dead.reserve(deadEntries.size());
+    return e.type() == LIVEENTRY ? e.liveEntry().type()
+                                 : e.deadEntry().type();
+}
 
-    for (auto const& e : liveEntries)
+// The tables holding entries of type `type`.
+static std::vector<std::string>
+entryTables(LedgerEntryType type)
+{
+    switch (type)
     {
-        BucketEntry ce;
-        ce.type(LIVEENTRY);
-        ce.liveEntry() = e;
-        live.push_back(ce);
+    case ACCOUNT:
+        return {"Accounts", "Signers"};
+    case TRUSTLINE:
+        return {"TrustLines"};
+    case OFFER:
+        return {"Offers"};
     }
+    throw std::runtime_error("unknown ledger entry type");
+}
 
-    for (auto const& e : deadEntries)
+static void
+dropEntryIndexes(soci::session& session, LedgerEntryType type)
+{
+    switch (type)
     {
-        BucketEntry ce;
-        ce.type(DEADENTRY);
-        ce.deadEntry() = e;
-        dead.push_back(ce);
+    case ACCOUNT:
+        AccountFrame::dropIndexes(session);
+        break;
+    case TRUSTLINE:
+        TrustFrame::dropIndexes(session);
+        break;
+    case OFFER:
+        OfferFrame::dropIndexes(session);
+        break;
     }
+}
 
-    std::sort(live.begin(), live.end(), BucketEntryIdCmp());
-
-    std::sort(dead.begin(), dead.end(), BucketEntryIdCmp());
-
-    OutputIterator liveOut(bucketManager.getTmpDir());
-    OutputIterator deadOut(bucketManager.getTmpDir());
-    for (auto const& e : live)
-    {
-        liveOut.put(e);
-    }
-    for (auto const& e : dead)
+static void
+createEntryIndexes(soci::session& session, LedgerEntryType type,
+                   std::string const& suffix)
+{
+    switch (type)
     {
-        deadOut.put(e);
+    case ACCOUNT:
+        AccountFrame::createIndexes(session, suffix);
+        break;
+    case TRUSTLINE:
+        TrustFrame::createIndexes(session, suffix);
+        break;
+    case OFFER:
+        OfferFrame::createIndexes(session, suffix);
+        break;
     }
-
-    auto liveBucket = liveOut.getBucket(bucketManager);
-    auto deadBucket = deadOut.getBucket(bucketManager);
-    return Bucket::merge(bucketManager, liveBucket, deadBucket);
 }
 
-inline void
-maybe_put(BucketEntryIdCmp const& cmp, Bucket::OutputIterator& out,
-          Bucket::InputIterator& in,
-          std::vector<Bucket::InputIterator>& shadowIterators)
+// Suffix of the tables Bucket::applyBulk stages concurrent loads in.
+static char const* const kStagingSuffix = "_load";
+
+// Replace the contents of the tables holding entries of type `type` with the
+// newest live entries of that type in `buckets`, writing through `session`.
+// If `staged`, the tables themselves are left alone and the entries go to
+// fresh copies of them named with kStagingSuffix instead, indexes and all
+// (PostgreSQL only).
+// Buckets sort entries by type first, so each one is read from the first page
+// of its index that can hold `type`, and only until the type changes.
+static size_t
+bulkLoadEntryType(Database& db, soci::session& session,
+                  std::vector<std::shared_ptr<Bucket>> const& buckets,
+                  LedgerEntryType type, bool staged = false)
 {
-    for (auto& si : shadowIterators)
+    LedgerKey firstKey;
+    firstKey.type(type);
+    std::vector<std::unique_ptr<Bucket::InputIterator>> iters;
+    for (auto const& b : buckets)
     {
-        // Advance the shadowIterator while it's less than the candidate
-        while (si && cmp(*si, *in))
+        if (!b->getFilename().empty())
         {
-            ++si;
+            size_t begin = 0, end = 0;
+            auto const& index = b->getIndex();
+            if (!index || !index->findPage(firstKey, begin, end))
+            {
+                begin = 0;
+            }
+            iters.push_back(make_unique<Bucket::InputIterator>(b, begin));
         }
-        // We have stepped si forward to the point that either si is exhausted,
-        // or else *si >= *in; we now check the opposite direction to see if we
-        // have equality.
-        if (si && !cmp(*in, *si))
-        {
-            // If so, then *in is shadowed in at least one level and we will
-            // not be doing a 'put'; we return early. There is no need to
-            // advance
-            // the other iterators, they will advance as and if necessary in
-            // future
-            // calls to maybe_put.
-            return;
+    }
+
+    std::string suffix = staged ? kStagingSuffix : "";
+    for (auto const& table : entryTables(type))
+    {
+        if (staged)
+        {
+            std::string staging = table + suffix;
+            session << "DROP TABLE IF EXISTS " + staging + ";";
+            session << "CREATE TABLE " + staging + " (LIKE " + table +
+                           " INCLUDING DEFAULTS INCLUDING CONSTRAINTS);";
+            // LIKE copies no indexes; the primary key is in place while
+            // loading, as on the table itself
+            std::string primaryKey;
+            session << "SELECT pg_get_constraintdef(oid) FROM pg_constraint "
+                       "WHERE conrelid = CAST(:t AS regclass) "
+                       "AND contype = 'p'",
+                soci::use(table), soci::into(primaryKey);
+            session << "ALTER TABLE " + staging + " ADD " + primaryKey + ";";
+        }
+        else
+        {
+            session << "DELETE FROM " + table + ";";
         }
     }
-    // Nothing shadowed.
-    out.put(*in);
+    if (!staged)
+    {
+        dropEntryIndexes(session, type);
+    }
+
+    std::unique_ptr<BulkInserter> rows, signers;
+    switch (type)
+    {
+    case ACCOUNT:
+        rows = AccountFrame::makeBulkInserter(db, session, suffix);
+        signers = AccountFrame::makeSignerBulkInserter(db, session, suffix);
+        break;
+    case TRUSTLINE:
+        rows = TrustFrame::makeBulkInserter(db, session, suffix);
+        break;
+    case OFFER:
+        rows = OfferFrame::makeBulkInserter(db, session, suffix);
+        break;
+    }
+
+    BucketEntryIdCmp cmp;
+    for (;;)
+    {
+        // Find the smallest key of `type` among the iterators; the first
+        // (newest) bucket holding it has the entry that counts.
+        Bucket::InputIterator* newest = nullptr;
+        for (auto& i : iters)
+        {
+            while (*i && bucketEntryType(**i) < type)
+            {
+                ++(*i);
+            }
+            if (*i && bucketEntryType(**i) == type &&
+                (!newest || cmp(**i, **newest)))
+            {
+                newest = i.get();
+            }
+        }
+        if (!newest)
+        {
+            break;
+        }
+
+        BucketEntry const& e = **newest;
+        if (e.type() == LIVEENTRY)
+        {
+            LedgerEntry const& le = e.liveEntry();
+            switch (type)
+            {
+            case ACCOUNT:
+                AccountFrame(le).addBulkRows(*rows, *signers);
+                break;
+            case TRUSTLINE:
+                TrustFrame(le).addBulkRows(*rows);
+                break;
+            case OFFER:
+                OfferFrame(le).addBulkRows(*rows);
+                break;
+            }
+        }
+
+        // Skip every older entry with the same key. `e` refers to `newest`'s
+        // current entry, so advance it last.
+        for (auto& i : iters)
+        {
+            if (i.get() != newest && *i && !cmp(e, **i))
+            {
+                ++(*i);
+            }
+        }
+        ++(*newest);
+    }
+
+    rows->flush();
+    if (signers)
+    {
+        signers->flush();
+    }
+    createEntryIndexes(session, type, suffix);
+
+    CLOG(DEBUG, "Bucket") << "Bulk-loaded " << rows->getRowCount()
+                          << " rows into " << rows->getTable() << " from "
+                          << iters.size() << " buckets";
+    return rows->getRowCount();
 }
 
-std::shared_ptr<Bucket>
-Bucket::merge(BucketManager& bucketManager, std::shared_ptr<Bucket> const& oldBucket,
-              std::shared_ptr<Bucket> const& newBucket,
-              std::vector<std::shared_ptr<Bucket>> const& shadows)
+void
+Bucket::applyBulk(Database& db,
+                  std::vector<std::shared_ptr<Bucket>> const& buckets)
 {
-    // This is the key operation in the scheme: merging two (read-only)
-    // buckets together into a new 3rd bucket, while calculating its hash,
-    // in a single pass.
+    std::vector<LedgerEntryType> const types{ACCOUNT, TRUSTLINE, OFFER};
 
-    assert(oldBucket);
-    assert(newBucket);
+    // The tables are rewritten behind the frames' backs.
+    db.getEntryCache().invalidateAll();
+    db.getOrderBook().invalidateAll();
+    db.getInflationTally().invalidateAll();
+
+    // The entry types live in disjoint tables, so on PostgreSQL each is
+    // loaded concurrently through its own pooled session into staging tables,
+    // which then replace the live tables through the main session. SQLite
+    // allows only one writer at a time, and the pool (one connection per
+    // core) needs room for a session per type besides its other users.
+    if (db.isSqlite() || !db.canUsePool() ||
+        std::thread::hardware_concurrency() <= types.size())
+    {
+        for (auto t : types)
+        {
+            bulkLoadEntryType(db, db.getSession(), buckets, t);
+        }
+        return;
+    }
 
-    Bucket::InputIterator oi(oldBucket);
-    Bucket::InputIterator ni(newBucket);
+    {
+        // Futures are joined on destruction, so if one load throws the others
+        // finish before it propagates. Staging tables a failed load (or a
+        // rolled back swap) leaves behind are dropped by the next one.
+        std::vector<std::future<size_t>> loads;
+        for (auto type : types)
+        {
+            loads.push_back(std::async(std::launch::async,
+                                       [&db, &buckets, type]()
+                                       {
+                                           soci::session session(db.getPool());
+                                           return bulkLoadEntryType(
+                                               db, session, buckets, type,
+                                               true);
+                                       }));
+        }
+        for (auto& f : loads)
+        {
+            f.get();
+        }
+    }
+
+    // Swap the loaded tables in, in the caller's transaction: the staging
+    // table, and its indexes, take the names of the table they replace
+    // ("accountBalances_load" and "accounts_load_pkey" lose kStagingSuffix).
+    soci::session& session = db.getSession();
+    std::string const suffix = kStagingSuffix;
+    for (auto type : types)
+    {
+        for (auto const& table : entryTables(type))
+        {
+            std::string staging = table + suffix;
+            session << "ALTER TABLE " + table + " RENAME TO " + table +
+                           "_old;";
+            session << "ALTER TABLE " + staging + " RENAME TO " + table + ";";
+            session << "DROP TABLE " + table + "_old;";
 
-    std::vector<Bucket::InputIterator> shadowIterators(shadows.begin(),
-                                                       shadows.end());
+            std::vector<std::string> indexes;
+            soci::rowset<std::string> rs =
+                (session.prepare << "SELECT indexname FROM pg_indexes "
+                                    "WHERE tablename = lower(:t)",
+                 soci::use(table));
+            std::copy(rs.begin(), rs.end(), std::back_inserter(indexes));
+            for (auto index : indexes)
+            {
+                auto pos = index.find(suffix);
+                if (pos != std::string::npos)
+                {
+                    session << "ALTER INDEX " + index + " RENAME TO " +
+                                   index.erase(pos, suffix.size()) + ";";
+                }
+            }
+        }
+    }
+}
 
-    auto timer = bucketManager.getMergeTimer().TimeScope();
-    Bucket::OutputIterator out(bucketManager.getTmpDir());
+std::shared_ptr<Bucket>
+Bucket::fresh(BucketManager& bucketManager, std::vector<LedgerEntry> const& liveEntries,
+              std::vector<LedgerKey> const& deadEntries)
+{
+    // Build a single vector of live entries followed by dead ones and
+    // stable-sort it, so that among entries with the same key the later one
+    // (and any dead entry over a live one) sorts last, then write it out in
+    // one pass keeping only the last entry of each key. This produces the same
+    // bucket as merging separately-written live and dead buckets would, with
+    // one file written instead of three.
+    std::vector<BucketEntry> entries;
+    entries.reserve(liveEntries.size() + deadEntries.size());
+
+    for (auto const& e : liveEntries)
+    {
+        entries.emplace_back();
+        entries.back().type(LIVEENTRY);
+        entries.back().liveEntry() = e;
+    }
+
+    for (auto const& e : deadEntries)
+    {
+        entries.emplace_back();
+        entries.back().type(DEADENTRY);
+        entries.back().deadEntry() = e;
+    }
 
     BucketEntryIdCmp cmp;
+    std::stable_sort(entries.begin(), entries.end(), cmp);
+
+    OutputIterator out(bucketManager.getTmpDir(),
+                       std::make_shared<BucketIndex>(entries.size()), true, 0,
+                       bucketManager.compressBuckets());
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        if (i + 1 < entries.size() && !cmp(entries[i], entries[i + 1]))
+        {
+            // Superseded by the next entry, which has the same key.
+            continue;
+        }
+        out.put(entries[i]);
+    }
+    return out.getBucket(bucketManager);
+}
+
+/**
+ * The shadows of a merge, merged into a single key-ordered stream: a min-heap
+ * of the shadow iterators, ordered by their current entries. Candidates are
+ * checked in key order, so a check costs one comparison with the top of the
+ * heap, plus O(log #shadows) for each shadow that has to be advanced to the
+ * candidate, rather than a comparison and possibly an advance per shadow.
+ * Shadows only ever move forward, skipping whole pages through their indexes.
+ *
+ * When the heap is behind a candidate, the union of the shadows' bloom
+ * filters (see shadowFilter) is probed before anything is advanced: a
+ * candidate that none of them can contain is not shadowed, and the heap
+ * catches up on a later candidate instead. Shadows are thus only advanced for
+ * candidates that are (or, on a false positive, might be) shadowed, and in
+ * large steps; any other candidate costs one probe of one filter, however
+ * many shadows there are.
+ */
+class ShadowSet
+{
+    // Heap order: the shadow with the smallest current entry on top.
+    struct HeapCmp
+    {
+        LedgerKeyXDRCmp mCmp;
+        bool
+        operator()(Bucket::InputIterator* a, Bucket::InputIterator* b) const
+        {
+            return mCmp(b->key(), a->key());
+        }
+    };
+
+    LedgerKeyXDRCmp mCmp;
+    HeapCmp mHeapCmp;
+    std::vector<Bucket::InputIterator*> mHeap;
+    std::shared_ptr<BloomUnion const> mFilter;
+
+    bool
+    mayContain(uint64_t keyHash) const
+    {
+        return !mFilter || mFilter->mayContain(keyHash);
+    }
+
+    // Move `si` to the first entry not less than `k`.
+    void
+    advanceTo(Bucket::InputIterator& si, LedgerKeyXDR const& k) const
+    {
+        auto index = si.getIndex();
+        size_t begin, end;
+        if (index && index->findPage(LedgerKeyFromXDR(k), begin, end) &&
+            begin > si.pos())
+        {
+            si.seek(begin);
+        }
+        while (si && mCmp(si.key(), k))
+        {
+            ++si;
+        }
+    }
+
+  public:
+    // `filter` is the shadowFilter of the shadows' buckets, if any.
+    ShadowSet(std::vector<Bucket::InputIterator>& shadows,
+              std::shared_ptr<BloomUnion const> filter)
+        : mFilter(filter)
+    {
+        for (auto& si : shadows)
+        {
+            if (si)
+            {
+                mHeap.push_back(&si);
+            }
+        }
+        std::make_heap(mHeap.begin(), mHeap.end(), mHeapCmp);
+    }
+
+    // Whether some shadow holds an entry with the key `k`, which hashes to
+    // `keyHash`. Must be called with keys in increasing order.
+    bool
+    isShadowed(LedgerKeyXDR const& k, uint64_t keyHash)
+    {
+        if (mHeap.empty())
+        {
+            return false;
+        }
+        if (mCmp(mHeap.front()->key(), k))
+        {
+            if (!mayContain(keyHash))
+            {
+                return false;
+            }
+            while (!mHeap.empty() && mCmp(mHeap.front()->key(), k))
+            {
+                std::pop_heap(mHeap.begin(), mHeap.end(), mHeapCmp);
+                advanceTo(*mHeap.back(), k);
+                if (*mHeap.back())
+                {
+                    std::push_heap(mHeap.begin(), mHeap.end(), mHeapCmp);
+                }
+                else
+                {
+                    mHeap.pop_back();
+                }
+            }
+            if (mHeap.empty())
+            {
+                return false;
+            }
+        }
+        // The smallest shadow entry is now not less than `k`; it shadows `k`
+        // if it is not greater either.
+        return !mCmp(k, mHeap.front()->key());
+    }
+};
+
+// The union of the bloom filters of `shadows`, built once per merge, or
+// nullptr if one of them has no index.
+static std::shared_ptr<BloomUnion const>
+shadowFilter(std::vector<std::shared_ptr<Bucket>> const& shadows)
+{
+    std::vector<BucketIndex const*> indexes;
+    for (auto const& b : shadows)
+    {
+        if (b->getFilename().empty())
+        {
+            continue;
+        }
+        if (!b->getIndex())
+        {
+            return nullptr;
+        }
+        indexes.push_back(b->getIndex().get());
+    }
+    return std::make_shared<BloomUnion>(indexes);
+}
+
+inline void
+maybe_put(Bucket::OutputIterator& out, Bucket::InputIterator& in,
+          ShadowSet& shadows)
+{
+    uint64_t keyHash = BucketIndex::hashKey(in.key());
+    if (!shadows.isShadowed(in.key(), keyHash))
+    {
+        out.put(in, keyHash);
+    }
+}
+
+// Merge the rest of `oi` and `ni` into `out`, dropping entries shadowed in
+// `shadowIterators`, whose buckets' shadowFilter is `filter`. If `checkpoint`
+// is given, the progress of the merge is saved to it every
+// `checkpoint->getInterval()` bytes of output, between keys; shadows need no
+// saved position, as they catch up with the inputs by themselves.
+//
+// Entries are ordered by their encoded keys and copied as they were read, so
+// none is decoded here, save the odd key probed for in a shadow's index.
+static void
+mergeInto(Bucket::OutputIterator& out,
+          Bucket::InputIterator& oi, Bucket::InputIterator& ni,
+          std::vector<Bucket::InputIterator>& shadowIterators,
+          std::shared_ptr<BloomUnion const> filter,
+          MergeCheckpoint* checkpoint = nullptr)
+{
+    LedgerKeyXDRCmp cmp;
+    ShadowSet shadows(shadowIterators, filter);
+    size_t nextCheckpoint =
+        checkpoint ? out.getBytesPut() + checkpoint->getInterval() : SIZE_MAX;
     while (oi || ni)
     {
+        if (out.getBytesPut() >= nextCheckpoint)
+        {
+            out.checkpoint(*checkpoint);
+            checkpoint->mOldOffset = oi.entryPos();
+            checkpoint->mNewOffset = ni.entryPos();
+            checkpoint->save();
+            nextCheckpoint = out.getBytesPut() + checkpoint->getInterval();
+        }
         if (!ni)
         {
             // Out of new entries, take old entries.
-            maybe_put(cmp, out, oi, shadowIterators);
+            maybe_put(out, oi, shadows);
             ++oi;
         }
         else if (!oi)
         {
             // Out of old entries, take new entries.
-            maybe_put(cmp, out, ni, shadowIterators);
+            maybe_put(out, ni, shadows);
             ++ni;
         }
-        else if (cmp(*oi, *ni))
+        else if (cmp(oi.key(), ni.key()))
         {
             // Next old-entry has smaller key, take it.
-            maybe_put(cmp, out, oi, shadowIterators);
+            maybe_put(out, oi, shadows);
             ++oi;
         }
-        else if (cmp(*ni, *oi))
+        else if (cmp(ni.key(), oi.key()))
         {
             // Next new-entry has smaller key, take it.
-            maybe_put(cmp, out, ni, shadowIterators);
+            maybe_put(out, ni, shadows);
             ++ni;
         }
         else
         {
             // Old and new are for the same key, take new.
-            maybe_put(cmp, out, ni, shadowIterators);
+            maybe_put(out, ni, shadows);
             ++oi;
             ++ni;
         }
     }
-    return out.getBucket(bucketManager);
+}
+
+std::shared_ptr<Bucket>
+Bucket::merge(BucketManager& bucketManager, std::shared_ptr<Bucket> const& oldBucket,
+              std::shared_ptr<Bucket> const& newBucket,
+              std::vector<std::shared_ptr<Bucket>> const& shadows)
+{
+    // This is the key operation in the scheme: merging two (read-only)
+    // buckets together into a new 3rd bucket, while calculating its hash,
+    // in a single pass.
+
+    assert(oldBucket);
+    assert(newBucket);
+
+    // Long merges record their progress as they go, and pick up any progress
+    // recorded by an earlier run of the same merge.
+    size_t inputBytes = oldBucket->getSize() + newBucket->getSize();
+    auto checkpoint = bucketManager.checkpointMerge(oldBucket, newBucket,
+                                                    shadows, inputBytes);
+    bool resuming = checkpoint && checkpoint->load();
+
+    // Large merges are split by key range and run on several threads; the
+    // threshold keeps the extra sampling pass off the small, frequent merges.
+    // A resumed merge keeps the shape it was started with.
+    size_t partitions = std::min<size_t>(std::thread::hardware_concurrency(),
+                                         inputBytes / kMinMergePartitionBytes);
+    if (resuming)
+    {
+        partitions = checkpoint->mPartitions;
+    }
+    if (partitions > 1)
+    {
+        auto b = mergePartitioned(bucketManager, oldBucket, newBucket, shadows,
+                                  partitions, checkpoint.get());
+        if (checkpoint)
+        {
+            checkpoint->remove();
+        }
+        return b;
+    }
+
+    // Serial merges can only be checkpointed if their output is uncompressed.
+    if (checkpoint && bucketManager.compressBuckets())
+    {
+        checkpoint->remove();
+        checkpoint.reset();
+        resuming = false;
+    }
+
+    auto timer = bucketManager.getMergeTimer().TimeScope();
+    size_t maxEntries = countEntries(oldBucket) + countEntries(newBucket);
+    size_t reserveBytes = bucketManager.preallocateBuckets() ? inputBytes : 0;
+    std::unique_ptr<Bucket::OutputIterator> out;
+    if (resuming)
+    {
+        try
+        {
+            out = make_unique<Bucket::OutputIterator>(
+                checkpoint->getOutputFilename(),
+                std::make_shared<BucketIndex>(maxEntries), true, reserveBytes,
+                false, checkpoint.get());
+            CLOG(INFO, "Bucket")
+                << "Resuming merge of curr=" << hexAbbrev(oldBucket->getHash())
+                << " with snap=" << hexAbbrev(newBucket->getHash())
+                << " after " << checkpoint->mBytesPut << " bytes of output";
+        }
+        catch (std::exception& e)
+        {
+            CLOG(WARNING, "Bucket") << "Restarting merge, failed to resume: "
+                                    << e.what();
+            out.reset();
+            checkpoint->remove();
+            resuming = false;
+        }
+    }
+    if (!out)
+    {
+        if (checkpoint)
+        {
+            out = make_unique<Bucket::OutputIterator>(
+                checkpoint->getOutputFilename(),
+                std::make_shared<BucketIndex>(maxEntries), true, reserveBytes,
+                false, nullptr);
+        }
+        else
+        {
+            out = make_unique<Bucket::OutputIterator>(
+                bucketManager.getTmpDir(),
+                std::make_shared<BucketIndex>(maxEntries), true, reserveBytes,
+                bucketManager.compressBuckets());
+        }
+    }
+
+    Bucket::InputIterator oi(
+        oldBucket,
+        resuming ? static_cast<size_t>(checkpoint->mOldOffset) : 0);
+    Bucket::InputIterator ni(
+        newBucket,
+        resuming ? static_cast<size_t>(checkpoint->mNewOffset) : 0);
+
+    std::vector<Bucket::InputIterator> shadowIterators;
+    shadowIterators.reserve(shadows.size());
+    for (auto const& shadow : shadows)
+    {
+        shadowIterators.emplace_back(shadow, 0, SIZE_MAX,
+                                     Bucket::InputIterator::SPARSE);
+    }
+
+    mergeInto(*out, oi, ni, shadowIterators, shadowFilter(shadows),
+              checkpoint.get());
+    auto b = out->getBucket(bucketManager);
+    if (checkpoint)
+    {
+        checkpoint->remove();
+    }
+    return b;
+}
+
+// Number of records between the offsets sampled from a bucket when choosing
+// partition boundaries for a merge.
+static const size_t kMergeSampleStride = 1024;
+
+/**
+ * Byte offsets of every `kMergeSampleStride`th record of a bucket, found by
+ * walking the record marks without decoding any entries.
+ */
+static std::vector<size_t>
+sampleRecordOffsets(std::shared_ptr<Bucket const> const& b)
+{
+    std::vector<size_t> offsets;
+    if (b->getFilename().empty())
+    {
+        return offsets;
+    }
+    Bucket::InputIterator iter(b);
+    size_t p = 0, n = 0;
+    do
+    {
+        if (n++ % kMergeSampleStride == 0)
+        {
+            offsets.push_back(p);
+        }
+        p = iter.pos();
+    } while (iter.skipOne());
+    return offsets;
+}
+
+/**
+ * Byte offset of the first entry in `b` that is not less than `key`, or the
+ * file size if there is none. Binary-searches the sampled offsets, then scans
+ * forward at most one sample stride.
+ */
+static size_t
+lowerBoundOffset(std::shared_ptr<Bucket const> const& b,
+                 std::vector<size_t> const& samples, BucketEntry const& key)
+{
+    if (samples.empty())
+    {
+        return 0;
+    }
+    BucketEntryIdCmp cmp;
+    Bucket::InputIterator iter(b);
+    size_t lo = 0, hi = samples.size();
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        iter.seek(samples[mid]);
+        if (cmp(*iter, key))
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    size_t p = samples[lo];
+    iter.seek(p);
+    while (iter && cmp(*iter, key))
+    {
+        p = iter.pos();
+        ++iter;
+    }
+    return iter ? p : b->getSize();
+}
+
+// Filename, object count, byte count and index of one part of a partitioned
+// merge.
+typedef std::tuple<std::string, size_t, size_t, std::shared_ptr<BucketIndex>>
+    MergePart;
+
+static void
+appendFile(BufferedFileWriter& out, std::string const& filename)
+{
+    size_t const chunk = 1 << 20;
+    std::ifstream in(filename, std::ifstream::binary);
+    // Read straight into the writer's buffer.
+    while (in)
+    {
+        in.read(out.reserve(chunk), chunk);
+        auto n = static_cast<size_t>(in.gcount());
+        out.commit(n);
+        if (n == 0)
+        {
+            break;
+        }
+    }
+}
+
+static void
+appendFile(CompressedFileWriter& out, std::string const& filename)
+{
+    // Reading through `reserve` would cut the output into blocks of the read
+    // size; copy block-sized reads instead, which costs little next to the
+    // compression.
+    std::vector<char> buf(CompressedFileWriter::kBlockBytes);
+    std::ifstream in(filename, std::ifstream::binary);
+    while (in)
+    {
+        in.read(buf.data(), buf.size());
+        auto n = static_cast<size_t>(in.gcount());
+        out.write(buf.data(), n);
+        if (n == 0)
+        {
+            break;
+        }
+    }
+}
+
+// Concatenate the parts of a partitioned merge into `out` in key order,
+// appending their indexes to `index`, and delete them unless `keepParts`.
+// Parts reused from an interrupted merge have no index; if there are any,
+// `index` is dropped.
+template <typename Writer>
+static void
+concatenateParts(Writer& out, std::vector<std::future<MergePart>>& parts,
+                 std::shared_ptr<BucketIndex>& index, size_t& nObjects,
+                 size_t& nBytes, bool keepParts)
+{
+    for (auto& f : parts)
+    {
+        auto part = f.get();
+        std::string const& partName = std::get<0>(part);
+        if (!std::get<3>(part))
+        {
+            index.reset();
+        }
+        else if (index)
+        {
+            index->append(*std::get<3>(part), nBytes);
+        }
+        nObjects += std::get<1>(part);
+        nBytes += std::get<2>(part);
+        appendFile(out, partName);
+        if (!keepParts)
+        {
+            std::remove(partName.c_str());
+        }
+    }
+}
+
+std::shared_ptr<Bucket>
+Bucket::mergePartitioned(BucketManager& bucketManager,
+                         std::shared_ptr<Bucket> const& oldBucket,
+                         std::shared_ptr<Bucket> const& newBucket,
+                         std::vector<std::shared_ptr<Bucket>> const& shadows,
+                         size_t partitions, MergeCheckpoint* checkpoint)
+{
+    assert(oldBucket);
+    assert(newBucket);
+
+    auto timer = bucketManager.getMergeTimer().TimeScope();
+
+    // Choose split keys at evenly spaced samples of the larger input; each
+    // partition i then covers keys in [split[i-1], split[i]). This depends
+    // only on the inputs and `partitions`, so a resumed merge splits the same
+    // way as the run it resumes.
+    size_t requestedPartitions = partitions;
+    auto const& larger =
+        oldBucket->getSize() >= newBucket->getSize() ? oldBucket : newBucket;
+    auto largerSamples = sampleRecordOffsets(larger);
+    std::vector<BucketEntry> splits;
+    {
+        Bucket::InputIterator iter(larger);
+        size_t prev = 0;
+        for (size_t i = 1; i < partitions; ++i)
+        {
+            // Small inputs may have fewer samples than partitions requested;
+            // drop split points that would produce empty partitions.
+            size_t j = i * largerSamples.size() / partitions;
+            if (j == prev)
+            {
+                continue;
+            }
+            prev = j;
+            iter.seek(largerSamples[j]);
+            splits.push_back(*iter);
+        }
+    }
+    partitions = splits.size() + 1;
+
+    // Map each split key to a byte offset in every input. Partition i of an
+    // input is the byte range [bounds[i], bounds[i+1]).
+    std::vector<std::shared_ptr<Bucket>> inputs{oldBucket, newBucket};
+    inputs.insert(inputs.end(), shadows.begin(), shadows.end());
+    std::vector<std::vector<size_t>> bounds(inputs.size());
+    for (size_t k = 0; k < inputs.size(); ++k)
+    {
+        auto const& b = inputs[k];
+        auto samples = (b == larger) ? largerSamples : sampleRecordOffsets(b);
+        bounds[k].push_back(0);
+        for (auto const& key : splits)
+        {
+            bounds[k].push_back(lowerBoundOffset(b, samples, key));
+        }
+        bounds[k].push_back(b->getSize());
+    }
+
+    CLOG(DEBUG, "Bucket") << "Merging curr=" << hexAbbrev(oldBucket->getHash())
+                          << " with snap=" << hexAbbrev(newBucket->getHash())
+                          << " in " << partitions << " partitions";
+
+    // A checkpointed merge keeps its parts, durably, until the merge is done,
+    // and records each part as it finishes; parts recorded by an interrupted
+    // run of the merge are reused.
+    std::vector<bool> reuse(partitions, false);
+    std::mutex checkpointMutex;
+    if (checkpoint)
+    {
+        if (checkpoint->mPartitions != requestedPartitions ||
+            checkpoint->mPartDone.size() != partitions)
+        {
+            checkpoint->remove();
+            checkpoint->mPartitions =
+                static_cast<uint32_t>(requestedPartitions);
+            checkpoint->mPartDone.assign(partitions, false);
+            checkpoint->mPartObjects.assign(partitions, 0);
+            checkpoint->mPartBytes.assign(partitions, 0);
+        }
+        size_t reused = 0;
+        for (size_t i = 0; i < partitions; ++i)
+        {
+            reuse[i] = checkpoint->mPartDone[i] &&
+                       fs::exists(checkpoint->getPartFilename(i));
+            reused += reuse[i] ? 1 : 0;
+        }
+        if (reused != 0)
+        {
+            CLOG(INFO, "Bucket") << "Resuming merge of curr="
+                                 << hexAbbrev(oldBucket->getHash())
+                                 << " with snap="
+                                 << hexAbbrev(newBucket->getHash()) << ", "
+                                 << reused << " of " << partitions
+                                 << " parts already merged";
+        }
+    }
+
+    // Merge the partitions into unhashed, uncompressed part files, on this
+    // merge's own thread plus one per idle slot the MergeScheduler lends it,
+    // each taking the next unmerged part. The threads are dedicated rather
+    // than posted to the worker io_service: this function is itself normally
+    // running on a worker, and blocking workers on tasks queued behind them
+    // could stall every merge in flight.
+    //
+    // The parts' indexes share the bloom filter of the whole bucket's index,
+    // which is sized for all the input entries; the parts also share one
+    // union of the shadows' filters.
+    std::string const& tmpDir = bucketManager.getTmpDir();
+    auto index = std::make_shared<BucketIndex>(countEntries(oldBucket) +
+                                               countEntries(newBucket));
+    auto filter = shadowFilter(shadows);
+    auto mergePart = [&, index](size_t i) -> MergePart
+        {
+            MergePart res;
+            if (reuse[i])
+            {
+                std::get<0>(res) = checkpoint->getPartFilename(i);
+                std::get<1>(res) =
+                    static_cast<size_t>(checkpoint->mPartObjects[i]);
+                std::get<2>(res) =
+                    static_cast<size_t>(checkpoint->mPartBytes[i]);
+                return res;
+            }
+            Bucket::InputIterator oi(oldBucket, bounds[0][i],
+                                     bounds[0][i + 1]);
+            Bucket::InputIterator ni(newBucket, bounds[1][i],
+                                     bounds[1][i + 1]);
+            std::vector<Bucket::InputIterator> shadowIterators;
+            shadowIterators.reserve(shadows.size());
+            for (size_t k = 0; k < shadows.size(); ++k)
+            {
+                shadowIterators.emplace_back(
+                    shadows[k], bounds[k + 2][i], bounds[k + 2][i + 1],
+                    Bucket::InputIterator::SPARSE);
+            }
+            size_t partBytes = bucketManager.preallocateBuckets()
+                                   ? (bounds[0][i + 1] - bounds[0][i]) +
+                                         (bounds[1][i + 1] - bounds[1][i])
+                                   : 0;
+            auto out =
+                checkpoint
+                    ? make_unique<Bucket::OutputIterator>(
+                          checkpoint->getPartFilename(i), index->makePart(),
+                          false, partBytes, false, nullptr)
+                    : make_unique<Bucket::OutputIterator>(
+                          tmpDir, index->makePart(), false, partBytes);
+            mergeInto(*out, oi, ni, shadowIterators, filter);
+            std::get<0>(res) =
+                out->finishPart(std::get<1>(res), std::get<2>(res),
+                                std::get<3>(res), checkpoint != nullptr);
+            if (checkpoint)
+            {
+                std::lock_guard<std::mutex> lock(checkpointMutex);
+                checkpoint->mPartDone[i] = true;
+                checkpoint->mPartObjects[i] = std::get<1>(res);
+                checkpoint->mPartBytes[i] = std::get<2>(res);
+                checkpoint->save();
+            }
+            return res;
+        };
+
+    auto& scheduler = bucketManager.getMergeScheduler();
+    size_t helpers = scheduler.reserve(partitions - 1);
+    std::vector<std::promise<MergePart>> promises(partitions);
+    std::vector<std::future<MergePart>> parts;
+    for (auto& p : promises)
+    {
+        parts.push_back(p.get_future());
+    }
+    std::atomic<size_t> nextPart{0};
+    std::vector<std::future<void>> threads;
+    for (size_t t = 0; t <= helpers; ++t)
+    {
+        threads.push_back(std::async(std::launch::async, [&, t]()
+            {
+                size_t i;
+                while ((i = nextPart++) < partitions)
+                {
+                    try
+                    {
+                        promises[i].set_value(mergePart(i));
+                    }
+                    catch (...)
+                    {
+                        promises[i].set_exception(std::current_exception());
+                    }
+                }
+                if (t != 0)
+                {
+                    scheduler.release(1);
+                }
+            }));
+    }
+
+    // Concatenate the parts in key order, hashing the result as it is written
+    // (and compressing it, if configured); the uncompressed output is
+    // byte-identical to that of the serial merge.
+    std::string filename = randomBucketName(tmpDir);
+    auto hasher = SHA256::create();
+    size_t nObjects = 0, nBytes = 0;
+    if (bucketManager.compressBuckets())
+    {
+        CompressedFileWriter out;
+        out.open(filename);
+        out.setHasher(hasher.get());
+        concatenateParts(out, parts, index, nObjects, nBytes,
+                         checkpoint != nullptr);
+        out.close(nObjects != 0);
+    }
+    else
+    {
+        BufferedFileWriter out;
+        out.open(filename, bucketManager.preallocateBuckets()
+                               ? oldBucket->getSize() + newBucket->getSize()
+                               : 0);
+        out.setHasher(hasher.get());
+        concatenateParts(out, parts, index, nObjects, nBytes,
+                         checkpoint != nullptr);
+        out.close(nObjects != 0);
+    }
+
+    if (nObjects == 0)
+    {
+        CLOG(DEBUG, "Bucket") << "Deleting empty bucket file " << filename;
+        std::remove(filename.c_str());
+        return std::make_shared<Bucket>();
+    }
+    if (index)
+    {
+        index->finish(nBytes);
+    }
+    return bucketManager.adoptFileAsBucket(filename, hasher->finish(), nObjects,
+                                           nBytes, index);
 }
 }
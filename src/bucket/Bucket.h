@@ -5,6 +5,7 @@
 // of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
 
 #include "generated/StellarXDR.h"
+#include <memory>
 #include <string>
 #include "util/NonCopyable.h"
 
@@ -22,8 +23,10 @@ namespace stellar
  * merged in sorted order, and all elements are hashed while being added.
  */
 
+class BucketIndex;
 class BucketManager;
 class Database;
+class MergeCheckpoint;
 
 class Bucket : public std::enable_shared_from_this<Bucket>
              , public NonMovableOrCopyable
@@ -32,6 +35,9 @@ class Bucket : public std::enable_shared_from_this<Bucket>
     std::string const mFilename;
     uint256 const mHash;
     bool mRetain {false};
+    bool mMappedInput {false};
+    bool mCompressed {false};
+    std::shared_ptr<BucketIndex const> mIndex;
 
   public:
 
@@ -59,6 +65,21 @@ class Bucket : public std::enable_shared_from_this<Bucket>
     uint256 const& getHash() const;
     std::string const& getFilename() const;
 
+    // Size in bytes of the bucket's uncompressed XDR contents, over which its
+    // hash, its index and its iterators' offsets are all defined; 0 for the
+    // empty bucket. For an uncompressed bucket this is the size of its file.
+    size_t getSize() const;
+
+    // Whether the bucket's file is in the block-compressed format (see
+    // CompressedFileReader) rather than a plain XDR record stream. Determined
+    // from the file itself when the bucket is constructed, so buckets of both
+    // kinds can coexist whatever Config::BUCKET_COMPRESS says.
+    bool isCompressed() const;
+
+    // Write the bucket's uncompressed XDR contents -- the canonical form, as
+    // stored in history archives -- to `filename`.
+    void writeUncompressed(std::string const& filename) const;
+
     // Sets or clears the `retain` flag on the bucket. A retained bucket will
     // not be deleted (from the filesystem) when the Bucket object is deleted. A
     // non-retained bucket _will_ delete the underlying file. Buckets should
@@ -67,6 +88,30 @@ class Bucket : public std::enable_shared_from_this<Bucket>
     // retained.
     void setRetain(bool r);
 
+    // Sets or clears the `mappedInput` flag on the bucket. Iterators over a
+    // bucket with this flag set read its file through a read-only memory
+    // mapping rather than through a buffered stream. Set by the BucketManager
+    // when it hands out the bucket, according to Config::BUCKET_MMAP_READS.
+    void setMappedInput(bool m);
+    bool isMappedInput() const;
+
+    // Attach the bucket's index (see BucketIndex). Set by the BucketManager
+    // before it hands out the bucket, and not changed afterwards.
+    void setIndex(std::shared_ptr<BucketIndex const> index);
+    std::shared_ptr<BucketIndex const> const& getIndex() const;
+
+    // Name of the side file in which the BucketManager persists the index.
+    std::string getIndexFilename() const;
+
+    // Scan the bucket's file and build its index.
+    std::shared_ptr<BucketIndex> buildIndex() const;
+
+    // Look up the entry with key `key`. Returns true and sets `entry` to the
+    // live entry or tombstone found, or returns false if the bucket has no
+    // entry for `key`. Uses the index if there is one, in which case this reads
+    // at most one page of the file; otherwise scans the bucket.
+    bool getBucketEntry(LedgerKey const& key, BucketEntry& entry) const;
+
     // Returns true if a BucketEntry that is key-wise identical to the given
     // BucketEntry exists in the bucket. For testing.
     bool containsBucketIdentity(BucketEntry const& id) const;
@@ -80,6 +125,25 @@ class Bucket : public std::enable_shared_from_this<Bucket>
     // entry in the database.
     void apply(Database& db) const;
 
+    // Replace the contents of the ledger-entry tables with the state described
+    // by `buckets`, ordered newest first (as in a BucketList: level 0 curr,
+    // level 0 snap, level 1 curr, ...). The buckets are merged in a single
+    // pass, so each key is written at most once -- as its newest live entry,
+    // or not at all if that is a tombstone -- and rows are written with
+    // BulkInserters into tables whose secondary indexes are dropped for the
+    // duration.
+    //
+    // Each entry type is loaded separately. On PostgreSQL the types are loaded
+    // concurrently, each through its own session from the Database's pool,
+    // into staging copies of their tables, which are indexed there too; once
+    // every type has loaded, the staging tables are renamed over the live
+    // ones through the main session. Otherwise the types are loaded in turn
+    // through the main session. Either way the live tables are only changed
+    // through the main session, so the load is atomic within whatever
+    // transaction the caller holds there.
+    static void applyBulk(Database& db,
+                          std::vector<std::shared_ptr<Bucket>> const& buckets);
+
     // Create a fresh bucket from a given vector of live LedgerEntries and
     // dead LedgerEntryKeys. The bucket will be sorted, hashed, and adopted
     // in the provided BucketManager.
@@ -91,10 +155,32 @@ class Bucket : public std::enable_shared_from_this<Bucket>
     // are overridden in the fresh bucket by keywise-equal entries in
     // `newBucket`. Entries are inhibited from the fresh bucket by keywise-equal
     // entries in any of the buckets in the provided `shadows` vector.
+    //
+    // Long merges save their progress as they go and, if interrupted, resume
+    // from it the next time the same merge is started; see MergeCheckpoint.
     static std::shared_ptr<Bucket>
     merge(BucketManager& bucketManager, std::shared_ptr<Bucket> const& oldBucket,
           std::shared_ptr<Bucket> const& newBucket,
           std::vector<std::shared_ptr<Bucket>> const& shadows =
               std::vector<std::shared_ptr<Bucket>>());
+
+    // Merge as above, but split the key space into up to `partitions` ranges
+    // that are merged concurrently and then concatenated. The result is
+    // identical (bytes and hash) to that of the serial merge. `merge` calls
+    // this itself when its inputs total more than `kMinMergePartitionBytes`
+    // per available core. Ranges beyond the first are merged concurrently
+    // only as far as the MergeScheduler has idle slots to lend.
+    //
+    // If `checkpoint` is given, each part is recorded in it as it finishes,
+    // and parts it already records as finished are not merged again; the
+    // caller removes its files once the merge is done.
+    static std::shared_ptr<Bucket>
+    mergePartitioned(BucketManager& bucketManager,
+                     std::shared_ptr<Bucket> const& oldBucket,
+                     std::shared_ptr<Bucket> const& newBucket,
+                     std::vector<std::shared_ptr<Bucket>> const& shadows,
+                     size_t partitions, MergeCheckpoint* checkpoint = nullptr);
+
+    static const size_t kMinMergePartitionBytes = 64 * 1024 * 1024;
 };
 }
@@ -0,0 +1,312 @@
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "bucket/BucketIndex.h"
+#include "bucket/LedgerCmp.h"
+#include "util/Fs.h"
+#include "util/Logging.h"
+#include "util/XDRStream.h"
+#include "xdrpp/marshal.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+
+namespace stellar
+{
+
+static uint64_t
+fnv1a64(uint8_t const* bytes, size_t size)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+BucketIndex::BucketIndex(uint64_t maxKeys)
+{
+    uint64_t nBits = 64;
+    while (nBits < maxKeys * kBloomBitsPerKey)
+    {
+        nBits *= 2;
+    }
+    mBloomWords = std::make_shared<std::vector<std::atomic<uint64_t>>>(
+        static_cast<size_t>(nBits / 64));
+    for (auto& w : *mBloomWords)
+    {
+        w.store(0, std::memory_order_relaxed);
+    }
+}
+
+uint64_t
+BucketIndex::hashKey(LedgerKey const& k)
+{
+    auto bytes = xdr::xdr_to_opaque(k);
+    return fnv1a64(bytes.data(), bytes.size());
+}
+
+uint64_t
+BucketIndex::hashKey(BucketEntry const& e)
+{
+    if (e.type() == LIVEENTRY)
+    {
+        return hashKey(LedgerEntryKey(e.liveEntry()));
+    }
+    return hashKey(e.deadEntry());
+}
+
+uint64_t
+BucketIndex::hashKey(LedgerKeyXDR const& k)
+{
+    return fnv1a64(reinterpret_cast<uint8_t const*>(k.mData), k.mSize);
+}
+
+void
+BucketIndex::add(BucketEntry const& e, uint64_t keyHash, size_t offset)
+{
+    assert(!mFinished);
+    addKey(keyHash);
+    if (mPageOffsets.empty() || offset >= mNextPageOffset)
+    {
+        mPageKeys.push_back(e.type() == LIVEENTRY ? LedgerEntryKey(e.liveEntry())
+                                                  : e.deadEntry());
+        mPageOffsets.push_back(offset);
+        mNextPageOffset = offset + kPageBytes;
+    }
+}
+
+void
+BucketIndex::add(LedgerKeyXDR const& k, uint64_t keyHash, size_t offset)
+{
+    assert(!mFinished);
+    addKey(keyHash);
+    if (mPageOffsets.empty() || offset >= mNextPageOffset)
+    {
+        mPageKeys.push_back(LedgerKeyFromXDR(k));
+        mPageOffsets.push_back(offset);
+        mNextPageOffset = offset + kPageBytes;
+    }
+}
+
+std::shared_ptr<BucketIndex>
+BucketIndex::makePart() const
+{
+    assert(!mFinished);
+    auto part = std::make_shared<BucketIndex>();
+    part->mBloomWords = mBloomWords;
+    return part;
+}
+
+void
+BucketIndex::append(BucketIndex const& other, size_t offset)
+{
+    assert(!mFinished);
+    assert(!other.mFinished);
+    // the other index's keys are in the shared bloom filter already
+    assert(other.mBloomWords == mBloomWords);
+    mKeyCount += other.mKeyCount;
+    mPageKeys.insert(mPageKeys.end(), other.mPageKeys.begin(),
+                     other.mPageKeys.end());
+    for (auto p : other.mPageOffsets)
+    {
+        mPageOffsets.push_back(p + offset);
+    }
+    if (!mPageOffsets.empty())
+    {
+        mNextPageOffset = mPageOffsets.back() + kPageBytes;
+    }
+}
+
+// Bit positions probed for a key, by double hashing (Kirsch & Mitzenmacher).
+template <typename F>
+static void
+forEachBloomBit(uint64_t keyHash, uint64_t nBits, F f)
+{
+    uint64_t h1 = keyHash;
+    uint64_t h2 = ((keyHash >> 32) | (keyHash << 32)) | 1;
+    for (uint32_t i = 0; i < BucketIndex::kBloomHashes; ++i)
+    {
+        if (!f((h1 + i * h2) % nBits))
+        {
+            return;
+        }
+    }
+}
+
+void
+BucketIndex::addKey(uint64_t keyHash)
+{
+    auto& words = *mBloomWords;
+    forEachBloomBit(keyHash, words.size() * 64, [&words](uint64_t bit)
+                    {
+                        words[bit / 64].fetch_or(uint64_t(1) << (bit % 64),
+                                                 std::memory_order_relaxed);
+                        return true;
+                    });
+    mKeyCount++;
+}
+
+void
+BucketIndex::finish(size_t fileBytes)
+{
+    assert(!mFinished);
+    auto const& words = *mBloomWords;
+    mBloom.resize(words.size() * 8);
+    for (size_t i = 0; i < mBloom.size(); ++i)
+    {
+        mBloom[i] = static_cast<uint8_t>(
+            words[i / 8].load(std::memory_order_relaxed) >> (8 * (i % 8)));
+    }
+    mBloomWords.reset();
+    mFileBytes = fileBytes;
+    mFinished = true;
+}
+
+bool
+BucketIndex::mayContain(uint64_t keyHash) const
+{
+    assert(mFinished);
+    if (mPageOffsets.empty())
+    {
+        return false;
+    }
+    bool found = true;
+    forEachBloomBit(keyHash, mBloom.size() * 8, [this, &found](uint64_t bit)
+                    {
+                        found = (mBloom[bit / 8] & (1 << (bit % 8))) != 0;
+                        return found;
+                    });
+    return found;
+}
+
+bool
+BucketIndex::mayContain(LedgerKey const& k) const
+{
+    return mayContain(hashKey(k));
+}
+
+bool
+BucketIndex::findPage(LedgerKey const& k, size_t& begin, size_t& end) const
+{
+    assert(mFinished);
+    LedgerEntryIdCmp cmp;
+    auto i = std::upper_bound(mPageKeys.begin(), mPageKeys.end(), k, cmp);
+    if (i == mPageKeys.begin())
+    {
+        return false;
+    }
+    size_t page = (i - mPageKeys.begin()) - 1;
+    begin = static_cast<size_t>(mPageOffsets[page]);
+    end = (page + 1 < mPageOffsets.size())
+              ? static_cast<size_t>(mPageOffsets[page + 1])
+              : static_cast<size_t>(mFileBytes);
+    return true;
+}
+
+void
+BucketIndex::save(std::string const& filename) const
+{
+    assert(mFinished);
+    XDROutputFileStream out;
+    out.open(filename);
+    uint32_t version = kFormatVersion;
+    uint64_t nPages = mPageKeys.size();
+    bool ok = out.writeOne(version) && out.writeOne(mFileBytes) &&
+              out.writeOne(mKeyCount) && out.writeOne(mBloom) &&
+              out.writeOne(nPages);
+    for (size_t i = 0; ok && i < mPageKeys.size(); ++i)
+    {
+        ok = out.writeOne(mPageOffsets[i]) && out.writeOne(mPageKeys[i]);
+    }
+    out.close();
+    if (!ok)
+    {
+        std::remove(filename.c_str());
+        throw std::runtime_error("failed to write bucket index: " + filename);
+    }
+}
+
+std::shared_ptr<BucketIndex>
+BucketIndex::load(std::string const& filename)
+{
+    if (!fs::exists(filename))
+    {
+        return nullptr;
+    }
+    auto idx = std::make_shared<BucketIndex>();
+    try
+    {
+        XDRInputFileStream in;
+        in.open(filename);
+        uint32_t version = 0;
+        uint64_t nPages = 0;
+        if (!(in.readOne(version) && version == kFormatVersion &&
+              in.readOne(idx->mFileBytes) && in.readOne(idx->mKeyCount) &&
+              in.readOne(idx->mBloom) && in.readOne(nPages)) ||
+            idx->mBloom.size() < 8 ||
+            (idx->mBloom.size() & (idx->mBloom.size() - 1)) != 0)
+        {
+            throw std::runtime_error("bad index header");
+        }
+        idx->mPageKeys.resize(static_cast<size_t>(nPages));
+        idx->mPageOffsets.resize(static_cast<size_t>(nPages));
+        for (size_t i = 0; i < nPages; ++i)
+        {
+            if (!(in.readOne(idx->mPageOffsets[i]) &&
+                  in.readOne(idx->mPageKeys[i])))
+            {
+                throw std::runtime_error("truncated index");
+            }
+        }
+    }
+    catch (std::exception& e)
+    {
+        CLOG(WARNING, "Bucket") << "Ignoring unreadable bucket index "
+                                << filename << ": " << e.what();
+        return nullptr;
+    }
+    idx->mBloomWords.reset();
+    idx->mFinished = true;
+    return idx;
+}
+
+BloomUnion::BloomUnion(std::vector<BucketIndex const*> const& indexes)
+{
+    size_t bytes = 0;
+    for (auto index : indexes)
+    {
+        assert(index->mFinished);
+        bytes += index->mBloom.size();
+    }
+    size_t size = 8;
+    while (size < bytes)
+    {
+        size *= 2;
+    }
+    mBloom.assign(size, 0);
+    for (auto index : indexes)
+    {
+        auto const& bloom = index->mBloom;
+        for (size_t i = 0; i < size; ++i)
+        {
+            mBloom[i] |= bloom[i & (bloom.size() - 1)];
+        }
+    }
+}
+
+bool
+BloomUnion::mayContain(uint64_t keyHash) const
+{
+    bool found = true;
+    forEachBloomBit(keyHash, mBloom.size() * 8, [this, &found](uint64_t bit)
+                    {
+                        found = (mBloom[bit / 8] & (1 << (bit % 8))) != 0;
+                        return found;
+                    });
+    return found;
+}
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "bucket/LedgerCmp.h"
+#include "generated/StellarXDR.h"
+#include "util/NonCopyable.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace stellar
+{
+
+/**
+ * BucketIndex is a small side structure describing the contents of a single
+ * bucket file, so that the bucket can answer "might key K be in here, and if
+ * so where" without reading the whole file. It consists of:
+ *
+ *   - A sparse page index: the key and byte offset of the first record at or
+ *     after every `kPageBytes` boundary of the file. A probe binary-searches
+ *     this to find the one page that could hold a key.
+ *
+ *   - A bloom filter over the keys of all records (live and dead), which lets
+ *     most probes for absent keys stop without touching the file at all.
+ *
+ * An index is built incrementally -- `add` is called for each record as it is
+ * written, in key order, then `finish` once the file is complete -- and is
+ * immutable afterwards. Its bloom filter is sized up front, from a bound on
+ * the number of keys the file will hold, and each key's bits are set as it is
+ * added. It is persisted beside the bucket file by the BucketManager and
+ * reloaded (or rebuilt, if missing) when the bucket is.
+ */
+class BucketIndex : NonMovableOrCopyable
+{
+  public:
+    // Spacing, in bytes of bucket file, between entries of the page index.
+    static const size_t kPageBytes = 16384;
+
+    // Bloom filter sizing: ~1% false positives at 10 bits and 7 hashes. The
+    // number of bits is rounded up to a power of two (see BloomUnion).
+    static const uint32_t kBloomBitsPerKey = 10;
+    static const uint32_t kBloomHashes = 7;
+
+    // An index for a bucket file of at most `maxKeys` entries; the input
+    // entries of a merge bound its output entries. Adding more keys only
+    // raises the false positive rate of the bloom filter.
+    explicit BucketIndex(uint64_t maxKeys = 0);
+
+    // Hash of the key of an entry; computed once by callers that both add an
+    // entry to an index and probe other indexes for it.
+    static uint64_t hashKey(LedgerKey const& k);
+    static uint64_t hashKey(BucketEntry const& e);
+    static uint64_t hashKey(LedgerKeyXDR const& k);
+
+    // Record that the entry `e`, whose key hashes to `keyHash`, was written at
+    // byte `offset` of the bucket file. Entries must be added in key order.
+    void add(BucketEntry const& e, uint64_t keyHash, size_t offset);
+
+    // As above, for an entry whose key is viewed in its encoding; the key is
+    // only decoded if it starts a page.
+    void add(LedgerKeyXDR const& k, uint64_t keyHash, size_t offset);
+
+    // An unfinished index for a part of this one's bucket file, to be
+    // appended to it once the part is written. The two share a single bloom
+    // filter, which the indexes of parts written concurrently add keys to
+    // together.
+    std::shared_ptr<BucketIndex> makePart() const;
+
+    // Append the (unfinished) index, made by `makePart`, of a bucket file that
+    // was concatenated to this one's file at byte `offset`.
+    void append(BucketIndex const& other, size_t offset);
+
+    // Seal the index of a bucket file of `fileBytes` bytes. Only a finished
+    // index can be queried or saved.
+    void finish(size_t fileBytes);
+
+    // False if the key is definitely not in the bucket.
+    bool mayContain(uint64_t keyHash) const;
+    bool mayContain(LedgerKey const& k) const;
+
+    // Find the byte range [begin, end) of the bucket file that holds the key
+    // if it is present at all. Returns false if the key sorts before every
+    // entry of the bucket.
+    bool findPage(LedgerKey const& k, size_t& begin, size_t& end) const;
+
+    size_t
+    getPageCount() const
+    {
+        return mPageKeys.size();
+    }
+
+    // Number of entries in the bucket file.
+    uint64_t
+    getKeyCount() const
+    {
+        return mKeyCount;
+    }
+
+    // Write the index to `filename`; throws std::runtime_error on failure.
+    void save(std::string const& filename) const;
+
+    // Read an index written by `save`. Returns nullptr if the file is missing,
+    // damaged or from an incompatible version, in which case the caller should
+    // rebuild it from the bucket.
+    static std::shared_ptr<BucketIndex> load(std::string const& filename);
+
+  private:
+    friend class BloomUnion;
+
+    static const uint32_t kFormatVersion = 3;
+
+    std::vector<LedgerKey> mPageKeys;
+    std::vector<uint64_t> mPageOffsets;
+    size_t mNextPageOffset{0};
+    uint64_t mKeyCount{0};
+
+    // The bloom filter while the index is built, in words that the indexes of
+    // the parts of a file (see makePart) set bits in concurrently; copied to
+    // mBloom by finish.
+    std::shared_ptr<std::vector<std::atomic<uint64_t>>> mBloomWords;
+
+    // count a key and set its bits in the bloom filter
+    void addKey(uint64_t keyHash);
+
+    xdr::opaque_vec<> mBloom;
+    uint64_t mFileBytes{0};
+    bool mFinished{false};
+};
+
+/**
+ * The union of the bloom filters of several finished indexes: false if a key
+ * is definitely in none of their buckets. One probe answers for all of them,
+ * so a merge checks its candidates against its shadows at the cost of
+ * checking them against one.
+ *
+ * Filter sizes are powers of two, so a key's bit in a filter of n bits is its
+ * bit in a larger one, modulo n; each filter is repeated to the size of the
+ * union and OR-ed in.
+ */
+class BloomUnion : NonMovableOrCopyable
+{
+    xdr::opaque_vec<> mBloom;
+
+  public:
+    explicit BloomUnion(std::vector<BucketIndex const*> const& indexes);
+
+    bool mayContain(uint64_t keyHash) const;
+};
+}
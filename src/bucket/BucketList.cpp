@@ -13,7 +13,9 @@
 #include "bucket/Bucket.h"
 #include "bucket/BucketManager.h"
 #include "bucket/LedgerCmp.h"
+#include "bucket/MergeCheckpoint.h"
 #include <cassert>
+#include <set>
 
 namespace stellar
 {
@@ -116,6 +118,10 @@ BucketLevel::prepare(Application& app, uint32_t currLedger,
 
     auto curr = mCurr;
 
+    // The result is needed when the previous level next spills, at which point
+    // this level commits it. Level 0 commits immediately.
+    uint32_t deadline = currLedger;
+
     // Subtle: We're "preparing the next state" of this level's mCurr, which is
     // *either* mCurr merged with snap, or else just snap (if mCurr is going to
     // be snapshotted itself in the next spill). This second condition happens
@@ -127,6 +133,7 @@ BucketLevel::prepare(Application& app, uint32_t currLedger,
     {
         uint32_t nextChangeLedger =
             currLedger + BucketList::levelHalf(mLevel - 1);
+        deadline = nextChangeLedger;
         if (BucketList::levelShouldSpill(nextChangeLedger, mLevel))
         {
             // CLOG(DEBUG, "Bucket") << "level " << mLevel
@@ -135,7 +142,7 @@ BucketLevel::prepare(Application& app, uint32_t currLedger,
         }
     }
 
-    mNextCurr = FutureBucket(app, curr, snap, shadows);
+    mNextCurr = FutureBucket(app, curr, snap, shadows, deadline, mLevel);
     assert(mNextCurr.isMerging());
 }
 
@@ -294,18 +301,88 @@ BucketList::addBatch(Application& app, uint32_t currLedger,
         app, currLedger,
         Bucket::fresh(app.getBucketManager(), liveEntries, deadEntries), shadows);
     mLevels[0].commit();
+
+    // The batch is now the newest state of its keys; refresh any cached
+    // lookups of them. Merges never change what a lookup returns, so nothing
+    // else in the cache goes stale.
+    for (auto const& e : liveEntries)
+    {
+        auto k = LedgerEntryKey(e);
+        if (mLookupCache.exists(k))
+        {
+            mLookupCache.put(k, std::make_shared<LedgerEntry const>(e));
+        }
+    }
+    for (auto const& k : deadEntries)
+    {
+        if (mLookupCache.exists(k))
+        {
+            mLookupCache.put(k, nullptr);
+        }
+    }
+}
+
+bool
+BucketList::getLedgerEntry(LedgerKey const& key, LedgerEntry& entry)
+{
+    auto cached = mLookupCache.get(key);
+    if (cached)
+    {
+        if (!*cached)
+        {
+            return false;
+        }
+        entry = **cached;
+        return true;
+    }
+
+    std::shared_ptr<LedgerEntry const> found;
+    BucketEntry be;
+    bool hit = false;
+    for (auto const& level : mLevels)
+    {
+        if (level.getCurr()->getBucketEntry(key, be) ||
+            level.getSnap()->getBucketEntry(key, be))
+        {
+            hit = true;
+            break;
+        }
+    }
+    if (hit && be.type() == LIVEENTRY)
+    {
+        found = std::make_shared<LedgerEntry const>(be.liveEntry());
+    }
+    mLookupCache.put(key, found);
+
+    if (!found)
+    {
+        return false;
+    }
+    entry = *found;
+    return true;
 }
 
 void
 BucketList::restartMerges(Application& app, uint32_t currLedger)
 {
+    // The levels have just been replaced wholesale.
+    mLookupCache.clear();
+
     size_t i = 0;
     for (auto& level : mLevels)
     {
         auto& next = level.getNext();
         if (next.hasHashes() && !next.isLive())
         {
-            next.makeLive(app);
+            // As in BucketLevel::prepare, a restarted merge is due at the next
+            // spill of the level above.
+            uint32_t deadline = currLedger;
+            if (i > 0)
+            {
+                uint32_t half = levelHalf(i - 1);
+                deadline = mask(currLedger, half) + half;
+            }
+            next.makeLive(app, deadline, i);
             if (next.isMerging())
             {
                 CLOG(INFO, "Bucket") << "Restarted merge on BucketList level " << i;
@@ -313,11 +390,24 @@ BucketList::restartMerges(Application& app, uint32_t currLedger)
         }
         ++i;
     }
+
+    // Drop the saved progress of merges that are no longer wanted, such as
+    // those of a BucketList replaced by catchup.
+    std::set<std::string> keep;
+    for (auto& level : mLevels)
+    {
+        if (level.getNext().isMerging())
+        {
+            keep.insert(level.getNext().getMergeKey());
+        }
+    }
+    MergeCheckpoint::removeStale(app.getBucketManager().getBucketDir(), keep);
 }
 
 size_t const BucketList::kNumLevels = 11;
+size_t const BucketList::kLookupCacheSize = 16384;
 
-BucketList::BucketList()
+BucketList::BucketList() : mLookupCache(kLookupCacheSize)
 {
     for (size_t i = 0; i < kNumLevels; ++i)
     {
@@ -6,7 +6,9 @@
 
 #include <future>
 #include "bucket/FutureBucket.h"
+#include "bucket/LedgerCmp.h"
 #include "generated/StellarXDR.h"
+#include "util/LRUCache.h"
 #include "xdrpp/message.h"
 
 namespace stellar
@@ -266,8 +268,17 @@ class BucketList
     static uint32_t mask(uint32_t v, uint32_t m);
     std::vector<BucketLevel> mLevels;
 
+    // Recent results of `getLedgerEntry`, keyed by LedgerKey; a null value
+    // records that the key is absent (or deleted).
+    LRUCache<LedgerKey, std::shared_ptr<LedgerEntry const>, LedgerEntryIdCmp>
+        mLookupCache;
+
   public:
 
+    // Number of recently looked-up keys whose current state the BucketList
+    // remembers.
+    static size_t const kLookupCacheSize;
+
     // Number of bucket levels in the bucketlist. Every bucketlist in the system
     // will have this many levels and it effectively gets wired-in to the
     // protocol. Careful about changing it.
@@ -301,6 +312,14 @@ class BucketList
     // catching up from buckets loaded over the network.
     void restartMerges(Application& app, uint32_t currLedger);
 
+    // Look up the current state of the ledger entry with key `key`. Searches
+    // the buckets from newest (level 0 curr) to oldest, stopping at the first
+    // entry for `key`: returns true and sets `entry` if that is a live entry,
+    // false if it is a tombstone or if no bucket has the key. Per-bucket
+    // indexes keep each probe to at most one page read, and the results of
+    // recent lookups are cached.
+    bool getLedgerEntry(LedgerKey const& key, LedgerEntry& entry);
+
     // Add a batch of live and dead entries to the bucketlist, representing the
     // entries effected by closing `currLedger`. The bucketlist will incorporate
     // these into the smallest (0th) level, as well as commit or prepare merges
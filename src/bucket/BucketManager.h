@@ -16,6 +16,8 @@ namespace stellar
 
 class Application;
 class BucketList;
+class MergeCheckpoint;
+class MergeScheduler;
 struct LedgerHeader;
 struct HistoryArchiveState;
 
@@ -53,6 +55,26 @@ public:
     virtual BucketList& getBucketList() = 0;
 
     virtual medida::Timer& getMergeTimer() = 0;
+    virtual MergeScheduler& getMergeScheduler() = 0;
+
+    // Whether new buckets are written in the block-compressed format; see
+    // Config::BUCKET_COMPRESS. Safe to call from worker threads.
+    virtual bool compressBuckets() = 0;
+
+    // Whether merges reserve space for their output up front; see
+    // Config::BUCKET_PREALLOCATE. Safe to call from worker threads.
+    virtual bool preallocateBuckets() = 0;
+
+    // Return the checkpoint through which a merge of the given buckets, which
+    // total `inputBytes`, should record its progress and resume earlier
+    // progress, claimed for the caller; or nullptr if the merge is too small
+    // to be worth checkpointing (see Config::BUCKET_MERGE_CHECKPOINT_BYTES) or
+    // the same merge is already running. Safe to call from worker threads.
+    virtual std::unique_ptr<MergeCheckpoint>
+    checkpointMerge(std::shared_ptr<Bucket> const& oldBucket,
+                    std::shared_ptr<Bucket> const& newBucket,
+                    std::vector<std::shared_ptr<Bucket>> const& shadows,
+                    size_t inputBytes) = 0;
 
     // Get a reference to a persistent bucket (in the BucketManager's bucket
     // directory), from the BucketManager's shared bucket-set.
@@ -62,13 +84,18 @@ public:
     // otherwise move `filename` to the bucket directory, stored under `hash`,
     // and return a new bucket pointing to that.
     //
+    // The bucket's index is persisted beside it and attached to the returned
+    // bucket: `index` if the caller built one while writing `filename`, else
+    // one built by scanning the file.
+    //
     // This method is mostly-threadsafe -- assuming you don't destruct the
     // BucketManager mid-call -- and is intended to be called from both main and
     // worker threads. Very carefully.
     virtual std::shared_ptr<Bucket> adoptFileAsBucket(std::string const& filename,
                                                       uint256 const& hash,
                                                       size_t nObjects = 0,
-                                                      size_t nBytes = 0) = 0;
+                                                      size_t nBytes = 0,
+                                                      std::shared_ptr<BucketIndex> index = nullptr) = 0;
 
     // Return a bucket by hash if we have it, else return nullptr.
     virtual std::shared_ptr<Bucket> getBucketByHash(uint256 const& hash) = 0;
@@ -79,6 +106,13 @@ public:
     // independently keep them alive.
     virtual void forgetUnreferencedBuckets() = 0;
 
+    // Keep the buckets of `states`, as well as those of the current
+    // BucketList, from being forgotten, until called again. These are the
+    // states the database may come back to after a crash, when ledgers are
+    // made durable in the background; see Config::LEDGER_PERSIST_DEPTH.
+    virtual void
+    retainBuckets(std::vector<HistoryArchiveState> const& states) = 0;
+
     // Feed a new batch of entries to the bucket list.
     virtual void addBatch(Application& app, uint32_t currLedger,
                           std::vector<LedgerEntry> const& liveEntries,
@@ -3,6 +3,9 @@
 // of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
 
 #include "bucket/BucketManagerImpl.h"
+#include "bucket/BucketIndex.h"
+#include "bucket/MergeCheckpoint.h"
+#include "bucket/MergeScheduler.h"
 #include "generated/StellarXDR.h"
 #include "main/Application.h"
 #include "main/Config.h"
@@ -67,6 +70,8 @@ BucketManagerImpl::BucketManagerImpl(Application& app)
         app.getMetrics().NewTimer({"bucket", "snap", "merge"}))
     , mSharedBucketsSize(
         app.getMetrics().NewCounter({"bucket", "memory", "shared"}))
+    , mMergeScheduler(make_unique<MergeScheduler>(
+          app, app.getConfig().BUCKET_MAX_CONCURRENT_MERGES))
 
 {
 }
@@ -149,10 +154,82 @@ BucketManagerImpl::getMergeTimer()
     return mBucketSnapMerge;
 }
 
+MergeScheduler&
+BucketManagerImpl::getMergeScheduler()
+{
+    return *mMergeScheduler;
+}
+
+bool
+BucketManagerImpl::compressBuckets()
+{
+    return mApp.getConfig().BUCKET_COMPRESS;
+}
+
+bool
+BucketManagerImpl::preallocateBuckets()
+{
+    return mApp.getConfig().BUCKET_PREALLOCATE;
+}
+
+std::unique_ptr<MergeCheckpoint>
+BucketManagerImpl::checkpointMerge(
+    std::shared_ptr<Bucket> const& oldBucket,
+    std::shared_ptr<Bucket> const& newBucket,
+    std::vector<std::shared_ptr<Bucket>> const& shadows, size_t inputBytes)
+{
+    auto const& cfg = mApp.getConfig();
+    auto interval = static_cast<size_t>(cfg.BUCKET_MERGE_CHECKPOINT_BYTES);
+    if (interval == 0 || inputBytes < interval)
+    {
+        return nullptr;
+    }
+    auto checkpoint = make_unique<MergeCheckpoint>(
+        getBucketDir(), oldBucket, newBucket, shadows, interval,
+        cfg.ARTIFICIALLY_INTERRUPT_MERGES_FOR_TESTING);
+    if (!checkpoint->claim())
+    {
+        return nullptr;
+    }
+    return checkpoint;
+}
+
+std::shared_ptr<BucketIndex>
+BucketManagerImpl::indexBucketFile(std::string const& filename,
+                                   uint256 const& hash, bool loadSaved)
+{
+    // A Bucket only to read the file through, which must leave it in place.
+    auto b = std::make_shared<Bucket>(filename, hash);
+    b->setRetain(true);
+    b->setMappedInput(mApp.getConfig().BUCKET_MMAP_READS);
+    std::shared_ptr<BucketIndex> index;
+    if (loadSaved)
+    {
+        index = BucketIndex::load(b->getIndexFilename());
+    }
+    if (!index)
+    {
+        CLOG(DEBUG, "Bucket") << "Building index for bucket " << filename;
+        index = b->buildIndex();
+        if (loadSaved)
+        {
+            index->save(b->getIndexFilename());
+        }
+    }
+    return index;
+}
+
 std::shared_ptr<Bucket>
 BucketManagerImpl::adoptFileAsBucket(std::string const& filename, uint256 const& hash,
-                                     size_t nObjects, size_t nBytes)
+                                     size_t nObjects, size_t nBytes,
+                                     std::shared_ptr<BucketIndex> index)
 {
+    // Index a new file before taking the lock: that scans the whole file.
+    if (!index && !getBucketByHash(hash))
+    {
+        index = indexBucketFile(filename, hash, false);
+    }
+
     std::lock_guard<std::recursive_mutex> lock(mBucketMutex);
     // Check to see if we have an existing bucket (either in-memory or on-disk)
     std::shared_ptr<Bucket> b = getBucketByHash(hash);
@@ -178,6 +255,14 @@ BucketManagerImpl::adoptFileAsBucket(std::string const& filename, uint256 const&
         }
 
         b = std::make_shared<Bucket>(canonicalName, hash);
+        b->setMappedInput(mApp.getConfig().BUCKET_MMAP_READS);
+        if (!index)
+        {
+            // the bucket we saw before locking went away meanwhile
+            index = indexBucketFile(canonicalName, hash, false);
+        }
+        index->save(b->getIndexFilename());
+        b->setIndex(index);
         {
             mSharedBuckets.insert(std::make_pair(basename, b));
             mSharedBucketsSize.set_count(mSharedBuckets.size());
@@ -190,33 +275,49 @@ BucketManagerImpl::adoptFileAsBucket(std::string const& filename, uint256 const&
 std::shared_ptr<Bucket>
 BucketManagerImpl::getBucketByHash(uint256 const& hash)
 {
-    std::lock_guard<std::recursive_mutex> lock(mBucketMutex);
     if (isZero(hash))
     {
         return std::make_shared<Bucket>();
     }
     std::string basename = bucketBasename(binToHex(hash));
-    auto i = mSharedBuckets.find(basename);
-    if (i != mSharedBuckets.end())
     {
-        CLOG(TRACE, "Bucket")
-            << "BucketManager::getBucketByHash("
-            << binToHex(hash) << ") found bucket "
-            << i->second->getFilename();
-        return i->second;
+        std::lock_guard<std::recursive_mutex> lock(mBucketMutex);
+        auto i = mSharedBuckets.find(basename);
+        if (i != mSharedBuckets.end())
+        {
+            CLOG(TRACE, "Bucket")
+                << "BucketManager::getBucketByHash("
+                << binToHex(hash) << ") found bucket "
+                << i->second->getFilename();
+            return i->second;
+        }
     }
     std::string canonicalName = getBucketDir() + "/" + basename;
-    if (fs::exists(canonicalName))
+    if (!fs::exists(canonicalName))
     {
-        CLOG(TRACE, "Bucket")
-            << "BucketManager::getBucketByHash("
-            << binToHex(hash) << ") found no bucket, making new one";
-        auto p = std::make_shared<Bucket>(canonicalName, hash);
-        mSharedBuckets.insert(std::make_pair(basename, p));
-        mSharedBucketsSize.set_count(mSharedBuckets.size());
-        return p;
+        return std::shared_ptr<Bucket>();
     }
-    return std::shared_ptr<Bucket>();
+
+    // Load or build the index without the lock, which is only taken again
+    // to share the bucket: building scans the whole file.
+    auto index = indexBucketFile(canonicalName, hash, true);
+
+    std::lock_guard<std::recursive_mutex> lock(mBucketMutex);
+    auto i = mSharedBuckets.find(basename);
+    if (i != mSharedBuckets.end())
+    {
+        // shared by another thread meanwhile
+        return i->second;
+    }
+    CLOG(TRACE, "Bucket")
+        << "BucketManager::getBucketByHash("
+        << binToHex(hash) << ") found no bucket, making new one";
+    auto p = std::make_shared<Bucket>(canonicalName, hash);
+    p->setMappedInput(mApp.getConfig().BUCKET_MMAP_READS);
+    p->setIndex(index);
+    mSharedBuckets.insert(std::make_pair(basename, p));
+    mSharedBucketsSize.set_count(mSharedBuckets.size());
+    return p;
 }
 
 void
@@ -240,6 +341,7 @@ BucketManagerImpl::forgetUnreferencedBuckets()
             referenced.insert(h);
         }
     }
+    referenced.insert(mRetainedBuckets.begin(), mRetainedBuckets.end());
 
     for (auto i = mSharedBuckets.begin();
          i != mSharedBuckets.end();)
@@ -276,6 +378,20 @@ BucketManagerImpl::forgetUnreferencedBuckets()
     }
 }
 
+void
+BucketManagerImpl::retainBuckets(std::vector<HistoryArchiveState> const& states)
+{
+    std::lock_guard<std::recursive_mutex> lock(mBucketMutex);
+    mRetainedBuckets.clear();
+    for (auto const& has : states)
+    {
+        for (auto const& hash : has.allBuckets())
+        {
+            mRetainedBuckets.insert(bucketBasename(hash));
+        }
+    }
+}
+
 void
 BucketManagerImpl::addBatch(Application& app, uint32_t currLedger,
                     std::vector<LedgerEntry> const& liveEntries,
@@ -296,16 +412,7 @@ BucketManagerImpl::snapshotLedger(LedgerHeader& currentHeader)
 std::vector<std::string>
 BucketManagerImpl::checkForMissingBucketsFiles(HistoryArchiveState const& has)
 {
-    std::vector<std::string> buckets;
-    for (auto const& level : has.currentBuckets)
-    {
-        for (auto const& h : level.next.getHashes())
-        {
-            buckets.push_back(h);
-        }
-        buckets.push_back(level.curr);
-        buckets.push_back(level.snap);
-    }
+    std::vector<std::string> buckets = has.allBuckets();
 
     std::vector<std::string> result;
     std::copy_if(buckets.begin(), buckets.end(), std::back_inserter(result), [&](std::string b) {
@@ -7,6 +7,7 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 
 // Copyright 2015 Stellar Development Foundation and contributors. Licensed
@@ -37,6 +38,7 @@ class BucketManagerImpl : public BucketManager
     BucketList mBucketList;
     std::unique_ptr<TmpDir> mWorkDir;
     std::map<std::string, std::shared_ptr<Bucket>> mSharedBuckets;
+    std::set<std::string> mRetainedBuckets;
     mutable std::recursive_mutex mBucketMutex;
     std::unique_ptr<std::string> mLockedBucketDir;
     medida::Meter& mBucketObjectInsert;
@@ -44,6 +46,14 @@ class BucketManagerImpl : public BucketManager
     medida::Timer& mBucketAddBatch;
     medida::Timer& mBucketSnapMerge;
     medida::Counter& mSharedBucketsSize;
+    std::unique_ptr<MergeScheduler> mMergeScheduler;
+
+    // The index of the bucket file `filename`, loaded from its side file if
+    // `loadSaved` and there is one, otherwise built by scanning the file (and
+    // saved beside it if `loadSaved`). Called without mBucketMutex held.
+    std::shared_ptr<BucketIndex> indexBucketFile(std::string const& filename,
+                                                 uint256 const& hash,
+                                                 bool loadSaved);
 
 public:
     BucketManagerImpl(Application& app);
@@ -52,13 +62,23 @@ public:
     std::string const& getBucketDir() override;
     BucketList& getBucketList() override;
     medida::Timer& getMergeTimer() override;
+    MergeScheduler& getMergeScheduler() override;
+    bool compressBuckets() override;
+    bool preallocateBuckets() override;
+    std::unique_ptr<MergeCheckpoint>
+    checkpointMerge(std::shared_ptr<Bucket> const& oldBucket,
+                    std::shared_ptr<Bucket> const& newBucket,
+                    std::vector<std::shared_ptr<Bucket>> const& shadows,
+                    size_t inputBytes) override;
     std::shared_ptr<Bucket> adoptFileAsBucket(std::string const& filename,
                                               uint256 const& hash,
                                               size_t nObjects,
-                                              size_t nBytes) override;
+                                              size_t nBytes,
+                                              std::shared_ptr<BucketIndex> index) override;
     std::shared_ptr<Bucket> getBucketByHash(uint256 const& hash) override;
 
     void forgetUnreferencedBuckets() override;
+    void retainBuckets(std::vector<HistoryArchiveState> const& states) override;
     void addBatch(Application& app, uint32_t currLedger,
                   std::vector<LedgerEntry> const& liveEntries,
                   std::vector<LedgerKey> const& deadEntries) override;
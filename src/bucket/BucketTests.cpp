@@ -8,11 +8,21 @@
 #include "util/asio.h"
 
 #include "bucket/Bucket.h"
+#include "bucket/BucketIndex.h"
 #include "bucket/BucketList.h"
 #include "bucket/BucketManager.h"
 #include "bucket/LedgerCmp.h"
+#include "bucket/MergeCheckpoint.h"
+#include "bucket/MergeScheduler.h"
 #include "crypto/Hex.h"
+#include "crypto/SHA.h"
+#include "crypto/SecretKey.h"
+#include "database/Database.h"
+#include "ledger/AccountFrame.h"
+#include "ledger/LedgerDelta.h"
 #include "ledger/LedgerManager.h"
+#include "ledger/OfferFrame.h"
+#include "ledger/TrustFrame.h"
 #include "lib/catch.hpp"
 #include "main/Application.h"
 #include "main/test.h"
@@ -21,9 +31,14 @@
 #include "util/Timer.h"
 #include "util/TmpDir.h"
 #include "util/types.h"
+#include "util/XDRStream.h"
 #include "xdrpp/autocheck.h"
 #include <algorithm>
+#include <chrono>
 #include <future>
+#include <map>
+#include <mutex>
+#include <set>
 
 using namespace stellar;
 
@@ -190,6 +205,153 @@ TEST_CASE("bucket list shadowing", "[bucket]")
     }
 }
 
+TEST_CASE("bucket list lookups", "[bucket][bucketlookup]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+    BucketList bl;
+
+    autocheck::generator<std::vector<LedgerEntry>> liveGen;
+    autocheck::generator<std::vector<LedgerKey>> deadGen;
+    autocheck::generator<AccountEntry> accountGen;
+    auto alice = accountGen(5);
+
+    // Expected current state of every key added so far; null when deleted.
+    std::map<LedgerKey, std::shared_ptr<LedgerEntry>, LedgerEntryIdCmp> expected;
+    auto sameEntry = [](LedgerEntry const& a, LedgerEntry const& b)
+    {
+        using xdr::operator==;
+        return a == b;
+    };
+
+    for (uint32_t i = 1; !app->getClock().getIOService().stopped() && i < 300;
+         ++i)
+    {
+        app->getClock().crank(false);
+
+        // Keep keys unique within a batch, as they are at ledger close.
+        std::set<LedgerKey, LedgerEntryIdCmp> batchKeys;
+        std::vector<LedgerEntry> live;
+        std::vector<LedgerKey> dead;
+        LedgerEntry aliceEntry;
+        alice.balance++;
+        aliceEntry.type(ACCOUNT);
+        aliceEntry.account() = alice;
+        live.push_back(aliceEntry);
+        batchKeys.insert(LedgerEntryKey(aliceEntry));
+        for (auto const& e : liveGen(5))
+        {
+            if (batchKeys.insert(LedgerEntryKey(e)).second)
+            {
+                live.push_back(e);
+            }
+        }
+        for (auto const& k : deadGen(5))
+        {
+            if (batchKeys.insert(k).second)
+            {
+                dead.push_back(k);
+            }
+        }
+        // Occasionally delete a key added earlier.
+        if (i % 7 == 0 && expected.size() > 1)
+        {
+            auto k = std::next(expected.begin(), i % expected.size())->first;
+            if (batchKeys.insert(k).second)
+            {
+                dead.push_back(k);
+            }
+        }
+
+        bl.addBatch(*app, i, live, dead);
+        for (auto const& e : live)
+        {
+            expected[LedgerEntryKey(e)] = std::make_shared<LedgerEntry>(e);
+        }
+        for (auto const& k : dead)
+        {
+            expected[k] = nullptr;
+        }
+
+        // Alice is looked up every ledger, so is always served from the
+        // cache; it must still track her latest state.
+        LedgerEntry found;
+        REQUIRE(bl.getLedgerEntry(LedgerEntryKey(aliceEntry), found));
+        CHECK(sameEntry(found, aliceEntry));
+
+        if (i % 50 == 0)
+        {
+            for (auto const& kv : expected)
+            {
+                bool got = bl.getLedgerEntry(kv.first, found);
+                REQUIRE(got == bool(kv.second));
+                if (got)
+                {
+                    CHECK(sameEntry(found, *kv.second));
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("bucket list versus SQL lookup benchmark",
+          "[bucket][bucketbench][bench][hide]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+    app->start();
+    Database& db = app->getDatabase();
+    BucketList& bl = app->getBucketManager().getBucketList();
+    LedgerDelta delta(app->getLedgerManager().getCurrentLedgerHeader());
+
+    // Spread the accounts over enough ledgers to fill several levels.
+    size_t nLedgers = 256, perLedger = 100;
+    CLOG(INFO, "Bucket") << "Creating " << nLedgers * perLedger
+                         << " accounts in SQL and the BucketList";
+    std::vector<AccountID> ids;
+    for (uint32_t i = 1; i <= nLedgers; ++i)
+    {
+        std::vector<LedgerEntry> live;
+        for (size_t j = 0; j < perLedger; ++j)
+        {
+            AccountFrame af(SecretKey::random().getPublicKey());
+            af.getAccount().balance = i;
+            af.storeAdd(delta, db);
+            ids.push_back(af.getID());
+            live.push_back(af.mEntry);
+        }
+        bl.addBatch(*app, i, live, std::vector<LedgerKey>());
+    }
+    std::random_shuffle(ids.begin(), ids.end());
+
+    for (size_t i = 0; i < 3; ++i)
+    {
+        {
+            TIMED_SCOPE(timerObj, "SQL account lookups");
+            AccountFrame af;
+            for (auto const& id : ids)
+            {
+                REQUIRE(AccountFrame::loadAccount(id, af, db));
+            }
+        }
+        {
+            // Every key is new to the lookup cache on the first pass, and the
+            // cache holds only a fraction of the keys thereafter.
+            TIMED_SCOPE(timerObj, "BucketList account lookups");
+            LedgerKey k;
+            k.type(ACCOUNT);
+            LedgerEntry e;
+            for (auto const& id : ids)
+            {
+                k.account().accountID = id;
+                REQUIRE(bl.getLedgerEntry(k, e));
+            }
+        }
+    }
+}
+
 TEST_CASE("file-backed buckets", "[bucket]")
 {
     VirtualClock clock;
@@ -225,6 +387,987 @@ TEST_CASE("file-backed buckets", "[bucket]")
     CLOG(DEBUG, "Bucket") << "Spill file size: " << fileSize(b1->getFilename());
 }
 
+TEST_CASE("mapped and stream bucket reads agree", "[bucket]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+
+    autocheck::generator<LedgerEntry> liveGen;
+    autocheck::generator<LedgerKey> deadGen;
+    std::vector<LedgerEntry> live(900);
+    std::vector<LedgerKey> dead(100);
+    for (auto& e : live)
+        e = liveGen(3);
+    for (auto& e : dead)
+        e = deadGen(3);
+    std::shared_ptr<Bucket> b1 =
+        Bucket::fresh(app->getBucketManager(), live, dead);
+    for (auto& e : live)
+        e = liveGen(3);
+    std::shared_ptr<Bucket> b2 =
+        Bucket::fresh(app->getBucketManager(), live, dead);
+
+    b1->setMappedInput(false);
+    b2->setMappedInput(false);
+    auto streamCounts = b1->countLiveAndDeadEntries();
+    auto streamMerge = Bucket::merge(app->getBucketManager(), b1, b2);
+
+    b1->setMappedInput(true);
+    b2->setMappedInput(true);
+    auto mappedCounts = b1->countLiveAndDeadEntries();
+    auto mappedMerge = Bucket::merge(app->getBucketManager(), b1, b2);
+
+    CHECK(streamCounts == mappedCounts);
+    CHECK(streamMerge->getHash() == mappedMerge->getHash());
+}
+
+TEST_CASE("mapped versus stream bucket read benchmark",
+          "[bucket][bucketbench][bench][hide]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+
+    autocheck::generator<LedgerEntry> liveGen;
+    autocheck::generator<LedgerKey> deadGen;
+    size_t n = 100000;
+    CLOG(INFO, "Bucket") << "Generating " << n << " random ledger entries";
+    std::vector<LedgerEntry> live(n);
+    std::vector<LedgerKey> dead(n / 10);
+    for (auto& e : live)
+        e = liveGen(10);
+    for (auto& e : dead)
+        e = deadGen(10);
+    std::shared_ptr<Bucket> b1 =
+        Bucket::fresh(app->getBucketManager(), live, dead);
+    for (auto& e : live)
+        e = liveGen(10);
+    std::shared_ptr<Bucket> b2 =
+        Bucket::fresh(app->getBucketManager(), live, dead);
+    CLOG(INFO, "Bucket") << "Benchmarking reads of "
+                         << fileSize(b1->getFilename()) << " + "
+                         << fileSize(b2->getFilename()) << " byte buckets";
+
+    for (size_t i = 0; i < 5; ++i)
+    {
+        b1->setMappedInput(false);
+        b2->setMappedInput(false);
+        {
+            TIMED_SCOPE(timerObj, "stream count");
+            b1->countLiveAndDeadEntries();
+        }
+        {
+            TIMED_SCOPE(timerObj, "stream merge");
+            Bucket::merge(app->getBucketManager(), b1, b2);
+        }
+
+        b1->setMappedInput(true);
+        b2->setMappedInput(true);
+        {
+            TIMED_SCOPE(timerObj, "mapped count");
+            b1->countLiveAndDeadEntries();
+        }
+        {
+            TIMED_SCOPE(timerObj, "mapped merge");
+            Bucket::merge(app->getBucketManager(), b1, b2);
+        }
+    }
+}
+
+// Write `entries` to `filename` with a stream or a buffered writer, returning
+// the hash of the bytes written. A buffered writer reserves `preallocateBytes`.
+static uint256
+writeEntries(std::string const& filename,
+             std::vector<BucketEntry> const& entries, bool buffered,
+             bool durable, size_t preallocateBytes = 0)
+{
+    auto hasher = SHA256::create();
+    if (buffered)
+    {
+        XDROutputBufferedFileStream out;
+        out.open(filename, preallocateBytes, hasher.get());
+        for (auto const& e : entries)
+        {
+            out.writeOne(e);
+        }
+        out.close(durable);
+    }
+    else
+    {
+        XDROutputFileStream out;
+        out.open(filename);
+        for (auto const& e : entries)
+        {
+            out.writeOne(e, hasher.get());
+        }
+        out.close();
+    }
+    return hasher->finish();
+}
+
+static std::vector<BucketEntry>
+randomBucketEntries(size_t n)
+{
+    autocheck::generator<LedgerEntry> liveGen;
+    std::vector<BucketEntry> entries(n);
+    for (auto& e : entries)
+    {
+        e.type(LIVEENTRY);
+        e.liveEntry() = liveGen(10);
+    }
+    return entries;
+}
+
+TEST_CASE("buffered and stream bucket writers agree", "[bucket]")
+{
+    TmpDirManager tdm("bucketwriter");
+    TmpDir dir = tdm.tmpDir("writer");
+    auto entries = randomBucketEntries(5000);
+
+    auto streamFile = dir.getName() + "/stream.xdr";
+    auto bufferedFile = dir.getName() + "/buffered.xdr";
+    auto streamHash = writeEntries(streamFile, entries, false, false);
+    auto bufferedHash = writeEntries(bufferedFile, entries, true, true);
+    CHECK(streamHash == bufferedHash);
+    REQUIRE(fileSize(streamFile) == fileSize(bufferedFile));
+
+    // space reserved beyond what is written does not show in the file
+    auto reservedFile = dir.getName() + "/reserved.xdr";
+    auto reservedHash =
+        writeEntries(reservedFile, entries, true, false,
+                     static_cast<size_t>(fileSize(streamFile)) * 4);
+    CHECK(streamHash == reservedHash);
+    CHECK(fileSize(streamFile) == fileSize(reservedFile));
+
+    XDRInputFileStream in;
+    in.open(bufferedFile);
+    BucketEntry e;
+    size_t n = 0;
+    while (in.readOne(e))
+    {
+        using xdr::operator==;
+        REQUIRE(n < entries.size());
+        CHECK(e == entries[n]);
+        ++n;
+    }
+    CHECK(n == entries.size());
+}
+
+TEST_CASE("buffered versus stream bucket write benchmark",
+          "[bucket][bucketbench][bench][hide]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+    TmpDirManager tdm("bucketwriter");
+    TmpDir dir = tdm.tmpDir("writer");
+
+    size_t n = 200000;
+    CLOG(INFO, "Bucket") << "Generating " << n << " random bucket entries";
+    auto entries = randomBucketEntries(n);
+    auto filename = dir.getName() + "/bench.xdr";
+
+    std::vector<LedgerEntry> live(n / 2);
+    for (size_t i = 0; i < live.size(); ++i)
+    {
+        live[i] = entries[i].liveEntry();
+    }
+    auto b1 = Bucket::fresh(app->getBucketManager(), live,
+                            std::vector<LedgerKey>());
+    for (size_t i = 0; i < live.size(); ++i)
+    {
+        live[i] = entries[live.size() + i].liveEntry();
+    }
+    auto b2 = Bucket::fresh(app->getBucketManager(), live,
+                            std::vector<LedgerKey>());
+
+    for (size_t i = 0; i < 5; ++i)
+    {
+        {
+            TIMED_SCOPE(timerObj, "stream write, per-record hashing");
+            writeEntries(filename, entries, false, false);
+        }
+        {
+            TIMED_SCOPE(timerObj, "buffered write, batched hashing");
+            writeEntries(filename, entries, true, false);
+        }
+        {
+            TIMED_SCOPE(timerObj, "buffered write, batched hashing, fdatasync");
+            writeEntries(filename, entries, true, true);
+        }
+        {
+            TIMED_SCOPE(timerObj, "merge");
+            Bucket::merge(app->getBucketManager(), b1, b2);
+        }
+    }
+}
+
+TEST_CASE("partitioned and serial bucket merges agree", "[bucket]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+    BucketManager& bm = app->getBucketManager();
+
+    autocheck::generator<LedgerEntry> liveGen;
+    autocheck::generator<LedgerKey> deadGen;
+    std::vector<LedgerEntry> live(5000);
+    std::vector<LedgerKey> dead(500);
+    for (auto& e : live)
+        e = liveGen(3);
+    for (auto& e : dead)
+        e = deadGen(3);
+    std::shared_ptr<Bucket> b1 = Bucket::fresh(bm, live, dead);
+
+    // Shadow every tenth entry of the old bucket.
+    std::vector<LedgerEntry> shadowed;
+    for (size_t i = 0; i < live.size(); i += 10)
+        shadowed.push_back(live[i]);
+    std::shared_ptr<Bucket> shadow =
+        Bucket::fresh(bm, shadowed, std::vector<LedgerKey>());
+
+    for (auto& e : live)
+        e = liveGen(3);
+    std::shared_ptr<Bucket> b2 = Bucket::fresh(bm, live, dead);
+
+    std::vector<std::shared_ptr<Bucket>> shadows{shadow};
+    auto serial = Bucket::merge(bm, b1, b2, shadows);
+    for (size_t partitions : {1, 2, 4, 7})
+    {
+        auto partitioned =
+            Bucket::mergePartitioned(bm, b1, b2, shadows, partitions);
+        CHECK(serial->getHash() == partitioned->getHash());
+        CHECK(countEntries(serial) == countEntries(partitioned));
+    }
+
+    // Degenerate inputs: an empty side and a result that is entirely empty.
+    auto empty = std::make_shared<Bucket>();
+    CHECK(Bucket::mergePartitioned(bm, b1, empty, shadows, 4)->getHash() ==
+          Bucket::merge(bm, b1, empty, shadows)->getHash());
+    CHECK(Bucket::mergePartitioned(bm, empty, empty, shadows, 4)
+              ->getFilename()
+              .empty());
+}
+
+// Copy the saved progress of merges from one bucket directory to another, as
+// if the process owning the first had been restarted as the second.
+static void
+copyMergeFiles(std::string const& from, std::string const& to)
+{
+    auto names = fs::findfiles(from, [](std::string const& name)
+                               {
+                                   return name.compare(0, 6, "merge-") == 0;
+                               });
+    for (auto const& name : names)
+    {
+        std::ifstream in(from + "/" + name, std::ifstream::binary);
+        std::ofstream out(to + "/" + name, std::ofstream::binary);
+        out << in.rdbuf();
+    }
+}
+
+TEST_CASE("interrupted bucket merges resume from their checkpoints",
+          "[bucket][bucketcheckpoint]")
+{
+    VirtualClock clock;
+    Config interruptedCfg(getTestConfig(0));
+    interruptedCfg.BUCKET_MERGE_CHECKPOINT_BYTES = 16384;
+    interruptedCfg.ARTIFICIALLY_INTERRUPT_MERGES_FOR_TESTING = true;
+    Config resumedCfg(getTestConfig(1));
+    resumedCfg.BUCKET_MERGE_CHECKPOINT_BYTES = 16384;
+    Config plainCfg(getTestConfig(2));
+    plainCfg.BUCKET_MERGE_CHECKPOINT_BYTES = 0;
+
+    Application::pointer interruptedApp =
+        Application::create(clock, interruptedCfg);
+    Application::pointer resumedApp = Application::create(clock, resumedCfg);
+    Application::pointer plainApp = Application::create(clock, plainCfg);
+    BucketManager& interruptedBm = interruptedApp->getBucketManager();
+    BucketManager& resumedBm = resumedApp->getBucketManager();
+    BucketManager& plainBm = plainApp->getBucketManager();
+
+    autocheck::generator<LedgerEntry> liveGen;
+    autocheck::generator<LedgerKey> deadGen;
+    std::vector<LedgerEntry> oldLive(5000), newLive(5000), shadowed;
+    std::vector<LedgerKey> dead(500);
+    for (auto& e : oldLive)
+        e = liveGen(3);
+    for (auto& e : newLive)
+        e = liveGen(3);
+    for (auto& e : dead)
+        e = deadGen(3);
+    for (size_t i = 0; i < oldLive.size(); i += 10)
+        shadowed.push_back(oldLive[i]);
+
+    // The same inputs, and so the same merges, in each application.
+    struct Inputs
+    {
+        std::shared_ptr<Bucket> mOld, mNew;
+        std::vector<std::shared_ptr<Bucket>> mShadows;
+        size_t mBytes;
+    };
+    auto makeInputs = [&](BucketManager& bm)
+    {
+        Inputs in;
+        in.mOld = Bucket::fresh(bm, oldLive, dead);
+        in.mNew = Bucket::fresh(bm, newLive, dead);
+        in.mShadows.push_back(
+            Bucket::fresh(bm, shadowed, std::vector<LedgerKey>()));
+        in.mBytes = in.mOld->getSize() + in.mNew->getSize();
+        return in;
+    };
+    Inputs interrupted = makeInputs(interruptedBm);
+    Inputs resumed = makeInputs(resumedBm);
+    Inputs plain = makeInputs(plainBm);
+    REQUIRE(plain.mBytes > 4 * resumedCfg.BUCKET_MERGE_CHECKPOINT_BYTES);
+
+    auto expected =
+        Bucket::merge(plainBm, plain.mOld, plain.mNew, plain.mShadows);
+    REQUIRE(!expected->getFilename().empty());
+
+    std::string const& interruptedDir = interruptedBm.getBucketDir();
+    std::string const& resumedDir = resumedBm.getBucketDir();
+    auto countMergeFiles = [](std::string const& dir)
+    {
+        return fs::findfiles(dir, [](std::string const& name)
+                             {
+                                 return name.compare(0, 6, "merge-") == 0;
+                             }).size();
+    };
+
+    SECTION("serial merge")
+    {
+        REQUIRE_THROWS_AS(Bucket::merge(interruptedBm, interrupted.mOld,
+                                        interrupted.mNew,
+                                        interrupted.mShadows),
+                          std::runtime_error);
+        copyMergeFiles(interruptedDir, resumedDir);
+        {
+            auto checkpoint = resumedBm.checkpointMerge(
+                resumed.mOld, resumed.mNew, resumed.mShadows, resumed.mBytes);
+            REQUIRE(checkpoint);
+            REQUIRE(checkpoint->load());
+            CHECK(checkpoint->mPartitions == 0);
+            CHECK(checkpoint->mBytesPut >= checkpoint->getInterval());
+            CHECK(checkpoint->mOldOffset + checkpoint->mNewOffset > 0);
+        }
+
+        auto b = Bucket::merge(resumedBm, resumed.mOld, resumed.mNew,
+                               resumed.mShadows);
+        CHECK(b->getHash() == expected->getHash());
+        CHECK(countEntries(b) == countEntries(expected));
+        CHECK(b->getIndex());
+        CHECK(countMergeFiles(resumedDir) == 0);
+    }
+
+    SECTION("partitioned merge")
+    {
+        size_t const partitions = 4;
+        {
+            auto checkpoint = interruptedBm.checkpointMerge(
+                interrupted.mOld, interrupted.mNew, interrupted.mShadows,
+                interrupted.mBytes);
+            REQUIRE(checkpoint);
+            REQUIRE_THROWS_AS(
+                Bucket::mergePartitioned(interruptedBm, interrupted.mOld,
+                                         interrupted.mNew,
+                                         interrupted.mShadows, partitions,
+                                         checkpoint.get()),
+                std::runtime_error);
+        }
+        copyMergeFiles(interruptedDir, resumedDir);
+
+        auto checkpoint = resumedBm.checkpointMerge(
+            resumed.mOld, resumed.mNew, resumed.mShadows, resumed.mBytes);
+        REQUIRE(checkpoint);
+        REQUIRE(checkpoint->load());
+        CHECK(checkpoint->mPartitions == partitions);
+        CHECK(std::count(checkpoint->mPartDone.begin(),
+                         checkpoint->mPartDone.end(), true) > 0);
+
+        auto b = Bucket::mergePartitioned(resumedBm, resumed.mOld,
+                                          resumed.mNew, resumed.mShadows,
+                                          partitions, checkpoint.get());
+        checkpoint->remove();
+        CHECK(b->getHash() == expected->getHash());
+        CHECK(countEntries(b) == countEntries(expected));
+        CHECK(countMergeFiles(resumedDir) == 0);
+    }
+
+    SECTION("stale checkpoints are removed")
+    {
+        REQUIRE_THROWS_AS(Bucket::merge(interruptedBm, interrupted.mOld,
+                                        interrupted.mNew,
+                                        interrupted.mShadows),
+                          std::runtime_error);
+        REQUIRE(countMergeFiles(interruptedDir) != 0);
+        MergeCheckpoint::removeStale(interruptedDir, std::set<std::string>());
+        CHECK(countMergeFiles(interruptedDir) == 0);
+    }
+}
+
+static BucketEntry
+liveBucketEntry(LedgerEntry const& e)
+{
+    BucketEntry be;
+    be.type(LIVEENTRY);
+    be.liveEntry() = e;
+    return be;
+}
+
+TEST_CASE("merges eliminate entries shadowed in any of many buckets",
+          "[bucket][bucketshadow]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+    BucketManager& bm = app->getBucketManager();
+
+    autocheck::generator<LedgerEntry> liveGen;
+    std::vector<LedgerEntry> oldLive(3000), newLive(3000);
+    for (auto& e : oldLive)
+        e = liveGen(3);
+    for (auto& e : newLive)
+        e = liveGen(3);
+    auto oldBucket = Bucket::fresh(bm, oldLive, std::vector<LedgerKey>());
+    auto newBucket = Bucket::fresh(bm, newLive, std::vector<LedgerKey>());
+
+    // Each shadow holds a different sample of the inputs' keys, plus some
+    // keys that are in neither input.
+    std::set<LedgerKey, LedgerEntryIdCmp> shadowed;
+    std::vector<std::shared_ptr<Bucket>> shadows;
+    for (size_t k = 0; k < 12; ++k)
+    {
+        std::vector<LedgerEntry> entries;
+        for (size_t i = k; i < oldLive.size(); i += 13 + k)
+            entries.push_back(oldLive[i]);
+        for (size_t i = 2 * k; i < newLive.size(); i += 17 + k)
+            entries.push_back(newLive[i]);
+        for (size_t i = 0; i < 50; ++i)
+            entries.push_back(liveGen(3));
+        for (auto const& e : entries)
+            shadowed.insert(LedgerEntryKey(e));
+        shadows.push_back(Bucket::fresh(bm, entries, std::vector<LedgerKey>()));
+    }
+
+    std::set<LedgerKey, LedgerEntryIdCmp> expected;
+    for (auto const* live : {&oldLive, &newLive})
+    {
+        for (auto const& e : *live)
+        {
+            if (shadowed.find(LedgerEntryKey(e)) == shadowed.end())
+            {
+                expected.insert(LedgerEntryKey(e));
+            }
+        }
+    }
+
+    // Without an index on one of the shadows, the bloom filters cannot rule
+    // out any candidate and every shadow is stepped through.
+    auto index = shadows.back()->getIndex();
+    for (bool indexed : {true, false})
+    {
+        shadows.back()->setIndex(indexed ? index : nullptr);
+        auto merged = Bucket::merge(bm, oldBucket, newBucket, shadows);
+        CHECK(countEntries(merged) == expected.size());
+        for (auto const* live : {&oldLive, &newLive})
+        {
+            for (auto const& e : *live)
+            {
+                bool present = expected.find(LedgerEntryKey(e)) != expected.end();
+                CHECK(merged->containsBucketIdentity(liveBucketEntry(e)) ==
+                      present);
+            }
+        }
+    }
+    shadows.back()->setIndex(index);
+}
+
+TEST_CASE("merge with many shadows benchmark",
+          "[bucket][bucketbench][bench][hide]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+    BucketManager& bm = app->getBucketManager();
+
+    autocheck::generator<LedgerEntry> liveGen;
+    size_t n = 100000;
+    CLOG(INFO, "Bucket") << "Generating " << n << " random ledger entries";
+    std::vector<LedgerEntry> oldLive(n), newLive(n);
+    for (auto& e : oldLive)
+        e = liveGen(10);
+    for (auto& e : newLive)
+        e = liveGen(10);
+    auto oldBucket = Bucket::fresh(bm, oldLive, std::vector<LedgerKey>());
+    auto newBucket = Bucket::fresh(bm, newLive, std::vector<LedgerKey>());
+
+    // Shadows shaped like the upper levels of a BucketList: each holds a small
+    // slice of the keys being merged.
+    std::vector<std::shared_ptr<Bucket>> shadows;
+    for (size_t k = 0; k < 20; ++k)
+    {
+        std::vector<LedgerEntry> entries;
+        for (size_t i = k; i < n; i += 200)
+            entries.push_back(oldLive[i]);
+        shadows.push_back(Bucket::fresh(bm, entries, std::vector<LedgerKey>()));
+    }
+
+    for (size_t nShadows : {0, 4, 10, 20})
+    {
+        std::vector<std::shared_ptr<Bucket>> used(shadows.begin(),
+                                                  shadows.begin() + nShadows);
+        for (size_t i = 0; i < 3; ++i)
+        {
+            TIMED_SCOPE(timerObj, "merge with " + std::to_string(nShadows) +
+                                      " shadows");
+            Bucket::merge(bm, oldBucket, newBucket, used);
+        }
+    }
+}
+
+#ifdef USE_ZLIB
+static std::string
+fileContents(std::string const& name)
+{
+    std::ifstream in(name, std::ifstream::binary);
+    return std::string(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+}
+
+TEST_CASE("compressed and plain buckets agree", "[bucket][bucketcompress]")
+{
+    VirtualClock clock;
+    Config const& plainCfg = getTestConfig(0);
+    Config compressedCfg = getTestConfig(1);
+    compressedCfg.BUCKET_COMPRESS = true;
+    Application::pointer plainApp = Application::create(clock, plainCfg);
+    Application::pointer compressedApp =
+        Application::create(clock, compressedCfg);
+    BucketManager& pbm = plainApp->getBucketManager();
+    BucketManager& cbm = compressedApp->getBucketManager();
+
+    autocheck::generator<LedgerEntry> liveGen;
+    autocheck::generator<LedgerKey> deadGen;
+    std::vector<LedgerEntry> live(5000);
+    std::vector<LedgerKey> dead(500);
+    for (auto& e : live)
+        e = liveGen(3);
+    for (auto& e : dead)
+        e = deadGen(3);
+    auto p1 = Bucket::fresh(pbm, live, dead);
+    auto c1 = Bucket::fresh(cbm, live, dead);
+    auto sampled = live;
+    for (auto& e : live)
+        e = liveGen(3);
+    auto p2 = Bucket::fresh(pbm, live, dead);
+    auto c2 = Bucket::fresh(cbm, live, dead);
+
+    CHECK(!p1->isCompressed());
+    REQUIRE(c1->isCompressed());
+    CHECK(p1->getHash() == c1->getHash());
+    CHECK(p1->getSize() == c1->getSize());
+    CHECK(p1->countLiveAndDeadEntries() == c1->countLiveAndDeadEntries());
+
+    // Index lookups seek into the middle of compressed blocks.
+    REQUIRE(c1->getIndex());
+    for (size_t i = 0; i < sampled.size(); i += 7)
+    {
+        using xdr::operator==;
+        BucketEntry pe, ce;
+        auto key = LedgerEntryKey(sampled[i]);
+        REQUIRE(p1->getBucketEntry(key, pe));
+        REQUIRE(c1->getBucketEntry(key, ce));
+        CHECK(pe == ce);
+    }
+
+    // Serial, partitioned and mixed-format merges all produce the same bucket,
+    // and a compressed bucket's uncompressed form is the plain bucket's file.
+    auto pm = Bucket::merge(pbm, p1, p2);
+    auto cm = Bucket::merge(cbm, c1, c2);
+    REQUIRE(cm->isCompressed());
+    CHECK(pm->getHash() == cm->getHash());
+    CHECK(Bucket::mergePartitioned(cbm, c1, c2, {}, 4)->getHash() ==
+          pm->getHash());
+    CHECK(Bucket::merge(cbm, p1, c2)->getHash() == pm->getHash());
+    CHECK(Bucket::merge(pbm, c1, p2)->getHash() == pm->getHash());
+
+    TmpDirManager tdm("bucketcompress");
+    TmpDir dir = tdm.tmpDir("export");
+    auto exported = dir.getName() + "/bucket.xdr";
+    cm->writeUncompressed(exported);
+    CHECK(fileContents(exported) == fileContents(pm->getFilename()));
+}
+
+TEST_CASE("compressed versus plain bucket merge benchmark",
+          "[bucket][bucketbench][bench][hide]")
+{
+    VirtualClock clock;
+    Config const& plainCfg = getTestConfig(0);
+    Config compressedCfg = getTestConfig(1);
+    compressedCfg.BUCKET_COMPRESS = true;
+    Application::pointer plainApp = Application::create(clock, plainCfg);
+    Application::pointer compressedApp =
+        Application::create(clock, compressedCfg);
+
+    autocheck::generator<LedgerEntry> liveGen;
+    autocheck::generator<LedgerKey> deadGen;
+    size_t n = 100000;
+    CLOG(INFO, "Bucket") << "Generating " << n << " random ledger entries";
+    std::vector<LedgerEntry> live1(n), live2(n);
+    std::vector<LedgerKey> dead(n / 10);
+    for (auto& e : live1)
+        e = liveGen(10);
+    for (auto& e : live2)
+        e = liveGen(10);
+    for (auto& e : dead)
+        e = deadGen(10);
+
+    for (auto app : {plainApp, compressedApp})
+    {
+        BucketManager& bm = app->getBucketManager();
+        bool compressed = app->getConfig().BUCKET_COMPRESS;
+        std::string name = compressed ? "compressed" : "plain";
+        auto b1 = Bucket::fresh(bm, live1, dead);
+        auto b2 = Bucket::fresh(bm, live2, dead);
+        size_t rawBytes = b1->getSize() + b2->getSize();
+        size_t fileBytes = static_cast<size_t>(fileSize(b1->getFilename()) +
+                                               fileSize(b2->getFilename()));
+        CLOG(INFO, "Bucket") << name << " buckets: " << fileBytes
+                             << " bytes on disk for " << rawBytes
+                             << " bytes of XDR, compression ratio "
+                             << double(rawBytes) / double(fileBytes);
+
+        for (size_t i = 0; i < 5; ++i)
+        {
+            auto start = std::chrono::steady_clock::now();
+            {
+                TIMED_SCOPE(timerObj, name + " merge");
+                Bucket::merge(bm, b1, b2);
+            }
+            std::chrono::duration<double> secs =
+                std::chrono::steady_clock::now() - start;
+            CLOG(INFO, "Bucket") << name << " merge throughput: "
+                                 << rawBytes / secs.count() / (1024 * 1024)
+                                 << " MB/s of XDR input";
+        }
+    }
+}
+#endif
+
+TEST_CASE("bucket index lookups", "[bucket][bucketindex]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+    BucketManager& bm = app->getBucketManager();
+
+    autocheck::generator<LedgerEntry> liveGen;
+    autocheck::generator<LedgerKey> deadGen;
+    std::vector<LedgerEntry> live(3000);
+    std::vector<LedgerKey> dead(300);
+    for (auto& e : live)
+        e = liveGen(3);
+    for (auto& e : dead)
+        e = deadGen(3);
+    std::shared_ptr<Bucket> b = Bucket::fresh(bm, live, dead);
+    REQUIRE(b->getIndex());
+    CHECK(b->getIndex()->getPageCount() > 1);
+
+    auto checkLookups = [&](std::shared_ptr<Bucket> const& bucket)
+    {
+        BucketEntry e;
+        for (auto const& le : live)
+        {
+            auto k = LedgerEntryKey(le);
+            REQUIRE(bucket->getBucketEntry(k, e));
+            // A later dead entry for the same key may have replaced it.
+            if (e.type() == LIVEENTRY)
+            {
+                using xdr::operator==;
+                bool sameKey = (LedgerEntryKey(e.liveEntry()) == k);
+                CHECK(sameKey);
+            }
+        }
+        for (auto const& k : dead)
+        {
+            REQUIRE(bucket->getBucketEntry(k, e));
+            CHECK(e.type() == DEADENTRY);
+        }
+    };
+
+    SECTION("entries are found through the index")
+    {
+        checkLookups(b);
+    }
+
+    SECTION("index agrees with a scan of the bucket")
+    {
+        auto scanned = b->buildIndex();
+        CHECK(scanned->getPageCount() == b->getIndex()->getPageCount());
+        CHECK(scanned->getKeyCount() == b->getIndex()->getKeyCount());
+        size_t falsePositives = 0, probes = 1000;
+        for (size_t i = 0; i < probes; ++i)
+        {
+            auto k = deadGen(3);
+            BucketEntry e;
+            if (b->getIndex()->mayContain(k) && !b->getBucketEntry(k, e))
+            {
+                ++falsePositives;
+            }
+        }
+        CHECK(falsePositives < probes / 20);
+    }
+
+    SECTION("a union of bloom filters holds the keys of every bucket")
+    {
+        // a much smaller bucket, whose filter is repeated in the union
+        std::vector<LedgerKey> dead2(30);
+        for (auto& k : dead2)
+            k = deadGen(3);
+        std::shared_ptr<Bucket> b2 =
+            Bucket::fresh(bm, std::vector<LedgerEntry>(), dead2);
+        BloomUnion both({b->getIndex().get(), b2->getIndex().get()});
+        for (auto const& le : live)
+        {
+            CHECK(both.mayContain(BucketIndex::hashKey(LedgerEntryKey(le))));
+        }
+        for (auto const& k : dead)
+        {
+            CHECK(both.mayContain(BucketIndex::hashKey(k)));
+        }
+        for (auto const& k : dead2)
+        {
+            CHECK(both.mayContain(BucketIndex::hashKey(k)));
+        }
+        size_t falsePositives = 0, probes = 1000;
+        for (size_t i = 0; i < probes; ++i)
+        {
+            auto k = deadGen(3);
+            BucketEntry e;
+            if (both.mayContain(BucketIndex::hashKey(k)) &&
+                !b->getBucketEntry(k, e) && !b2->getBucketEntry(k, e))
+            {
+                ++falsePositives;
+            }
+        }
+        CHECK(falsePositives < probes / 20);
+    }
+
+    SECTION("index survives a reload from disk")
+    {
+        auto loaded = BucketIndex::load(b->getIndexFilename());
+        REQUIRE(loaded);
+        CHECK(loaded->getPageCount() == b->getIndex()->getPageCount());
+        CHECK(loaded->getKeyCount() == b->getIndex()->getKeyCount());
+        for (auto const& k : dead)
+        {
+            CHECK(loaded->mayContain(k));
+        }
+    }
+
+    SECTION("partitioned merge builds an equivalent index")
+    {
+        std::vector<LedgerKey> dead2(300);
+        for (auto& k : dead2)
+            k = deadGen(3);
+        std::shared_ptr<Bucket> b2 =
+            Bucket::fresh(bm, std::vector<LedgerEntry>(), dead2);
+        auto merged = Bucket::mergePartitioned(
+            bm, b, b2, std::vector<std::shared_ptr<Bucket>>(), 4);
+        checkLookups(merged);
+        CHECK(merged->getIndex()->getKeyCount() ==
+              merged->buildIndex()->getKeyCount());
+        BucketEntry e;
+        for (auto const& k : dead2)
+        {
+            REQUIRE(merged->getBucketEntry(k, e));
+            CHECK(e.type() == DEADENTRY);
+        }
+    }
+}
+
+TEST_CASE("fresh bucket matches merge of live and dead buckets", "[bucket]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+    BucketManager& bm = app->getBucketManager();
+
+    autocheck::generator<LedgerEntry> liveGen;
+    std::vector<LedgerEntry> live(1000);
+    std::vector<LedgerKey> dead;
+    for (auto& e : live)
+    {
+        e = liveGen(3);
+        // Kill a third of the live entries in the same batch.
+        if (dead.size() * 3 < live.size())
+        {
+            dead.push_back(LedgerEntryKey(e));
+        }
+    }
+
+    auto fresh = Bucket::fresh(bm, live, dead);
+    auto merged =
+        Bucket::merge(bm, Bucket::fresh(bm, live, std::vector<LedgerKey>()),
+                      Bucket::fresh(bm, std::vector<LedgerEntry>(), dead));
+    CHECK(fresh->getHash() == merged->getHash());
+    auto counts = fresh->countLiveAndDeadEntries();
+    CHECK(counts.second == dead.size());
+}
+
+// Bulk-load the same buckets into a database of type `bulkMode` and, entry by
+// entry, into an in-memory one, and check the two agree.
+static void
+checkBulkApply(Config::TestDbMode bulkMode)
+{
+    VirtualClock clock;
+    Application::pointer bulkApp =
+        Application::create(clock, getTestConfig(0, bulkMode));
+    Application::pointer entryApp =
+        Application::create(clock, getTestConfig(1));
+    bulkApp->start();
+    entryApp->start();
+    BucketManager& bm = bulkApp->getBucketManager();
+
+    // An older bucket creating accounts, each with a signer, a trust line and
+    // an offer, and a newer one updating some and deleting others.
+    std::vector<LedgerEntry> oldLive, newLive;
+    std::vector<LedgerKey> newDead;
+    std::vector<AccountID> ids;
+    for (size_t i = 0; i < 300; ++i)
+    {
+        auto id = SecretKey::random().getPublicKey();
+        ids.push_back(id);
+
+        LedgerEntry account;
+        account.type(ACCOUNT);
+        auto& ae = account.account();
+        ae.accountID = id;
+        ae.balance = 1000000 + i;
+        ae.seqNum = i;
+        ae.numSubEntries = 2;
+        ae.thresholds[0] = 1;
+        ae.homeDomain = "example.com";
+        ae.signers.emplace_back(SecretKey::random().getPublicKey(), 1);
+        if (i % 2)
+        {
+            ae.inflationDest.activate() = ids[0];
+        }
+        oldLive.push_back(account);
+
+        Currency currency;
+        currency.type(CURRENCY_TYPE_ALPHANUM);
+        strToCurrencyCode(currency.alphaNum().currencyCode, "USD");
+        currency.alphaNum().issuer = ids[0];
+        Currency other = currency;
+        strToCurrencyCode(other.alphaNum().currencyCode, "EUR");
+
+        LedgerEntry line;
+        line.type(TRUSTLINE);
+        line.trustLine().accountID = id;
+        line.trustLine().currency = currency;
+        line.trustLine().limit = 100 + i;
+        line.trustLine().flags = AUTHORIZED_FLAG;
+        if (i != 0)
+        {
+            oldLive.push_back(line);
+        }
+
+        LedgerEntry offer;
+        offer.type(OFFER);
+        auto& oe = offer.offer();
+        oe.accountID = id;
+        oe.offerID = i + 1;
+        oe.takerGets = currency;
+        oe.takerPays = other;
+        oe.amount = 10 + i;
+        oe.price.n = 3;
+        oe.price.d = 2;
+        oldLive.push_back(offer);
+
+        if (i % 3 == 1)
+        {
+            ae.balance *= 2;
+            ae.signers.clear();
+            ae.signers.emplace_back(SecretKey::random().getPublicKey(), 2);
+            newLive.push_back(account);
+            oe.amount = 5;
+            newLive.push_back(offer);
+        }
+        else if (i % 3 == 2)
+        {
+            newDead.push_back(LedgerEntryKey(line));
+            newDead.push_back(LedgerEntryKey(offer));
+        }
+    }
+
+    auto oldBucket = Bucket::fresh(bm, oldLive, std::vector<LedgerKey>());
+    auto newBucket = Bucket::fresh(bm, newLive, newDead);
+
+    Database& bulkDb = bulkApp->getDatabase();
+    Database& entryDb = entryApp->getDatabase();
+    {
+        soci::transaction tx(bulkDb.getSession());
+        Bucket::applyBulk(bulkDb, {newBucket, oldBucket});
+        tx.commit();
+    }
+    oldBucket->apply(entryDb);
+    newBucket->apply(entryDb);
+
+    using xdr::operator==;
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        AccountFrame a1, a2;
+        REQUIRE(AccountFrame::loadAccount(ids[i], a1, bulkDb));
+        REQUIRE(AccountFrame::loadAccount(ids[i], a2, entryDb));
+        CHECK(a1.mEntry == a2.mEntry);
+
+        if (i != 0)
+        {
+            Currency currency;
+            currency.type(CURRENCY_TYPE_ALPHANUM);
+            strToCurrencyCode(currency.alphaNum().currencyCode, "USD");
+            currency.alphaNum().issuer = ids[0];
+            TrustFrame t1, t2;
+            bool got1 = TrustFrame::loadTrustLine(ids[i], currency, t1, bulkDb);
+            bool got2 =
+                TrustFrame::loadTrustLine(ids[i], currency, t2, entryDb);
+            REQUIRE(got1 == got2);
+            CHECK(got1 == (i % 3 != 2));
+            if (got1)
+            {
+                CHECK(t1.mEntry == t2.mEntry);
+            }
+        }
+
+        OfferFrame o1, o2;
+        bool got1 = OfferFrame::loadOffer(ids[i], i + 1, o1, bulkDb);
+        bool got2 = OfferFrame::loadOffer(ids[i], i + 1, o2, entryDb);
+        REQUIRE(got1 == got2);
+        CHECK(got1 == (i % 3 != 2));
+        if (got1)
+        {
+            CHECK(o1.mEntry == o2.mEntry);
+        }
+    }
+}
+
+TEST_CASE("bulk and per-entry bucket apply agree", "[bucket][bucketapply]")
+{
+    std::vector<Config::TestDbMode> dbModes = {
+#ifdef USE_POSTGRES
+        // Loads the entry types concurrently through pooled sessions.
+        Config::TESTDB_TCP_LOCALHOST_POSTGRESQL,
+#endif
+        Config::TESTDB_IN_MEMORY_SQLITE, Config::TESTDB_ON_DISK_SQLITE};
+    for (auto dbMode : dbModes)
+    {
+        checkBulkApply(dbMode);
+    }
+}
+
 TEST_CASE("merging bucket entries", "[bucket]")
 {
     VirtualClock clock;
@@ -330,6 +1473,169 @@ TEST_CASE("merging bucket entries", "[bucket]")
     }
 }
 
+TEST_CASE("encoded bucket entry keys order and hash as decoded keys do",
+          "[bucket]")
+{
+    autocheck::generator<LedgerEntry> leGen;
+    autocheck::generator<bool> flip;
+
+    std::vector<BucketEntry> entries;
+    for (size_t i = 0; i < 200; ++i)
+    {
+        BucketEntry e;
+        auto le = leGen(10);
+        if (flip())
+        {
+            e.type(LIVEENTRY);
+            e.liveEntry() = le;
+        }
+        else
+        {
+            e.type(DEADENTRY);
+            e.deadEntry() = LedgerEntryKey(le);
+        }
+        entries.push_back(e);
+        if (flip())
+        {
+            // The other kind of entry for the same key.
+            BucketEntry other;
+            if (e.type() == LIVEENTRY)
+            {
+                other.type(DEADENTRY);
+                other.deadEntry() = LedgerEntryKey(le);
+            }
+            else
+            {
+                other.type(LIVEENTRY);
+                other.liveEntry() = le;
+            }
+            entries.push_back(other);
+        }
+    }
+
+    std::vector<xdr::opaque_vec<>> encoded;
+    for (auto const& e : entries)
+    {
+        encoded.push_back(xdr::xdr_to_opaque(e));
+    }
+    auto keyOf = [&](size_t i)
+    {
+        return BucketEntryKeyXDR(
+            reinterpret_cast<char const*>(encoded[i].data()),
+            encoded[i].size());
+    };
+
+    BucketEntryIdCmp cmp;
+    LedgerKeyXDRCmp xdrCmp;
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        auto k = keyOf(i);
+        auto key = LedgerKeyFromXDR(k);
+        REQUIRE(xdr::xdr_to_opaque(key) ==
+                xdr::xdr_to_opaque(entries[i].type() == LIVEENTRY
+                                       ? LedgerEntryKey(entries[i].liveEntry())
+                                       : entries[i].deadEntry()));
+        REQUIRE(BucketIndex::hashKey(k) == BucketIndex::hashKey(entries[i]));
+        for (size_t j = 0; j < entries.size(); ++j)
+        {
+            REQUIRE(xdrCmp(k, keyOf(j)) == cmp(entries[i], entries[j]));
+        }
+    }
+
+    auto bytes = encoded[0];
+    bytes.resize(8);
+    REQUIRE_THROWS_AS(
+        BucketEntryKeyXDR(reinterpret_cast<char const*>(bytes.data()),
+                          bytes.size()),
+        xdr::xdr_runtime_error);
+}
+
+TEST_CASE("merge scheduler runs deep merges by deadline",
+          "[bucket][mergescheduler]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+    MergeScheduler sched(*app, 1);
+
+    std::mutex mutex;
+    std::vector<uint32_t> order;
+    auto record = [&](uint32_t deadline)
+    {
+        return [&mutex, &order, deadline]()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            order.push_back(deadline);
+        };
+    };
+
+    // Occupy the single slot until the other merges have been queued.
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    std::promise<void> done;
+    sched.schedule(100, 5, [released]()
+                   {
+                       released.wait();
+                   });
+    sched.schedule(30, 3, record(30));
+    sched.schedule(10, 4, record(10));
+    sched.schedule(20, 2, record(20));
+    sched.schedule(40, 6, [&done]()
+                   {
+                       done.set_value();
+                   });
+    CHECK(sched.getRunning() == 1);
+    CHECK(sched.getQueueDepth() == 4);
+
+    // Shallow levels bypass the queue.
+    std::promise<void> shallow;
+    sched.schedule(1, 0, [&shallow]()
+                   {
+                       shallow.set_value();
+                   });
+    CHECK(sched.getQueueDepth() == 4);
+
+    release.set_value();
+    shallow.get_future().wait();
+    done.get_future().wait();
+
+    // The workers still call back into `sched` once the last merge is done;
+    // let them finish before it goes away.
+    app->joinAllThreads();
+    CHECK(sched.getQueueDepth() == 0);
+    CHECK(sched.getRunning() == 0);
+    std::lock_guard<std::mutex> lock(mutex);
+    CHECK(order == std::vector<uint32_t>({10, 20, 30}));
+}
+
+TEST_CASE("merge scheduler lends idle slots to partitioned merges",
+          "[bucket][mergescheduler]")
+{
+    VirtualClock clock;
+    Config const& cfg = getTestConfig();
+    Application::pointer app = Application::create(clock, cfg);
+    MergeScheduler sched(*app, 2);
+
+    // Helpers only get slots no merge is using, and merges queue behind them.
+    CHECK(sched.reserve(5) == 2);
+    CHECK(sched.reserve(1) == 0);
+    std::promise<void> done;
+    sched.schedule(10, 4, [&done]()
+                   {
+                       done.set_value();
+                   });
+    CHECK(sched.getRunning() == 2);
+    CHECK(sched.getQueueDepth() == 1);
+
+    sched.release(1);
+    done.get_future().wait();
+    app->joinAllThreads();
+    CHECK(sched.getQueueDepth() == 0);
+    CHECK(sched.getRunning() == 1);
+    sched.release(1);
+    CHECK(sched.getRunning() == 0);
+}
+
 TEST_CASE("bucketmanager ownership", "[bucket]")
 {
     VirtualClock clock;
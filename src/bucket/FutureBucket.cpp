@@ -10,6 +10,8 @@
 #include "bucket/FutureBucket.h"
 #include "bucket/Bucket.h"
 #include "bucket/BucketManager.h"
+#include "bucket/MergeCheckpoint.h"
+#include "bucket/MergeScheduler.h"
 #include "crypto/Hex.h"
 #include "main/Application.h"
 #include "util/Logging.h"
@@ -22,7 +24,8 @@ namespace stellar
 FutureBucket::FutureBucket(Application& app,
                            std::shared_ptr<Bucket> const& curr,
                            std::shared_ptr<Bucket> const& snap,
-                           std::vector<std::shared_ptr<Bucket>> const& shadows)
+                           std::vector<std::shared_ptr<Bucket>> const& shadows,
+                           uint32_t deadline, size_t level)
     : mState(FB_LIVE_INPUTS)
     , mInputCurrBucket(curr)
     , mInputSnapBucket(snap)
@@ -39,7 +42,7 @@ FutureBucket::FutureBucket(Application& app,
     {
         mInputShadowBucketHashes.push_back(binToHex(b->getHash()));
     }
-    startMerge(app);
+    startMerge(app, deadline, level);
 }
 
 void
@@ -248,7 +251,7 @@ FutureBucket::getOutputHash() const
 }
 
 void
-FutureBucket::startMerge(Application& app)
+FutureBucket::startMerge(Application& app, uint32_t deadline, size_t level)
 {
     // NB: startMerge starts with FutureBucket in a half-valid state; the inputs
     // are live but the merge is not yet running. So you can't call checkState()
@@ -297,12 +300,13 @@ FutureBucket::startMerge(Application& app)
         });
 
     mOutputBucket = task->get_future().share();
-    app.getWorkerIOService().post(bind(&task_t::operator(), task));
+    bm.getMergeScheduler().schedule(deadline, level,
+                                    bind(&task_t::operator(), task));
     checkState();
 }
 
 void
-FutureBucket::makeLive(Application& app)
+FutureBucket::makeLive(Application& app, uint32_t deadline, size_t level)
 {
     checkState();
     assert(!isLive());
@@ -325,7 +329,7 @@ FutureBucket::makeLive(Application& app)
             mInputShadowBuckets.push_back(b);
         }
         mState = FB_LIVE_INPUTS;
-        startMerge(app);
+        startMerge(app, deadline, level);
         assert(isLive());
     }
 }
@@ -353,5 +357,13 @@ FutureBucket::getHashes() const
     return hashes;
 }
 
+std::string
+FutureBucket::getMergeKey() const
+{
+    assert(isMerging());
+    return MergeCheckpoint::key(mInputCurrBucketHash, mInputSnapBucketHash,
+                                mInputShadowBucketHashes);
+}
+
 
 }
@@ -73,7 +73,7 @@ class FutureBucket
 
     void checkHashesMatch() const;
     void checkState() const;
-    void startMerge(Application& app);
+    void startMerge(Application& app, uint32_t deadline, size_t level);
 
     void clearInputs();
     void clearOutput();
@@ -81,10 +81,14 @@ class FutureBucket
 
 public:
 
+    // Start merging `curr` and `snap`, for BucketLevel `level` which will
+    // commit the result at ledger `deadline`; these two determine when the
+    // merge is scheduled to run (see MergeScheduler).
     FutureBucket(Application& app,
                  std::shared_ptr<Bucket> const& curr,
                  std::shared_ptr<Bucket> const& snap,
-                 std::vector<std::shared_ptr<Bucket>> const& shadows);
+                 std::vector<std::shared_ptr<Bucket>> const& shadows,
+                 uint32_t deadline = 0, size_t level = 0);
 
     FutureBucket(std::shared_ptr<Bucket> output);
 
@@ -116,12 +120,17 @@ public:
     // Precondition: isLive(); waits-for and resolves to merged bucket.
     std::shared_ptr<Bucket> resolve();
 
-    // Precondition: !isLive(); transitions from FB_HASH_FOO to FB_LIVE_FOO
-    void makeLive(Application& app);
+    // Precondition: !isLive(); transitions from FB_HASH_FOO to FB_LIVE_FOO,
+    // restarting the merge (as in the constructor) if there is no output yet.
+    void makeLive(Application& app, uint32_t deadline = 0, size_t level = 0);
 
     // Return all hashes referenced by this future.
     std::vector<std::string> getHashes() const;
 
+    // Precondition: isMerging(); returns the key under which the merge saves
+    // its progress (see MergeCheckpoint).
+    std::string getMergeKey() const;
+
     template <class Archive>
     void load(Archive& ar)
     {
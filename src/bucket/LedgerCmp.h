@@ -5,6 +5,8 @@
 // of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
 
 #include "generated/StellarXDR.h"
+#include <algorithm>
+#include <cstring>
 
 namespace stellar
 {
@@ -12,6 +14,26 @@ namespace stellar
 // Helper for getting a LedgerKey from a LedgerEntry.
 LedgerKey LedgerEntryKey(LedgerEntry const& e);
 
+/**
+ * The XDR encoding of a LedgerKey, viewed in place rather than decoded;
+ * typically inside the encoding of the BucketEntry it is the key of.
+ */
+struct LedgerKeyXDR
+{
+    char const* mData;
+    size_t mSize;
+};
+
+// View the key of the BucketEntry encoded in the `size` bytes at `body`,
+// without decoding it. A BucketEntry is encoded as its type followed by either
+// a LedgerKey or a LedgerEntry, and a LedgerEntry's encoding begins with that
+// of its key, so the key is always found right after the type. Throws
+// xdr::xdr_runtime_error if the body is too short or of an unknown type.
+LedgerKeyXDR BucketEntryKeyXDR(char const* body, size_t size);
+
+// Decode a key viewed in place.
+LedgerKey LedgerKeyFromXDR(LedgerKeyXDR const& k);
+
 /**
  * Compare two LedgerEntries or LedgerKeys for 'identity', not content.
  *
@@ -76,6 +98,98 @@ struct LedgerEntryIdCmp
     }
 };
 
+/**
+ * Test two LedgerEntries or LedgerKeys for equal 'identity', as
+ * LedgerEntryIdCmp orders them.
+ */
+struct LedgerEntryIdEq
+{
+    template <typename T, typename U>
+    bool operator()(T const& a, U const& b) const
+    {
+        if (a.type() != b.type())
+            return false;
+
+        switch (a.type())
+        {
+
+        case ACCOUNT:
+            return a.account().accountID == b.account().accountID;
+
+        case TRUSTLINE:
+        {
+            using xdr::operator==;
+            auto const& atl = a.trustLine();
+            auto const& btl = b.trustLine();
+            return atl.accountID == btl.accountID &&
+                   atl.currency == btl.currency;
+        }
+
+        case OFFER:
+            return a.offer().accountID == b.offer().accountID &&
+                   a.offer().offerID == b.offer().offerID;
+        }
+        return false;
+    }
+};
+
+/**
+ * Hash the 'identity' of a LedgerEntry or LedgerKey, consistently with
+ * LedgerEntryIdEq. Account IDs and issuers are public keys, so their first
+ * bytes are already evenly distributed and are used as they are.
+ */
+struct LedgerEntryIdHash
+{
+    template <typename T>
+    size_t operator()(T const& a) const
+    {
+        size_t h = a.type();
+        switch (a.type())
+        {
+
+        case ACCOUNT:
+            combine(h, prefix(a.account().accountID));
+            break;
+
+        case TRUSTLINE:
+        {
+            auto const& tl = a.trustLine();
+            combine(h, prefix(tl.accountID));
+            if (tl.currency.type() == CURRENCY_TYPE_ALPHANUM)
+            {
+                auto const& an = tl.currency.alphaNum();
+                uint32_t code;
+                std::memcpy(&code, an.currencyCode.data(), sizeof(code));
+                combine(h, prefix(an.issuer));
+                combine(h, code);
+            }
+            break;
+        }
+
+        case OFFER:
+            combine(h, prefix(a.offer().accountID));
+            combine(h, static_cast<size_t>(a.offer().offerID));
+            break;
+        }
+        return h;
+    }
+
+  private:
+    static size_t
+    prefix(uint256 const& key)
+    {
+        size_t p;
+        std::memcpy(&p, key.data(), sizeof(p));
+        return p;
+    }
+
+    static void
+    combine(size_t& h, size_t v)
+    {
+        h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2);
+    }
+};
+
 /**
  * Compare two BucketEntries for identity by comparing their respective
  * LedgerEntries (ignoring their hashes, as the LedgerEntryIdCmp ignores their
@@ -113,4 +227,20 @@ struct BucketEntryIdCmp
         }
     }
 };
+
+/**
+ * Compare two LedgerKeys in their XDR encodings, in the same order as
+ * LedgerEntryIdCmp compares the keys themselves: every field of a key is an
+ * unsigned big-endian integer or a fixed-length opaque, laid out in the order
+ * that LedgerEntryIdCmp compares them, and two keys only differ in length
+ * after differing in a type. So the encodings compare as plain bytes.
+ */
+struct LedgerKeyXDRCmp
+{
+    bool operator()(LedgerKeyXDR const& a, LedgerKeyXDR const& b) const
+    {
+        int c = std::memcmp(a.mData, b.mData, std::min(a.mSize, b.mSize));
+        return c < 0 || (c == 0 && a.mSize < b.mSize);
+    }
+};
 }
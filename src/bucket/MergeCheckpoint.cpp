@@ -0,0 +1,241 @@
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "bucket/MergeCheckpoint.h"
+#include "bucket/Bucket.h"
+#include "crypto/ByteSlice.h"
+#include "crypto/Hex.h"
+#include "crypto/SHA.h"
+#include "util/Fs.h"
+#include "util/Logging.h"
+#include "util/XDRStream.h"
+#include "xdrpp/marshal.h"
+#include <cassert>
+#include <cstdio>
+#include <mutex>
+
+namespace stellar
+{
+
+static const std::string kPrefix = "merge-";
+
+// Files held by merges in this process, by their common path prefix.
+static std::mutex gClaimedMutex;
+static std::set<std::string> gClaimed;
+
+static bool
+isClaimed(std::string const& base)
+{
+    std::lock_guard<std::mutex> lock(gClaimedMutex);
+    return gClaimed.find(base) != gClaimed.end();
+}
+
+MergeCheckpoint::MergeCheckpoint(
+    std::string const& dir, std::shared_ptr<Bucket> const& oldBucket,
+    std::shared_ptr<Bucket> const& newBucket,
+    std::vector<std::shared_ptr<Bucket>> const& shadows, size_t interval,
+    bool interruptForTesting)
+    : mInterval(interval), mInterruptForTesting(interruptForTesting)
+{
+    std::vector<std::string> shadowHashes;
+    for (auto const& b : shadows)
+    {
+        shadowHashes.push_back(binToHex(b->getHash()));
+    }
+    mBase = dir + "/" + kPrefix +
+            key(binToHex(oldBucket->getHash()),
+                binToHex(newBucket->getHash()), shadowHashes);
+}
+
+MergeCheckpoint::~MergeCheckpoint()
+{
+    if (mClaimed)
+    {
+        std::lock_guard<std::mutex> lock(gClaimedMutex);
+        gClaimed.erase(mBase);
+    }
+}
+
+std::string
+MergeCheckpoint::key(std::string const& curr, std::string const& snap,
+                     std::vector<std::string> const& shadows)
+{
+    auto hasher = SHA256::create();
+    hasher->add(ByteSlice(curr));
+    hasher->add(ByteSlice(snap));
+    for (auto const& s : shadows)
+    {
+        hasher->add(ByteSlice(s));
+    }
+    return binToHex(hasher->finish());
+}
+
+bool
+MergeCheckpoint::claim()
+{
+    std::lock_guard<std::mutex> lock(gClaimedMutex);
+    mClaimed = gClaimed.insert(mBase).second;
+    return mClaimed;
+}
+
+std::string
+MergeCheckpoint::getFilename() const
+{
+    return mBase + ".checkpoint";
+}
+
+std::string
+MergeCheckpoint::getOutputFilename() const
+{
+    return mBase + ".partial";
+}
+
+std::string
+MergeCheckpoint::getPartFilename(size_t i) const
+{
+    return mBase + ".part-" + std::to_string(i);
+}
+
+bool
+MergeCheckpoint::load()
+{
+    assert(mClaimed);
+    std::string filename = getFilename();
+    if (!fs::exists(filename))
+    {
+        return false;
+    }
+    try
+    {
+        XDRInputFileStream in;
+        in.open(filename);
+        uint32_t version = 0;
+        uint32_t nParts = 0;
+        if (!(in.readOne(version) && version == kFormatVersion &&
+              in.readOne(mOldOffset) && in.readOne(mNewOffset) &&
+              in.readOne(mBytesPut) && in.readOne(mObjectsPut) &&
+              in.readOne(mHashState) && in.readOne(mPartitions) &&
+              in.readOne(nParts)))
+        {
+            throw std::runtime_error("bad checkpoint header");
+        }
+        mPartDone.resize(nParts);
+        mPartObjects.resize(nParts);
+        mPartBytes.resize(nParts);
+        for (size_t i = 0; i < nParts; ++i)
+        {
+            uint32_t done = 0;
+            if (!(in.readOne(done) && in.readOne(mPartObjects[i]) &&
+                  in.readOne(mPartBytes[i])))
+            {
+                throw std::runtime_error("truncated checkpoint");
+            }
+            mPartDone[i] = done != 0;
+        }
+    }
+    catch (std::exception& e)
+    {
+        CLOG(WARNING, "Bucket") << "Ignoring unreadable merge checkpoint "
+                                << filename << ": " << e.what();
+        remove();
+        return false;
+    }
+    return true;
+}
+
+void
+MergeCheckpoint::save()
+{
+    assert(mClaimed);
+    std::string filename = getFilename();
+    std::string tmp = filename + ".tmp";
+    {
+        XDROutputFileStream out;
+        out.open(tmp);
+        uint32_t version = kFormatVersion;
+        uint32_t nParts = static_cast<uint32_t>(mPartDone.size());
+        bool ok = out.writeOne(version) && out.writeOne(mOldOffset) &&
+                  out.writeOne(mNewOffset) && out.writeOne(mBytesPut) &&
+                  out.writeOne(mObjectsPut) && out.writeOne(mHashState) &&
+                  out.writeOne(mPartitions) && out.writeOne(nParts);
+        for (size_t i = 0; ok && i < nParts; ++i)
+        {
+            uint32_t done = mPartDone[i] ? 1 : 0;
+            ok = out.writeOne(done) && out.writeOne(mPartObjects[i]) &&
+                 out.writeOne(mPartBytes[i]);
+        }
+        out.close();
+        if (!ok)
+        {
+            std::remove(tmp.c_str());
+            throw std::runtime_error("failed to write merge checkpoint: " +
+                                     tmp);
+        }
+    }
+#ifdef _WIN32
+    // rename() does not replace an existing file here; a crash in between
+    // just loses the checkpoint, and the merge starts over.
+    std::remove(filename.c_str());
+#endif
+    if (rename(tmp.c_str(), filename.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("failed to rename merge checkpoint: " +
+                                 filename);
+    }
+    if (mInterruptForTesting)
+    {
+        throw std::runtime_error("merge interrupted for testing");
+    }
+}
+
+void
+MergeCheckpoint::remove()
+{
+    assert(mClaimed);
+    mOldOffset = mNewOffset = mBytesPut = mObjectsPut = 0;
+    mHashState.clear();
+    mPartitions = 0;
+    mPartDone.clear();
+    mPartObjects.clear();
+    mPartBytes.clear();
+
+    auto slash = mBase.rfind('/');
+    std::string dir = mBase.substr(0, slash);
+    std::string prefix = mBase.substr(slash + 1) + ".";
+    auto names = fs::findfiles(dir, [&](std::string const& name)
+                               {
+                                   return name.compare(0, prefix.size(),
+                                                       prefix) == 0;
+                               });
+    for (auto const& name : names)
+    {
+        std::remove((dir + "/" + name).c_str());
+    }
+}
+
+void
+MergeCheckpoint::removeStale(std::string const& dir,
+                             std::set<std::string> const& keep)
+{
+    // A key is 64 hex digits; keep anything else well alone.
+    size_t const keyLen = 64;
+    auto names = fs::findfiles(dir, [&](std::string const& name)
+                               {
+                                   return name.size() > kPrefix.size() + keyLen &&
+                                          name.compare(0, kPrefix.size(),
+                                                       kPrefix) == 0 &&
+                                          name[kPrefix.size() + keyLen] == '.';
+                               });
+    for (auto const& name : names)
+    {
+        std::string k = name.substr(kPrefix.size(), keyLen);
+        if (keep.find(k) == keep.end() && !isClaimed(dir + "/" + kPrefix + k))
+        {
+            CLOG(DEBUG, "Bucket") << "Removing stale merge file " << name;
+            std::remove((dir + "/" + name).c_str());
+        }
+    }
+}
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "generated/StellarXDR.h"
+#include "util/NonCopyable.h"
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace stellar
+{
+
+class Bucket;
+
+/**
+ * MergeCheckpoint records the progress of a long bucket merge on disk, so that
+ * a merge cut short by a crash or restart resumes from where it got to --
+ * when BucketList::restartMerges starts a merge of the same inputs again --
+ * rather than starting over.
+ *
+ * A merge's files live in the bucket directory, named for a key derived from
+ * the hashes of its inputs:
+ *
+ *   merge-<key>.checkpoint  this record
+ *   merge-<key>.partial     output of a serial merge; its first `mBytesPut`
+ *                           bytes are durable and described by the record
+ *   merge-<key>.part-<i>    finished parts of a partitioned merge
+ *
+ * A serial merge periodically syncs its output, then saves the offsets of the
+ * next unmerged entries of its two inputs together with the size, object count
+ * and running hash state of the output written so far. A partitioned merge
+ * keeps each part's file once the part is finished and records it, so only
+ * unfinished parts are merged again. The record is replaced atomically; the
+ * files are removed once the merge's bucket has been adopted.
+ */
+class MergeCheckpoint : NonMovableOrCopyable
+{
+    std::string mBase;
+    size_t mInterval;
+    bool mInterruptForTesting;
+    bool mClaimed{false};
+
+  public:
+    // Serial merges: offsets of the next entries to merge from the old and
+    // new buckets, and the part of the output already written.
+    uint64_t mOldOffset{0};
+    uint64_t mNewOffset{0};
+    uint64_t mBytesPut{0};
+    uint64_t mObjectsPut{0};
+    xdr::opaque_vec<> mHashState;
+
+    // Partitioned merges: the number of partitions requested, from which the
+    // partition boundaries are recomputed identically, and for each actual
+    // partition whether its part is finished and, if so, its object and byte
+    // counts.
+    uint32_t mPartitions{0};
+    std::vector<bool> mPartDone;
+    std::vector<uint64_t> mPartObjects;
+    std::vector<uint64_t> mPartBytes;
+
+    // Checkpoint a merge of `oldBucket` and `newBucket` under `shadows` into
+    // `dir`, every `interval` bytes of output.
+    MergeCheckpoint(std::string const& dir,
+                    std::shared_ptr<Bucket> const& oldBucket,
+                    std::shared_ptr<Bucket> const& newBucket,
+                    std::vector<std::shared_ptr<Bucket>> const& shadows,
+                    size_t interval, bool interruptForTesting = false);
+
+    // Releases the claim, if held; the files stay.
+    ~MergeCheckpoint();
+
+    // Key of a merge of the buckets with the given hex hashes.
+    static std::string key(std::string const& curr, std::string const& snap,
+                           std::vector<std::string> const& shadows);
+
+    // Take the merge's files for this merge. Returns false if another merge in
+    // this process already holds them -- the same merge, restarted while still
+    // running -- in which case this one must not touch them.
+    bool claim();
+
+    size_t
+    getInterval() const
+    {
+        return mInterval;
+    }
+
+    std::string getFilename() const;
+    std::string getOutputFilename() const;
+    std::string getPartFilename(size_t i) const;
+
+    // Read the merge's saved record, if any, into this one. Returns false,
+    // leaving the record empty, if there is none or it cannot be read.
+    bool load();
+
+    // Save the record, replacing the previous one atomically. Throws
+    // std::runtime_error on failure -- or, for testing, once it has succeeded;
+    // see Config::ARTIFICIALLY_INTERRUPT_MERGES_FOR_TESTING.
+    void save();
+
+    // Forget all progress, in memory and on disk, deleting the merge's files.
+    void remove();
+
+    // Delete the files of merges in `dir` whose keys are not in `keep` and
+    // that no merge in this process holds.
+    static void removeStale(std::string const& dir,
+                            std::set<std::string> const& keep);
+
+  private:
+    static const uint32_t kFormatVersion = 1;
+};
+}
@@ -0,0 +1,162 @@
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+// ASIO is somewhat particular about when it gets included -- it wants to be the
+// first to include <windows.h> -- so we try to include it before everything
+// else.
+#include "util/asio.h"
+
+#include "bucket/MergeScheduler.h"
+#include "bucket/BucketList.h"
+#include "main/Application.h"
+#include "util/Logging.h"
+
+#include "medida/counter.h"
+#include "medida/metrics_registry.h"
+#include "medida/timer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <string>
+#include <thread>
+
+namespace stellar
+{
+
+static size_t
+defaultMaxRunning()
+{
+    return std::max<size_t>(1, std::thread::hardware_concurrency() / 2);
+}
+
+MergeScheduler::MergeScheduler(Application& app, size_t maxRunning)
+    : mApp(app)
+    , mMaxRunning(maxRunning == 0 ? defaultMaxRunning() : maxRunning)
+    , mQueueDepth(
+          app.getMetrics().NewCounter({"bucket", "merge", "queue-depth"}))
+    , mRunningCount(app.getMetrics().NewCounter({"bucket", "merge", "running"}))
+{
+    for (size_t i = 0; i < BucketList::kNumLevels; ++i)
+    {
+        std::string level = "level-" + std::to_string(i);
+        mWaitTimers.push_back(
+            &app.getMetrics().NewTimer({"bucket", "merge-wait", level}));
+        mRunTimers.push_back(
+            &app.getMetrics().NewTimer({"bucket", "merge-run", level}));
+    }
+}
+
+void
+MergeScheduler::schedule(uint32_t deadline, size_t level,
+                         std::function<void()> merge)
+{
+    assert(level < BucketList::kNumLevels);
+    Job job{deadline, 0, level, std::chrono::steady_clock::now(),
+            std::move(merge)};
+    if (level < kFirstQueuedLevel)
+    {
+        post(std::move(job), false);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    job.mSeq = mNextSeq++;
+    CLOG(TRACE, "Bucket") << "Queueing merge for level " << level
+                          << " due at ledger " << deadline;
+    mQueue.push(std::move(job));
+    mQueueDepth.set_count(mQueue.size());
+    dispatch();
+}
+
+void
+MergeScheduler::post(Job job, bool queued)
+{
+    auto shared = std::make_shared<Job>(std::move(job));
+    mApp.getWorkerIOService().post([this, shared, queued]()
+                                   {
+                                       auto& j = *shared;
+                                       mWaitTimers[j.mLevel]->Update(
+                                           std::chrono::steady_clock::now() -
+                                           j.mQueuedAt);
+                                       {
+                                           auto timer = mRunTimers[j.mLevel]
+                                                            ->TimeScope();
+                                           j.mMerge();
+                                       }
+                                       if (queued)
+                                       {
+                                           finished();
+                                       }
+                                   });
+}
+
+// Called with mMutex held.
+void
+MergeScheduler::dispatch()
+{
+    while (mRunning < mMaxRunning && !mQueue.empty())
+    {
+        Job job = mQueue.top();
+        mQueue.pop();
+        ++mRunning;
+        CLOG(TRACE, "Bucket") << "Starting merge for level " << job.mLevel
+                              << " due at ledger " << job.mDeadline;
+        post(std::move(job), true);
+    }
+    mQueueDepth.set_count(mQueue.size());
+    mRunningCount.set_count(mRunning);
+}
+
+void
+MergeScheduler::finished()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    assert(mRunning > 0);
+    --mRunning;
+    dispatch();
+}
+
+size_t
+MergeScheduler::reserve(size_t wanted)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    size_t n = std::min(wanted, mMaxRunning - std::min(mRunning, mMaxRunning));
+    mRunning += n;
+    mRunningCount.set_count(mRunning);
+    return n;
+}
+
+void
+MergeScheduler::release(size_t n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    assert(mRunning >= n);
+    mRunning -= n;
+    dispatch();
+}
+
+size_t
+MergeScheduler::getQueueDepth() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mQueue.size();
+}
+
+size_t
+MergeScheduler::getRunning() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mRunning;
+}
+
+size_t
+MergeScheduler::getMaxRunning() const
+{
+    return mMaxRunning;
+}
+}
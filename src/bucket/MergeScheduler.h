@@ -0,0 +1,110 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "util/NonCopyable.h"
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+namespace medida
+{
+class Counter;
+class Timer;
+}
+
+namespace stellar
+{
+
+class Application;
+
+/**
+ * MergeScheduler decides when the bucket merges started by FutureBuckets get
+ * to run on the worker threads.
+ *
+ * Merges for the small, shallow levels of the BucketList are needed within a
+ * ledger or two and are cheap, so they are posted to the workers immediately.
+ * Merges for deeper levels are large, IO-heavy and due many ledgers later;
+ * they are queued and run at most `maxRunning` at a time, earliest deadline
+ * first, so that they neither starve each other nor crowd out the shallow
+ * merges and other work (hash verification, SCP) sharing the worker pool.
+ *
+ * The deadline of a merge is the ledger at which its BucketLevel will commit
+ * it -- that is, block on its result.
+ *
+ * Threadsafe: merges are scheduled from the main thread and complete on
+ * workers.
+ */
+class MergeScheduler : NonMovableOrCopyable
+{
+  public:
+    // Levels below this are never queued.
+    static const size_t kFirstQueuedLevel = 2;
+
+    // `maxRunning` caps the number of queued-level merges running at once; 0
+    // means half the worker threads (at least one).
+    MergeScheduler(Application& app, size_t maxRunning = 0);
+
+    // Run `merge` on a worker thread, for BucketLevel `level`, which needs its
+    // result by ledger `deadline`.
+    void schedule(uint32_t deadline, size_t level, std::function<void()> merge);
+
+    // Take up to `wanted` idle slots for helper threads of a merge that is
+    // already running -- the parts of a partitioned merge -- so that they
+    // count against `maxRunning` like merges do. Returns the number taken,
+    // each of which must be handed back by `release` once its thread is done.
+    size_t reserve(size_t wanted);
+    void release(size_t n);
+
+    size_t getQueueDepth() const;
+    size_t getRunning() const;
+    size_t getMaxRunning() const;
+
+  private:
+    struct Job
+    {
+        uint32_t mDeadline;
+        uint64_t mSeq;
+        size_t mLevel;
+        std::chrono::steady_clock::time_point mQueuedAt;
+        std::function<void()> mMerge;
+    };
+
+    // Orders the priority queue so the earliest deadline is on top, ties
+    // broken by order of scheduling.
+    struct LaterJob
+    {
+        bool
+        operator()(Job const& a, Job const& b) const
+        {
+            if (a.mDeadline != b.mDeadline)
+            {
+                return a.mDeadline > b.mDeadline;
+            }
+            return a.mSeq > b.mSeq;
+        }
+    };
+
+    Application& mApp;
+    size_t const mMaxRunning;
+
+    mutable std::mutex mMutex;
+    std::priority_queue<Job, std::vector<Job>, LaterJob> mQueue;
+    size_t mRunning{0};
+    uint64_t mNextSeq{0};
+
+    medida::Counter& mQueueDepth;
+    medida::Counter& mRunningCount;
+    std::vector<medida::Timer*> mWaitTimers;
+    std::vector<medida::Timer*> mRunTimers;
+
+    void post(Job job, bool queued);
+    void dispatch();
+    void finished();
+};
+}
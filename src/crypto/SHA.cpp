@@ -7,6 +7,7 @@
 #include <sodium.h>
 #include "util/make_unique.h"
 #include "util/NonCopyable.h"
+#include <cstring>
 
 namespace stellar
 {
@@ -29,8 +30,10 @@ class SHA256Impl : public SHA256, NonCopyable
     bool mFinished;
 public:
     SHA256Impl();
+    explicit SHA256Impl(xdr::opaque_vec<> const& state);
     void add(ByteSlice const& bin) override;
     uint256 finish() override;
+    xdr::opaque_vec<> saveState() const override;
 };
 
 std::unique_ptr<SHA256>
@@ -39,6 +42,12 @@ SHA256::create()
     return make_unique<SHA256Impl>();
 }
 
+std::unique_ptr<SHA256>
+SHA256::resume(xdr::opaque_vec<> const& state)
+{
+    return make_unique<SHA256Impl>(state);
+}
+
 SHA256Impl::SHA256Impl()
     : mFinished(false)
 {
@@ -48,6 +57,27 @@ SHA256Impl::SHA256Impl()
     }
 }
 
+SHA256Impl::SHA256Impl(xdr::opaque_vec<> const& state)
+    : mFinished(false)
+{
+    if (state.size() != sizeof(mState))
+    {
+        throw std::runtime_error("bad saved SHA256 state");
+    }
+    memcpy(&mState, state.data(), sizeof(mState));
+}
+
+xdr::opaque_vec<>
+SHA256Impl::saveState() const
+{
+    if (mFinished)
+    {
+        throw std::runtime_error("saving state of finished SHA256");
+    }
+    auto p = reinterpret_cast<uint8_t const*>(&mState);
+    return xdr::opaque_vec<>(p, p + sizeof(mState));
+}
+
 void
 SHA256Impl::add(ByteSlice const& bin)
 {
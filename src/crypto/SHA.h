@@ -22,5 +22,11 @@ class SHA256
     virtual ~SHA256() {};
     virtual void add(ByteSlice const& bin) = 0;
     virtual uint256 finish() = 0;
+
+    // Capture the state of an unfinished hash, so that it can be continued
+    // later -- possibly by another process on the same machine -- with
+    // `resume`. The state is opaque and not portable between builds.
+    virtual xdr::opaque_vec<> saveState() const = 0;
+    static std::unique_ptr<SHA256> resume(xdr::opaque_vec<> const& state);
 };
 }
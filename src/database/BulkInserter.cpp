@@ -0,0 +1,407 @@
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "database/BulkInserter.h"
+#include "crypto/Hex.h"
+#include "database/Database.h"
+#include "util/make_unique.h"
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstdint>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef USE_POSTGRES
+#include "soci-postgresql.h"
+#include <libpq-fe.h>
+#endif
+
+namespace stellar
+{
+
+using namespace soci;
+
+// SQLite refuses statements with more bound parameters than this
+// (SQLITE_MAX_VARIABLE_NUMBER in its default build).
+static const size_t kSqliteMaxParams = 999;
+
+// Amount of COPY data buffered before it is sent to PostgreSQL.
+static const size_t kCopyBufferBytes = 4 * 1024 * 1024;
+
+BulkInserter::BulkInserter(Database& db, std::string const& table,
+                           std::vector<std::string> const& columns)
+    : BulkInserter(db, db.getSession(), table, columns)
+{
+}
+
+BulkInserter::BulkInserter(Database& db, soci::session& session,
+                           std::string const& table,
+                           std::vector<std::string> const& columns)
+    : mDatabase(db)
+    , mSession(session)
+    , mTable(table)
+    , mColumns(columns)
+    , mUseCopy(!db.isSqlite())
+    , mBatchRows(std::max<size_t>(1, kSqliteMaxParams / columns.size()))
+{
+    assert(!columns.empty());
+#ifndef USE_POSTGRES
+    if (mUseCopy)
+    {
+        throw std::runtime_error("bulk insert: unsupported database");
+    }
+#endif
+    if (mUseCopy)
+    {
+        lookupCopyFields();
+    }
+}
+
+void
+BulkInserter::lookupCopyFields()
+{
+    // type OIDs of the columns, by name (folded to lower case, as unquoted)
+    std::map<std::string, long long> types;
+    std::string name;
+    long long type = 0;
+    statement st = (mSession.prepare
+                        << "SELECT attname, CAST(atttypid AS BIGINT) "
+                           "FROM pg_attribute "
+                           "WHERE attrelid = CAST(:t AS regclass) "
+                           "AND attnum > 0 AND NOT attisdropped",
+                    into(name), into(type), use(mTable));
+    st.execute(true);
+    while (st.got_data())
+    {
+        types[name] = type;
+        st.fetch();
+    }
+
+    std::vector<CopyField> fields;
+    for (auto const& column : mColumns)
+    {
+        std::string lower(column);
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        auto it = types.find(lower);
+        if (it == types.end())
+        {
+            return;
+        }
+        switch (it->second)
+        {
+        case 17:   // BYTEA
+        case 25:   // TEXT
+        case 1042: // CHARACTER
+        case 1043: // VARCHAR
+            fields.push_back(COPY_BYTES);
+            break;
+        case 21: // SMALLINT
+            fields.push_back(COPY_INT2);
+            break;
+        case 23: // INT
+            fields.push_back(COPY_INT4);
+            break;
+        case 20: // BIGINT
+            fields.push_back(COPY_INT8);
+            break;
+        default:
+            return;
+        }
+    }
+    mCopyFields = fields;
+}
+
+// Escape a value for COPY's text format: backslash, and the characters it
+// uses as row and column delimiters.
+static void
+appendCopyText(std::string& out, std::string const& text)
+{
+    for (auto c : text)
+    {
+        switch (c)
+        {
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        default:
+            out += c;
+        }
+    }
+}
+
+// Append `v` to `out` as a `bytes`-byte big-endian integer, as COPY's binary
+// format has every integer.
+static void
+appendCopyInt(std::string& out, uint64_t v, size_t bytes)
+{
+    while (bytes-- > 0)
+    {
+        out += static_cast<char>((v >> (8 * bytes)) & 0xff);
+    }
+}
+
+static int64_t
+parseCopyInt(std::string const& text, int64_t min, int64_t max)
+{
+    size_t end = 0;
+    long long v = 0;
+    try
+    {
+        v = std::stoll(text, &end);
+    }
+    catch (std::logic_error&)
+    {
+        end = 0;
+    }
+    if (end == 0 || end != text.size() || v < min || v > max)
+    {
+        throw std::runtime_error("bulk insert: bad integer '" + text + "'");
+    }
+    return v;
+}
+
+void
+BulkInserter::addCopyText(std::vector<Value> const& values)
+{
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        if (i != 0)
+        {
+            mCopyBuffer += '\t';
+        }
+        if (values[i].mNull)
+        {
+            mCopyBuffer += "\\N";
+        }
+        else if (values[i].mBinary)
+        {
+            // BYTEA's hex input format, its backslash escaped for COPY
+            mCopyBuffer += "\\\\x";
+            mCopyBuffer += binToHex(values[i].mText);
+        }
+        else
+        {
+            appendCopyText(mCopyBuffer, values[i].mText);
+        }
+    }
+    mCopyBuffer += '\n';
+}
+
+void
+BulkInserter::addCopyBinary(std::vector<Value> const& values)
+{
+    if (mCopyBuffer.empty())
+    {
+        // signature, flags and header extension length
+        mCopyBuffer.append("PGCOPY\n\377\r\n\0", 11);
+        appendCopyInt(mCopyBuffer, 0, 4);
+        appendCopyInt(mCopyBuffer, 0, 4);
+    }
+    appendCopyInt(mCopyBuffer, values.size(), 2);
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        Value const& v = values[i];
+        if (v.mNull)
+        {
+            appendCopyInt(mCopyBuffer, static_cast<uint32_t>(-1), 4);
+            continue;
+        }
+        switch (mCopyFields[i])
+        {
+        case COPY_BYTES:
+            appendCopyInt(mCopyBuffer, v.mText.size(), 4);
+            mCopyBuffer += v.mText;
+            break;
+        case COPY_INT2:
+            appendCopyInt(mCopyBuffer, 2, 4);
+            appendCopyInt(mCopyBuffer,
+                          parseCopyInt(v.mText, INT16_MIN, INT16_MAX), 2);
+            break;
+        case COPY_INT4:
+            appendCopyInt(mCopyBuffer, 4, 4);
+            appendCopyInt(mCopyBuffer,
+                          parseCopyInt(v.mText, INT32_MIN, INT32_MAX), 4);
+            break;
+        case COPY_INT8:
+            appendCopyInt(mCopyBuffer, 8, 4);
+            appendCopyInt(mCopyBuffer,
+                          parseCopyInt(v.mText, INT64_MIN, INT64_MAX), 8);
+            break;
+        }
+    }
+}
+
+void
+BulkInserter::addRow(std::vector<Value> const& values)
+{
+    if (values.size() != mColumns.size())
+    {
+        throw std::runtime_error("bulk insert: wrong number of values for " +
+                                 mTable);
+    }
+    ++mRowCount;
+    if (mUseCopy)
+    {
+        if (mCopyFields.empty())
+        {
+            addCopyText(values);
+        }
+        else
+        {
+            addCopyBinary(values);
+        }
+        if (mCopyBuffer.size() >= kCopyBufferBytes)
+        {
+            flushCopy();
+        }
+    }
+    else
+    {
+        mPending.insert(mPending.end(), values.begin(), values.end());
+        if (mPending.size() >= mBatchRows * mColumns.size())
+        {
+            flushInsert(mBatchRows);
+        }
+    }
+}
+
+void
+BulkInserter::flush()
+{
+    if (mUseCopy)
+    {
+        flushCopy();
+    }
+    else
+    {
+        flushInsert(mPending.size() / mColumns.size());
+    }
+}
+
+void
+BulkInserter::flushInsert(size_t rows)
+{
+    if (rows == 0)
+    {
+        return;
+    }
+    assert(mPending.size() == rows * mColumns.size());
+
+    std::ostringstream sql;
+    sql << "INSERT INTO " << mTable << " (";
+    for (size_t c = 0; c < mColumns.size(); ++c)
+    {
+        sql << (c == 0 ? "" : ",") << mColumns[c];
+    }
+    sql << ") VALUES ";
+    for (size_t r = 0; r < rows; ++r)
+    {
+        sql << (r == 0 ? "(" : ",(");
+        for (size_t c = 0; c < mColumns.size(); ++c)
+        {
+            sql << (c == 0 ? ":v" : ",:v") << (r * mColumns.size() + c);
+        }
+        sql << ")";
+    }
+
+    // SOCI binds strings as C strings: bytes go in blobs
+    std::vector<indicator> inds(mPending.size());
+    std::vector<std::unique_ptr<blob>> blobs;
+    statement st(mSession);
+    st.alloc();
+    st.prepare(sql.str());
+    for (size_t i = 0; i < mPending.size(); ++i)
+    {
+        Value const& v = mPending[i];
+        inds[i] = v.mNull ? i_null : i_ok;
+        if (v.mBinary && !v.mNull)
+        {
+            blobs.emplace_back(make_unique<blob>(mSession));
+            if (!v.mText.empty())
+            {
+                blobs.back()->write(0, v.mText.data(), v.mText.size());
+            }
+            st.exchange(use(*blobs.back(), inds[i]));
+        }
+        else
+        {
+            st.exchange(use(mPending[i].mText, inds[i]));
+        }
+    }
+    st.define_and_bind();
+    {
+        auto timer = mDatabase.getInsertTimer("bulk");
+        st.execute(true);
+    }
+    if (st.get_affected_rows() != static_cast<long long>(rows))
+    {
+        throw std::runtime_error("Could not bulk insert data in SQL");
+    }
+    mPending.clear();
+}
+
+void
+BulkInserter::flushCopy()
+{
+    if (mCopyBuffer.empty())
+    {
+        return;
+    }
+#ifdef USE_POSTGRES
+    auto backend =
+        static_cast<postgresql_session_backend*>(mSession.get_backend());
+    PGconn* conn = backend->conn_;
+
+    std::ostringstream sql;
+    sql << "COPY " << mTable << " (";
+    for (size_t c = 0; c < mColumns.size(); ++c)
+    {
+        sql << (c == 0 ? "" : ",") << mColumns[c];
+    }
+    sql << ") FROM STDIN";
+    if (!mCopyFields.empty())
+    {
+        sql << " WITH (FORMAT binary)";
+        // file trailer
+        appendCopyInt(mCopyBuffer, static_cast<uint16_t>(-1), 2);
+    }
+
+    auto timer = mDatabase.getInsertTimer("bulk");
+    PGresult* res = PQexec(conn, sql.str().c_str());
+    bool ok = (PQresultStatus(res) == PGRES_COPY_IN);
+    PQclear(res);
+    if (ok)
+    {
+        ok = PQputCopyData(conn, mCopyBuffer.data(),
+                           static_cast<int>(mCopyBuffer.size())) == 1;
+        ok = (PQputCopyEnd(conn, ok ? nullptr : "bulk insert aborted") == 1) &&
+             ok;
+        while ((res = PQgetResult(conn)) != nullptr)
+        {
+            ok = ok && (PQresultStatus(res) == PGRES_COMMAND_OK);
+            PQclear(res);
+        }
+    }
+    if (!ok)
+    {
+        std::string msg("Could not bulk insert data in SQL: ");
+        throw std::runtime_error(msg + PQerrorMessage(conn));
+    }
+    mCopyBuffer.clear();
+#else
+    assert(false);
+#endif
+}
+}
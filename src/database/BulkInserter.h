@@ -0,0 +1,138 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "util/NonCopyable.h"
+#include <string>
+#include <vector>
+
+namespace soci
+{
+class session;
+}
+
+namespace stellar
+{
+class Database;
+
+/**
+ * Helper for writing many rows to a single table much faster than issuing an
+ * INSERT per row.
+ *
+ * On PostgreSQL, rows are streamed to the server with COPY ... FROM STDIN, in
+ * its binary format: the types of the columns are looked up in the catalog
+ * when the inserter is made, and integers sent as such rather than parsed by
+ * the server, strings and bytes as they are. Tables with columns of other
+ * types are streamed in COPY's text format. On SQLite, rows are written with
+ * multi-row INSERT statements, each carrying as many rows as SQLite's limit
+ * on bound parameters allows.
+ *
+ * Rows are buffered as they are added and written out in batches; `flush`
+ * writes whatever remains and must be called once all rows are added (the
+ * destructor does not write anything, so that an exception part-way through a
+ * load does not trigger further SQL). Values are passed as text, in column
+ * order, and converted by the database according to the column types; or as
+ * raw bytes, for binary columns (see BinaryColumn).
+ *
+ * The caller is responsible for any enclosing transaction; the inserter never
+ * commits.
+ */
+class BulkInserter : NonMovableOrCopyable
+{
+  public:
+    // A single column value; `mNull` marks SQL NULL, in which case `mText` is
+    // ignored, and `mBinary` a value of a binary column, whose bytes `mText`
+    // holds.
+    struct Value
+    {
+        std::string mText;
+        bool mNull;
+        bool mBinary;
+
+        Value(std::string const& text)
+            : mText(text), mNull(false), mBinary(false)
+        {
+        }
+        Value(char const* text) : mText(text), mNull(false), mBinary(false)
+        {
+        }
+        static Value
+        null()
+        {
+            Value v("");
+            v.mNull = true;
+            return v;
+        }
+        static Value
+        binary(std::string const& bytes)
+        {
+            Value v(bytes);
+            v.mBinary = true;
+            return v;
+        }
+    };
+
+    // Write to `table`'s `columns` through the main session of `db`.
+    BulkInserter(Database& db, std::string const& table,
+                 std::vector<std::string> const& columns);
+
+    // Write through `session`, which must be connected to the same database as
+    // `db` (for example a session from Database::getPool).
+    BulkInserter(Database& db, soci::session& session,
+                 std::string const& table,
+                 std::vector<std::string> const& columns);
+
+    // Add a row; `values` must have one entry per column.
+    void addRow(std::vector<Value> const& values);
+
+    // Write all buffered rows.
+    void flush();
+
+    // Number of rows added so far.
+    size_t
+    getRowCount() const
+    {
+        return mRowCount;
+    }
+
+    std::string const&
+    getTable() const
+    {
+        return mTable;
+    }
+
+  private:
+    Database& mDatabase;
+    soci::session& mSession;
+    std::string const mTable;
+    std::vector<std::string> const mColumns;
+    bool const mUseCopy;
+    size_t const mBatchRows;
+    size_t mRowCount{0};
+
+    // SQLite: values of the rows not yet written, row-major.
+    std::vector<Value> mPending;
+
+    // PostgreSQL: how each column is sent in COPY's binary format, or empty
+    // to use its text format.
+    enum CopyField
+    {
+        COPY_BYTES,
+        COPY_INT2,
+        COPY_INT4,
+        COPY_INT8
+    };
+    std::vector<CopyField> mCopyFields;
+
+    // PostgreSQL: COPY data not yet sent.
+    std::string mCopyBuffer;
+
+    void lookupCopyFields();
+    void addCopyText(std::vector<Value> const& values);
+    void addCopyBinary(std::vector<Value> const& values);
+    void flushInsert(size_t rows);
+    void flushCopy();
+};
+}
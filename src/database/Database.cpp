@@ -5,6 +5,7 @@
 #include "bucket/BucketManager.h"
 #include "crypto/Base58.h"
 #include "crypto/Hex.h"
+#include "database/BulkInserter.h"
 #include "database/Database.h"
 #include "generated/StellarXDR.h"
 #include "ledger/LedgerHeaderFrame.h"
@@ -17,11 +18,13 @@
 #include "util/make_unique.h"
 #include "util/types.h"
 #include "util/GlobalChecks.h"
+#include <cereal/external/base64.hpp>
 
 #include "medida/metrics_registry.h"
 #include "medida/timer.h"
 #include "medida/counter.h"
 
+#include <algorithm>
 #include <stdexcept>
 #include <vector>
 #include <sstream>
@@ -66,6 +69,9 @@ Database::registerDrivers()
 
 Database::Database(Application& app)
     : mApp(app)
+    , mEntryCache(app)
+    , mOrderBook(app)
+    , mOpenDelta(nullptr)
     , mStatementsSize(app.getMetrics().NewCounter({"database", "memory", "statements"}))
 {
     registerDrivers();
@@ -74,6 +80,11 @@ Database::Database(Application& app)
     if (isSqlite())
     {
         mSession << "PRAGMA journal_mode = WAL";
+        if (canDeferDurability())
+        {
+            // commits are made durable by makeDurable()
+            mSession << "PRAGMA synchronous = NORMAL";
+        }
     }
     else
     {
@@ -125,9 +136,65 @@ Database::canUsePool() const
     return !(mApp.getConfig().DATABASE == ("sqlite3://:memory:"));
 }
 
+bool
+Database::canDeferDurability() const
+{
+    return mApp.getConfig().LEDGER_PERSIST_DEPTH > 0 && canUsePool();
+}
+
+void
+Database::deferDurability()
+{
+    assert(canDeferDurability());
+    if (!isSqlite())
+    {
+        mSession << "SET LOCAL synchronous_commit TO OFF";
+    }
+}
+
+bool
+Database::makeDurable(soci::session& session)
+{
+    if (isSqlite())
+    {
+        // in WAL mode with synchronous=NORMAL, commits are synced to disk
+        // when the log is checkpointed -- all of them only once the whole log
+        // is: a checkpoint held up by another session reports busy, or fewer
+        // frames checkpointed than logged. A passive checkpoint is tried
+        // first, as it does not wait for readers and writers.
+        for (auto mode : {"PASSIVE", "FULL"})
+        {
+            int busy = 0, logged = 0, checkpointed = 0;
+            session << "PRAGMA wal_checkpoint(" << mode << ")",
+                soci::into(busy), soci::into(logged), soci::into(checkpointed);
+            if (busy == 0 && checkpointed == logged)
+            {
+                return true;
+            }
+            CLOG(DEBUG, "Database") << mode << " checkpoint incomplete: busy="
+                                    << busy << " logged=" << logged
+                                    << " checkpointed=" << checkpointed;
+        }
+        return false;
+    }
+    else
+    {
+        // a synchronous commit waits for the log up to its commit record,
+        // which follows the records of every transaction committed before
+        soci::transaction tx(session);
+        long long id;
+        session << "SELECT txid_current()", soci::into(id);
+        tx.commit();
+        return true;
+    }
+}
+
 void
 Database::initialize()
 {
+    mEntryCache.invalidateAll();
+    mOrderBook.invalidateAll();
+    mInflationTally.invalidateAll();
     AccountFrame::dropAll(*this);
     OfferFrame::dropAll(*this);
     TrustFrame::dropAll(*this);
@@ -136,6 +203,208 @@ Database::initialize()
     LedgerHeaderFrame::dropAll(*this);
     TransactionFrame::dropAll(*this);
     BucketManager::dropAll(mApp);
+    mApp.getPersistentState().setState(PersistentState::kDatabaseSchema,
+                                       std::to_string(SCHEMA_VERSION));
+}
+
+int
+Database::getDBSchemaVersion()
+{
+    auto vers = mApp.getPersistentState().getState(
+        PersistentState::kDatabaseSchema);
+    return vers.empty() ? 1 : std::stoi(vers);
+}
+
+// Re-encode the Base58Check account keys in `column` of `table` with
+// toSQLKey(). Each distinct key is converted once, into a temporary table
+// mapping old keys to new, which a single UPDATE then joins against: the
+// column itself may be unindexed. The two encodings differ in length, so no
+// re-encoded key can collide with one still to be converted.
+static void
+upgradeKeyColumn(Database& db, std::string const& table,
+                 std::string const& column)
+{
+    soci::session& session = db.getSession();
+    std::vector<std::string> oldKeys;
+    std::string key;
+    soci::statement sel =
+        (session.prepare << "SELECT DISTINCT " << column << " FROM " << table
+                         << " WHERE " << column << " IS NOT NULL",
+         soci::into(key));
+    sel.execute(true);
+    while (sel.got_data())
+    {
+        oldKeys.push_back(key);
+        sel.fetch();
+    }
+
+    session << "CREATE TEMPORARY TABLE KeyUpgrade ("
+               "oldKey VARCHAR(64) PRIMARY KEY, newKey CHARACTER(44) NOT NULL)";
+    BulkInserter keys(db, session, "KeyUpgrade", {"oldKey", "newKey"});
+    for (auto const& k : oldKeys)
+    {
+        keys.addRow({k, toSQLKey(fromBase58Check256(VER_ACCOUNT_ID, k))});
+    }
+    keys.flush();
+
+    session << "UPDATE " << table << " SET " << column
+            << " = (SELECT newKey FROM KeyUpgrade WHERE oldKey = " << table
+            << "." << column << ") WHERE " << column << " IS NOT NULL";
+    session << "DROP TABLE KeyUpgrade";
+    CLOG(INFO, "Database") << "Re-encoded " << keys.getRowCount()
+                           << " keys in " << table << "." << column;
+}
+
+// Convert the base64-encoded TEXT columns of TxHistory to binary ones.
+static void
+upgradeTxHistory(Database& db)
+{
+    soci::session& session = db.getSession();
+    char const* columns[] = {"TxBody", "TxResult", "TxMeta"};
+    if (!db.isSqlite())
+    {
+        for (auto c : columns)
+        {
+            session << "ALTER TABLE TxHistory ALTER COLUMN " << c
+                    << " TYPE BYTEA USING decode(" << c << ", 'base64')";
+        }
+        CLOG(INFO, "Database") << "Converted TxHistory to binary";
+        return;
+    }
+
+    // SQLite cannot change the type of a column: copy the table
+    session << "ALTER TABLE TxHistory RENAME TO TxHistoryOld";
+    TransactionFrame::createHistoryTable(db);
+    auto inserter = TransactionFrame::makeBulkInserter(db);
+    std::string txID, txBody, txResult, txMeta;
+    uint32_t ledgerSeq;
+    int txindex;
+    soci::statement st =
+        (session.prepare << "SELECT txID, ledgerSeq, txindex, TxBody, "
+                            "TxResult, TxMeta FROM TxHistoryOld",
+         soci::into(txID), soci::into(ledgerSeq), soci::into(txindex),
+         soci::into(txBody), soci::into(txResult), soci::into(txMeta));
+    st.execute(true);
+    while (st.got_data())
+    {
+        inserter->addRow(
+            {txID, std::to_string(ledgerSeq), std::to_string(txindex),
+             BulkInserter::Value::binary(base64::decode(txBody)),
+             BulkInserter::Value::binary(base64::decode(txResult)),
+             BulkInserter::Value::binary(base64::decode(txMeta))});
+        st.fetch();
+    }
+    inserter->flush();
+    session << "DROP TABLE TxHistoryOld";
+    CLOG(INFO, "Database") << "Converted " << inserter->getRowCount()
+                           << " transactions in TxHistory to binary";
+}
+
+void
+Database::upgradeToCurrentSchema()
+{
+    if (mApp.getPersistentState().getState(
+            PersistentState::kDatabaseInitialized) != "true")
+    {
+        return;
+    }
+
+    int vers = getDBSchemaVersion();
+    if (vers > SCHEMA_VERSION)
+    {
+        throw std::runtime_error(
+            "Database schema version " + std::to_string(vers) +
+            " is newer than the version this program supports, " +
+            std::to_string(SCHEMA_VERSION));
+    }
+    if (vers == SCHEMA_VERSION)
+    {
+        return;
+    }
+
+    CLOG(INFO, "Database") << "Upgrading database schema from version "
+                           << vers << " to " << SCHEMA_VERSION;
+    mEntryCache.invalidateAll();
+    mOrderBook.invalidateAll();
+    mInflationTally.invalidateAll();
+    soci::transaction tx(mSession);
+    if (vers < 2)
+    {
+        upgradeKeyColumn(*this, "Accounts", "accountID");
+        upgradeKeyColumn(*this, "Accounts", "inflationDest");
+        upgradeKeyColumn(*this, "Signers", "accountID");
+        upgradeKeyColumn(*this, "Signers", "publicKey");
+        upgradeKeyColumn(*this, "TrustLines", "accountID");
+        upgradeKeyColumn(*this, "TrustLines", "issuer");
+        upgradeKeyColumn(*this, "Offers", "accountID");
+        upgradeKeyColumn(*this, "Offers", "paysIssuer");
+        upgradeKeyColumn(*this, "Offers", "getsIssuer");
+    }
+    if (vers < 3)
+    {
+        upgradeTxHistory(*this);
+    }
+    mApp.getPersistentState().setState(PersistentState::kDatabaseSchema,
+                                       std::to_string(SCHEMA_VERSION));
+    tx.commit();
+}
+
+std::string
+toSQLKey(uint256 const& key)
+{
+    return base64::encode(key.data(), key.size());
+}
+
+uint256
+fromSQLKey(std::string const& encoded)
+{
+    std::string bin = base64::decode(encoded);
+    uint256 key;
+    if (bin.size() != key.size())
+    {
+        throw std::runtime_error("invalid key in database: " + encoded);
+    }
+    std::copy(bin.begin(), bin.end(), key.begin());
+    return key;
+}
+
+// The value of a base64 digit; padding sorts first.
+static int
+base64Digit(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+    {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z')
+    {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0' + 52;
+    }
+    if (c == '+')
+    {
+        return 62;
+    }
+    if (c == '/')
+    {
+        return 63;
+    }
+    return -1;
+}
+
+bool
+sqlKeyLess(std::string const& a, std::string const& b)
+{
+    // base64 is big-endian, so comparing digits by value compares the keys
+    return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(),
+                                        [](char x, char y)
+                                        {
+                                            return base64Digit(x) <
+                                                   base64Digit(y);
+                                        });
 }
 
 soci::session&
@@ -146,6 +415,39 @@ Database::getSession()
     return mSession;
 }
 
+LedgerEntryCache&
+Database::getEntryCache()
+{
+    assertThreadIsMain();
+    return mEntryCache;
+}
+
+OrderBook&
+Database::getOrderBook()
+{
+    assertThreadIsMain();
+    return mOrderBook;
+}
+
+InflationTally&
+Database::getInflationTally()
+{
+    assertThreadIsMain();
+    return mInflationTally;
+}
+
+LedgerDelta*
+Database::getOpenDelta()
+{
+    return mOpenDelta;
+}
+
+void
+Database::setOpenDelta(LedgerDelta* delta)
+{
+    mOpenDelta = delta;
+}
+
 soci::connection_pool&
 Database::getPool()
 {
@@ -240,4 +542,43 @@ Database::captureAndLogSQL(std::string contextName)
     return make_shared<SQLLogContext>(contextName, mSession);
 }
 
+BinaryColumn::BinaryColumn(Database& db, soci::session& session)
+    : mHex(!db.isSqlite())
+    , mBlob(mHex ? nullptr : make_unique<soci::blob>(session))
+{
+}
+
+char const*
+BinaryColumn::sqlType(Database& db)
+{
+    return db.isSqlite() ? "BLOB" : "BYTEA";
+}
+
+std::string
+BinaryColumn::select(std::string const& column) const
+{
+    return mHex ? "encode(" + column + ", 'hex')" : column;
+}
+
+soci::details::into_type_ptr
+BinaryColumn::into()
+{
+    return mHex ? soci::into(mText) : soci::into(*mBlob);
+}
+
+std::string
+BinaryColumn::get()
+{
+    if (mHex)
+    {
+        auto bin = hexToBin(mText);
+        return std::string(bin.begin(), bin.end());
+    }
+    std::string bytes(mBlob->get_len(), '\0');
+    if (!bytes.empty())
+    {
+        mBlob->read(0, &bytes[0], bytes.size());
+    }
+    return bytes;
+}
 }
@@ -8,7 +8,10 @@
 #include <soci.h>
 #include "generated/StellarXDR.h"
 #include "ledger/AccountFrame.h"
+#include "ledger/InflationTally.h"
+#include "ledger/LedgerEntryCache.h"
 #include "ledger/OfferFrame.h"
+#include "ledger/OrderBook.h"
 #include "ledger/TrustFrame.h"
 #include "medida/timer_context.h"
 #include "util/NonCopyable.h"
@@ -23,8 +26,24 @@ class Counter;
 namespace stellar
 {
 class Application;
+class LedgerDelta;
 class SQLLogContext;
 
+// Encode a public key (an account ID, issuer, signer or inflation destination)
+// for the key columns of the ledger entry tables, and decode it back. Keys are
+// stored base64-encoded: fixed-width, and linear-time to convert both ways,
+// unlike the Base58Check form shown to users. They are not stored as raw
+// bytes, as TxHistory is (see BinaryColumn): binary values only go in through
+// BulkInserter, whereas keys are bound as parameters of most statements on
+// the entry tables, which would each need a backend-specific form to bind
+// them as bytes. The text costs 12 bytes a key over the raw form.
+std::string toSQLKey(uint256 const& key);
+uint256 fromSQLKey(std::string const& encoded);
+
+// Order keys encoded by toSQLKey as the raw keys they encode, which neither
+// their text nor the database's collation of it follows.
+bool sqlKeyLess(std::string const& a, std::string const& b);
+
 /**
  * Helper class for borrowing a SOCI prepared statement handle into a local
  * scope and cleaning it up once done with it. Returned by
@@ -87,6 +106,10 @@ class Database : NonMovableOrCopyable
     Application& mApp;
     soci::session mSession;
     std::unique_ptr<soci::connection_pool> mPool;
+    LedgerEntryCache mEntryCache;
+    OrderBook mOrderBook;
+    InflationTally mInflationTally;
+    LedgerDelta* mOpenDelta;
 
     std::map<std::string, std::shared_ptr<soci::statement>> mStatements;
     medida::Counter& mStatementsSize;
@@ -94,7 +117,13 @@ class Database : NonMovableOrCopyable
     static bool gDriversRegistered;
     static void registerDrivers();
 
+    int getDBSchemaVersion();
+
   public:
+    // Version of the schema created by initialize(); see
+    // upgradeToCurrentSchema().
+    static const int SCHEMA_VERSION = 3;
+
     // Instantiate object and connect to app.getConfig().DATABASE;
     // if there is a connection error, this will throw.
     Database(Application& app);
@@ -125,15 +154,83 @@ class Database : NonMovableOrCopyable
     // to read from the database through, otherwise false.
     bool canUsePool() const;
 
+    // Return true if SQL transactions committed on the main session may be
+    // made durable later, by makeDurable(), otherwise false. See
+    // Config::LEDGER_PERSIST_DEPTH; requires canUsePool().
+    bool canDeferDurability() const;
+
+    // Let the SQL transaction open on the main session commit without waiting
+    // for the disk. Requires canDeferDurability().
+    void deferDurability();
+
+    // Wait until every SQL transaction committed so far, on any session, is
+    // on disk, and return true; or return false if other sessions kept this
+    // from being established. `session` is one of the pool's, so that this
+    // can be called from a worker thread.
+    bool makeDurable(soci::session& session);
+
     // Drop and recreate all tables in the database target. This is called
     // by the --newdb command-line flag on stellar-core.
     void initialize();
 
+    // Bring the tables of an initialized database created by an older version
+    // of stellar-core up to SCHEMA_VERSION, in a single SQL transaction.
+    // Throws if the database was created by a newer version. Versions:
+    //   1: account keys stored in Base58Check (the default, if unrecorded)
+    //   2: account keys stored base64-encoded, see toSQLKey()
+    //   3: transaction history stored in binary columns, see BinaryColumn
+    void upgradeToCurrentSchema();
+
     // Access the underlying SOCI session object
     soci::session& getSession();
 
+    // Access the cache of ledger entries in front of the entry tables; see
+    // LedgerEntryCache. Main thread only.
+    LedgerEntryCache& getEntryCache();
+
+    // Access the in-memory offers of recently crossed currency pairs; see
+    // OrderBook. Main thread only.
+    OrderBook& getOrderBook();
+
+    // Access the in-memory inflation votes of the committed ledger; see
+    // InflationTally. Main thread only.
+    InflationTally& getInflationTally();
+
+    // The outermost LedgerDelta of the ledger being closed, if any; null
+    // otherwise. Maintained by LedgerDelta.
+    LedgerDelta* getOpenDelta();
+    void setOpenDelta(LedgerDelta* delta);
+
     // Access the optional SOCI connection pool available for worker
     // threads. Throws an error if !canUsePool().
     soci::connection_pool& getPool();
 };
+
+/**
+ * Helper for reading a binary column -- BLOB on SQLite, BYTEA on PostgreSQL --
+ * into a std::string. SOCI passes strings through as C strings, so values are
+ * fetched as blobs from SQLite, and as hex text from PostgreSQL. Select the
+ * column with `select`, bind `into` to the statement, and read each row
+ * fetched with `get`. Write binary columns with BulkInserter::Value::binary.
+ */
+class BinaryColumn : NonMovableOrCopyable
+{
+    bool const mHex;
+    std::unique_ptr<soci::blob> mBlob;
+    std::string mText;
+
+  public:
+    BinaryColumn(Database& db, soci::session& session);
+
+    // The SQL type of binary columns in `db`.
+    static char const* sqlType(Database& db);
+
+    // The expression selecting `column`.
+    std::string select(std::string const& column) const;
+
+    soci::details::into_type_ptr into();
+
+    // The value of the row last fetched.
+    std::string get();
+};
 }
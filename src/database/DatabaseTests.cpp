@@ -3,16 +3,34 @@
 // of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
 
 #include "util/asio.h"
+#include "bucket/Bucket.h"
+#include "bucket/BucketManager.h"
+#include "database/BulkInserter.h"
 #include "database/Database.h"
 #include "main/Application.h"
 #include "main/Config.h"
+#include "main/PersistentState.h"
 #include "main/test.h"
+#include "crypto/Base58.h"
 #include "crypto/Hex.h"
+#include "crypto/SHA.h"
+#include "crypto/SecretKey.h"
+#include "ledger/EntryFrame.h"
+#include "ledger/LedgerDelta.h"
+#include "ledger/LedgerManager.h"
 #include "util/Logging.h"
 #include "util/Timer.h"
 #include "util/TmpDir.h"
+#include "util/types.h"
+#include "util/make_unique.h"
+#include "transactions/TransactionFrame.h"
+#include <cereal/external/base64.hpp>
 #include "lib/catch.hpp"
+#include <algorithm>
+#include <map>
 #include <random>
+#include <set>
+#include <sstream>
 
 using namespace stellar;
 
@@ -186,7 +204,413 @@ TEST_CASE("sqlite MVCC test", "[db]")
     checkMVCCIsolation(app);
 }
 
+TEST_CASE("schema upgrade re-encodes Base58 account keys", "[db]")
+{
+    Config const& cfg = getTestConfig();
+    VirtualClock clock;
+    Application::pointer app = Application::create(clock, cfg);
+    app->start();
+
+    auto& db = app->getDatabase();
+    auto& session = db.getSession();
+    auto& ps = app->getPersistentState();
+    REQUIRE(ps.getState(PersistentState::kDatabaseSchema) ==
+            std::to_string(Database::SCHEMA_VERSION));
+
+    AccountID accountID = SecretKey::random().getPublicKey();
+    AccountID signerID = SecretKey::random().getPublicKey();
+    REQUIRE(fromSQLKey(toSQLKey(accountID)) == accountID);
+
+    AccountFrame account(accountID);
+    account.getAccount().balance = 1000;
+    account.getAccount().inflationDest.activate() = signerID;
+    account.getAccount().signers.push_back(Signer(signerID, 1));
+    account.getAccount().numSubEntries = 1;
+    LedgerDelta delta(app->getLedgerManager().getCurrentLedgerHeader());
+    account.storeAdd(delta, db);
+
+    // Rewrite the keys as a version 1 database held them.
+    std::string id = toSQLKey(accountID), signer = toSQLKey(signerID);
+    std::string b58ID = toBase58Check(VER_ACCOUNT_ID, accountID);
+    std::string b58Signer = toBase58Check(VER_ACCOUNT_ID, signerID);
+    session << "UPDATE Accounts SET accountID=:a, inflationDest=:b "
+               "WHERE accountID=:c",
+        soci::use(b58ID), soci::use(b58Signer), soci::use(id);
+    session << "UPDATE Signers SET accountID=:a, publicKey=:b "
+               "WHERE accountID=:c",
+        soci::use(b58ID), soci::use(b58Signer), soci::use(id);
+    ps.setState(PersistentState::kDatabaseSchema, "1");
+
+    db.upgradeToCurrentSchema();
+    REQUIRE(ps.getState(PersistentState::kDatabaseSchema) ==
+            std::to_string(Database::SCHEMA_VERSION));
+
+    AccountFrame loaded;
+    REQUIRE(AccountFrame::loadAccount(accountID, loaded, db));
+    REQUIRE(loaded.getBalance() == 1000);
+    REQUIRE(*loaded.getAccount().inflationDest == signerID);
+    REQUIRE(loaded.getAccount().signers.size() == 1);
+    REQUIRE(loaded.getAccount().signers[0].pubKey == signerID);
+
+    ps.setState(PersistentState::kDatabaseSchema,
+                std::to_string(Database::SCHEMA_VERSION + 1));
+    REQUIRE_THROWS(db.upgradeToCurrentSchema());
+}
+
+TEST_CASE("schema upgrade stores transaction history in binary", "[db]")
+{
+    Config const& cfg = getTestConfig();
+    VirtualClock clock;
+    Application::pointer app = Application::create(clock, cfg);
+    app->start();
+
+    auto& db = app->getDatabase();
+    auto& session = db.getSession();
+    auto& ps = app->getPersistentState();
+
+    // Recreate TxHistory as a version 2 database held it.
+    std::string body("\0body\n\\", 7), result("\x01\x02", 2), meta;
+    session << "DROP TABLE TxHistory";
+    session << "CREATE TABLE TxHistory ("
+               "txID          CHARACTER(64) NOT NULL,"
+               "ledgerSeq     INT NOT NULL CHECK (ledgerSeq >= 0),"
+               "txindex         INT NOT NULL,"
+               "TxBody        TEXT NOT NULL,"
+               "TxResult      TEXT NOT NULL,"
+               "TxMeta        TEXT NOT NULL,"
+               "PRIMARY KEY (txID, ledgerSeq),"
+               "UNIQUE      (ledgerSeq, txindex)"
+               ")";
+    std::string txID(64, 'a');
+    std::string body64 = base64::encode(
+        reinterpret_cast<unsigned char const*>(body.data()), body.size());
+    std::string result64 = base64::encode(
+        reinterpret_cast<unsigned char const*>(result.data()), result.size());
+    session << "INSERT INTO TxHistory VALUES (:id, 2, 1, :b, :r, '')",
+        soci::use(txID), soci::use(body64), soci::use(result64);
+    ps.setState(PersistentState::kDatabaseSchema, "2");
+
+    db.upgradeToCurrentSchema();
+    REQUIRE(ps.getState(PersistentState::kDatabaseSchema) ==
+            std::to_string(Database::SCHEMA_VERSION));
+
+    BinaryColumn txBody(db, session), txResult(db, session),
+        txMeta(db, session);
+    session << "SELECT " << txBody.select("TxBody") << ", "
+            << txResult.select("TxResult") << ", " << txMeta.select("TxMeta")
+            << " FROM TxHistory WHERE txID = :id",
+        txBody.into(), txResult.into(), txMeta.into(), soci::use(txID);
+    REQUIRE(session.got_data());
+    REQUIRE(txBody.get() == body);
+    REQUIRE(txResult.get() == result);
+    REQUIRE(txMeta.get() == meta);
+
+    // and new rows are written in binary too
+    auto history = TransactionFrame::makeBulkInserter(db, session);
+    history->addRow({std::string(64, 'b'), "2", "2",
+                     BulkInserter::Value::binary(result),
+                     BulkInserter::Value::binary(body),
+                     BulkInserter::Value::binary(meta)});
+    history->flush();
+    txID = std::string(64, 'b');
+    session << "SELECT " << txBody.select("TxBody") << ", "
+            << txResult.select("TxResult") << ", " << txMeta.select("TxMeta")
+            << " FROM TxHistory WHERE txID = :id",
+        txBody.into(), txResult.into(), txMeta.into(), soci::use(txID);
+    REQUIRE(txBody.get() == result);
+    REQUIRE(txResult.get() == body);
+}
+
+// The rows of `table`, sorted, each the text of its `columns` then the hex of
+// its `binary` columns, separated by '|'.
+static std::vector<std::string>
+dumpTable(Database& db, std::string const& table,
+          std::vector<std::string> const& columns,
+          std::vector<std::string> const& binary = {})
+{
+    auto& session = db.getSession();
+    std::vector<std::string> text(columns.size());
+    std::vector<soci::indicator> inds(columns.size());
+    std::vector<std::unique_ptr<BinaryColumn>> bins;
+
+    std::ostringstream sql;
+    sql << "SELECT ";
+    for (size_t i = 0; i < columns.size(); ++i)
+    {
+        sql << (i == 0 ? "" : ", ") << "CAST(" << columns[i] << " AS TEXT)";
+    }
+    for (auto const& c : binary)
+    {
+        bins.push_back(make_unique<BinaryColumn>(db, session));
+        sql << ", " << bins.back()->select(c);
+    }
+    sql << " FROM " << table;
+
+    soci::statement st(session);
+    st.alloc();
+    st.prepare(sql.str());
+    for (size_t i = 0; i < columns.size(); ++i)
+    {
+        st.exchange(soci::into(text[i], inds[i]));
+    }
+    for (auto& b : bins)
+    {
+        st.exchange(b->into());
+    }
+    st.define_and_bind();
+    st.execute(true);
+
+    std::vector<std::string> rows;
+    while (st.got_data())
+    {
+        std::string row;
+        for (size_t i = 0; i < columns.size(); ++i)
+        {
+            row += (inds[i] == soci::i_null ? "NULL" : text[i]) + "|";
+        }
+        for (auto& b : bins)
+        {
+            row += binToHex(b->get()) + "|";
+        }
+        rows.push_back(row);
+        st.fetch();
+    }
+    std::sort(rows.begin(), rows.end());
+    return rows;
+}
+
+typedef std::map<std::string, std::vector<std::string>> TableDumps;
+
+static TableDumps
+dumpEntryTables(Database& db)
+{
+    TableDumps dumps;
+    dumps["Accounts"] = dumpTable(
+        db, "Accounts", {"accountID", "balance", "seqNum", "numSubEntries",
+                         "inflationDest", "homeDomain", "thresholds", "flags"});
+    dumps["Signers"] =
+        dumpTable(db, "Signers", {"accountID", "publicKey", "weight"});
+    dumps["TrustLines"] =
+        dumpTable(db, "TrustLines", {"accountID", "issuer", "AlphaNumCurrency",
+                                     "tlimit", "balance", "flags"});
+    dumps["Offers"] = dumpTable(
+        db, "Offers", {"accountID", "offerID", "paysAlphaNumCurrency",
+                       "paysIssuer", "getsAlphaNumCurrency", "getsIssuer",
+                       "amount", "priceN", "priceD", "price"});
+    return dumps;
+}
+
+// Accounts, each with signers, a trust line and an offer; enough of them for
+// the multi-row INSERTs of SQLite to take several batches.
+static std::vector<LedgerEntry>
+makeBulkEntries()
+{
+    std::vector<LedgerEntry> entries;
+    std::vector<AccountID> ids;
+    for (size_t i = 0; i < 300; ++i)
+    {
+        auto id = SecretKey::random().getPublicKey();
+        ids.push_back(id);
+
+        LedgerEntry account;
+        account.type(ACCOUNT);
+        auto& ae = account.account();
+        ae.accountID = id;
+        ae.balance = INT64_MAX - i;
+        ae.seqNum = (static_cast<int64_t>(i) << 32) + 1;
+        ae.numSubEntries = 3;
+        ae.thresholds[0] = 1;
+        ae.thresholds[3] = 255;
+        ae.homeDomain = i % 3 ? "example.com" : "";
+        ae.flags = i % 4;
+        ae.signers.emplace_back(SecretKey::random().getPublicKey(), 1);
+        ae.signers.emplace_back(SecretKey::random().getPublicKey(), 255);
+        if (i % 2)
+        {
+            ae.inflationDest.activate() = ids[0];
+        }
+        entries.push_back(account);
+
+        Currency usd;
+        usd.type(CURRENCY_TYPE_ALPHANUM);
+        strToCurrencyCode(usd.alphaNum().currencyCode, "USD");
+        usd.alphaNum().issuer = ids[0];
+        Currency eur = usd;
+        strToCurrencyCode(eur.alphaNum().currencyCode, "EUR");
+
+        if (i != 0)
+        {
+            LedgerEntry line;
+            line.type(TRUSTLINE);
+            line.trustLine().accountID = id;
+            line.trustLine().currency = usd;
+            line.trustLine().limit = INT64_MAX;
+            line.trustLine().balance = i;
+            line.trustLine().flags = AUTHORIZED_FLAG;
+            entries.push_back(line);
+        }
+
+        LedgerEntry offer;
+        offer.type(OFFER);
+        auto& oe = offer.offer();
+        oe.accountID = id;
+        oe.offerID = (static_cast<uint64>(1) << 40) + i;
+        oe.takerGets = usd;
+        oe.takerPays = eur;
+        oe.amount = 10 + i;
+        oe.price.n = INT32_MAX;
+        oe.price.d = 1 + i;
+        entries.push_back(offer);
+    }
+    return entries;
+}
+
+// Load `entries` into a database of type `mode` as catchup does, through
+// BulkInserter (COPY on PostgreSQL, multi-row INSERTs on SQLite), along with
+// transaction history rows; return the contents of the tables.
+static TableDumps
+bulkLoadAndDump(Config::TestDbMode mode,
+                std::vector<LedgerEntry> const& entries)
+{
+    VirtualClock clock;
+    Application::pointer app =
+        Application::create(clock, getTestConfig(0, mode));
+    app->start();
+    auto& db = app->getDatabase();
+    auto& session = db.getSession();
+
+    auto bucket = Bucket::fresh(app->getBucketManager(), entries,
+                                std::vector<LedgerKey>());
+    soci::transaction tx(session);
+    Bucket::applyBulk(db, {bucket});
+
+    auto history = TransactionFrame::makeBulkInserter(db, session);
+    for (int i = 0; i < 200; ++i)
+    {
+        std::string bytes(static_cast<size_t>(i), static_cast<char>(i));
+        history->addRow({binToHex(sha256(bytes)), "7", std::to_string(i),
+                         BulkInserter::Value::binary(bytes),
+                         BulkInserter::Value::binary(bytes + "\t\n\\"),
+                         BulkInserter::Value::binary("")});
+    }
+    history->flush();
+    tx.commit();
+
+    auto dumps = dumpEntryTables(db);
+    dumps["TxHistory"] =
+        dumpTable(db, "TxHistory", {"txID", "ledgerSeq", "txindex"},
+                  {"TxBody", "TxResult", "TxMeta"});
+    return dumps;
+}
+
+// Store `entries` into a database of type `mode` one row at a time, through
+// their frames; return the contents of the entry tables.
+static TableDumps
+storeAndDump(Config::TestDbMode mode,
+             std::vector<LedgerEntry> const& entries)
+{
+    VirtualClock clock;
+    Application::pointer app =
+        Application::create(clock, getTestConfig(0, mode));
+    app->start();
+    auto& db = app->getDatabase();
+    auto& session = db.getSession();
+
+    soci::transaction tx(session);
+    session << "DELETE FROM Accounts";
+    session << "DELETE FROM Signers";
+    session << "DELETE FROM TrustLines";
+    session << "DELETE FROM Offers";
+    LedgerDelta delta(app->getLedgerManager().getCurrentLedgerHeader(), db);
+    for (auto const& e : entries)
+    {
+        EntryFrame::FromXDR(e)->storeAdd(delta, db);
+    }
+    tx.commit();
+    return dumpEntryTables(db);
+}
+
+TEST_CASE("bulk and per-row writes produce identical tables", "[db][bulk]")
+{
+    std::vector<Config::TestDbMode> dbModes = {
+#ifdef USE_POSTGRES
+        // bulk loads through COPY
+        Config::TESTDB_TCP_LOCALHOST_POSTGRESQL,
+#endif
+        Config::TESTDB_IN_MEMORY_SQLITE};
+
+    auto entries = makeBulkEntries();
+    TableDumps first;
+    for (auto mode : dbModes)
+    {
+        auto bulk = bulkLoadAndDump(mode, entries);
+        auto stored = storeAndDump(mode, entries);
+        REQUIRE(bulk["Accounts"].size() == 300);
+        REQUIRE(bulk["Signers"].size() == 600);
+        REQUIRE(bulk["TxHistory"].size() == 200);
+        for (auto const& t : stored)
+        {
+            CHECK(bulk[t.first] == t.second);
+        }
+
+        // COPY and multi-row INSERTs write the same tables
+        if (first.empty())
+        {
+            first = bulk;
+        }
+        else
+        {
+            CHECK(bulk == first);
+        }
+    }
+}
+
 #ifdef USE_POSTGRES
+TEST_CASE("bulk loads swap in indexed entry tables", "[db][bulk]")
+{
+    VirtualClock clock;
+    Application::pointer app = Application::create(
+        clock, getTestConfig(0, Config::TESTDB_TCP_LOCALHOST_POSTGRESQL));
+    app->start();
+    auto& db = app->getDatabase();
+    auto& session = db.getSession();
+
+    auto indexes = [&session]()
+    {
+        std::set<std::string> names;
+        soci::rowset<std::string> rs =
+            (session.prepare << "SELECT indexname FROM pg_indexes WHERE "
+                                "tablename IN ('accounts', 'signers', "
+                                "'trustlines', 'offers')");
+        names.insert(rs.begin(), rs.end());
+        return names;
+    };
+    auto before = indexes();
+    REQUIRE(before.count("accountbalances") == 1);
+    REQUIRE(before.count("accounts_pkey") == 1);
+
+    auto bucket = Bucket::fresh(app->getBucketManager(), makeBulkEntries(),
+                                std::vector<LedgerKey>());
+    // twice, so the second load's staging tables and indexes are named
+    // like the ones the first swapped in
+    for (int i = 0; i < 2; ++i)
+    {
+        soci::transaction tx(session);
+        Bucket::applyBulk(db, {bucket});
+        tx.commit();
+
+        CHECK(indexes() == before);
+        int staging = -1;
+        session << "SELECT COUNT(*) FROM pg_tables WHERE tablename LIKE "
+                   "'%\\_load' OR tablename LIKE '%\\_old'",
+            soci::into(staging);
+        CHECK(staging == 0);
+        int accounts = 0;
+        session << "SELECT COUNT(*) FROM Accounts", soci::into(accounts);
+        CHECK(accounts == 300);
+    }
+}
+
 TEST_CASE("postgres smoketest", "[db]")
 {
     Config const& cfg =
@@ -6,6 +6,7 @@
 #include "history/HistoryManager.h"
 #include "history/FileTransferInfo.h"
 
+#include "bucket/Bucket.h"
 #include "bucket/BucketManager.h"
 #include "bucket/BucketList.h"
 #include "crypto/Hex.h"
@@ -702,6 +703,40 @@ CatchupStateMachine::applyBucketsAtLastClosedLedger()
     CLOG(INFO, "History") << "mLastClosed bucketListHash: "
                           << hexAbbrev(mLastClosed.header.bucketListHash);
 
+    if (mApp.getConfig().CATCHUP_BULK_APPLY)
+    {
+        // Install the archive's buckets and, if any differ from ours, reload
+        // the whole ledger state from them in one bulk pass.
+        std::vector<std::shared_ptr<Bucket>> buckets;
+        for (size_t level = 0; level < n; ++level)
+        {
+            auto const& hb = mArchiveState.currentBuckets.at(level);
+            BucketLevel& existingLevel = bl.getLevel(level);
+            auto curr = getBucketToApply(hb.curr);
+            auto snap = getBucketToApply(hb.snap);
+            applying = applying ||
+                       hb.curr != binToHex(existingLevel.getCurr()->getHash()) ||
+                       hb.snap != binToHex(existingLevel.getSnap()->getHash());
+            existingLevel.setCurr(curr);
+            existingLevel.setSnap(snap);
+            existingLevel.setNext(hb.next);
+            buckets.push_back(curr);
+            buckets.push_back(snap);
+        }
+        if (applying)
+        {
+            CLOG(INFO, "History") << "Bulk-loading ledger state from "
+                                  << buckets.size() << " buckets";
+            // One transaction for the whole load: on SQLite, the multi-row
+            // INSERTs are then written once, not committed batch by batch.
+            soci::transaction tx(db.getSession());
+            Bucket::applyBulk(db, buckets);
+            tx.commit();
+        }
+        bl.restartMerges(mApp, mLastClosed.header.ledgerSeq);
+        return;
+    }
+
     // Apply buckets in reverse order, oldest bucket to new. Once we apply
     // one bucket, apply all buckets newer as well.
     for (auto i = mArchiveState.currentBuckets.rbegin();
@@ -226,6 +226,22 @@ HistoryArchiveState::differingBuckets(HistoryArchiveState const& other) const
     return ret;
 }
 
+std::vector<std::string>
+HistoryArchiveState::allBuckets() const
+{
+    std::vector<std::string> buckets;
+    for (auto const& level : currentBuckets)
+    {
+        for (auto const& h : level.next.getHashes())
+        {
+            buckets.push_back(h);
+        }
+        buckets.push_back(level.curr);
+        buckets.push_back(level.snap);
+    }
+    return buckets;
+}
+
 HistoryArchiveState::HistoryArchiveState()
 {
     uint256 u;
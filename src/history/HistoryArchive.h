@@ -84,6 +84,11 @@ struct HistoryArchiveState
     std::vector<std::string>
     differingBuckets(HistoryArchiveState const& other) const;
 
+    // Return the hashes of all the buckets this archive state refers to: the
+    // curr and snap buckets of each level, and the inputs and output of its
+    // 'next' bucket-future. Zero-buckets are included.
+    std::vector<std::string> allBuckets() const;
+
     template <class Archive>
     void
     serialize(Archive& ar)
@@ -133,8 +133,25 @@ ArchivePublisher::enterObservedState(HistoryArchiveState const& has)
     {
         auto b = bucketsByHash[hash];
         assert(b);
-        filePublishInfos.push_back(
-            std::make_shared<FilePublishInfo>(FILE_PUBLISH_NEEDED, *b));
+        if (b->isCompressed())
+        {
+            // Archives hold plain XDR buckets, so publish an uncompressed copy
+            // written to the snapshot directory, where other archives
+            // publishing the same snapshot can find it too.
+            auto pi = std::make_shared<FilePublishInfo>(
+                FILE_PUBLISH_NEEDED, mSnap->mSnapDir,
+                HISTORY_FILE_TYPE_BUCKET, hash);
+            if (!fs::exists(pi->localPath_nogz()))
+            {
+                b->writeUncompressed(pi->localPath_nogz());
+            }
+            filePublishInfos.push_back(pi);
+        }
+        else
+        {
+            filePublishInfos.push_back(
+                std::make_shared<FilePublishInfo>(FILE_PUBLISH_NEEDED, *b));
+        }
     }
 
     for (auto pi : filePublishInfos)
@@ -3,12 +3,14 @@
 // of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
 
 #include "AccountFrame.h"
-#include "crypto/Base58.h"
 #include "crypto/Hex.h"
+#include "database/BulkInserter.h"
 #include "database/Database.h"
 #include "LedgerDelta.h"
 #include "ledger/LedgerManager.h"
+#include "util/make_unique.h"
 #include <algorithm>
+#include <sstream>
 
 using namespace soci;
 using namespace std;
@@ -18,11 +20,11 @@ namespace stellar
 const char* AccountFrame::kSQLCreateStatement1 =
     "CREATE TABLE Accounts"
     "("
-    "accountID       VARCHAR(51)  PRIMARY KEY,"
+    "accountID       CHARACTER(44) PRIMARY KEY,"
     "balance         BIGINT       NOT NULL CHECK (balance >= 0),"
     "seqNum          BIGINT       NOT NULL,"
     "numSubEntries   INT          NOT NULL CHECK (numSubEntries >= 0),"
-    "inflationDest   VARCHAR(51),"
+    "inflationDest   CHARACTER(44),"
     "homeDomain      VARCHAR(32),"
     "thresholds      TEXT,"
     "flags           INT          NOT NULL"
@@ -31,18 +33,12 @@ const char* AccountFrame::kSQLCreateStatement1 =
 const char* AccountFrame::kSQLCreateStatement2 =
     "CREATE TABLE Signers"
     "("
-    "accountID       VARCHAR(51) NOT NULL,"
-    "publicKey       VARCHAR(51) NOT NULL,"
+    "accountID       CHARACTER(44) NOT NULL,"
+    "publicKey       CHARACTER(44) NOT NULL,"
     "weight          INT         NOT NULL,"
     "PRIMARY KEY (accountID, publicKey)"
     ");";
 
-const char* AccountFrame::kSQLCreateStatement3 =
-    "CREATE INDEX signersAccount ON Signers (accountID)";
-
-const char* AccountFrame::kSQLCreateStatement4 =
-    "CREATE INDEX accountBalances ON Accounts (balance)";
-
 AccountFrame::AccountFrame()
     : EntryFrame(ACCOUNT), mAccountEntry(mEntry.account())
 {
@@ -164,15 +160,59 @@ AccountFrame::getLowThreshold() const
     return mAccountEntry.thresholds[1];
 }
 
+// fill in the fields of `account` read from nullable columns
+static void
+setNullableFields(AccountEntry& account, std::string const& inflationDest,
+                  soci::indicator inflationDestInd,
+                  std::string const& homeDomain, soci::indicator homeDomainInd,
+                  std::string const& thresholds, soci::indicator thresholdsInd)
+{
+    if (homeDomainInd == soci::i_ok)
+    {
+        account.homeDomain = homeDomain;
+    }
+
+    if (thresholdsInd == soci::i_ok)
+    {
+        std::vector<uint8_t> bin = hexToBin(thresholds);
+        for (size_t n = 0; (n < 4) && (n < bin.size()); n++)
+        {
+            account.thresholds[n] = bin[n];
+        }
+    }
+
+    if (inflationDestInd == soci::i_ok)
+    {
+        account.inflationDest.activate() = fromSQLKey(inflationDest);
+    }
+}
+
 bool
 AccountFrame::loadAccount(AccountID const& accountID, AccountFrame& retAcc,
                           Database& db)
 {
-    std::string base58ID = toBase58Check(VER_ACCOUNT_ID, accountID);
+    std::string sqlID = toSQLKey(accountID);
     std::string publicKey, inflationDest, creditAuthKey;
     std::string homeDomain, thresholds;
     soci::indicator inflationDestInd, homeDomainInd, thresholdsInd;
 
+    LedgerKey key;
+    key.type(ACCOUNT);
+    key.account().accountID = accountID;
+    LedgerEntryCache& cache = db.getEntryCache();
+    std::shared_ptr<LedgerEntry const> cached;
+    if (lookupEntry(db, key, cached))
+    {
+        if (!cached)
+        {
+            return false;
+        }
+        retAcc.getAccount() = cached->account();
+        retAcc.mUpdateSigners = false;
+        retAcc.mKeyCalculated = false;
+        return true;
+    }
+
     soci::session& session = db.getSession();
 
     retAcc.clearCached();
@@ -186,31 +226,17 @@ AccountFrame::loadAccount(AccountID const& accountID, AccountFrame& retAcc,
             into(account.balance), into(account.seqNum),
             into(account.numSubEntries), into(inflationDest, inflationDestInd),
             into(homeDomain, homeDomainInd), into(thresholds, thresholdsInd),
-            into(account.flags), use(base58ID);
+            into(account.flags), use(sqlID);
     }
 
     if (!session.got_data())
-        return false;
-
-    if (homeDomainInd == soci::i_ok)
     {
-        account.homeDomain = homeDomain;
-    }
-
-    if (thresholdsInd == soci::i_ok)
-    {
-        std::vector<uint8_t> bin = hexToBin(thresholds);
-        for (size_t n = 0; (n < 4) && (n < bin.size()); n++)
-        {
-            retAcc.mAccountEntry.thresholds[n] = bin[n];
-        }
+        cache.put(key, nullptr);
+        return false;
     }
 
-    if (inflationDestInd == soci::i_ok)
-    {
-        account.inflationDest.activate() =
-            fromBase58Check256(VER_ACCOUNT_ID, inflationDest);
-    }
+    setNullableFields(account, inflationDest, inflationDestInd, homeDomain,
+                      homeDomainInd, thresholds, thresholdsInd);
 
     account.signers.clear();
 
@@ -222,7 +248,7 @@ AccountFrame::loadAccount(AccountID const& accountID, AccountFrame& retAcc,
         auto prep = db.getPreparedStatement("SELECT publicKey, weight from "
                                             "Signers where accountID =:id");
         auto& st = prep.statement();
-        st.exchange(use(base58ID));
+        st.exchange(use(sqlID));
         st.exchange(into(pubKey));
         st.exchange(into(signer.weight));
         st.define_and_bind();
@@ -232,7 +258,7 @@ AccountFrame::loadAccount(AccountID const& accountID, AccountFrame& retAcc,
         }
         while (st.got_data())
         {
-            signer.pubKey = fromBase58Check256(VER_ACCOUNT_ID, pubKey);
+            signer.pubKey = fromSQLKey(pubKey);
 
             account.signers.push_back(signer);
 
@@ -244,20 +270,122 @@ AccountFrame::loadAccount(AccountID const& accountID, AccountFrame& retAcc,
     retAcc.mUpdateSigners = false;
 
     retAcc.mKeyCalculated = false;
+    cache.put(key, std::make_shared<LedgerEntry const>(retAcc.mEntry));
     return true;
 }
 
+void
+AccountFrame::loadIntoCache(Database& db, std::vector<LedgerKey> const& keys)
+{
+    std::vector<std::string> sqlIDs;
+    std::map<std::string, AccountFrame> accounts;
+    std::ostringstream params;
+    for (auto const& k : keys)
+    {
+        params << (sqlIDs.empty() ? ":v" : ",:v") << sqlIDs.size();
+        sqlIDs.push_back(toSQLKey(k.account().accountID));
+    }
+
+    soci::session& session = db.getSession();
+    {
+        std::string sqlID, inflationDest, homeDomain, thresholds;
+        soci::indicator inflationDestInd, homeDomainInd, thresholdsInd;
+        AccountFrame acc;
+        AccountEntry& account = acc.getAccount();
+
+        soci::details::prepare_temp_type sql =
+            (session.prepare << "SELECT accountID, balance, seqNum, "
+                                "numSubEntries, inflationDest, homeDomain, "
+                                "thresholds, flags FROM Accounts WHERE "
+                                "accountID IN ("
+                             << params.str() << ")");
+        for (auto const& id : sqlIDs)
+        {
+            sql, use(id);
+        }
+        soci::statement st =
+            (sql, into(sqlID), into(account.balance), into(account.seqNum),
+             into(account.numSubEntries), into(inflationDest, inflationDestInd),
+             into(homeDomain, homeDomainInd), into(thresholds, thresholdsInd),
+             into(account.flags));
+
+        auto timer = db.getSelectTimer("account-prefetch");
+        st.execute(true);
+        while (st.got_data())
+        {
+            AccountFrame& loaded = accounts[sqlID];
+            loaded.getAccount() = account;
+            loaded.getAccount().accountID = fromSQLKey(sqlID);
+            setNullableFields(loaded.getAccount(), inflationDest,
+                              inflationDestInd, homeDomain, homeDomainInd,
+                              thresholds, thresholdsInd);
+            st.fetch();
+        }
+    }
+
+    if (!accounts.empty())
+    {
+        std::string sqlID, pubKey;
+        Signer signer;
+
+        soci::details::prepare_temp_type sql =
+            (session.prepare << "SELECT accountID, publicKey, weight FROM "
+                                "Signers WHERE accountID IN ("
+                             << params.str() << ")");
+        for (auto const& id : sqlIDs)
+        {
+            sql, use(id);
+        }
+        soci::statement st =
+            (sql, into(sqlID), into(pubKey), into(signer.weight));
+
+        auto timer = db.getSelectTimer("signer-prefetch");
+        st.execute(true);
+        while (st.got_data())
+        {
+            auto it = accounts.find(sqlID);
+            if (it != accounts.end())
+            {
+                signer.pubKey = fromSQLKey(pubKey);
+                it->second.getAccount().signers.push_back(signer);
+            }
+            st.fetch();
+        }
+    }
+
+    LedgerEntryCache& cache = db.getEntryCache();
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        auto it = accounts.find(sqlIDs[i]);
+        if (it == accounts.end())
+        {
+            cache.put(keys[i], nullptr);
+        }
+        else
+        {
+            it->second.normalize();
+            cache.put(keys[i],
+                      std::make_shared<LedgerEntry const>(it->second.mEntry));
+        }
+    }
+}
+
 bool
 AccountFrame::exists(Database& db, LedgerKey const& key)
 {
-    std::string base58ID =
-        toBase58Check(VER_ACCOUNT_ID, key.account().accountID);
+    std::shared_ptr<LedgerEntry const> cached;
+    if (lookupEntry(db, key, cached))
+    {
+        return cached != nullptr;
+    }
+
+    std::string sqlID = toSQLKey(key.account().accountID);
     int exists = 0;
     {
         auto timer = db.getSelectTimer("account-exists");
         db.getSession() << "SELECT EXISTS (SELECT NULL FROM Accounts \
              WHERE accountID=:v1)",
-            use(base58ID), into(exists);
+            use(sqlID), into(exists);
     }
     return exists != 0;
 }
@@ -272,19 +400,27 @@ void
 AccountFrame::storeDelete(LedgerDelta& delta, Database& db,
                           LedgerKey const& key)
 {
-    std::string base58ID =
-        toBase58Check(VER_ACCOUNT_ID, key.account().accountID);
+    if (delta.defersWrites())
+    {
+        delta.deleteEntry(key);
+        return;
+    }
+
+    std::string sqlID = toSQLKey(key.account().accountID);
+
+    db.getEntryCache().invalidate(key);
+    db.getInflationTally().invalidate(sqlID);
 
     soci::session& session = db.getSession();
     {
         auto timer = db.getDeleteTimer("account");
         session << "DELETE from Accounts where accountID= :v1",
-            soci::use(base58ID);
+            soci::use(sqlID);
     }
     {
         auto timer = db.getDeleteTimer("signer");
         session << "DELETE from Signers where accountID= :v1",
-            soci::use(base58ID);
+            soci::use(sqlID);
     }
     delta.deleteEntry(key);
 }
@@ -292,8 +428,23 @@ AccountFrame::storeDelete(LedgerDelta& delta, Database& db,
 void
 AccountFrame::storeUpdate(LedgerDelta& delta, Database& db, bool insert) const
 {
-    std::string base58ID =
-        toBase58Check(VER_ACCOUNT_ID, mAccountEntry.accountID);
+    if (delta.defersWrites())
+    {
+        if (insert)
+        {
+            delta.addEntry(*this);
+        }
+        else
+        {
+            delta.modEntry(*this);
+        }
+        return;
+    }
+
+    std::string sqlID = toSQLKey(mAccountEntry.accountID);
+
+    db.getEntryCache().invalidate(getKey());
+    db.getInflationTally().invalidate(sqlID);
 
     std::string sql;
 
@@ -318,8 +469,7 @@ AccountFrame::storeUpdate(LedgerDelta& delta, Database& db, bool insert) const
 
     if (mAccountEntry.inflationDest)
     {
-        inflationDestStr =
-            toBase58Check(VER_ACCOUNT_ID, *mAccountEntry.inflationDest);
+        inflationDestStr = toSQLKey(*mAccountEntry.inflationDest);
         inflation_ind = soci::i_ok;
     }
 
@@ -329,7 +479,7 @@ AccountFrame::storeUpdate(LedgerDelta& delta, Database& db, bool insert) const
 
     {
         soci::statement& st = prep.statement();
-        st.exchange(use(base58ID, "id"));
+        st.exchange(use(sqlID, "id"));
         st.exchange(use(mAccountEntry.balance, "v1"));
         st.exchange(use(mAccountEntry.seqNum, "v2"));
         st.exchange(use(mAccountEntry.numSubEntries, "v3"));
@@ -381,15 +531,15 @@ AccountFrame::storeUpdate(LedgerDelta& delta, Database& db, bool insert) const
                     {
                         if (finalSigner.weight != startSigner.weight)
                         {
-                            std::string b58signKey = toBase58Check(
-                                VER_ACCOUNT_ID, finalSigner.pubKey);
+                            std::string sqlSignKey =
+                                toSQLKey(finalSigner.pubKey);
                             {
                                 auto timer = db.getUpdateTimer("signer");
                                 db.getSession()
                                     << "UPDATE Signers set weight=:v1 where "
                                        "accountID=:v2 and publicKey=:v3",
-                                    use(finalSigner.weight), use(base58ID),
-                                    use(b58signKey);
+                                    use(finalSigner.weight), use(sqlID),
+                                    use(sqlSignKey);
                             }
                         }
                         found = true;
@@ -398,14 +548,13 @@ AccountFrame::storeUpdate(LedgerDelta& delta, Database& db, bool insert) const
                 }
                 if (!found)
                 { // delete signer
-                    std::string b58signKey =
-                        toBase58Check(VER_ACCOUNT_ID, startSigner.pubKey);
+                    std::string sqlSignKey = toSQLKey(startSigner.pubKey);
 
                     soci::statement st =
                         (db.getSession().prepare << "DELETE from Signers where "
                                                     "accountID=:v2 and "
                                                     "publicKey=:v3",
-                         use(base58ID), use(b58signKey));
+                         use(sqlID), use(sqlSignKey));
 
                     {
                         auto timer = db.getDeleteTimer("signer");
@@ -431,15 +580,15 @@ AccountFrame::storeUpdate(LedgerDelta& delta, Database& db, bool insert) const
                     {
                         if (finalSigner.weight != startSigner.weight)
                         {
-                            std::string b58signKey = toBase58Check(
-                                VER_ACCOUNT_ID, finalSigner.pubKey);
+                            std::string sqlSignKey =
+                                toSQLKey(finalSigner.pubKey);
 
                             soci::statement st =
                                 (db.getSession().prepare
                                      << "UPDATE Signers set weight=:v1 where "
                                         "accountID=:v2 and publicKey=:v3",
-                                 use(finalSigner.weight), use(base58ID),
-                                 use(b58signKey));
+                                 use(finalSigner.weight), use(sqlID),
+                                 use(sqlSignKey));
 
                             st.execute(true);
 
@@ -455,14 +604,13 @@ AccountFrame::storeUpdate(LedgerDelta& delta, Database& db, bool insert) const
                 }
                 if (!found)
                 { // new signer
-                    std::string b58signKey =
-                        toBase58Check(VER_ACCOUNT_ID, finalSigner.pubKey);
+                    std::string sqlSignKey = toSQLKey(finalSigner.pubKey);
 
                     soci::statement st = (db.getSession().prepare
                                               << "INSERT INTO Signers "
                                                  "(accountID,publicKey,weight) "
                                                  "values (:v1,:v2,:v3)",
-                                          use(base58ID), use(b58signKey),
+                                          use(sqlID), use(sqlSignKey),
                                           use(finalSigner.weight));
 
                     st.execute(true);
@@ -497,33 +645,194 @@ AccountFrame::processForInflation(
     std::function<bool(AccountFrame::InflationVotes const&)> inflationProcessor,
     int maxWinners, Database& db)
 {
+    if (db.getInflationTally().processForInflation(
+            [&](int64 votes, std::string const& dest)
+            {
+                InflationVotes v;
+                v.mVotes = votes;
+                v.mInflationDest = fromSQLKey(dest);
+                return inflationProcessor(v);
+            },
+            maxWinners, db))
+    {
+        return;
+    }
+
+    // no tally yet: count the votes in the table
     soci::session& session = db.getSession();
+    int64 minBalance = InflationTally::kMinVoterBalance;
+
+    // accounts changed by the ledger being closed move their votes from the
+    // destination in their row to the one in their new state
+    std::map<std::string, int64> corrections;
+    for (auto const& p : LedgerDelta::getPendingEntries(db, ACCOUNT))
+    {
+        std::string sqlID = toSQLKey(p.first.account().accountID);
+        int64 balance = 0;
+        std::string inflationDest;
+        soci::indicator inflationDestInd;
+        session << "SELECT balance, inflationDest FROM Accounts "
+                   "WHERE accountID=:v1",
+            into(balance), into(inflationDest, inflationDestInd), use(sqlID);
+        if (session.got_data() && inflationDestInd == soci::i_ok &&
+            balance >= minBalance)
+        {
+            corrections[inflationDest] -= balance;
+        }
+        if (p.second)
+        {
+            auto const& acc = static_cast<AccountFrame const&>(*p.second);
+            if (acc.mAccountEntry.inflationDest &&
+                acc.mAccountEntry.balance >= minBalance)
+            {
+                corrections[toSQLKey(*acc.mAccountEntry.inflationDest)] +=
+                    acc.mAccountEntry.balance;
+            }
+        }
+    }
 
+    // Tally every destination and rank them here rather than in SQL: how
+    // ORDER BY breaks ties between keys depends on the database's collation,
+    // and the corrections may reorder any of them anyway.
     InflationVotes v;
     std::string inflationDest;
-
+    std::map<std::string, int64> votes;
     soci::statement st =
-        (session.prepare
-             << "SELECT"
-                " sum(balance) AS votes, inflationDest FROM Accounts WHERE"
-                " inflationDest IS NOT NULL"
-                " AND balance >= 1000000000 GROUP BY inflationDest"
-                " ORDER BY votes DESC, inflationDest DESC LIMIT :lim",
-         into(v.mVotes), into(inflationDest), use(maxWinners));
-
+        (session.prepare << "SELECT"
+                            " sum(balance) AS votes, inflationDest FROM "
+                            "Accounts WHERE inflationDest IS NOT NULL"
+                            " AND balance >= :min GROUP BY inflationDest",
+         into(v.mVotes), into(inflationDest), use(minBalance));
     st.execute(true);
-
     while (st.got_data())
     {
-        v.mInflationDest = fromBase58Check256(VER_ACCOUNT_ID, inflationDest);
+        votes[inflationDest] = v.mVotes;
+        st.fetch();
+    }
+    for (auto const& c : corrections)
+    {
+        votes[c.first] += c.second;
+    }
+
+    std::vector<InflationTally::Rank> winners;
+    for (auto const& dest : votes)
+    {
+        if (dest.second > 0)
+        {
+            winners.emplace_back(dest.second, dest.first);
+        }
+    }
+    std::sort(winners.begin(), winners.end(), &InflationTally::ranksBefore);
+
+    for (int i = 0; i < maxWinners && i < static_cast<int>(winners.size());
+         ++i)
+    {
+        v.mVotes = winners[i].first;
+        v.mInflationDest = fromSQLKey(winners[i].second);
         if (!inflationProcessor(v))
         {
             break;
         }
-        st.fetch();
     }
 }
 
+std::unique_ptr<BulkInserter>
+AccountFrame::makeBulkInserter(Database& db, soci::session& session,
+                               std::string const& suffix)
+{
+    return make_unique<BulkInserter>(
+        db, session, "Accounts" + suffix,
+        std::vector<std::string>{"accountID", "balance", "seqNum",
+                                 "numSubEntries", "inflationDest",
+                                 "homeDomain", "thresholds", "flags"});
+}
+
+std::unique_ptr<BulkInserter>
+AccountFrame::makeSignerBulkInserter(Database& db, soci::session& session,
+                                     std::string const& suffix)
+{
+    return make_unique<BulkInserter>(
+        db, session, "Signers" + suffix,
+        std::vector<std::string>{"accountID", "publicKey", "weight"});
+}
+
+void
+AccountFrame::addBulkRows(BulkInserter& accounts, BulkInserter& signers) const
+{
+    std::string sqlID = toSQLKey(mAccountEntry.accountID);
+
+    BulkInserter::Value inflationDest = BulkInserter::Value::null();
+    if (mAccountEntry.inflationDest)
+    {
+        inflationDest = toSQLKey(*mAccountEntry.inflationDest);
+    }
+
+    accounts.addRow({sqlID, to_string(mAccountEntry.balance),
+                     to_string(mAccountEntry.seqNum),
+                     to_string(mAccountEntry.numSubEntries), inflationDest,
+                     string(mAccountEntry.homeDomain),
+                     binToHex(mAccountEntry.thresholds),
+                     to_string(mAccountEntry.flags)});
+
+    for (auto const& signer : mAccountEntry.signers)
+    {
+        signers.addRow({sqlID, toSQLKey(signer.pubKey),
+                        to_string(signer.weight)});
+    }
+}
+
+void
+AccountFrame::deleteBulkRows(Database& db, std::vector<LedgerKey> const& keys)
+{
+    if (keys.empty())
+    {
+        return;
+    }
+
+    std::vector<std::string> sqlIDs;
+    std::ostringstream params;
+    for (auto const& k : keys)
+    {
+        params << (sqlIDs.empty() ? ":v" : ",:v") << sqlIDs.size();
+        sqlIDs.push_back(toSQLKey(k.account().accountID));
+    }
+
+    soci::session& session = db.getSession();
+    auto deleteFrom = [&](char const* table, char const* entityName)
+    {
+        soci::details::prepare_temp_type sql =
+            (session.prepare << "DELETE FROM " << table
+                             << " WHERE accountID IN (" << params.str()
+                             << ")");
+        for (auto const& id : sqlIDs)
+        {
+            sql, use(id);
+        }
+        soci::statement st(sql);
+        auto timer = db.getDeleteTimer(entityName);
+        st.execute(true);
+    };
+    deleteFrom("Accounts", "account");
+    deleteFrom("Signers", "signer");
+}
+
+void
+AccountFrame::dropIndexes(soci::session& session)
+{
+    session << "DROP INDEX IF EXISTS signersAccount;";
+    session << "DROP INDEX IF EXISTS accountBalances;";
+}
+
+void
+AccountFrame::createIndexes(soci::session& session,
+                            std::string const& suffix)
+{
+    session << "CREATE INDEX signersAccount" + suffix + " ON Signers" +
+                   suffix + " (accountID);";
+    session << "CREATE INDEX accountBalances" + suffix + " ON Accounts" +
+                   suffix + " (balance);";
+}
+
 void
 AccountFrame::dropAll(Database& db)
 {
@@ -532,7 +841,6 @@ AccountFrame::dropAll(Database& db)
 
     db.getSession() << kSQLCreateStatement1;
     db.getSession() << kSQLCreateStatement2;
-    db.getSession() << kSQLCreateStatement3;
-    db.getSession() << kSQLCreateStatement4;
+    createIndexes(db.getSession());
 }
 }
@@ -7,9 +7,11 @@
 #include "ledger/EntryFrame.h"
 #include <functional>
 #include <map>
+#include <memory>
 
 namespace soci
 {
+class session;
 namespace details
 {
 class prepare_temp_type;
@@ -18,6 +20,7 @@ class prepare_temp_type;
 
 namespace stellar
 {
+class BulkInserter;
 class LedgerManager;
 
 class AccountFrame : public EntryFrame
@@ -113,6 +116,10 @@ class AccountFrame : public EntryFrame
     static bool loadAccount(AccountID const& accountID, AccountFrame& retEntry,
                             Database& db);
 
+    // load the accounts keyed `keys` into the database's entry cache, with
+    // one query per table; see EntryFrame::prefetch
+    static void loadIntoCache(Database& db, std::vector<LedgerKey> const& keys);
+
     // inflation helper
 
     struct InflationVotes
@@ -126,10 +133,30 @@ class AccountFrame : public EntryFrame
         std::function<bool(InflationVotes const&)> inflationProcessor,
         int maxWinners, Database& db);
 
+    // bulk loading: inserters for the Accounts and Signers tables (or tables
+    // of the same shape named by suffixing theirs with `suffix`), and the
+    // rows describing this account in each
+    static std::unique_ptr<BulkInserter>
+    makeBulkInserter(Database& db, soci::session& session,
+                     std::string const& suffix = "");
+    static std::unique_ptr<BulkInserter>
+    makeSignerBulkInserter(Database& db, soci::session& session,
+                           std::string const& suffix = "");
+    void addBulkRows(BulkInserter& accounts, BulkInserter& signers) const;
+    // delete the rows of the accounts `keys`, and of their signers, in one
+    // statement per table; `keys` must be few enough to bind (see
+    // EntryFrame::storeBatch)
+    static void deleteBulkRows(Database& db,
+                               std::vector<LedgerKey> const& keys);
+
+    // secondary indexes, dropped while bulk loading; `suffix` names a
+    // staging copy of the tables to index instead, and its indexes
+    static void dropIndexes(soci::session& session);
+    static void createIndexes(soci::session& session,
+                              std::string const& suffix = "");
+
     static void dropAll(Database& db);
     static const char* kSQLCreateStatement1;
     static const char* kSQLCreateStatement2;
-    static const char* kSQLCreateStatement3;
-    static const char* kSQLCreateStatement4;
 };
 }
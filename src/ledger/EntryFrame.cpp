@@ -4,13 +4,20 @@
 
 #include "ledger/EntryFrame.h"
 #include "LedgerManager.h"
+#include "database/BulkInserter.h"
+#include "database/Database.h"
 #include "ledger/AccountFrame.h"
+#include "ledger/LedgerDelta.h"
 #include "ledger/OfferFrame.h"
 #include "ledger/TrustFrame.h"
 
 namespace stellar
 {
 
+// keys loaded or deleted per query by prefetch() and storeBatch(); SQLite
+// binds at most 999 parameters per statement, and a trust line takes three
+static const size_t kBatchSize = 256;
+
 EntryFrame::pointer
 EntryFrame::FromXDR(LedgerEntry const& from)
 {
@@ -65,6 +72,27 @@ EntryFrame::storeAddOrChange(LedgerDelta& delta, Database& db) const
     }
 }
 
+bool
+EntryFrame::lookupEntry(Database& db, LedgerKey const& key,
+                        std::shared_ptr<LedgerEntry const>& entry)
+{
+    EntryFrame::pointer pending;
+    if (LedgerDelta::getPendingEntry(db, key, pending))
+    {
+        if (pending)
+        {
+            entry = std::shared_ptr<LedgerEntry const>(pending,
+                                                       &pending->mEntry);
+        }
+        else
+        {
+            entry.reset();
+        }
+        return true;
+    }
+    return db.getEntryCache().get(key, entry);
+}
+
 bool
 EntryFrame::exists(Database& db, LedgerKey const& key)
 {
@@ -97,4 +125,138 @@ EntryFrame::storeDelete(LedgerDelta& delta, Database& db, LedgerKey const& key)
         break;
     }
 }
+
+void
+EntryFrame::storeBatch(Database& db, std::vector<LedgerKey> const& removed,
+                       std::vector<EntryFrame::pointer> const& inserted)
+{
+    std::vector<LedgerKey> accounts, trustLines, offers;
+    auto flush = [&db](std::vector<LedgerKey>& batch, bool force)
+    {
+        if (batch.empty() || (!force && batch.size() < kBatchSize))
+        {
+            return;
+        }
+        switch (batch.front().type())
+        {
+        case ACCOUNT:
+            AccountFrame::deleteBulkRows(db, batch);
+            break;
+        case TRUSTLINE:
+            TrustFrame::deleteBulkRows(db, batch);
+            break;
+        case OFFER:
+            OfferFrame::deleteBulkRows(db, batch);
+            break;
+        }
+        batch.clear();
+    };
+    for (auto const& k : removed)
+    {
+        switch (k.type())
+        {
+        case ACCOUNT:
+            accounts.push_back(k);
+            flush(accounts, false);
+            break;
+        case TRUSTLINE:
+            trustLines.push_back(k);
+            flush(trustLines, false);
+            break;
+        case OFFER:
+            offers.push_back(k);
+            flush(offers, false);
+            break;
+        }
+    }
+    flush(accounts, true);
+    flush(trustLines, true);
+    flush(offers, true);
+
+    soci::session& session = db.getSession();
+    auto accountRows = AccountFrame::makeBulkInserter(db, session);
+    auto signerRows = AccountFrame::makeSignerBulkInserter(db, session);
+    auto trustLineRows = TrustFrame::makeBulkInserter(db, session);
+    auto offerRows = OfferFrame::makeBulkInserter(db, session);
+    for (auto const& e : inserted)
+    {
+        switch (e->mEntry.type())
+        {
+        case ACCOUNT:
+            std::static_pointer_cast<AccountFrame>(e)->addBulkRows(
+                *accountRows, *signerRows);
+            break;
+        case TRUSTLINE:
+            std::static_pointer_cast<TrustFrame>(e)->addBulkRows(
+                *trustLineRows);
+            break;
+        case OFFER:
+            std::static_pointer_cast<OfferFrame>(e)->addBulkRows(*offerRows);
+            break;
+        }
+    }
+    accountRows->flush();
+    signerRows->flush();
+    trustLineRows->flush();
+    offerRows->flush();
+}
+
+void
+EntryFrame::prefetch(Database& db,
+                     std::set<LedgerKey, LedgerEntryIdCmp> const& keys)
+{
+    if (!db.getEntryCache().isEnabled())
+    {
+        return;
+    }
+
+    std::vector<LedgerKey> accounts, trustLines, offers;
+    auto flush = [&db](std::vector<LedgerKey>& batch, bool force)
+    {
+        if (batch.empty() || (!force && batch.size() < kBatchSize))
+        {
+            return;
+        }
+        switch (batch.front().type())
+        {
+        case ACCOUNT:
+            AccountFrame::loadIntoCache(db, batch);
+            break;
+        case TRUSTLINE:
+            TrustFrame::loadIntoCache(db, batch);
+            break;
+        case OFFER:
+            OfferFrame::loadIntoCache(db, batch);
+            break;
+        }
+        batch.clear();
+    };
+
+    std::shared_ptr<LedgerEntry const> entry;
+    for (auto const& k : keys)
+    {
+        if (lookupEntry(db, k, entry))
+        {
+            continue;
+        }
+        switch (k.type())
+        {
+        case ACCOUNT:
+            accounts.push_back(k);
+            flush(accounts, false);
+            break;
+        case TRUSTLINE:
+            trustLines.push_back(k);
+            flush(trustLines, false);
+            break;
+        case OFFER:
+            offers.push_back(k);
+            flush(offers, false);
+            break;
+        }
+    }
+    flush(accounts, true);
+    flush(trustLines, true);
+    flush(offers, true);
+}
 }
@@ -6,6 +6,9 @@
 
 #include "generated/StellarXDR.h"
 #include "bucket/LedgerCmp.h"
+#include <memory>
+#include <set>
+#include <vector>
 
 /*
 Frame
@@ -30,6 +33,13 @@ class EntryFrame
         mKeyCalculated = false;
     }
 
+    // Look up the state of `key` without querying its table: its pending
+    // state in the ledger being closed, or else its cached state. Returns
+    // true if found, setting `entry` to the state, or to null if there is no
+    // such entry; false if the table must be queried.
+    static bool lookupEntry(Database& db, LedgerKey const& key,
+                            std::shared_ptr<LedgerEntry const>& entry);
+
   public:
     typedef std::shared_ptr<EntryFrame> pointer;
 
@@ -52,5 +62,16 @@ class EntryFrame
     static bool exists(Database& db, LedgerKey const& key);
     static void storeDelete(LedgerDelta& delta, Database& db,
                             LedgerKey const& key);
+
+    // Delete the rows of the entries keyed `removed`, then insert those of
+    // `inserted`, with batched statements grouped by table.
+    static void storeBatch(Database& db, std::vector<LedgerKey> const& removed,
+                           std::vector<pointer> const& inserted);
+
+    // Load the entries keyed `keys` into the database's entry cache, with a
+    // few batched queries per table, so that their point loads that follow
+    // need not query the tables. Does nothing if the cache is disabled.
+    static void prefetch(Database& db,
+                         std::set<LedgerKey, LedgerEntryIdCmp> const& keys);
 };
 }
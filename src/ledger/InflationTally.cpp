@@ -0,0 +1,257 @@
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "ledger/InflationTally.h"
+#include "database/Database.h"
+#include "ledger/LedgerDelta.h"
+#include "util/Logging.h"
+#include <algorithm>
+
+namespace stellar
+{
+
+const int64 InflationTally::kMinVoterBalance = 1000000000;
+
+bool
+InflationTally::ranksBefore(Rank const& a, Rank const& b)
+{
+    if (a.first != b.first)
+    {
+        return a.first > b.first;
+    }
+    return sqlKeyLess(b.second, a.second);
+}
+
+void
+InflationTally::addVotes(std::string const& dest, int64 votes)
+{
+    int64 total = votes;
+    auto it = mVotes.find(dest);
+    if (it != mVotes.end())
+    {
+        mRanking.erase(std::make_pair(it->second, dest));
+        total += it->second;
+    }
+    if (total > 0)
+    {
+        mVotes[dest] = total;
+        mRanking.insert(std::make_pair(total, dest));
+    }
+    else if (it != mVotes.end())
+    {
+        mVotes.erase(it);
+    }
+}
+
+void
+InflationTally::setVoter(std::string const& account, AccountEntry const* entry)
+{
+    auto it = mVoters.find(account);
+    if (it != mVoters.end())
+    {
+        addVotes(it->second.first, -it->second.second);
+        mVoters.erase(it);
+    }
+    if (entry && entry->inflationDest && entry->balance >= kMinVoterBalance)
+    {
+        std::string dest = toSQLKey(*entry->inflationDest);
+        mVoters[account] = std::make_pair(dest, entry->balance);
+        addVotes(dest, entry->balance);
+    }
+}
+
+void
+InflationTally::build(Database& db)
+{
+    std::string account, dest;
+    int64 balance;
+    int64 minBalance = kMinVoterBalance;
+    soci::statement st =
+        (db.getSession().prepare
+             << "SELECT accountID, balance, inflationDest FROM Accounts "
+                "WHERE inflationDest IS NOT NULL AND balance >= :v1",
+         soci::into(account), soci::into(balance), soci::into(dest),
+         soci::use(minBalance));
+    st.execute(true);
+    while (st.got_data())
+    {
+        mVoters[account] = std::make_pair(dest, balance);
+        addVotes(dest, balance);
+        st.fetch();
+    }
+    mHeld = true;
+    CLOG(DEBUG, "Ledger") << "Tallied the inflation votes of "
+                          << mVoters.size() << " accounts";
+}
+
+bool
+InflationTally::processForInflation(Processor const& processor, int maxWinners,
+                                    Database& db)
+{
+    if (!mHeld)
+    {
+        return false;
+    }
+
+    // the votes of the destinations the tally is not up to date for
+    std::map<std::string, int64> corrected;
+    auto correct = [&](std::string const& dest, int64 votes)
+    {
+        auto it = corrected.find(dest);
+        if (it == corrected.end())
+        {
+            auto v = mVotes.find(dest);
+            it = corrected.insert(std::make_pair(
+                                      dest, v == mVotes.end() ? 0 : v->second))
+                     .first;
+        }
+        it->second += votes;
+    };
+    auto revote = [&](std::string const& account, std::string const* dest,
+                      int64 balance)
+    {
+        auto it = mVoters.find(account);
+        if (it != mVoters.end())
+        {
+            correct(it->second.first, -it->second.second);
+        }
+        if (dest && balance >= kMinVoterBalance)
+        {
+            correct(*dest, balance);
+        }
+    };
+
+    // accounts changed by the ledger being closed with deferred writes...
+    std::set<std::string> pending;
+    for (auto const& p : LedgerDelta::getPendingEntries(db, ACCOUNT))
+    {
+        std::string account = toSQLKey(p.first.account().accountID);
+        pending.insert(account);
+        if (!p.second)
+        {
+            revote(account, nullptr, 0);
+            continue;
+        }
+        AccountEntry const& acc = p.second->mEntry.account();
+        if (acc.inflationDest)
+        {
+            std::string dest = toSQLKey(*acc.inflationDest);
+            revote(account, &dest, acc.balance);
+        }
+        else
+        {
+            revote(account, nullptr, 0);
+        }
+    }
+
+    // ... and those written since the last ledger closed, as in their rows
+    soci::session& session = db.getSession();
+    for (auto const& account : mDirty)
+    {
+        if (pending.find(account) != pending.end())
+        {
+            continue;
+        }
+        int64 balance = 0;
+        std::string dest;
+        soci::indicator destInd;
+        session << "SELECT balance, inflationDest FROM Accounts "
+                   "WHERE accountID=:v1",
+            soci::into(balance), soci::into(dest, destInd),
+            soci::use(account);
+        bool votes = session.got_data() && destInd == soci::i_ok;
+        revote(account, votes ? &dest : nullptr, balance);
+    }
+
+    std::vector<Rank> changed;
+    for (auto const& c : corrected)
+    {
+        if (c.second > 0)
+        {
+            changed.emplace_back(c.second, c.first);
+        }
+    }
+    std::sort(changed.begin(), changed.end(), &ranksBefore);
+
+    // merge the corrected destinations into the ranking
+    auto r = mRanking.begin();
+    auto c = changed.begin();
+    for (int i = 0; i < maxWinners; ++i)
+    {
+        while (r != mRanking.end() &&
+               corrected.find(r->second) != corrected.end())
+        {
+            ++r;
+        }
+        Rank const* next;
+        if (c == changed.end())
+        {
+            if (r == mRanking.end())
+            {
+                break;
+            }
+            next = &*r++;
+        }
+        else if (r != mRanking.end() && ranksBefore(*r, *c))
+        {
+            next = &*r++;
+        }
+        else
+        {
+            next = &*c++;
+        }
+        if (!processor(next->first, next->second))
+        {
+            break;
+        }
+    }
+    return true;
+}
+
+void
+InflationTally::invalidate(std::string const& account)
+{
+    if (mHeld)
+    {
+        mDirty.insert(account);
+    }
+}
+
+void
+InflationTally::invalidateAll()
+{
+    mHeld = false;
+    mVoters.clear();
+    mVotes.clear();
+    mRanking.clear();
+    mDirty.clear();
+}
+
+void
+InflationTally::refresh(Database& db, std::vector<LedgerEntry> const& live,
+                        std::vector<LedgerKey> const& dead)
+{
+    mDirty.clear();
+    if (!mHeld)
+    {
+        // the ledger is written already: count it in the scan
+        build(db);
+        return;
+    }
+    for (auto const& k : dead)
+    {
+        if (k.type() == ACCOUNT)
+        {
+            setVoter(toSQLKey(k.account().accountID), nullptr);
+        }
+    }
+    for (auto const& e : live)
+    {
+        if (e.type() == ACCOUNT)
+        {
+            setVoter(toSQLKey(e.account().accountID), &e.account());
+        }
+    }
+}
+}
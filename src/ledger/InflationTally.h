@@ -0,0 +1,107 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "generated/StellarXDR.h"
+#include "util/NonCopyable.h"
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace stellar
+{
+class Database;
+
+/**
+ * InflationTally keeps the inflation votes of the committed ledger in memory:
+ * the balance and inflation destination of every account that votes, and the
+ * sum of the votes of every destination, ranked. It spares the inflation
+ * operation a scan of the whole Accounts table grouped by destination.
+ *
+ * Destinations and accounts are identified by their keys as stored in the
+ * Accounts table (see toSQLKey). Destinations with equal votes rank by their
+ * raw keys, greatest first (see ranksBefore), as do those counted from the
+ * table when the tally is not held.
+ *
+ * The tally is built by one scan of the Accounts table when the first ledger
+ * closes after startup, or after the table was rewritten other than through
+ * account frames (invalidateAll). From then on it is kept up to date, like
+ * LedgerEntryCache:
+ *
+ *   - An account frame writing an account first marks it dirty.
+ *
+ *   - When a ledger closes, the commit of its outermost LedgerDelta applies
+ *     the ledger's changed and deleted accounts to the tally, and clears the
+ *     dirty marks.
+ *
+ * Votes are counted from the tally corrected by the current state of the
+ * dirty accounts, and of those changed by the ledger being closed with
+ * deferred writes (Config::DEFER_LEDGER_WRITES); that is, in time
+ * proportional to the winners and the accounts the ledger changed.
+ *
+ * Owned by the Database; used only from the main thread.
+ */
+class InflationTally : NonMovableOrCopyable
+{
+  public:
+    // accounts with a lower balance do not vote
+    static const int64 kMinVoterBalance;
+
+    // returns true to be called with the next destination, false to stop
+    typedef std::function<bool(int64 votes, std::string const& dest)>
+        Processor;
+
+    // (votes, destination) pairs, ranked: most votes first, then the greatest
+    // destination key, compared as raw bytes.
+    typedef std::pair<int64, std::string> Rank;
+    static bool ranksBefore(Rank const& a, Rank const& b);
+
+  private:
+    bool mHeld{false};
+
+    // by voting account: destination and balance
+    std::map<std::string, std::pair<std::string, int64>> mVoters;
+    // by destination
+    std::map<std::string, int64> mVotes;
+    std::set<Rank, bool (*)(Rank const&, Rank const&)> mRanking{
+        &ranksBefore};
+
+    std::set<std::string> mDirty;
+
+    void addVotes(std::string const& dest, int64 votes);
+    void setVoter(std::string const& account, AccountEntry const* entry);
+    void build(Database& db);
+
+  public:
+    // True if the tally is held, and votes can be counted without a scan.
+    bool
+    isHeld() const
+    {
+        return mHeld;
+    }
+
+    // Call `processor` with up to `maxWinners` destinations, most votes first,
+    // while it returns true. Returns false, calling nothing, if the tally is
+    // not held.
+    bool processForInflation(Processor const& processor, int maxWinners,
+                             Database& db);
+
+    // The account with key `account` (see toSQLKey) is about to be written.
+    void invalidate(std::string const& account);
+
+    // Accounts are about to be written other than through their frames;
+    // forget everything until the next refresh.
+    void invalidateAll();
+
+    // A ledger has closed in `db`, making `live` the state of their keys and
+    // removing the entries with keys in `dead`. Entries other than accounts
+    // are ignored.
+    void refresh(Database& db, std::vector<LedgerEntry> const& live,
+                 std::vector<LedgerKey> const& dead);
+};
+}
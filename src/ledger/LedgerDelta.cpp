@@ -5,25 +5,97 @@
 #include "ledger/LedgerDelta.h"
 #include "generated/Stellar-ledger.h"
 #include "main/Application.h"
+#include "database/Database.h"
+#include "util/Logging.h"
 #include "medida/metrics_registry.h"
 #include "medida/meter.h"
+#include <algorithm>
 
 namespace stellar
 {
 LedgerDelta::LedgerDelta(LedgerDelta& outerDelta)
     : mOuterDelta(&outerDelta)
+    , mRoot(outerDelta.mRoot)
     , mHeader(&outerDelta.getHeader())
+    , mDatabase(outerDelta.mDatabase)
+    , mDeferWrites(outerDelta.mDeferWrites)
     , mCurrentHeader(outerDelta.getHeader())
     , mPreviousHeaderValue(outerDelta.getHeader())
+    , mInnermost(nullptr)
 {
+    outerDelta.checkState();
+    assert(mRoot->mInnermost == mOuterDelta);
+    if (mOuterDelta == mRoot)
+    {
+        // the undo records of the deltas nested in the outermost one before
+        // are no longer needed
+        mRoot->mUndoLog.clear();
+    }
+    mUndoBegin = mUndoEnd = mRoot->mUndoLog.size();
+    mRoot->mInnermost = this;
 }
 
 LedgerDelta::LedgerDelta(LedgerHeader& header)
     : mOuterDelta(nullptr)
+    , mRoot(this)
     , mHeader(&header)
+    , mDatabase(nullptr)
+    , mDeferWrites(false)
     , mCurrentHeader(header)
     , mPreviousHeaderValue(header)
+    , mInnermost(this)
+    , mUndoBegin(0)
+    , mUndoEnd(0)
+{
+}
+
+LedgerDelta::LedgerDelta(LedgerHeader& header, Database& db, bool deferWrites)
+    : LedgerDelta(header)
+{
+    mDatabase = &db;
+    mDeferWrites = deferWrites;
+    assert(db.getOpenDelta() == nullptr);
+    db.setOpenDelta(this);
+}
+
+LedgerDelta::~LedgerDelta()
+{
+    if (mHeader && mOuterDelta)
+    {
+        // never committed: its changes are discarded
+        rollback();
+    }
+    else if (mHeader)
+    {
+        abandon();
+    }
+    release();
+}
+
+void
+LedgerDelta::release()
 {
+    if (mDatabase && mDatabase->getOpenDelta() == this)
+    {
+        mDatabase->setOpenDelta(nullptr);
+    }
+}
+
+void
+LedgerDelta::abandon()
+{
+    if (mDatabase && !mDeferWrites)
+    {
+        // the order book may have loaded offers this delta wrote from the
+        // database, and these writes are now in doubt
+        mDatabase->getOrderBook().invalidateAll();
+    }
+}
+
+bool
+LedgerDelta::isOpenIn(Database& db) const
+{
+    return db.getOpenDelta() == mRoot;
 }
 
 LedgerHeader&
@@ -46,6 +118,7 @@ LedgerDelta::checkState()
         throw std::runtime_error(
             "Invalid operation: delta is already committed");
     }
+    assert(mRoot->mInnermost == this);
 }
 
 void
@@ -66,23 +139,44 @@ LedgerDelta::modEntry(EntryFrame const& entry)
     modEntry(entry.copy());
 }
 
+void
+LedgerDelta::recordUndo(LedgerKey const& key, bool existed,
+                        ChangeTable::const_iterator it)
+{
+    if (this == mRoot)
+    {
+        // the outermost delta is rolled back by dropping the whole table
+        return;
+    }
+    mRoot->mUndoLog.emplace_back();
+    Undo& u = mRoot->mUndoLog.back();
+    u.mKey = key;
+    u.mExisted = existed;
+    u.mHadChange = (it != mRoot->mChanges.end());
+    if (u.mHadChange)
+    {
+        u.mPrevious = it->second;
+    }
+}
+
 void
 LedgerDelta::addEntry(EntryFrame::pointer entry)
 {
     checkState();
     auto k = entry->getKey();
-    auto del_it = mDelete.find(k);
-    if (del_it != mDelete.end())
+    auto& changes = mRoot->mChanges;
+    auto it = changes.find(k);
+    recordUndo(k, false, it);
+    if (it == changes.end())
     {
-        // delete + new is an update
-        mDelete.erase(del_it);
-        mMod[k] = entry;
+        changes.emplace(k, Change{NEW_ENTRY, entry});
     }
     else
     {
-        assert(mNew.find(k) == mNew.end()); // double new
-        assert(mMod.find(k) == mMod.end()); // mod + new is invalid
-        mNew[k] = entry;
+        // double new, or mod + new, is invalid
+        assert(it->second.mType == DELETED_ENTRY);
+        // delete + new is an update
+        it->second = Change{MOD_ENTRY, entry};
     }
 }
 
@@ -97,18 +191,24 @@ void
 LedgerDelta::deleteEntry(LedgerKey const& k)
 {
     checkState();
-    auto new_it = mNew.find(k);
-    if (new_it != mNew.end())
+    auto& changes = mRoot->mChanges;
+    auto it = changes.find(k);
+    recordUndo(k, true, it);
+    if (it == changes.end())
+    {
+        changes.emplace(k, Change{DELETED_ENTRY, nullptr});
+    }
+    else if (it->second.mType == NEW_ENTRY)
     {
         // new + delete -> don't add it in the first place
-        mNew.erase(new_it);
+        changes.erase(it);
     }
     else
     {
-        assert(mDelete.find(k) == mDelete.end()); // double delete is invalid
+        // double delete is invalid
+        assert(it->second.mType != DELETED_ENTRY);
         // only keep the delete
-        mMod.erase(k);
-        mDelete.insert(k);
+        it->second = Change{DELETED_ENTRY, nullptr};
     }
 }
 
@@ -117,88 +217,250 @@ LedgerDelta::modEntry(EntryFrame::pointer entry)
 {
     checkState();
     auto k = entry->getKey();
-    auto mod_it = mMod.find(k);
-    if (mod_it != mMod.end())
+    auto& changes = mRoot->mChanges;
+    auto it = changes.find(k);
+    recordUndo(k, true, it);
+    if (it == changes.end())
     {
-        // collapse mod
-        mod_it->second = entry;
+        changes.emplace(k, Change{MOD_ENTRY, entry});
     }
     else
     {
-        auto new_it = mNew.find(k);
-        if (new_it != mNew.end())
+        // delete + mod is illegal
+        assert(it->second.mType != DELETED_ENTRY);
+        // collapse mod, or new + mod = new (with latest value)
+        it->second.mEntry = entry;
+    }
+}
+
+void
+LedgerDelta::undo(size_t mark)
+{
+    auto& log = mRoot->mUndoLog;
+    auto& changes = mRoot->mChanges;
+    while (log.size() > mark)
+    {
+        Undo& u = log.back();
+        if (mDatabase && !mDeferWrites && u.mKey.type() == OFFER)
+        {
+            auto it = changes.find(u.mKey);
+            EntryFrame::pointer entry, previous;
+            if (it != changes.end())
+            {
+                entry = it->second.mEntry;
+            }
+            if (u.mHadChange)
+            {
+                previous = u.mPrevious.mEntry;
+            }
+            mDatabase->getOrderBook().undo(
+                u.mKey, entry ? &entry->mEntry : nullptr,
+                previous ? &previous->mEntry : nullptr,
+                u.mExisted && !u.mHadChange);
+        }
+        if (u.mHadChange)
         {
-            // new + mod = new (with latest value)
-            new_it->second = entry;
+            changes[u.mKey] = std::move(u.mPrevious);
         }
         else
         {
-            assert(mDelete.find(k) == mDelete.end()); // delete + mod is illegal
-            mMod[k] = entry;
+            changes.erase(u.mKey);
         }
+        log.pop_back();
     }
 }
 
 void
-LedgerDelta::mergeEntries(LedgerDelta& other)
+LedgerDelta::commit()
 {
     checkState();
-    for (auto& d : other.mDelete)
+    // checks if we're not about to override changes
+    if (std::memcmp(&mPreviousHeaderValue, mHeader, sizeof(LedgerHeader)) != 0)
     {
-        deleteEntry(d);
+        throw std::runtime_error("unexpected header state");
     }
-    for (auto& n : other.mNew)
+    if (mOuterDelta)
     {
-        addEntry(n.second);
+        // the changes are in the table already, and the undo records now
+        // belong to the outer delta
+        mUndoEnd = mRoot->mUndoLog.size();
+        mRoot->mInnermost = mOuterDelta;
     }
-    for (auto& m : other.mMod)
+    else if (mDatabase)
     {
-        modEntry(m.second);
+        if (mDeferWrites)
+        {
+            writeBack();
+        }
+        auto live = getLiveEntries();
+        auto dead = getDeadEntries();
+        mDatabase->getEntryCache().refresh(live, dead);
+        mDatabase->getOrderBook().refresh(live, dead);
+        mDatabase->getInflationTally().refresh(*mDatabase, live, dead);
     }
+    release();
+    mOuterDelta = nullptr;
+    *mHeader = mCurrentHeader.mHeader;
+    mHeader = nullptr;
 }
 
 void
-LedgerDelta::commit()
+LedgerDelta::rollback()
 {
     checkState();
-    // checks if we're not about to override changes
-    if (std::memcmp(&mPreviousHeaderValue, mHeader, sizeof(LedgerHeader)) != 0)
+    if (mOuterDelta)
     {
-        throw std::runtime_error("unexpected header state");
+        undo(mUndoBegin);
+        mUndoEnd = mUndoBegin;
+        mRoot->mInnermost = mOuterDelta;
     }
-    if (mOuterDelta)
+    else
     {
-        mOuterDelta->mergeEntries(*this);
-        mOuterDelta = nullptr;
+        mChanges.clear();
+        mUndoLog.clear();
+        abandon();
     }
-    *mHeader = mCurrentHeader.mHeader;
+    release();
     mHeader = nullptr;
 }
 
+template <typename F>
 void
-LedgerDelta::rollback()
+LedgerDelta::forEachChange(F f) const
 {
-    checkState();
-    mHeader = nullptr;
+    auto const& changes = mRoot->mChanges;
+    if (this == mRoot)
+    {
+        for (auto const& c : changes)
+        {
+            f(c.first, c.second.mType, c.second.mEntry);
+        }
+        return;
+    }
+
+    // whether each entry changed existed when this delta was opened, from
+    // the first undo record of its key
+    auto const& log = mRoot->mUndoLog;
+    size_t end = std::min(mHeader ? log.size() : mUndoEnd, log.size());
+    std::unordered_map<LedgerKey, bool, LedgerEntryIdHash, LedgerEntryIdEq>
+        existed;
+    for (size_t i = mUndoBegin; i < end; ++i)
+    {
+        existed.emplace(log[i].mKey, log[i].mExisted);
+    }
+    for (auto const& e : existed)
+    {
+        auto it = changes.find(e.first);
+        if (it != changes.end() && it->second.mType != DELETED_ENTRY)
+        {
+            f(e.first, e.second ? MOD_ENTRY : NEW_ENTRY, it->second.mEntry);
+        }
+        else if (e.second)
+        {
+            f(e.first, DELETED_ENTRY, EntryFrame::pointer());
+        }
+    }
+}
+
+void
+LedgerDelta::writeBack()
+{
+    // Rows of changed entries are replaced: deleted, then inserted again
+    // along with those of the new entries.
+    std::vector<LedgerKey> removed;
+    std::vector<EntryFrame::pointer> inserted;
+    removed.reserve(mChanges.size());
+    inserted.reserve(mChanges.size());
+    for (auto const& c : mChanges)
+    {
+        if (c.second.mType != NEW_ENTRY)
+        {
+            removed.push_back(c.first);
+        }
+        if (c.second.mType != DELETED_ENTRY)
+        {
+            inserted.push_back(c.second.mEntry);
+        }
+    }
+    EntryFrame::storeBatch(*mDatabase, removed, inserted);
+    CLOG(DEBUG, "Ledger") << "Wrote back " << inserted.size() << " and removed "
+                          << removed.size() << " rows of changed entries";
+}
+
+bool
+LedgerDelta::getPendingEntry(Database& db, LedgerKey const& key,
+                             EntryFrame::pointer& entry)
+{
+    LedgerDelta const* d = db.getOpenDelta();
+    if (!d)
+    {
+        return false;
+    }
+    auto it = d->mChanges.find(key);
+    if (it == d->mChanges.end())
+    {
+        return false;
+    }
+    entry = it->second.mEntry;
+    return true;
+}
+
+LedgerDelta::KeyEntryMap
+LedgerDelta::getPendingEntries(Database& db, LedgerEntryType type)
+{
+    KeyEntryMap entries;
+    LedgerDelta const* d = db.getOpenDelta();
+    if (d && d->mDeferWrites)
+    {
+        for (auto const& c : d->mChanges)
+        {
+            if (c.first.type() == type)
+            {
+                entries.insert(std::make_pair(c.first, c.second.mEntry));
+            }
+        }
+    }
+    return entries;
 }
 
 xdr::opaque_vec<>
 LedgerDelta::getTransactionMeta() const
 {
+    // in the order of the keys: new entries, then changed, then deleted ones
+    KeyEntryMap added, changed;
+    std::vector<LedgerKey> deleted;
+    forEachChange([&](LedgerKey const& k, ChangeType type,
+                      EntryFrame::pointer const& entry)
+                  {
+                      switch (type)
+                      {
+                      case NEW_ENTRY:
+                          added.insert(std::make_pair(k, entry));
+                          break;
+                      case MOD_ENTRY:
+                          changed.insert(std::make_pair(k, entry));
+                          break;
+                      case DELETED_ENTRY:
+                          deleted.push_back(k);
+                          break;
+                      }
+                  });
+    std::sort(deleted.begin(), deleted.end(), LedgerEntryIdCmp());
+
     TransactionMeta tm;
 
-    for (auto const& k : mNew)
+    for (auto const& k : added)
     {
         tm.entries.emplace_back(LIVEENTRY);
         tm.entries.back().liveEntry() = k.second->mEntry;
     }
-    for (auto const& k : mMod)
+    for (auto const& k : changed)
     {
         tm.entries.emplace_back(LIVEENTRY);
         tm.entries.back().liveEntry() = k.second->mEntry;
     }
 
-    for (auto const& k : mDelete)
+    for (auto const& k : deleted)
     {
         tm.entries.emplace_back(DEADENTRY);
         tm.entries.back().deadEntry() = k;
@@ -212,16 +474,18 @@ LedgerDelta::getLiveEntries() const
 {
     std::vector<LedgerEntry> live;
 
-    live.reserve(mNew.size() + mMod.size());
-
-    for (auto const& k : mNew)
-    {
-        live.push_back(k.second->mEntry);
-    }
-    for (auto const& k : mMod)
+    if (this == mRoot)
     {
-        live.push_back(k.second->mEntry);
+        live.reserve(mChanges.size());
     }
+    forEachChange([&](LedgerKey const&, ChangeType type,
+                      EntryFrame::pointer const& entry)
+                  {
+                      if (type != DELETED_ENTRY)
+                      {
+                          live.push_back(entry->mEntry);
+                      }
+                  });
 
     return live;
 }
@@ -231,82 +495,44 @@ LedgerDelta::getDeadEntries() const
 {
     std::vector<LedgerKey> dead;
 
-    dead.reserve(mDelete.size());
+    forEachChange([&](LedgerKey const& k, ChangeType type,
+                      EntryFrame::pointer const&)
+                  {
+                      if (type == DELETED_ENTRY)
+                      {
+                          dead.push_back(k);
+                      }
+                  });
 
-    for (auto const& k : mDelete)
-    {
-        dead.push_back(k);
-    }
     return dead;
 }
 
 void
 LedgerDelta::markMeters(Application& app) const
 {
-    for (auto const& ke : mNew)
-    {
-        switch (ke.first.type())
-        {
-        case ACCOUNT:
-            app.getMetrics()
-                .NewMeter({"ledger", "account", "add"}, "entry")
-                .Mark();
-            break;
-        case TRUSTLINE:
-            app.getMetrics()
-                .NewMeter({"ledger", "trust", "add"}, "entry")
-                .Mark();
-            break;
-        case OFFER:
-            app.getMetrics()
-                .NewMeter({"ledger", "offer", "add"}, "entry")
-                .Mark();
-            break;
-        }
-    }
-
-    for (auto const& ke : mMod)
-    {
-        switch (ke.first.type())
-        {
-        case ACCOUNT:
-            app.getMetrics()
-                .NewMeter({"ledger", "account", "modify"}, "entry")
-                .Mark();
-            break;
-        case TRUSTLINE:
-            app.getMetrics()
-                .NewMeter({"ledger", "trust", "modify"}, "entry")
-                .Mark();
-            break;
-        case OFFER:
-            app.getMetrics()
-                .NewMeter({"ledger", "offer", "modify"}, "entry")
-                .Mark();
-            break;
-        }
-    }
-
-    for (auto const& ke : mDelete)
-    {
-        switch (ke.type())
-        {
-        case ACCOUNT:
-            app.getMetrics()
-                .NewMeter({"ledger", "account", "delete"}, "entry")
-                .Mark();
-            break;
-        case TRUSTLINE:
-            app.getMetrics()
-                .NewMeter({"ledger", "trust", "delete"}, "entry")
-                .Mark();
-            break;
-        case OFFER:
-            app.getMetrics()
-                .NewMeter({"ledger", "offer", "delete"}, "entry")
-                .Mark();
-            break;
-        }
-    }
+    static char const* const actions[] = {"add", "modify", "delete"};
+    forEachChange([&](LedgerKey const& k, ChangeType type,
+                      EntryFrame::pointer const&)
+                  {
+                      char const* action = actions[type];
+                      switch (k.type())
+                      {
+                      case ACCOUNT:
+                          app.getMetrics()
+                              .NewMeter({"ledger", "account", action}, "entry")
+                              .Mark();
+                          break;
+                      case TRUSTLINE:
+                          app.getMetrics()
+                              .NewMeter({"ledger", "trust", action}, "entry")
+                              .Mark();
+                          break;
+                      case OFFER:
+                          app.getMetrics()
+                              .NewMeter({"ledger", "offer", action}, "entry")
+                              .Mark();
+                          break;
+                      }
+                  });
 }
 }
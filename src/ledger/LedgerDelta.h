@@ -5,41 +5,126 @@
 // of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
 
 #include <map>
-#include <set>
+#include <unordered_map>
+#include <vector>
 #include "ledger/EntryFrame.h"
 #include "ledger/LedgerHeaderFrame.h"
 #include "bucket/LedgerCmp.h"
+#include "util/NonCopyable.h"
 #include "xdrpp/marshal.h"
 
 namespace stellar
 {
 class Application;
-
-class LedgerDelta
+class Database;
+
+/**
+ * LedgerDelta tracks the changes made to the ledger header and entries by a
+ * ledger close, a transaction, or an operation.
+ *
+ * The changes to entries are kept in a single table, owned by the outermost
+ * delta and shared by the deltas nested in it, holding the state of every
+ * entry changed since the outermost delta was opened. A change made through a
+ * nested delta is applied to the table directly, after recording how to undo
+ * it; committing a nested delta only hands its undo records over to the delta
+ * it is nested in, and rolling it back (or destroying it uncommitted) replays
+ * them. Nested deltas must therefore be opened, committed or rolled back, and
+ * destroyed in strict LIFO order, and changes made only through the innermost
+ * open one.
+ *
+ * The outermost delta of a ledger close may defer writes to the database:
+ * then entry frames storing or deleting entries through it (or any delta
+ * nested in it) only record the change here, and loads see the pending state
+ * before the database's (see getPendingEntry). Committing the outermost delta
+ * writes the final state of every entry the ledger changed, in batches grouped
+ * by table, so an entry changed by many transactions is written once.
+ *
+ * The outermost delta of a ledger close, whether it defers writes or not, is
+ * registered with the Database while it is open: the order book merges the
+ * offers it changed into the books held until it commits.
+ */
+class LedgerDelta : NonMovableOrCopyable
 {
+  public:
     typedef std::map<LedgerKey, EntryFrame::pointer, LedgerEntryIdCmp>
         KeyEntryMap;
 
+  private:
+    enum ChangeType
+    {
+        NEW_ENTRY,
+        MOD_ENTRY,
+        DELETED_ENTRY
+    };
+
+    struct Change
+    {
+        ChangeType mType;
+        EntryFrame::pointer mEntry; // null if deleted
+    };
+
+    typedef std::unordered_map<LedgerKey, Change, LedgerEntryIdHash,
+                               LedgerEntryIdEq> ChangeTable;
+
+    // how to restore the change table after a change made in a nested delta
+    struct Undo
+    {
+        LedgerKey mKey;
+        bool mExisted;   // the entry existed before the change
+        bool mHadChange; // the table held mPrevious for mKey
+        Change mPrevious;
+    };
+
     LedgerDelta*
         mOuterDelta;       // set when this delta is nested inside another delta
+    LedgerDelta* mRoot;    // outermost delta, owning the change table
     LedgerHeader* mHeader; // LedgerHeader to commit changes to
+    Database* mDatabase;   // set on the outermost delta of a ledger close
+    bool mDeferWrites;     // changes are written when the ledger closes
 
     // objects to keep track of changes
     // ledger header itself
     LedgerHeaderFrame mCurrentHeader;
     LedgerHeader mPreviousHeaderValue;
-    // ledger entries
-    KeyEntryMap mNew;
-    KeyEntryMap mMod;
-    std::set<LedgerKey, LedgerEntryIdCmp> mDelete;
+
+    // ledger entries, on the outermost delta only: the state of the entries
+    // changed, the undo records of the open nested deltas (and of the last
+    // ones committed into the outermost delta's direct child), and the
+    // innermost open delta
+    ChangeTable mChanges;
+    std::vector<Undo> mUndoLog;
+    LedgerDelta* mInnermost;
+
+    // the undo records of this delta, in mRoot->mUndoLog: from mUndoBegin, up
+    // to mUndoEnd once committed or rolled back
+    size_t mUndoBegin;
+    size_t mUndoEnd;
 
     void checkState();
     void addEntry(EntryFrame::pointer entry);
     void deleteEntry(EntryFrame::pointer entry);
     void modEntry(EntryFrame::pointer entry);
 
-    // merge "other" into current ledgerDelta
-    void mergeEntries(LedgerDelta& other);
+    // record how to undo a change to `key`, whose entry `existed`, about to
+    // be made to the table, where it is found at `it`
+    void recordUndo(LedgerKey const& key, bool existed,
+                    ChangeTable::const_iterator it);
+
+    // undo the changes recorded since `mark`
+    void undo(size_t mark);
+
+    // call f(key, type, entry) for each entry changed by this delta, with
+    // the type of change since this delta was opened
+    template <typename F> void forEachChange(F f) const;
+
+    // stop being the open delta of mDatabase, if this is it
+    void release();
+
+    // the outermost delta is discarded without being committed
+    void abandon();
+
+    // write the final state of the changed entries to the database
+    void writeBack();
 
   public:
     // keeps an internal reference to the outerDelta,
@@ -50,16 +135,43 @@ class LedgerDelta
     // will apply changes to ledgerHeader on commit
     LedgerDelta(LedgerHeader& ledgerHeader);
 
+    // as above, and on commit also refreshes the database's entry cache
+    // with the changes made: for the delta of a ledger being closed. If
+    // deferWrites, changes are written to the database only on commit.
+    LedgerDelta(LedgerHeader& ledgerHeader, Database& db,
+                bool deferWrites = false);
+
+    ~LedgerDelta();
+
+    // true if entry frames should only record their changes in this delta
+    bool
+    defersWrites() const
+    {
+        return mDeferWrites;
+    }
+
+    // true if this delta belongs to the ledger being closed in `db`: its
+    // changes are seen by getPendingEntry
+    bool isOpenIn(Database& db) const;
+
     LedgerHeader& getHeader();
     LedgerHeaderFrame& getHeaderFrame();
 
+    // the innermost delta open in the outermost delta of this one, where
+    // changes are to be made
+    LedgerDelta&
+    getInnermost()
+    {
+        return *mRoot->mInnermost;
+    }
+
     // methods to register changes in the ledger entries
     void addEntry(EntryFrame const& entry);
     void deleteEntry(EntryFrame const& entry);
     void deleteEntry(LedgerKey const& key);
     void modEntry(EntryFrame const& entry);
 
-    // commits this delta into outer delta
+    // commits this delta into outer delta; O(1) if nested
     void commit();
     // aborts any changes pending
     void rollback();
@@ -69,6 +181,20 @@ class LedgerDelta
     std::vector<LedgerEntry> getLiveEntries() const;
     std::vector<LedgerKey> getDeadEntries() const;
 
+    // Look up the state of `key` in the changes of the ledger being closed
+    // in `db`, if any. Returns true if it has changed, setting `entry` to its
+    // new state, or to null if it was deleted.
+    static bool getPendingEntry(Database& db, LedgerKey const& key,
+                                EntryFrame::pointer& entry);
+
+    // All the entries of `type` changed by the ledger being closed with
+    // deferred writes in `db`, with their new state (null if deleted); none
+    // if its changes are written as they are made.
+    static KeyEntryMap getPendingEntries(Database& db, LedgerEntryType type);
+
+    // The changes made by this delta, as they stand in the ledger. For a
+    // nested delta, valid until the delta it is nested in changes the same
+    // entries, or another delta is nested in the outermost one.
     xdr::opaque_vec<> getTransactionMeta() const;
 };
 }
@@ -0,0 +1,139 @@
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "ledger/LedgerEntryCache.h"
+#include "main/Application.h"
+#include "main/Config.h"
+#include "util/make_unique.h"
+#include "medida/meter.h"
+#include "medida/metrics_registry.h"
+
+namespace stellar
+{
+
+LedgerEntryCache::TypeCache::TypeCache(Application& app,
+                                       std::string const& type, size_t size)
+    : mEntries(size)
+    , mHit(app.getMetrics().NewMeter({"ledger", type, "cache-hit"}, "entry"))
+    , mMiss(app.getMetrics().NewMeter({"ledger", type, "cache-miss"}, "entry"))
+    , mEvict(
+          app.getMetrics().NewMeter({"ledger", type, "cache-evict"}, "entry"))
+{
+}
+
+LedgerEntryCache::LedgerEntryCache(Application& app)
+{
+    size_t size = app.getConfig().ENTRY_CACHE_SIZE;
+    if (size != 0)
+    {
+        // In LedgerEntryType order.
+        for (auto type : {"account", "trust", "offer"})
+        {
+            mCaches.push_back(make_unique<TypeCache>(app, type, size));
+        }
+    }
+}
+
+LedgerEntryCache::TypeCache*
+LedgerEntryCache::getCache(LedgerKey const& key)
+{
+    size_t type = static_cast<size_t>(key.type());
+    return type < mCaches.size() ? mCaches[type].get() : nullptr;
+}
+
+void
+LedgerEntryCache::store(LedgerKey const& key,
+                        std::shared_ptr<LedgerEntry const> entry)
+{
+    auto cache = getCache(key);
+    if (cache)
+    {
+        size_t evictions = cache->mEntries.getEvictions();
+        cache->mEntries.put(key, entry);
+        cache->mEvict.Mark(cache->mEntries.getEvictions() - evictions);
+    }
+}
+
+bool
+LedgerEntryCache::get(LedgerKey const& key,
+                      std::shared_ptr<LedgerEntry const>& entry)
+{
+    auto cache = getCache(key);
+    if (!cache)
+    {
+        return false;
+    }
+    auto cached = cache->mEntries.get(key);
+    if (!cached)
+    {
+        cache->mMiss.Mark();
+        return false;
+    }
+    cache->mHit.Mark();
+    entry = *cached;
+    return true;
+}
+
+void
+LedgerEntryCache::put(LedgerKey const& key,
+                      std::shared_ptr<LedgerEntry const> entry)
+{
+    if (mAllDirty || mDirty.find(key) != mDirty.end())
+    {
+        return;
+    }
+    store(key, entry);
+}
+
+void
+LedgerEntryCache::invalidate(LedgerKey const& key)
+{
+    auto cache = getCache(key);
+    if (!cache)
+    {
+        return;
+    }
+    cache->mEntries.erase(key);
+    if (mAllDirty)
+    {
+        return;
+    }
+    if (mDirty.size() < kMaxDirty)
+    {
+        mDirty.insert(key);
+    }
+    else
+    {
+        mDirty.clear();
+        mAllDirty = true;
+    }
+}
+
+void
+LedgerEntryCache::invalidateAll()
+{
+    for (auto& cache : mCaches)
+    {
+        cache->mEntries.clear();
+    }
+    mDirty.clear();
+    mAllDirty = true;
+}
+
+void
+LedgerEntryCache::refresh(std::vector<LedgerEntry> const& live,
+                          std::vector<LedgerKey> const& dead)
+{
+    mDirty.clear();
+    mAllDirty = false;
+    for (auto const& e : live)
+    {
+        store(LedgerEntryKey(e), std::make_shared<LedgerEntry const>(e));
+    }
+    for (auto const& k : dead)
+    {
+        store(k, nullptr);
+    }
+}
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "bucket/LedgerCmp.h"
+#include "generated/StellarXDR.h"
+#include "util/LRUCache.h"
+#include "util/NonCopyable.h"
+#include <memory>
+#include <set>
+#include <vector>
+
+namespace medida
+{
+class Meter;
+}
+
+namespace stellar
+{
+class Application;
+
+/**
+ * LedgerEntryCache holds the committed state of recently used ledger entries
+ * -- or the fact that they do not exist -- in front of the SQL tables, so that
+ * the point loads of AccountFrame, TrustFrame and OfferFrame need not query
+ * the database again for entries they have seen. Each entry type has a cache
+ * of its own, bounded by Config::ENTRY_CACHE_SIZE, so a burst of one type of
+ * entry cannot evict all of another.
+ *
+ * The cache only ever holds state known to be committed to the database:
+ *
+ *   - A frame storing or deleting an entry first invalidates it: the key is
+ *     dropped from the cache and marked dirty. The write may yet be rolled
+ *     back with its SQL transaction, so until the ledger closes, loads of a
+ *     dirty key go to the database and their results are not cached.
+ *
+ *   - When a ledger closes, the commit of its outermost LedgerDelta refreshes
+ *     the cache with the ledger's new, changed and deleted entries, and clears
+ *     the dirty marks. Should the close then fail before its SQL transaction
+ *     commits, the LedgerManager invalidates the whole cache.
+ *
+ * Past `kMaxDirty` dirty keys (as when a bucket is applied entry by entry),
+ * the cache stops tracking them individually and caches nothing more until the
+ * next refresh. Writes that bypass the frames altogether must invalidate the
+ * whole cache.
+ *
+ * Owned by the Database; used only from the main thread.
+ */
+class LedgerEntryCache : NonMovableOrCopyable
+{
+    typedef LRUCache<LedgerKey, std::shared_ptr<LedgerEntry const>,
+                     LedgerEntryIdCmp> Cache;
+
+    struct TypeCache
+    {
+        Cache mEntries;
+        medida::Meter& mHit;
+        medida::Meter& mMiss;
+        medida::Meter& mEvict;
+
+        TypeCache(Application& app, std::string const& type, size_t size);
+    };
+
+    // By LedgerEntryType; empty if the cache is disabled.
+    std::vector<std::unique_ptr<TypeCache>> mCaches;
+    std::set<LedgerKey, LedgerEntryIdCmp> mDirty;
+    bool mAllDirty{false};
+
+    TypeCache* getCache(LedgerKey const& key);
+    void store(LedgerKey const& key, std::shared_ptr<LedgerEntry const> entry);
+
+  public:
+    static const size_t kMaxDirty = 65536;
+
+    explicit LedgerEntryCache(Application& app);
+
+    // False if Config::ENTRY_CACHE_SIZE disabled the cache.
+    bool
+    isEnabled() const
+    {
+        return !mCaches.empty();
+    }
+
+    // Look up `key`. Returns true if its state is cached, setting `entry` to
+    // it, or to null if the entry does not exist.
+    bool get(LedgerKey const& key, std::shared_ptr<LedgerEntry const>& entry);
+
+    // Remember the state of `key` just loaded from the database: `entry`, or
+    // null if there is no such entry. Ignored if the key is dirty.
+    void put(LedgerKey const& key, std::shared_ptr<LedgerEntry const> entry);
+
+    // The entry with key `key` is about to be written.
+    void invalidate(LedgerKey const& key);
+
+    // Entries are about to be written other than through their frames; forget
+    // everything, and cache nothing until the next refresh.
+    void invalidateAll();
+
+    // A ledger has closed, making `live` the state of their keys and removing
+    // the entries with keys in `dead`.
+    void refresh(std::vector<LedgerEntry> const& live,
+                 std::vector<LedgerKey> const& dead);
+};
+}
@@ -10,8 +10,14 @@
 #include "util/Logging.h"
 #include "crypto/Base58.h"
 #include "ledger/LedgerManager.h"
+#include "database/Database.h"
+#include "bucket/BucketManager.h"
+#include "bucket/BucketList.h"
+#include <algorithm>
 
 #include "main/Config.h"
+#include "medida/counter.h"
+#include "medida/metrics_registry.h"
 
 using namespace stellar;
 using namespace std;
@@ -52,3 +58,106 @@ TEST_CASE("ledgerheader", "[ledger]")
                 app2->getLedgerManager().getLastClosedLedgerHeader().hash);
     }
 }
+
+TEST_CASE("ledger close with asynchronous persistence", "[ledger][persist]")
+{
+    Config cfg(getTestConfig(0, Config::TESTDB_ON_DISK_SQLITE));
+    cfg.LEDGER_PERSIST_DEPTH = 2;
+
+    Hash saved;
+    {
+        VirtualClock clock;
+        Application::pointer app = Application::create(clock, cfg);
+        app->start();
+
+        auto& lm = app->getLedgerManager();
+        auto& notDurable = app->getMetrics().NewCounter(
+            {"ledger", "persistence", "not-durable"});
+        REQUIRE(app->getDatabase().canDeferDurability());
+        REQUIRE(notDurable.count() == 0);
+
+        for (uint64_t closeTime = 1; closeTime <= 8; ++closeTime)
+        {
+            TxSetFramePtr txSet = make_shared<TxSetFrame>(
+                lm.getLastClosedLedgerHeader().hash);
+            LedgerCloseData ledgerData(lm.getLedgerNum(), txSet, closeTime,
+                                       10);
+            lm.closeLedger(ledgerData);
+
+            REQUIRE(notDurable.count() >= 0);
+            REQUIRE(notDurable.count() <= 2);
+        }
+        saved = lm.getLastClosedLedgerHeader().hash;
+    }
+
+    SECTION("load existing ledger")
+    {
+        Config cfg2(cfg);
+        cfg2.REBUILD_DB = false;
+        cfg2.FORCE_SCP = false;
+        VirtualClock clock2;
+        Application::pointer app2 = Application::create(clock2, cfg2);
+        app2->start();
+
+        REQUIRE(saved ==
+                app2->getLedgerManager().getLastClosedLedgerHeader().hash);
+    }
+}
+
+TEST_CASE("ledger close recovers from ledgers not made durable",
+          "[ledger][persist]")
+{
+    Config cfg(getTestConfig(0, Config::TESTDB_ON_DISK_SQLITE));
+    cfg.LEDGER_PERSIST_DEPTH = 2;
+
+    std::vector<Hash> closed;
+    {
+        VirtualClock clock;
+        Application::pointer app = Application::create(clock, cfg);
+        app->start();
+
+        auto& lm = app->getLedgerManager();
+        closed.push_back(lm.getLastClosedLedgerHeader().hash);
+
+        // a reader on an old snapshot keeps the log from being checkpointed,
+        // so no ledger closed from now on can be made durable
+        soci::session reader(app->getDatabase().getPool());
+        soci::transaction readTx(reader);
+        int accounts = 0;
+        reader << "SELECT count(*) FROM Accounts", soci::into(accounts);
+
+        bool failed = false;
+        for (uint64_t closeTime = 1; closeTime <= 8 && !failed; ++closeTime)
+        {
+            TxSetFramePtr txSet = make_shared<TxSetFrame>(
+                lm.getLastClosedLedgerHeader().hash);
+            LedgerCloseData ledgerData(lm.getLedgerNum(), txSet, closeTime,
+                                       10);
+            try
+            {
+                lm.closeLedger(ledgerData);
+            }
+            catch (std::runtime_error&)
+            {
+                failed = true;
+            }
+            closed.push_back(lm.getLastClosedLedgerHeader().hash);
+        }
+        REQUIRE(failed);
+        // the node goes down here, before its ledgers are known durable
+    }
+
+    // and comes back to one of the ledgers it closed, with its buckets
+    Config cfg2(cfg);
+    cfg2.REBUILD_DB = false;
+    cfg2.FORCE_SCP = false;
+    VirtualClock clock2;
+    Application::pointer app2 = Application::create(clock2, cfg2);
+    app2->start();
+
+    auto const& lcl = app2->getLedgerManager().getLastClosedLedgerHeader();
+    REQUIRE(std::find(closed.begin(), closed.end(), lcl.hash) !=
+            closed.end());
+    REQUIRE(app2->getBucketManager().getBucketList().getHash() ==
+            lcl.header.bucketListHash);
+}
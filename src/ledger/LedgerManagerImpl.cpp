@@ -7,6 +7,7 @@
 #include "crypto/Hex.h"
 #include "crypto/SHA.h"
 #include "crypto/SecretKey.h"
+#include "database/BulkInserter.h"
 #include "database/Database.h"
 #include "herder/Herder.h"
 #include "herder/TxSetFrame.h"
@@ -96,15 +97,28 @@ LedgerManagerImpl::LedgerManagerImpl(Application& app)
     : mApp(app)
     , mTransactionApply(
           app.getMetrics().NewTimer({"ledger", "transaction", "apply"}))
+    , mPrefetch(app.getMetrics().NewTimer({"ledger", "entry", "prefetch"}))
     , mLedgerClose(app.getMetrics().NewTimer({"ledger", "ledger", "close"}))
+    , mPersistWait(
+          app.getMetrics().NewTimer({"ledger", "persistence", "wait"}))
     , mSyncingLedgersSize(
           app.getMetrics().NewCounter({"ledger", "memory", "syncing-ledgers"}))
+    , mNotDurableLedgers(
+          app.getMetrics().NewCounter({"ledger", "persistence", "not-durable"}))
     , mState(LM_BOOTING_STATE)
 
 {
     mLastCloseTime = mApp.timeNow(); // this is 0 at this point
 }
 
+LedgerManagerImpl::~LedgerManagerImpl()
+{
+    if (mPersisting.valid())
+    {
+        mPersisting.wait();
+    }
+}
+
 void
 LedgerManagerImpl::setState(State s)
 {
@@ -150,7 +164,8 @@ LedgerManagerImpl::startNewLedger()
                                  // always has the same hash
     genesisHeader.ledgerSeq = 1;
 
-    LedgerDelta delta(genesisHeader);
+    LedgerDelta delta(genesisHeader, getDatabase(),
+                      mApp.getConfig().DEFER_LEDGER_WRITES);
     masterAccount.storeAdd(delta, this->getDatabase());
     delta.commit();
 
@@ -568,9 +583,14 @@ LedgerManagerImpl::closeLedger(LedgerCloseData ledgerData)
         throw std::runtime_error("txset mismatch");
     }
 
-    LedgerDelta ledgerDelta(mCurrentLedger->mHeader);
+    LedgerDelta ledgerDelta(mCurrentLedger->mHeader, getDatabase(),
+                            mApp.getConfig().DEFER_LEDGER_WRITES);
 
     soci::transaction txscope(getDatabase().getSession());
+    if (getDatabase().canDeferDurability())
+    {
+        getDatabase().deferDurability();
+    }
 
     auto ledgerTime = mLedgerClose.TimeScope();
 
@@ -580,7 +600,21 @@ LedgerManagerImpl::closeLedger(LedgerCloseData ledgerData)
     vector<TransactionFramePtr> txs = ledgerData.mTxSet->sortForApply();
     int index = 0;
 
+    // load the entries the transactions are known to touch with a few
+    // batched queries, rather than one by one as they are applied
+    {
+        std::set<LedgerKey, LedgerEntryIdCmp> keys;
+        for (auto const& tx : txs)
+        {
+            tx->addPrefetchKeys(keys);
+        }
+        auto prefetchTime = mPrefetch.TimeScope();
+        EntryFrame::prefetch(getDatabase(), keys);
+    }
+
     auto txResultHasher = SHA256::create();
+    auto& db = getDatabase();
+    auto txHistory = TransactionFrame::makeBulkInserter(db, db.getSession());
     for (auto tx : txs)
     {
         auto txTime = mTransactionApply.TimeScope();
@@ -627,15 +661,33 @@ LedgerManagerImpl::closeLedger(LedgerCloseData ledgerData)
             // ensures that this transaction doesn't have any side effects
             delta.rollback();
         }
-        tx->storeTransaction(*this, delta, ++index, *txResultHasher);
+        tx->storeTransaction(*this, delta, ++index, *txResultHasher,
+                             *txHistory);
     }
+    txHistory->flush();
     ledgerDelta.commit();
     mCurrentLedger->mHeader.baseFee = ledgerData.mBaseFee;
     mCurrentLedger->mHeader.closeTime = ledgerData.mCloseTime;
     mCurrentLedger->mHeader.txSetHash = ledgerData.mTxSet->getContentsHash();
     mCurrentLedger->mHeader.txSetResultHash = txResultHasher->finish();
-    closeLedgerHelper(ledgerDelta);
-    txscope.commit();
+    HistoryArchiveState has;
+    try
+    {
+        has = closeLedgerHelper(ledgerDelta);
+        txscope.commit();
+    }
+    catch (...)
+    {
+        // committing ledgerDelta refreshed the entry cache, order book and
+        // inflation tally with the ledger's changes, which the database never
+        // saw: drop them
+        auto& db = getDatabase();
+        db.getEntryCache().invalidateAll();
+        db.getOrderBook().invalidateAll();
+        db.getInflationTally().invalidateAll();
+        throw;
+    }
+    persistLedger(has);
 
     // Notify ledger close to other components.
     mApp.getHistoryManager().maybePublishHistory([](asio::error_code const&)
@@ -646,6 +698,83 @@ LedgerManagerImpl::closeLedger(LedgerCloseData ledgerData)
     mApp.getBucketManager().forgetUnreferencedBuckets();
 }
 
+// With Config::LEDGER_PERSIST_DEPTH set, the ledger just closed is committed
+// without waiting for the disk, and the commits are made durable by a job on a
+// pool session, one at a time: each job covers every ledger closed before it
+// starts. Closing waits for the job in flight only when more than
+// LEDGER_PERSIST_DEPTH closed ledgers are not known to be durable -- or, as
+// nothing is known durable yet, at the first close. A job that cannot establish
+// durability (another session holds up the checkpoint) leaves the ledgers not
+// known durable; past LEDGER_PERSIST_DEPTH of them, closing makes them durable
+// itself, or throws. Each ledger commits
+// atomically with its header, LCL and HAS, so after a crash the database comes
+// back to one of the ledgers closed since the last durable one; the buckets of
+// their states are retained until then.
+void
+LedgerManagerImpl::persistLedger(HistoryArchiveState const& has)
+{
+    auto& db = getDatabase();
+    if (!db.canDeferDurability())
+    {
+        return;
+    }
+    mRecoverableStates.push_back(has);
+
+    uint32_t lcl = getLastClosedLedgerNum();
+    uint32_t depth = mApp.getConfig().LEDGER_PERSIST_DEPTH;
+    auto collect = [this]()
+    {
+        auto waitTime = mPersistWait.TimeScope();
+        if (mPersisting.get())
+        {
+            mDurableLedger = mPersistingLedger;
+        }
+    };
+
+    if (mPersisting.valid() &&
+        (lcl - mDurableLedger > depth ||
+         mPersisting.wait_for(std::chrono::seconds(0)) ==
+             std::future_status::ready))
+    {
+        collect();
+    }
+    if (!mPersisting.valid())
+    {
+        auto& pool = db.getPool();
+        mPersistingLedger = lcl;
+        mPersisting = std::async(std::launch::async, [&db, &pool]()
+                                 {
+                                     soci::session sess(pool);
+                                     return db.makeDurable(sess);
+                                 });
+    }
+    if (lcl - mDurableLedger > depth)
+    {
+        collect();
+    }
+    if (lcl - mDurableLedger > depth)
+    {
+        // the job could not tell: try from the main session, as no ledger is
+        // being written now
+        auto waitTime = mPersistWait.TimeScope();
+        if (!db.makeDurable(db.getSession()))
+        {
+            throw std::runtime_error(
+                "could not make closed ledgers durable");
+        }
+        mDurableLedger = lcl;
+    }
+    mNotDurableLedgers.set_count(lcl - mDurableLedger);
+
+    while (mRecoverableStates.size() > 1 &&
+           mRecoverableStates.front().currentLedger < mDurableLedger)
+    {
+        mRecoverableStates.pop_front();
+    }
+    mApp.getBucketManager().retainBuckets(std::vector<HistoryArchiveState>(
+        mRecoverableStates.begin(), mRecoverableStates.end()));
+}
+
 void
 LedgerManagerImpl::advanceLedgerPointers()
 {
@@ -660,7 +789,7 @@ LedgerManagerImpl::advanceLedgerPointers()
                           << mCurrentLedger->mHeader.ledgerSeq;
 }
 
-void
+HistoryArchiveState
 LedgerManagerImpl::closeLedgerHelper(LedgerDelta const& delta)
 {
     mLastCloseTime = mApp.timeNow();
@@ -695,5 +824,6 @@ LedgerManagerImpl::closeLedgerHelper(LedgerDelta const& delta)
                                        has.toString());
 
     advanceLedgerPointers();
+    return has;
 }
 }
@@ -5,6 +5,8 @@
 // of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
 #include "util/asio.h"
 
+#include <deque>
+#include <future>
 #include <string>
 #include "ledger/LedgerManager.h"
 #include "ledger/LedgerHeaderFrame.h"
@@ -37,24 +39,38 @@ class LedgerManagerImpl : public LedgerManager
 
     Application& mApp;
     medida::Timer& mTransactionApply;
+    medida::Timer& mPrefetch;
     medida::Timer& mLedgerClose;
+    medida::Timer& mPersistWait;
     medida::Counter& mSyncingLedgersSize;
+    medida::Counter& mNotDurableLedgers;
 
     uint64_t mLastCloseTime;
 
     std::vector<LedgerCloseData> mSyncingLedgers;
 
+    // Ledgers made durable in the background (Config::LEDGER_PERSIST_DEPTH):
+    // the job making the commits so far durable, and the LCL it started at.
+    std::future<bool> mPersisting;
+    uint32_t mPersistingLedger{0};
+    uint32_t mDurableLedger{0};
+    // The bucket list states the database may come back to after a crash:
+    // those of the last durable ledger and of the ledgers closed since.
+    std::deque<HistoryArchiveState> mRecoverableStates;
+
     void historyCaughtup(asio::error_code const& ec,
                          HistoryManager::CatchupMode mode,
                          LedgerHeaderHistoryEntry const& lastClosed);
 
-    void closeLedgerHelper(LedgerDelta const& delta);
+    HistoryArchiveState closeLedgerHelper(LedgerDelta const& delta);
+    void persistLedger(HistoryArchiveState const& has);
     void advanceLedgerPointers();
 
     State mState;
 
   public:
     LedgerManagerImpl(Application& app);
+    ~LedgerManagerImpl();
 
     void setState(State s) override;
     State getState() const override;
@@ -7,12 +7,19 @@
 #include "main/test.h"
 #include "main/Config.h"
 #include "lib/catch.hpp"
+#include "crypto/SecretKey.h"
 #include "database/Database.h"
 #include "ledger/LedgerDelta.h"
 #include "ledger/LedgerManager.h"
+#include "ledger/AccountFrame.h"
 #include "ledger/EntryFrame.h"
+#include "ledger/OfferFrame.h"
+#include "ledger/TrustFrame.h"
 #include "util/Logging.h"
 #include "util/types.h"
+#include "medida/meter.h"
+#include "medida/metrics_registry.h"
+#include "medida/timer.h"
 #include <xdrpp/autocheck.h>
 
 using namespace stellar;
@@ -124,3 +131,790 @@ TEST_CASE("single ledger entry insert SQL", "[singlesql][entrysql][hide]")
     auto ctx = db.captureAndLogSQL("ledger-insert");
     le->storeAddOrChange(delta, db);
 }
+
+TEST_CASE("Ledger entry cache", "[ledger][entrycache]")
+{
+    Config cfg(getTestConfig());
+    cfg.ENTRY_CACHE_SIZE = 4;
+    VirtualClock clock;
+    Application::pointer app = Application::create(clock, cfg);
+    app->start();
+
+    auto& db = app->getDatabase();
+    auto& hits =
+        app->getMetrics().NewMeter({"ledger", "account", "cache-hit"}, "entry");
+    auto& evictions = app->getMetrics().NewMeter(
+        {"ledger", "account", "cache-evict"}, "entry");
+    LedgerHeader header(app->getLedgerManager().getCurrentLedgerHeader());
+
+    AccountFrame acc(SecretKey::random().getPublicKey());
+    acc.getAccount().balance = 1000;
+    {
+        LedgerDelta ledgerDelta(header, db);
+        LedgerDelta txDelta(ledgerDelta);
+        acc.storeAdd(txDelta, db);
+        txDelta.commit();
+        ledgerDelta.commit();
+    }
+
+    // the committed ledger put the account in the cache: loads no longer
+    // look at the table
+    AccountFrame loaded;
+    auto before = hits.count();
+    REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+    REQUIRE(hits.count() == before + 1);
+    REQUIRE(loaded.getBalance() == 1000);
+    db.getSession() << "DELETE FROM Accounts";
+    REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+    db.getEntryCache().invalidateAll();
+    REQUIRE(!AccountFrame::loadAccount(acc.getID(), loaded, db));
+
+    SECTION("rolled back changes are never cached")
+    {
+        LedgerDelta ledgerDelta(header, db);
+        acc.storeAdd(ledgerDelta, db);
+        {
+            soci::transaction sqlTx(db.getSession());
+            LedgerDelta txDelta(ledgerDelta);
+            acc.getAccount().balance = 2000;
+            acc.storeChange(txDelta, db);
+            REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+            REQUIRE(loaded.getBalance() == 2000);
+            txDelta.rollback();
+        }
+        before = hits.count();
+        REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+        REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+        REQUIRE(hits.count() == before);
+        REQUIRE(loaded.getBalance() == 1000);
+
+        ledgerDelta.commit();
+        REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+        REQUIRE(hits.count() == before + 1);
+        REQUIRE(loaded.getBalance() == 1000);
+    }
+
+    SECTION("deletes are cached as missing entries")
+    {
+        {
+            LedgerDelta ledgerDelta(header, db);
+            acc.storeAdd(ledgerDelta, db);
+            ledgerDelta.commit();
+        }
+        {
+            LedgerDelta ledgerDelta(header, db);
+            acc.storeDelete(ledgerDelta, db);
+            ledgerDelta.commit();
+        }
+        before = hits.count();
+        REQUIRE(!AccountFrame::exists(db, acc.getKey()));
+        REQUIRE(hits.count() == before + 1);
+    }
+
+    SECTION("each entry type is bounded")
+    {
+        LedgerDelta ledgerDelta(header, db);
+        before = evictions.count();
+        for (int i = 0; i < 10; ++i)
+        {
+            AccountFrame other(SecretKey::random().getPublicKey());
+            other.storeAdd(ledgerDelta, db);
+        }
+        ledgerDelta.commit();
+        REQUIRE(evictions.count() == before + 6);
+    }
+}
+
+TEST_CASE("Deferred ledger writes", "[ledger][deferwrites]")
+{
+    Config cfg(getTestConfig());
+    cfg.DEFER_LEDGER_WRITES = true;
+    VirtualClock clock;
+    Application::pointer app = Application::create(clock, cfg);
+    app->start();
+
+    auto& db = app->getDatabase();
+    LedgerHeader header(app->getLedgerManager().getCurrentLedgerHeader());
+    auto countRows = [&db](std::string const& table)
+    {
+        int n = 0;
+        db.getSession() << "SELECT count(*) FROM " << table, soci::into(n);
+        return n;
+    };
+    int accounts = countRows("Accounts");
+
+    AccountFrame acc(SecretKey::random().getPublicKey());
+    acc.getAccount().balance = 1000;
+
+    TrustFrame line;
+    line.getTrustLine().accountID = acc.getID();
+    line.getTrustLine().currency.type(CURRENCY_TYPE_ALPHANUM);
+    line.getTrustLine().currency.alphaNum().issuer =
+        SecretKey::random().getPublicKey();
+    strToCurrencyCode(line.getTrustLine().currency.alphaNum().currencyCode,
+                      "USD");
+    line.getTrustLine().limit = 100;
+
+    OfferFrame offer;
+    offer.getOffer().accountID = acc.getID();
+    offer.getOffer().offerID = 1;
+    offer.getOffer().takerGets.type(CURRENCY_TYPE_NATIVE);
+    offer.getOffer().takerPays = line.getTrustLine().currency;
+    offer.getOffer().amount = 10;
+    offer.getOffer().price.n = 1;
+    offer.getOffer().price.d = 1;
+
+    AccountFrame loaded;
+    std::vector<TrustFrame> lines;
+    std::vector<OfferFrame> offers;
+
+    SECTION("changes are seen by loads, and written when the ledger closes")
+    {
+        LedgerDelta ledgerDelta(header, db, true);
+        acc.storeAdd(ledgerDelta, db);
+        line.storeAdd(ledgerDelta, db);
+        offer.storeAdd(ledgerDelta, db);
+
+        REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+        REQUIRE(loaded.getBalance() == 1000);
+        TrustFrame::loadLines(acc.getID(), lines, db);
+        REQUIRE(lines.size() == 1);
+        OfferFrame::loadOffers(acc.getID(), offers, db);
+        REQUIRE(offers.size() == 1);
+        offers.clear();
+        OfferFrame::loadBestOffers(5, nullptr, offer.getOffer().takerPays,
+                                   offer.getOffer().takerGets, offers, db);
+        REQUIRE(offers.size() == 1);
+        REQUIRE(countRows("Accounts") == accounts);
+        REQUIRE(countRows("TrustLines") == 0);
+        REQUIRE(countRows("Offers") == 0);
+
+        {
+            LedgerDelta txDelta(ledgerDelta);
+            acc.getAccount().balance = 2000;
+            acc.storeChange(txDelta, db);
+            offer.storeDelete(txDelta, db);
+            REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+            REQUIRE(loaded.getBalance() == 2000);
+            REQUIRE(!OfferFrame::exists(db, offer.getKey()));
+            txDelta.rollback();
+        }
+        REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+        REQUIRE(loaded.getBalance() == 1000);
+        REQUIRE(OfferFrame::exists(db, offer.getKey()));
+
+        ledgerDelta.commit();
+        REQUIRE(countRows("Accounts") == accounts + 1);
+        REQUIRE(countRows("TrustLines") == 1);
+        REQUIRE(countRows("Offers") == 1);
+
+        db.getEntryCache().invalidateAll();
+        REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+        REQUIRE(loaded.getBalance() == 1000);
+    }
+
+    SECTION("changed entries replace their rows")
+    {
+        {
+            LedgerDelta ledgerDelta(header, db, true);
+            acc.storeAdd(ledgerDelta, db);
+            line.storeAdd(ledgerDelta, db);
+            offer.storeAdd(ledgerDelta, db);
+            ledgerDelta.commit();
+        }
+        {
+            LedgerDelta ledgerDelta(header, db, true);
+            LedgerDelta txDelta(ledgerDelta);
+            acc.getAccount().balance = 3000;
+            acc.storeChange(txDelta, db);
+            line.getTrustLine().balance = 50;
+            line.storeChange(txDelta, db);
+            offer.storeDelete(txDelta, db);
+            txDelta.commit();
+
+            TrustFrame::loadLines(acc.getID(), lines, db);
+            REQUIRE(lines.size() == 1);
+            REQUIRE(lines[0].getBalance() == 50);
+            REQUIRE(TrustFrame::hasIssued(
+                line.getTrustLine().currency.alphaNum().issuer, db));
+            OfferFrame::loadOffers(acc.getID(), offers, db);
+            REQUIRE(offers.empty());
+            REQUIRE(countRows("Offers") == 1);
+            ledgerDelta.commit();
+        }
+        REQUIRE(countRows("Accounts") == accounts + 1);
+        REQUIRE(countRows("Offers") == 0);
+
+        db.getEntryCache().invalidateAll();
+        REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+        REQUIRE(loaded.getBalance() == 3000);
+        lines.clear();
+        TrustFrame::loadLines(acc.getID(), lines, db);
+        REQUIRE(lines.size() == 1);
+        REQUIRE(lines[0].getBalance() == 50);
+    }
+}
+
+TEST_CASE("Prefetch ledger entries", "[ledger][prefetch]")
+{
+    Config cfg(getTestConfig());
+    VirtualClock clock;
+    Application::pointer app = Application::create(clock, cfg);
+    app->start();
+
+    auto& db = app->getDatabase();
+    auto& accountHits =
+        app->getMetrics().NewMeter({"ledger", "account", "cache-hit"}, "entry");
+    auto& trustHits = app->getMetrics().NewMeter(
+        {"ledger", "trustline", "cache-hit"}, "entry");
+    LedgerHeader header(app->getLedgerManager().getCurrentLedgerHeader());
+
+    std::vector<AccountFrame> accounts;
+    std::set<LedgerKey, LedgerEntryIdCmp> keys;
+    {
+        LedgerDelta ledgerDelta(header, db);
+        for (int i = 0; i < 300; ++i)
+        {
+            AccountFrame acc(SecretKey::random().getPublicKey());
+            acc.getAccount().balance = 1000 + i;
+            acc.getAccount().numSubEntries = 1;
+            Signer signer(SecretKey::random().getPublicKey(), 1);
+            acc.getAccount().signers.push_back(signer);
+            acc.storeAdd(ledgerDelta, db);
+            accounts.push_back(acc);
+            keys.insert(acc.getKey());
+        }
+        ledgerDelta.commit();
+    }
+
+    TrustFrame line;
+    line.getTrustLine().accountID = accounts[0].getID();
+    line.getTrustLine().currency.type(CURRENCY_TYPE_ALPHANUM);
+    line.getTrustLine().currency.alphaNum().issuer = accounts[1].getID();
+    strToCurrencyCode(line.getTrustLine().currency.alphaNum().currencyCode,
+                      "USD");
+    line.getTrustLine().limit = 100;
+    {
+        LedgerDelta ledgerDelta(header, db);
+        line.storeAdd(ledgerDelta, db);
+        ledgerDelta.commit();
+    }
+    keys.insert(line.getKey());
+
+    AccountFrame missing(SecretKey::random().getPublicKey());
+    keys.insert(missing.getKey());
+
+    // empty the cache, and let the next ledger make it usable again
+    db.getEntryCache().invalidateAll();
+    {
+        LedgerDelta ledgerDelta(header, db);
+        ledgerDelta.commit();
+    }
+    EntryFrame::prefetch(db, keys);
+
+    auto before = accountHits.count();
+    AccountFrame loaded;
+    for (auto const& acc : accounts)
+    {
+        REQUIRE(AccountFrame::loadAccount(acc.getID(), loaded, db));
+        REQUIRE(loaded.getBalance() == acc.getBalance());
+        REQUIRE(loaded.getAccount().signers.size() == 1);
+        REQUIRE(loaded.getAccount().signers[0].pubKey ==
+                acc.getAccount().signers[0].pubKey);
+    }
+    REQUIRE(!AccountFrame::loadAccount(missing.getID(), loaded, db));
+    REQUIRE(accountHits.count() == before + accounts.size() + 1);
+
+    before = trustHits.count();
+    TrustFrame loadedLine;
+    REQUIRE(TrustFrame::loadTrustLine(accounts[0].getID(),
+                                      line.getTrustLine().currency,
+                                      loadedLine, db));
+    REQUIRE(loadedLine.getTrustLine().limit == 100);
+    REQUIRE(trustHits.count() == before + 1);
+}
+
+TEST_CASE("In-memory order book", "[ledger][orderbook]")
+{
+    Config cfg(getTestConfig());
+    VirtualClock clock;
+    Application::pointer app = Application::create(clock, cfg);
+    app->start();
+
+    auto& db = app->getDatabase();
+    auto& loads =
+        app->getMetrics().NewMeter({"ledger", "orderbook", "load"}, "pair");
+    LedgerHeader header(app->getLedgerManager().getCurrentLedgerHeader());
+
+    Currency native;
+    native.type(CURRENCY_TYPE_NATIVE);
+    Currency usd;
+    usd.type(CURRENCY_TYPE_ALPHANUM);
+    usd.alphaNum().issuer = SecretKey::random().getPublicKey();
+    strToCurrencyCode(usd.alphaNum().currencyCode, "USD");
+
+    auto makeOffer = [&](uint64 offerID, int32 priceN)
+    {
+        OfferFrame offer;
+        offer.getOffer().accountID = SecretKey::random().getPublicKey();
+        offer.getOffer().offerID = offerID;
+        offer.getOffer().takerGets = native;
+        offer.getOffer().takerPays = usd;
+        offer.getOffer().amount = 10;
+        offer.getOffer().price.n = priceN;
+        offer.getOffer().price.d = 1;
+        return offer;
+    };
+    auto bestOfferIDs = [&]()
+    {
+        std::vector<OfferFrame> offers;
+        OfferFrame::loadBestOffers(5, nullptr, usd, native, offers, db);
+        std::vector<uint64> ids;
+        for (auto const& of : offers)
+        {
+            ids.push_back(of.getOfferID());
+        }
+        return ids;
+    };
+
+    OfferFrame o1 = makeOffer(1, 2);
+    OfferFrame o2 = makeOffer(2, 1);
+    {
+        LedgerDelta ledgerDelta(header, db);
+        o1.storeAdd(ledgerDelta, db);
+        o2.storeAdd(ledgerDelta, db);
+        ledgerDelta.commit();
+    }
+
+    // the pair is loaded once, then crossed from memory
+    auto before = loads.count();
+    REQUIRE(bestOfferIDs() == std::vector<uint64>({2, 1}));
+    REQUIRE(loads.count() == before + 1);
+    REQUIRE(bestOfferIDs() == std::vector<uint64>({2, 1}));
+    REQUIRE(loads.count() == before + 1);
+
+    {
+        // offers written while the ledger closes are merged into the book
+        LedgerDelta ledgerDelta(header, db);
+        o1.getOffer().price.d = 4;
+        o1.storeChange(ledgerDelta, db);
+        OfferFrame o3 = makeOffer(3, 3);
+        o3.storeAdd(ledgerDelta, db);
+        REQUIRE(bestOfferIDs() == std::vector<uint64>({1, 2, 3}));
+        REQUIRE(loads.count() == before + 1);
+        ledgerDelta.commit();
+    }
+    REQUIRE(bestOfferIDs() == std::vector<uint64>({1, 2, 3}));
+    REQUIRE(loads.count() == before + 1);
+
+    {
+        // and a closed ledger updates the pairs held
+        LedgerDelta ledgerDelta(header, db);
+        o2.storeDelete(ledgerDelta, db);
+        ledgerDelta.commit();
+    }
+    REQUIRE(bestOfferIDs() == std::vector<uint64>({1, 3}));
+    REQUIRE(loads.count() == before + 1);
+
+    {
+        // changes undone are forgotten
+        LedgerDelta ledgerDelta(header, db);
+        {
+            soci::transaction sqlTx(db.getSession());
+            LedgerDelta txDelta(ledgerDelta);
+            makeOffer(4, 1).storeAdd(txDelta, db);
+            REQUIRE(bestOfferIDs() == std::vector<uint64>({1, 4, 3}));
+            txDelta.rollback();
+        }
+        REQUIRE(bestOfferIDs() == std::vector<uint64>({1, 3}));
+        ledgerDelta.commit();
+    }
+    REQUIRE(bestOfferIDs() == std::vector<uint64>({1, 3}));
+    REQUIRE(loads.count() == before + 2);
+
+    {
+        // offers written outside of a ledger close are read from the table
+        // until the next one
+        LedgerDelta delta(header);
+        makeOffer(4, 1).storeAdd(delta, db);
+        REQUIRE(bestOfferIDs() == std::vector<uint64>({1, 4, 3}));
+        REQUIRE(loads.count() == before + 2);
+    }
+    {
+        LedgerDelta ledgerDelta(header, db);
+        ledgerDelta.commit();
+    }
+    REQUIRE(bestOfferIDs() == std::vector<uint64>({1, 4, 3}));
+    REQUIRE(loads.count() == before + 3);
+
+    // a ledger crossing more offers of a pair than a page holds pages through
+    // them in memory
+    {
+        LedgerDelta ledgerDelta(header, db);
+        for (uint64 id = 5; id <= 10; ++id)
+        {
+            makeOffer(id, 5).storeAdd(ledgerDelta, db);
+        }
+        ledgerDelta.commit();
+    }
+    REQUIRE(bestOfferIDs().size() == 5);
+    before = loads.count();
+    auto& selects =
+        app->getMetrics().NewTimer({"database", "select", "offer"});
+    auto selectsBefore = selects.count();
+    {
+        LedgerDelta ledgerDelta(header, db);
+        // as OfferExchange does: each offer of a page is taken by a
+        // transaction of its own
+        std::vector<uint64> taken;
+        OfferFrame::Position cursor;
+        OfferFrame::Position const* after = nullptr;
+        for (;;)
+        {
+            std::vector<OfferFrame> offers;
+            OfferFrame::loadBestOffers(5, after, usd, native, offers, db);
+            for (auto const& of : offers)
+            {
+                soci::transaction sqlTx(db.getSession());
+                LedgerDelta txDelta(ledgerDelta);
+                of.storeDelete(txDelta, db);
+                txDelta.commit();
+                sqlTx.commit();
+                taken.push_back(of.getOfferID());
+            }
+            if (offers.size() < 5)
+            {
+                break;
+            }
+            cursor = offers.back().getPosition();
+            after = &cursor;
+        }
+        REQUIRE(taken ==
+                std::vector<uint64>({1, 4, 3, 5, 6, 7, 8, 9, 10}));
+        REQUIRE(bestOfferIDs().empty());
+        ledgerDelta.commit();
+    }
+    REQUIRE(bestOfferIDs().empty());
+    REQUIRE(loads.count() == before);
+    REQUIRE(selects.count() == selectsBefore);
+}
+
+TEST_CASE("Paging offers changed by the ledger being closed",
+          "[ledger][orderbook][deferwrites]")
+{
+    Config cfg(getTestConfig());
+    cfg.DEFER_LEDGER_WRITES = true;
+    VirtualClock clock;
+    Application::pointer app = Application::create(clock, cfg);
+    app->start();
+
+    auto& db = app->getDatabase();
+    auto& loads =
+        app->getMetrics().NewMeter({"ledger", "orderbook", "load"}, "pair");
+    LedgerHeader header(app->getLedgerManager().getCurrentLedgerHeader());
+
+    Currency native;
+    native.type(CURRENCY_TYPE_NATIVE);
+    Currency usd;
+    usd.type(CURRENCY_TYPE_ALPHANUM);
+    usd.alphaNum().issuer = SecretKey::random().getPublicKey();
+    strToCurrencyCode(usd.alphaNum().currencyCode, "USD");
+
+    auto makeOffer = [&](uint64 offerID, int32 priceN, Currency const& pays)
+    {
+        OfferFrame offer;
+        offer.getOffer().accountID = SecretKey::random().getPublicKey();
+        offer.getOffer().offerID = offerID;
+        offer.getOffer().takerGets = native;
+        offer.getOffer().takerPays = pays;
+        offer.getOffer().amount = 10;
+        offer.getOffer().price.n = priceN;
+        offer.getOffer().price.d = 1;
+        return offer;
+    };
+    // all the offers taking USD, three at a time
+    auto pagedOfferIDs = [&]()
+    {
+        std::vector<uint64> ids;
+        OfferFrame::Position cursor;
+        OfferFrame::Position const* after = nullptr;
+        for (;;)
+        {
+            std::vector<OfferFrame> offers;
+            OfferFrame::loadBestOffers(3, after, usd, native, offers, db);
+            for (auto const& of : offers)
+            {
+                ids.push_back(of.getOfferID());
+            }
+            if (offers.size() < 3)
+            {
+                return ids;
+            }
+            cursor = offers.back().getPosition();
+            after = &cursor;
+        }
+    };
+
+    std::vector<OfferFrame> committed;
+    {
+        LedgerDelta ledgerDelta(header, db, true);
+        for (uint64 id = 1; id <= 7; ++id)
+        {
+            committed.push_back(makeOffer(id, static_cast<int32>(id), usd));
+            committed.back().storeAdd(ledgerDelta, db);
+        }
+        ledgerDelta.commit();
+    }
+
+    auto before = loads.count();
+    REQUIRE(pagedOfferIDs() == std::vector<uint64>({1, 2, 3, 4, 5, 6, 7}));
+    REQUIRE(loads.count() == before + 1);
+
+    SECTION("pages merge the pending offers of the pair into the book")
+    {
+        LedgerDelta ledgerDelta(header, db, true);
+        LedgerDelta txDelta(ledgerDelta);
+        committed[1].storeDelete(txDelta, db);
+        committed[5].getOffer().price.n = 1;
+        committed[5].getOffer().price.d = 2;
+        committed[5].storeChange(txDelta, db);
+        makeOffer(8, 3, usd).storeAdd(txDelta, db);
+        Currency eur = usd;
+        strToCurrencyCode(eur.alphaNum().currencyCode, "EUR");
+        makeOffer(9, 1, eur).storeAdd(txDelta, db);
+        txDelta.commit();
+
+        REQUIRE(pagedOfferIDs() == std::vector<uint64>({6, 1, 3, 8, 4, 5, 7}));
+        REQUIRE(loads.count() == before + 1);
+        ledgerDelta.commit();
+        REQUIRE(pagedOfferIDs() == std::vector<uint64>({6, 1, 3, 8, 4, 5, 7}));
+        REQUIRE(loads.count() == before + 1);
+    }
+
+    SECTION("rolled back changes are not paged")
+    {
+        LedgerDelta ledgerDelta(header, db, true);
+        {
+            LedgerDelta txDelta(ledgerDelta);
+            committed[0].storeDelete(txDelta, db);
+            makeOffer(8, 3, usd).storeAdd(txDelta, db);
+            txDelta.rollback();
+        }
+        REQUIRE(pagedOfferIDs() == std::vector<uint64>({1, 2, 3, 4, 5, 6, 7}));
+    }
+
+    SECTION("pages read from the table skip the pending offers")
+    {
+        db.getOrderBook().invalidateAll();
+        LedgerDelta ledgerDelta(header, db, true);
+        for (size_t i = 0; i < 4; ++i)
+        {
+            committed[i].storeDelete(ledgerDelta, db);
+        }
+        REQUIRE(pagedOfferIDs() == std::vector<uint64>({5, 6, 7}));
+        REQUIRE(loads.count() == before + 1);
+    }
+}
+
+TEST_CASE("Nested ledger deltas", "[ledger][delta]")
+{
+    Config cfg(getTestConfig());
+    VirtualClock clock;
+    Application::pointer app = Application::create(clock, cfg);
+    app->start();
+
+    LedgerHeader header(app->getLedgerManager().getCurrentLedgerHeader());
+    AccountFrame a(SecretKey::random().getPublicKey());
+    AccountFrame b(SecretKey::random().getPublicKey());
+    AccountFrame c(SecretKey::random().getPublicKey());
+    a.getAccount().balance = 1;
+    b.getAccount().balance = 2;
+
+    LedgerDelta ledgerDelta(header);
+    ledgerDelta.addEntry(a);
+    ledgerDelta.modEntry(b);
+
+    SECTION("changes are relative to the delta they are made in")
+    {
+        LedgerDelta txDelta(ledgerDelta);
+        {
+            LedgerDelta opDelta(txDelta);
+            // delete + new is an update, new + delete nothing
+            opDelta.deleteEntry(a);
+            a.getAccount().balance = 10;
+            opDelta.addEntry(a);
+            opDelta.addEntry(c);
+            opDelta.deleteEntry(c);
+            opDelta.deleteEntry(b);
+            opDelta.commit();
+        }
+        txDelta.commit();
+
+        auto live = txDelta.getLiveEntries();
+        REQUIRE(live.size() == 1);
+        REQUIRE(live[0].account().balance == 10);
+        REQUIRE(txDelta.getDeadEntries().size() == 1);
+
+        // while in the ledger a is still new
+        auto ledgerLive = ledgerDelta.getLiveEntries();
+        REQUIRE(ledgerLive.size() == 1);
+        REQUIRE(ledgerLive[0].account().balance == 10);
+        ledgerDelta.commit();
+    }
+
+    SECTION("rolled back and abandoned deltas undo their changes")
+    {
+        {
+            LedgerDelta txDelta(ledgerDelta);
+            txDelta.deleteEntry(a);
+            txDelta.addEntry(c);
+            LedgerDelta opDelta(txDelta);
+            b.getAccount().balance = 20;
+            opDelta.modEntry(b);
+            opDelta.rollback();
+            REQUIRE(txDelta.getLiveEntries().size() == 1);
+            REQUIRE(txDelta.getDeadEntries().size() == 1);
+        }
+        auto live = ledgerDelta.getLiveEntries();
+        REQUIRE(live.size() == 2);
+        for (auto const& e : live)
+        {
+            REQUIRE(e.account().balance ==
+                    (e.account().accountID == a.getID() ? 1 : 2));
+        }
+        REQUIRE(ledgerDelta.getDeadEntries().empty());
+    }
+}
+
+TEST_CASE("Inflation vote tally", "[ledger][inflation]")
+{
+    for (bool defer : {false, true})
+    {
+        Config cfg(getTestConfig());
+        cfg.DEFER_LEDGER_WRITES = defer;
+        VirtualClock clock;
+        Application::pointer app = Application::create(clock, cfg);
+        app->start();
+
+        auto& db = app->getDatabase();
+        auto& tally = db.getInflationTally();
+        LedgerHeader header(app->getLedgerManager().getCurrentLedgerHeader());
+
+        std::vector<AccountID> dests;
+        for (int i = 0; i < 4; ++i)
+        {
+            dests.push_back(SecretKey::random().getPublicKey());
+        }
+        std::vector<AccountFrame> accounts;
+        for (int i = 0; i < 20; ++i)
+        {
+            AccountFrame acc(SecretKey::random().getPublicKey());
+            acc.getAccount().balance = (i + 1) * 300000000LL;
+            acc.getAccount().inflationDest.activate() = dests[i % 4];
+            accounts.push_back(acc);
+        }
+
+        auto winners = [&]()
+        {
+            std::vector<std::pair<int64, AccountID>> w;
+            AccountFrame::processForInflation(
+                [&](AccountFrame::InflationVotes const& v)
+                {
+                    w.emplace_back(v.mVotes, v.mInflationDest);
+                    return true;
+                },
+                3, db);
+            return w;
+        };
+        // the winners by the accounts' current state: ties go to the
+        // greatest key
+        auto expected = [&]()
+        {
+            std::map<AccountID, int64> votes;
+            for (auto const& acc : accounts)
+            {
+                auto const& a = acc.getAccount();
+                if (a.inflationDest &&
+                    a.balance >= InflationTally::kMinVoterBalance)
+                {
+                    votes[*a.inflationDest] += a.balance;
+                }
+            }
+            std::vector<std::pair<int64, AccountID>> w;
+            for (auto const& v : votes)
+            {
+                w.emplace_back(v.second, v.first);
+            }
+            std::sort(w.begin(), w.end(),
+                      std::greater<std::pair<int64, AccountID>>());
+            w.resize(std::min<size_t>(w.size(), 3));
+            return w;
+        };
+
+        {
+            LedgerDelta ledgerDelta(header, db, defer);
+            for (auto const& acc : accounts)
+            {
+                acc.storeAdd(ledgerDelta, db);
+            }
+            ledgerDelta.commit();
+        }
+        // the first ledger closed tallies the votes
+        REQUIRE(tally.isHeld());
+        REQUIRE(winners() == expected());
+
+        {
+            LedgerDelta ledgerDelta(header, db, defer);
+            accounts[3].getAccount().balance += 5000000000LL;
+            accounts[3].storeChange(ledgerDelta, db);
+            accounts[5].getAccount().inflationDest.activate() = dests[2];
+            accounts[5].storeChange(ledgerDelta, db);
+            accounts[6].getAccount().inflationDest.reset();
+            accounts[6].storeChange(ledgerDelta, db);
+            accounts[7].storeDelete(ledgerDelta, db);
+            accounts.erase(accounts.begin() + 7);
+            AccountFrame added(SecretKey::random().getPublicKey());
+            added.getAccount().balance = 7000000000LL;
+            added.getAccount().inflationDest.activate() = dests[3];
+            added.storeAdd(ledgerDelta, db);
+            accounts.push_back(added);
+            {
+                soci::transaction sqlTx(db.getSession());
+                LedgerDelta txDelta(ledgerDelta);
+                AccountFrame abandoned = accounts[8];
+                abandoned.getAccount().balance = 90000000000LL;
+                abandoned.storeChange(txDelta, db);
+            }
+
+            // changes of the ledger being closed are counted
+            REQUIRE(winners() == expected());
+            ledgerDelta.commit();
+        }
+        REQUIRE(winners() == expected());
+
+        // and agree with a scan of the table
+        tally.invalidateAll();
+        REQUIRE(!tally.isHeld());
+        REQUIRE(winners() == expected());
+
+        // destinations with equal votes rank the same way on every path
+        {
+            LedgerDelta ledgerDelta(header, db, defer);
+            for (int i = 0; i < 3; ++i)
+            {
+                AccountFrame tied(SecretKey::random().getPublicKey());
+                tied.getAccount().balance = 100000000000LL;
+                tied.getAccount().inflationDest.activate() =
+                    SecretKey::random().getPublicKey();
+                tied.storeAdd(ledgerDelta, db);
+                accounts.push_back(tied);
+            }
+            REQUIRE(winners() == expected());
+            ledgerDelta.commit();
+        }
+        REQUIRE(tally.isHeld());
+        REQUIRE(winners() == expected());
+        tally.invalidateAll();
+        REQUIRE(winners() == expected());
+    }
+}
@@ -4,11 +4,14 @@
 
 #include "ledger/OfferFrame.h"
 #include "transactions/OperationFrame.h"
+#include "database/BulkInserter.h"
 #include "database/Database.h"
-#include "crypto/Base58.h"
 #include "crypto/SHA.h"
 #include "LedgerDelta.h"
+#include "util/make_unique.h"
 #include "util/types.h"
+#include <algorithm>
+#include <sstream>
 
 using namespace std;
 using namespace soci;
@@ -18,12 +21,12 @@ namespace stellar
 const char* OfferFrame::kSQLCreateStatement1 =
     "CREATE TABLE Offers"
     "("
-    "accountID       VARCHAR(51)  NOT NULL,"
+    "accountID       CHARACTER(44) NOT NULL,"
     "offerID         BIGINT       NOT NULL CHECK (offerID >= 0),"
     "paysAlphaNumCurrency VARCHAR(4)   NOT NULL,"
-    "paysIssuer      VARCHAR(51)  NOT NULL,"
+    "paysIssuer      CHARACTER(44) NOT NULL,"
     "getsAlphaNumCurrency VARCHAR(4)   NOT NULL,"
-    "getsIssuer      VARCHAR(51)  NOT NULL,"
+    "getsIssuer      CHARACTER(44) NOT NULL,"
     "amount          BIGINT       NOT NULL CHECK (amount >= 0),"
     "priceN          INT          NOT NULL,"
     "priceD          INT          NOT NULL,"
@@ -31,15 +34,6 @@ const char* OfferFrame::kSQLCreateStatement1 =
     "PRIMARY KEY (offerID)"
     ");";
 
-const char* OfferFrame::kSQLCreateStatement2 =
-    "CREATE INDEX paysIssuerIndex ON Offers (paysIssuer);";
-
-const char* OfferFrame::kSQLCreateStatement3 =
-    "CREATE INDEX getsIssuerIndex ON Offers (getsIssuer);";
-
-const char* OfferFrame::kSQLCreateStatement4 =
-    "CREATE INDEX priceIndex ON Offers (price);";
-
 OfferFrame::OfferFrame() : EntryFrame(OFFER), mOffer(mEntry.offer())
 {
 }
@@ -121,8 +115,24 @@ bool
 OfferFrame::loadOffer(AccountID const& accountID, uint64_t offerID,
                       OfferFrame& retOffer, Database& db)
 {
+    LedgerKey key;
+    key.type(OFFER);
+    key.offer().accountID = accountID;
+    key.offer().offerID = offerID;
+    LedgerEntryCache& cache = db.getEntryCache();
+    std::shared_ptr<LedgerEntry const> cached;
+    if (lookupEntry(db, key, cached))
+    {
+        if (!cached)
+        {
+            return false;
+        }
+        retOffer = OfferFrame(*cached);
+        return true;
+    }
+
     std::string accStr;
-    accStr = toBase58Check(VER_ACCOUNT_ID, accountID);
+    accStr = toSQLKey(accountID);
 
     soci::session& session = db.getSession();
 
@@ -141,6 +151,8 @@ OfferFrame::loadOffer(AccountID const& accountID, uint64_t offerID,
                    res = true;
                });
 
+    cache.put(key, res ? std::make_shared<LedgerEntry const>(retOffer.mEntry)
+                       : nullptr);
     return res;
 }
 
@@ -168,14 +180,13 @@ OfferFrame::loadOffers(soci::details::prepare_temp_type& prep,
     st.execute(true);
     while (st.got_data())
     {
-        oe.accountID = fromBase58Check256(VER_ACCOUNT_ID, accountID);
+        oe.accountID = fromSQLKey(accountID);
         if (paysAlphaNumIndicator == soci::i_ok)
         {
             oe.takerPays.type(CURRENCY_TYPE_ALPHANUM);
             strToCurrencyCode(oe.takerPays.alphaNum().currencyCode,
                               paysAlphaNumCurrency);
-            oe.takerPays.alphaNum().issuer =
-                fromBase58Check256(VER_ACCOUNT_ID, paysIssuer);
+            oe.takerPays.alphaNum().issuer = fromSQLKey(paysIssuer);
         }
         else
         {
@@ -186,8 +197,7 @@ OfferFrame::loadOffers(soci::details::prepare_temp_type& prep,
             oe.takerGets.type(CURRENCY_TYPE_ALPHANUM);
             strToCurrencyCode(oe.takerGets.alphaNum().currencyCode,
                               getsAlphaNumCurrency);
-            oe.takerGets.alphaNum().issuer =
-                fromBase58Check256(VER_ACCOUNT_ID, getsIssuer);
+            oe.takerGets.alphaNum().issuer = fromSQLKey(getsIssuer);
         }
         else
         {
@@ -200,17 +210,18 @@ OfferFrame::loadOffers(soci::details::prepare_temp_type& prep,
 }
 
 void
-OfferFrame::loadBestOffers(size_t numOffers, size_t offset,
-                           Currency const& pays, Currency const& gets,
-                           vector<OfferFrame>& retOffers, Database& db)
+OfferFrame::loadPairOffers(
+    Currency const& pays, Currency const& gets, size_t limit,
+    Position const* after, Database& db,
+    std::function<void(OfferFrame const&)> offerProcessor)
 {
     soci::session& session = db.getSession();
 
     soci::details::prepare_temp_type sql =
         (session.prepare << offerColumnSelector);
 
-    std::string getCurrencyCode, b58GIssuer;
-    std::string payCurrencyCode, b58PIssuer;
+    std::string getCurrencyCode, sqlGIssuer;
+    std::string payCurrencyCode, sqlPIssuer;
 
     if (pays.type() == CURRENCY_TYPE_NATIVE)
     {
@@ -219,9 +230,9 @@ OfferFrame::loadBestOffers(size_t numOffers, size_t offset,
     else
     {
         currencyCodeToStr(pays.alphaNum().currencyCode, payCurrencyCode);
-        b58PIssuer = toBase58Check(VER_ACCOUNT_ID, pays.alphaNum().issuer);
+        sqlPIssuer = toSQLKey(pays.alphaNum().issuer);
         sql << " WHERE paysAlphaNumCurrency=:pcur AND paysIssuer = :pi",
-            use(payCurrencyCode), use(b58PIssuer);
+            use(payCurrencyCode), use(sqlPIssuer);
     }
 
     if (gets.type() == CURRENCY_TYPE_NATIVE)
@@ -231,19 +242,131 @@ OfferFrame::loadBestOffers(size_t numOffers, size_t offset,
     else
     {
         currencyCodeToStr(gets.alphaNum().currencyCode, getCurrencyCode);
-        b58GIssuer = toBase58Check(VER_ACCOUNT_ID, gets.alphaNum().issuer);
+        sqlGIssuer = toSQLKey(gets.alphaNum().issuer);
 
         sql << " AND getsAlphaNumCurrency=:gcur AND getsIssuer = :gi",
-            use(getCurrencyCode), use(b58GIssuer);
+            use(getCurrencyCode), use(sqlGIssuer);
+    }
+    if (after)
+    {
+        sql << " AND (price > :p1 OR (price = :p2 AND offerID > :id))",
+            use(after->first), use(after->first), use(after->second);
+    }
+    sql << " ORDER BY price,offerID,accountID";
+    if (limit != 0)
+    {
+        sql << " LIMIT :n", use(limit);
     }
-    sql << " ORDER BY price,offerID,accountID LIMIT :n OFFSET :o",
-        use(numOffers), use(offset);
 
     auto timer = db.getSelectTimer("offer");
-    loadOffers(sql, [&retOffers](OfferFrame const& of)
-               {
-                   retOffers.push_back(of);
-               });
+    loadOffers(sql, offerProcessor);
+}
+
+void
+OfferFrame::loadBestOffers(size_t numOffers, Position const* after,
+                           Currency const& pays, Currency const& gets,
+                           vector<OfferFrame>& retOffers, Database& db)
+{
+    if (numOffers == 0)
+    {
+        return;
+    }
+
+    // offers changed by the ledger being closed replace their committed
+    // state: take the first committed offers of the page that are unchanged,
+    // and merge in the pending offers of the pair
+    vector<OfferFrame> offers;
+    auto addCommitted = [&offers, &db](OfferFrame const& of)
+    {
+        EntryFrame::pointer pending;
+        if (!LedgerDelta::getPendingEntry(db, of.getKey(), pending))
+        {
+            offers.push_back(of);
+        }
+    };
+
+    OrderBook& book = db.getOrderBook();
+    auto committed = book.getOffers(pays, gets);
+    if (!committed && book.canPutOffers(pays, gets))
+    {
+        std::vector<LedgerEntry> all;
+        loadPairOffers(pays, gets, 0, nullptr, db,
+                       [&all](OfferFrame const& of)
+                       {
+                           all.push_back(of.mEntry);
+                       });
+        committed = book.putOffers(pays, gets, all);
+    }
+
+    if (committed)
+    {
+        auto it = committed->begin();
+        if (after)
+        {
+            it = committed->upper_bound(*after);
+        }
+        for (; it != committed->end() && offers.size() < numOffers; ++it)
+        {
+            addCommitted(OfferFrame(it->second));
+        }
+    }
+    else
+    {
+        // page through the table until enough unchanged offers are found
+        Position from, last;
+        Position const* cursor = after;
+        for (;;)
+        {
+            size_t found = 0;
+            size_t wanted = numOffers - offers.size();
+            loadPairOffers(pays, gets, wanted, cursor, db,
+                           [&](OfferFrame const& of)
+                           {
+                               ++found;
+                               last = of.getPosition();
+                               addCommitted(of);
+                           });
+            if (found < wanted || offers.size() >= numOffers)
+            {
+                break;
+            }
+            from = last;
+            cursor = &from;
+        }
+    }
+
+    auto pendingKeys = book.getPending(pays, gets);
+    if (!pendingKeys)
+    {
+        retOffers.insert(retOffers.end(), offers.begin(), offers.end());
+        return;
+    }
+
+    for (auto const& k : *pendingKeys)
+    {
+        EntryFrame::pointer pending;
+        if (!LedgerDelta::getPendingEntry(db, k, pending) || !pending)
+        {
+            continue;
+        }
+        auto const& of = static_cast<OfferFrame const&>(*pending);
+        if (compareCurrency(of.mOffer.takerPays, pays) &&
+            compareCurrency(of.mOffer.takerGets, gets) &&
+            (!after || *after < of.getPosition()))
+        {
+            offers.push_back(of);
+        }
+    }
+    sort(offers.begin(), offers.end(),
+         [](OfferFrame const& a, OfferFrame const& b)
+         {
+             return a.getPosition() < b.getPosition();
+         });
+    if (offers.size() > numOffers)
+    {
+        offers.resize(numOffers);
+    }
+    retOffers.insert(retOffers.end(), offers.begin(), offers.end());
 }
 
 void
@@ -253,32 +376,109 @@ OfferFrame::loadOffers(AccountID const& accountID,
     soci::session& session = db.getSession();
 
     std::string accStr;
-    accStr = toBase58Check(VER_ACCOUNT_ID, accountID);
+    accStr = toSQLKey(accountID);
 
     soci::details::prepare_temp_type sql =
         (session.prepare << offerColumnSelector << " WHERE accountID=:id",
          use(accStr));
 
+    auto pending = LedgerDelta::getPendingEntries(db, OFFER);
+
     auto timer = db.getSelectTimer("offer");
-    loadOffers(sql, [&retOffers](OfferFrame const& of)
+    loadOffers(sql, [&retOffers, &pending](OfferFrame const& of)
                {
-                   retOffers.push_back(of);
+                   if (pending.find(LedgerEntryKey(of.mEntry)) ==
+                       pending.end())
+                   {
+                       retOffers.push_back(of);
+                   }
                });
+
+    for (auto const& p : pending)
+    {
+        if (p.second && p.first.offer().accountID == accountID)
+        {
+            retOffers.push_back(static_cast<OfferFrame const&>(*p.second));
+        }
+    }
+}
+
+void
+OfferFrame::loadIntoCache(Database& db, std::vector<LedgerKey> const& keys)
+{
+    std::ostringstream params;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        params << (i == 0 ? ":v" : ",:v") << i;
+    }
+
+    soci::session& session = db.getSession();
+    soci::details::prepare_temp_type sql =
+        (session.prepare << offerColumnSelector << " WHERE offerID IN ("
+                         << params.str() << ")");
+    for (auto const& k : keys)
+    {
+        sql, use(k.offer().offerID);
+    }
+
+    std::set<LedgerKey, LedgerEntryIdCmp> wanted(keys.begin(), keys.end());
+    LedgerEntryCache& cache = db.getEntryCache();
+    {
+        auto timer = db.getSelectTimer("offer-prefetch");
+        loadOffers(sql, [&wanted, &cache](OfferFrame const& of)
+                   {
+                       auto it = wanted.find(LedgerEntryKey(of.mEntry));
+                       if (it != wanted.end())
+                       {
+                           cache.put(*it, std::make_shared<LedgerEntry const>(
+                                              of.mEntry));
+                           wanted.erase(it);
+                       }
+                   });
+    }
+    for (auto const& k : wanted)
+    {
+        cache.put(k, nullptr);
+    }
 }
 
 bool
 OfferFrame::exists(Database& db, LedgerKey const& key)
 {
-    std::string b58AccountID =
-        toBase58Check(VER_ACCOUNT_ID, key.offer().accountID);
+    std::shared_ptr<LedgerEntry const> cached;
+    if (lookupEntry(db, key, cached))
+    {
+        return cached != nullptr;
+    }
+
+    std::string sqlAccountID = toSQLKey(key.offer().accountID);
     int exists = 0;
     auto timer = db.getSelectTimer("offer-exists");
     db.getSession() << "SELECT EXISTS (SELECT NULL FROM Offers \
              WHERE accountID=:id AND offerID=:s)",
-        use(b58AccountID), use(key.offer().offerID), into(exists);
+        use(sqlAccountID), use(key.offer().offerID), into(exists);
     return exists != 0;
 }
 
+// The offer `key` is being given the state `entry` (null if deleted) through
+// `delta`. Changes made by the ledger being closed are merged into the order
+// book by loads until it commits and refreshes the book; others make the
+// book forget the pairs of the offer.
+static void
+updateOrderBook(LedgerDelta& delta, Database& db, LedgerKey const& key,
+                LedgerEntry const* entry)
+{
+    OrderBook& book = db.getOrderBook();
+    if (!delta.isOpenIn(db))
+    {
+        book.invalidate(key, entry);
+    }
+    else if (entry)
+    {
+        book.addPending(key, *entry);
+    }
+}
+
 void
 OfferFrame::storeDelete(LedgerDelta& delta, Database& db) const
 {
@@ -288,6 +488,15 @@ OfferFrame::storeDelete(LedgerDelta& delta, Database& db) const
 void
 OfferFrame::storeDelete(LedgerDelta& delta, Database& db, LedgerKey const& key)
 {
+    updateOrderBook(delta, db, key, nullptr);
+    if (delta.defersWrites())
+    {
+        delta.deleteEntry(key);
+        return;
+    }
+
+    db.getEntryCache().invalidate(key);
+
     auto timer = db.getDeleteTimer("offer");
 
     db.getSession() << "DELETE FROM Offers WHERE offerID=:s",
@@ -302,9 +511,23 @@ OfferFrame::computePrice() const
     return bigDivide(mOffer.price.n, OFFER_PRICE_DIVISOR, mOffer.price.d);
 }
 
+OfferFrame::Position
+OfferFrame::getPosition() const
+{
+    return std::make_pair(computePrice(), mOffer.offerID);
+}
+
 void
 OfferFrame::storeChange(LedgerDelta& delta, Database& db) const
 {
+    updateOrderBook(delta, db, getKey(), &mEntry);
+    if (delta.defersWrites())
+    {
+        delta.modEntry(*this);
+        return;
+    }
+
+    db.getEntryCache().invalidate(getKey());
 
     auto timer = db.getUpdateTimer("offer");
 
@@ -327,7 +550,16 @@ OfferFrame::storeChange(LedgerDelta& delta, Database& db) const
 void
 OfferFrame::storeAdd(LedgerDelta& delta, Database& db) const
 {
-    std::string b58AccountID = toBase58Check(VER_ACCOUNT_ID, mOffer.accountID);
+    updateOrderBook(delta, db, getKey(), &mEntry);
+    if (delta.defersWrites())
+    {
+        delta.addEntry(*this);
+        return;
+    }
+
+    db.getEntryCache().invalidate(getKey());
+
+    std::string sqlAccountID = toSQLKey(mOffer.accountID);
 
     soci::statement st(db.getSession().prepare << "select 1");
 
@@ -335,8 +567,7 @@ OfferFrame::storeAdd(LedgerDelta& delta, Database& db) const
 
     if (mOffer.takerGets.type() == CURRENCY_TYPE_NATIVE)
     {
-        std::string b58issuer =
-            toBase58Check(VER_ACCOUNT_ID, mOffer.takerPays.alphaNum().issuer);
+        std::string sqlIssuer = toSQLKey(mOffer.takerPays.alphaNum().issuer);
         std::string currencyCode;
         currencyCodeToStr(mOffer.takerPays.alphaNum().currencyCode,
                           currencyCode);
@@ -345,15 +576,14 @@ OfferFrame::storeAdd(LedgerDelta& delta, Database& db) const
                      "(accountID,offerID,paysAlphaNumCurrency,paysIssuer,"
                      "amount,priceN,priceD,price) values"
                      "(:v1,:v2,:v3,:v4,:v5,:v6,:v7,:v8)",
-              use(b58AccountID), use(mOffer.offerID), use(b58issuer),
-              use(currencyCode), use(mOffer.amount), use(mOffer.price.n),
+              use(sqlAccountID), use(mOffer.offerID), use(currencyCode),
+              use(sqlIssuer), use(mOffer.amount), use(mOffer.price.n),
               use(mOffer.price.d), use(computePrice()));
         st.execute(true);
     }
     else if (mOffer.takerPays.type() == CURRENCY_TYPE_NATIVE)
     {
-        std::string b58issuer =
-            toBase58Check(VER_ACCOUNT_ID, mOffer.takerGets.alphaNum().issuer);
+        std::string sqlIssuer = toSQLKey(mOffer.takerGets.alphaNum().issuer);
         std::string currencyCode;
         currencyCodeToStr(mOffer.takerGets.alphaNum().currencyCode,
                           currencyCode);
@@ -362,20 +592,20 @@ OfferFrame::storeAdd(LedgerDelta& delta, Database& db) const
                      "(accountID,offerID,getsAlphaNumCurrency,getsIssuer,"
                      "amount,priceN,priceD,price) values"
                      "(:v1,:v2,:v3,:v4,:v5,:v6,:v7,:v8)",
-              use(b58AccountID), use(mOffer.offerID), use(b58issuer),
-              use(currencyCode), use(mOffer.amount), use(mOffer.price.n),
+              use(sqlAccountID), use(mOffer.offerID), use(currencyCode),
+              use(sqlIssuer), use(mOffer.amount), use(mOffer.price.n),
               use(mOffer.price.d), use(computePrice()));
         st.execute(true);
     }
     else
     {
-        std::string b58PaysIssuer =
-            toBase58Check(VER_ACCOUNT_ID, mOffer.takerPays.alphaNum().issuer);
+        std::string sqlPaysIssuer =
+            toSQLKey(mOffer.takerPays.alphaNum().issuer);
         std::string paysAlphaNumCurrency, getsAlphaNumCurrency;
         currencyCodeToStr(mOffer.takerPays.alphaNum().currencyCode,
                           paysAlphaNumCurrency);
-        std::string b58GetsIssuer =
-            toBase58Check(VER_ACCOUNT_ID, mOffer.takerGets.alphaNum().issuer);
+        std::string sqlGetsIssuer =
+            toSQLKey(mOffer.takerGets.alphaNum().issuer);
         currencyCodeToStr(mOffer.takerGets.alphaNum().currencyCode,
                           getsAlphaNumCurrency);
         st = (db.getSession().prepare
@@ -384,8 +614,8 @@ OfferFrame::storeAdd(LedgerDelta& delta, Database& db) const
                      "getsIssuer,"
                      "amount,priceN,priceD,price) values "
                      "(:v1,:v2,:v3,:v4,:v5,:v6,:v7,:v8,:v9,:v10)",
-              use(b58AccountID), use(mOffer.offerID), use(paysAlphaNumCurrency),
-              use(b58PaysIssuer), use(getsAlphaNumCurrency), use(b58GetsIssuer),
+              use(sqlAccountID), use(mOffer.offerID), use(paysAlphaNumCurrency),
+              use(sqlPaysIssuer), use(getsAlphaNumCurrency), use(sqlGetsIssuer),
               use(mOffer.amount), use(mOffer.price.n), use(mOffer.price.d),
               use(computePrice()));
         st.execute(true);
@@ -399,13 +629,104 @@ OfferFrame::storeAdd(LedgerDelta& delta, Database& db) const
     delta.addEntry(*this);
 }
 
+std::unique_ptr<BulkInserter>
+OfferFrame::makeBulkInserter(Database& db, soci::session& session,
+                             std::string const& suffix)
+{
+    return make_unique<BulkInserter>(
+        db, session, "Offers" + suffix,
+        std::vector<std::string>{
+            "accountID", "offerID", "paysAlphaNumCurrency", "paysIssuer",
+            "getsAlphaNumCurrency", "getsIssuer", "amount", "priceN", "priceD",
+            "price"});
+}
+
+// Currency code and issuer columns for one side of an offer; both NULL for
+// the native currency, as loadOffers expects.
+static void
+addCurrencyValues(Currency const& currency,
+                  std::vector<BulkInserter::Value>& values)
+{
+    if (currency.type() == CURRENCY_TYPE_NATIVE)
+    {
+        values.push_back(BulkInserter::Value::null());
+        values.push_back(BulkInserter::Value::null());
+    }
+    else
+    {
+        std::string currencyCode;
+        currencyCodeToStr(currency.alphaNum().currencyCode, currencyCode);
+        values.push_back(currencyCode);
+        values.push_back(toSQLKey(currency.alphaNum().issuer));
+    }
+}
+
+void
+OfferFrame::addBulkRows(BulkInserter& offers) const
+{
+    std::vector<BulkInserter::Value> values;
+    values.push_back(toSQLKey(mOffer.accountID));
+    values.push_back(to_string(mOffer.offerID));
+    addCurrencyValues(mOffer.takerPays, values);
+    addCurrencyValues(mOffer.takerGets, values);
+    values.push_back(to_string(mOffer.amount));
+    values.push_back(to_string(mOffer.price.n));
+    values.push_back(to_string(mOffer.price.d));
+    values.push_back(to_string(computePrice()));
+    offers.addRow(values);
+}
+
+void
+OfferFrame::deleteBulkRows(Database& db, std::vector<LedgerKey> const& keys)
+{
+    if (keys.empty())
+    {
+        return;
+    }
+
+    std::ostringstream params;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        params << (i == 0 ? ":v" : ",:v") << i;
+    }
+
+    soci::session& session = db.getSession();
+    soci::details::prepare_temp_type sql =
+        (session.prepare << "DELETE FROM Offers WHERE offerID IN ("
+                         << params.str() << ")");
+    for (auto const& k : keys)
+    {
+        sql, use(k.offer().offerID);
+    }
+    soci::statement st(sql);
+    auto timer = db.getDeleteTimer("offer");
+    st.execute(true);
+}
+
+void
+OfferFrame::dropIndexes(soci::session& session)
+{
+    session << "DROP INDEX IF EXISTS paysIssuerIndex;";
+    session << "DROP INDEX IF EXISTS getsIssuerIndex;";
+    session << "DROP INDEX IF EXISTS priceIndex;";
+}
+
+void
+OfferFrame::createIndexes(soci::session& session, std::string const& suffix)
+{
+    session << "CREATE INDEX paysIssuerIndex" + suffix + " ON Offers" +
+                   suffix + " (paysIssuer);";
+    session << "CREATE INDEX getsIssuerIndex" + suffix + " ON Offers" +
+                   suffix + " (getsIssuer);";
+    session << "CREATE INDEX priceIndex" + suffix + " ON Offers" + suffix +
+                   " (price);";
+}
+
 void
 OfferFrame::dropAll(Database& db)
 {
     db.getSession() << "DROP TABLE IF EXISTS Offers;";
     db.getSession() << kSQLCreateStatement1;
-    db.getSession() << kSQLCreateStatement2;
-    db.getSession() << kSQLCreateStatement3;
-    db.getSession() << kSQLCreateStatement4;
+    createIndexes(db.getSession());
 }
 }
@@ -6,9 +6,12 @@
 
 #include "ledger/EntryFrame.h"
 #include <functional>
+#include <memory>
+#include <utility>
 
 namespace soci
 {
+class session;
 namespace details
 {
 class prepare_temp_type;
@@ -19,15 +22,27 @@ class prepare_temp_type;
 
 namespace stellar
 {
+class BulkInserter;
 class OperationFrame;
 
 class OfferFrame : public EntryFrame
 {
+  public:
+    // where an offer stands among the offers of its currency pair, in the
+    // order they are crossed: by price, then offerID
+    typedef std::pair<int64_t, uint64> Position;
+
+  private:
     static void
     loadOffers(soci::details::prepare_temp_type& prep,
                std::function<void(OfferFrame const&)> offerProcessor);
 
-    int64_t computePrice() const;
+    // the offers taking `pays` for `gets`, in crossing order, that come
+    // after `after` if not null; all of them if `limit` is 0
+    static void
+    loadPairOffers(Currency const& pays, Currency const& gets, size_t limit,
+                   Position const* after, Database& db,
+                   std::function<void(OfferFrame const&)> offerProcessor);
 
     OfferEntry& mOffer;
 
@@ -57,6 +72,11 @@ class OfferFrame : public EntryFrame
     Currency const& getTakerGets() const;
     uint64 getOfferID() const;
 
+    // the price, as a fixed-point number with OFFER_PRICE_DIVISOR as unit,
+    // that orders offers of a currency pair
+    int64_t computePrice() const;
+    Position getPosition() const;
+
     OfferEntry const&
     getOffer() const
     {
@@ -82,7 +102,10 @@ class OfferFrame : public EntryFrame
     static bool loadOffer(AccountID const& accountID, uint64_t offerID,
                           OfferFrame& retEntry, Database& db);
 
-    static void loadBestOffers(size_t numOffers, size_t offset,
+    // the best `numOffers` offers taking `pays` for `gets`, in crossing
+    // order; when paging through them, those that come after `after`, the
+    // position of the last offer of the previous page
+    static void loadBestOffers(size_t numOffers, Position const* after,
                                Currency const& pays, Currency const& gets,
                                std::vector<OfferFrame>& retOffers,
                                Database& db);
@@ -90,10 +113,28 @@ class OfferFrame : public EntryFrame
     static void loadOffers(AccountID const& accountID,
                            std::vector<OfferFrame>& retOffers, Database& db);
 
+    // load the offers keyed `keys` into the database's entry cache, with one
+    // query; see EntryFrame::prefetch
+    static void loadIntoCache(Database& db, std::vector<LedgerKey> const& keys);
+
+    // bulk loading: an inserter for the Offers table (or one of the same
+    // shape named "Offers" + `suffix`), and the row describing this offer
+    static std::unique_ptr<BulkInserter>
+    makeBulkInserter(Database& db, soci::session& session,
+                     std::string const& suffix = "");
+    void addBulkRows(BulkInserter& offers) const;
+    // delete the rows of the offers `keys`, in one statement; `keys` must be
+    // few enough to bind (see EntryFrame::storeBatch)
+    static void deleteBulkRows(Database& db,
+                               std::vector<LedgerKey> const& keys);
+
+    // secondary indexes, dropped while bulk loading; `suffix` names a
+    // staging copy of the tables to index instead, and its indexes
+    static void dropIndexes(soci::session& session);
+    static void createIndexes(soci::session& session,
+                              std::string const& suffix = "");
+
     static void dropAll(Database& db);
     static const char* kSQLCreateStatement1;
-    static const char* kSQLCreateStatement2;
-    static const char* kSQLCreateStatement3;
-    static const char* kSQLCreateStatement4;
 };
 }
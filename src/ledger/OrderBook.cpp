@@ -0,0 +1,215 @@
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "ledger/OrderBook.h"
+#include "ledger/OfferFrame.h"
+#include "main/Application.h"
+#include "main/Config.h"
+#include "xdrpp/marshal.h"
+#include "medida/meter.h"
+#include "medida/metrics_registry.h"
+#include <cassert>
+
+namespace stellar
+{
+
+OrderBook::OrderBook(Application& app)
+    : mEnabled(app.getConfig().IN_MEMORY_ORDER_BOOK)
+    , mHit(app.getMetrics().NewMeter({"ledger", "orderbook", "hit"}, "pair"))
+    , mLoad(app.getMetrics().NewMeter({"ledger", "orderbook", "load"}, "pair"))
+{
+}
+
+std::string
+OrderBook::pairKey(Currency const& pays, Currency const& gets)
+{
+    auto p = xdr::xdr_to_opaque(pays);
+    auto g = xdr::xdr_to_opaque(gets);
+    std::string key(p.begin(), p.end());
+    key.append(g.begin(), g.end());
+    return key;
+}
+
+std::string
+OrderBook::pairKey(OfferEntry const& offer)
+{
+    return pairKey(offer.takerPays, offer.takerGets);
+}
+
+void
+OrderBook::dropBook(std::string const& key)
+{
+    auto it = mBooks.find(key);
+    if (it == mBooks.end())
+    {
+        return;
+    }
+    for (auto const& o : it->second)
+    {
+        mOfferPositions.erase(o.first.second);
+    }
+    mBooks.erase(it);
+}
+
+void
+OrderBook::dropOffer(uint64 offerID)
+{
+    auto pos = mOfferPositions.find(offerID);
+    if (pos == mOfferPositions.end())
+    {
+        return;
+    }
+    auto it = mBooks.find(pos->second.first);
+    assert(it != mBooks.end());
+    it->second.erase(std::make_pair(pos->second.second, offerID));
+    mOfferPositions.erase(pos);
+}
+
+OrderBook::Offers const*
+OrderBook::getOffers(Currency const& pays, Currency const& gets)
+{
+    if (!mEnabled)
+    {
+        return nullptr;
+    }
+    auto it = mBooks.find(pairKey(pays, gets));
+    if (it == mBooks.end())
+    {
+        return nullptr;
+    }
+    mHit.Mark();
+    return &it->second;
+}
+
+bool
+OrderBook::canPutOffers(Currency const& pays, Currency const& gets) const
+{
+    return mEnabled && !mAllDirty &&
+           mDirty.find(pairKey(pays, gets)) == mDirty.end();
+}
+
+OrderBook::Offers const*
+OrderBook::putOffers(Currency const& pays, Currency const& gets,
+                     std::vector<LedgerEntry> const& offers)
+{
+    if (!canPutOffers(pays, gets))
+    {
+        return nullptr;
+    }
+    std::string key = pairKey(pays, gets);
+    mLoad.Mark();
+    dropBook(key);
+    Offers& book = mBooks[key];
+    for (auto const& e : offers)
+    {
+        int64_t price = OfferFrame(e).computePrice();
+        uint64 offerID = e.offer().offerID;
+        book.insert(std::make_pair(std::make_pair(price, offerID), e));
+        mOfferPositions[offerID] = std::make_pair(key, price);
+    }
+    return &book;
+}
+
+void
+OrderBook::invalidate(LedgerKey const& key, LedgerEntry const* entry)
+{
+    if (!mEnabled)
+    {
+        return;
+    }
+    auto pos = mOfferPositions.find(key.offer().offerID);
+    if (pos != mOfferPositions.end())
+    {
+        std::string old = pos->second.first;
+        dropBook(old);
+        mDirty.insert(old);
+    }
+    if (entry)
+    {
+        std::string now = pairKey(entry->offer());
+        dropBook(now);
+        mDirty.insert(now);
+    }
+}
+
+void
+OrderBook::addPending(LedgerKey const& key, LedgerEntry const& entry)
+{
+    mPending[pairKey(entry.offer())].insert(key);
+}
+
+std::set<LedgerKey, LedgerEntryIdCmp> const*
+OrderBook::getPending(Currency const& pays, Currency const& gets) const
+{
+    auto it = mPending.find(pairKey(pays, gets));
+    return it == mPending.end() ? nullptr : &it->second;
+}
+
+void
+OrderBook::undo(LedgerKey const& key, LedgerEntry const* entry,
+                LedgerEntry const* previous, bool committed)
+{
+    if (!mEnabled)
+    {
+        return;
+    }
+    if (committed && !entry &&
+        mOfferPositions.find(key.offer().offerID) == mOfferPositions.end())
+    {
+        // the offer comes back to a pair we do not know
+        mBooks.clear();
+        mOfferPositions.clear();
+        mAllDirty = true;
+        return;
+    }
+    invalidate(key, entry);
+    if (previous)
+    {
+        invalidate(key, previous);
+    }
+}
+
+void
+OrderBook::invalidateAll()
+{
+    mBooks.clear();
+    mOfferPositions.clear();
+    mDirty.clear();
+    mAllDirty = true;
+}
+
+void
+OrderBook::refresh(std::vector<LedgerEntry> const& live,
+                   std::vector<LedgerKey> const& dead)
+{
+    mDirty.clear();
+    mAllDirty = false;
+    mPending.clear();
+    for (auto const& k : dead)
+    {
+        if (k.type() == OFFER)
+        {
+            dropOffer(k.offer().offerID);
+        }
+    }
+    for (auto const& e : live)
+    {
+        if (e.type() != OFFER)
+        {
+            continue;
+        }
+        uint64 offerID = e.offer().offerID;
+        dropOffer(offerID);
+        std::string key = pairKey(e.offer());
+        auto it = mBooks.find(key);
+        if (it != mBooks.end())
+        {
+            int64_t price = OfferFrame(e).computePrice();
+            it->second.insert(
+                std::make_pair(std::make_pair(price, offerID), e));
+            mOfferPositions[offerID] = std::make_pair(key, price);
+        }
+    }
+}
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "bucket/LedgerCmp.h"
+#include "generated/StellarXDR.h"
+#include "util/NonCopyable.h"
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace medida
+{
+class Meter;
+}
+
+namespace stellar
+{
+class Application;
+
+/**
+ * OrderBook holds the committed offers of recently crossed currency pairs in
+ * memory, in the order offers are crossed -- by price, then offerID -- so that
+ * OfferFrame::loadBestOffers need not page through the Offers table with
+ * ORDER BY ... LIMIT queries. A pair's offers are loaded from the table in
+ * one query the first time they are needed (so the book is rebuilt lazily
+ * after a restart), and kept up to date from then on as ledgers close.
+ *
+ * The book holds offers as they stand before the ledger being closed, if
+ * any, changes it:
+ *
+ *   - Offer frames storing or deleting offers through the LedgerDelta of the
+ *     ledger being closed (the outermost delta, registered with the Database)
+ *     leave the books alone, but index the offers changed by pair (see
+ *     addPending). Loads merge the pending offers of their pair, as seen by
+ *     LedgerDelta::getPendingEntry, into the book.
+ *
+ *   - When the ledger closes, the commit of its outermost LedgerDelta applies
+ *     the ledger's changed and deleted offers to the books held.
+ *
+ *   - Offers written otherwise are invalidated first: the books of their old
+ *     and new currency pairs are dropped and the pairs marked dirty. Until
+ *     the next ledger closes, loads of a dirty pair go to the table.
+ *
+ * A ledger closing without deferred writes (Config::DEFER_LEDGER_WRITES)
+ * writes its changes to the table as they are made, so a pair loaded while
+ * it is open may hold some of them. This is harmless while they stand, as
+ * loads replace them by their pending state, but the pairs of changes undone
+ * are forgotten (see undo).
+ *
+ * Owned by the Database; used only from the main thread.
+ */
+class OrderBook : NonMovableOrCopyable
+{
+  public:
+    // offers of a pair by (price, offerID)
+    typedef std::map<std::pair<int64_t, uint64>, LedgerEntry> Offers;
+
+  private:
+    bool mEnabled;
+    medida::Meter& mHit;
+    medida::Meter& mLoad;
+
+    // by pairKey
+    std::map<std::string, Offers> mBooks;
+    // where the offers of the books held are, by offerID: pairKey and price
+    std::map<uint64, std::pair<std::string, int64_t>> mOfferPositions;
+    std::set<std::string> mDirty;
+    bool mAllDirty{false};
+    // keys of the offers changed by the ledger being closed, by the pairKey
+    // of the states they were given; cleared when it closes
+    std::map<std::string, std::set<LedgerKey, LedgerEntryIdCmp>> mPending;
+
+    static std::string pairKey(Currency const& pays, Currency const& gets);
+    static std::string pairKey(OfferEntry const& offer);
+
+    void dropBook(std::string const& key);
+    void dropOffer(uint64 offerID);
+
+  public:
+    explicit OrderBook(Application& app);
+
+    // The offers taking `pays` for `gets`, or null if they are not held.
+    Offers const* getOffers(Currency const& pays, Currency const& gets);
+
+    // True if the offers taking `pays` for `gets` may be held: the book is
+    // enabled and the pair not dirty.
+    bool canPutOffers(Currency const& pays, Currency const& gets) const;
+
+    // Hold `offers`, all the offers taking `pays` for `gets` just loaded from
+    // the database, and return them. Returns null, holding nothing, if the
+    // pair is dirty.
+    Offers const* putOffers(Currency const& pays, Currency const& gets,
+                            std::vector<LedgerEntry> const& offers);
+
+    // The offer with key `key`, whose new state is `entry` if not null, is
+    // about to be written.
+    void invalidate(LedgerKey const& key, LedgerEntry const* entry);
+
+    // The offer with key `key` has been given the state `entry` by the ledger
+    // being closed, which holds it until it commits (see
+    // LedgerDelta::getPendingEntry): index it under its pair.
+    void addPending(LedgerKey const& key, LedgerEntry const& entry);
+
+    // The keys of the offers the ledger being closed may have given a state
+    // taking `pays` for `gets`, or null if there are none. Changes rolled
+    // back or superseded since are not removed: check each key's current
+    // state with LedgerDelta::getPendingEntry.
+    std::set<LedgerKey, LedgerEntryIdCmp> const*
+    getPending(Currency const& pays, Currency const& gets) const;
+
+    // A change the ledger being closed made to the offer `key`, and wrote to
+    // the database, is undone: the offer goes back from `entry` to `previous`
+    // (either null if deleted), or to its committed state if `committed`.
+    // Books loaded since may hold the change: forget the pairs involved.
+    void undo(LedgerKey const& key, LedgerEntry const* entry,
+              LedgerEntry const* previous, bool committed);
+
+    // Offers are about to be written other than through their frames; forget
+    // everything, and hold nothing until the next refresh.
+    void invalidateAll();
+
+    // A ledger has closed, making `live` the state of their keys and removing
+    // the entries with keys in `dead`. Entries other than offers are ignored.
+    void refresh(std::vector<LedgerEntry> const& live,
+                 std::vector<LedgerKey> const& dead);
+};
+}
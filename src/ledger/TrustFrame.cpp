@@ -4,11 +4,13 @@
 
 #include "ledger/TrustFrame.h"
 #include "ledger/AccountFrame.h"
-#include "crypto/Base58.h"
 #include "crypto/SHA.h"
+#include "database/BulkInserter.h"
 #include "database/Database.h"
 #include "LedgerDelta.h"
+#include "util/make_unique.h"
 #include "util/types.h"
+#include <sstream>
 
 using namespace std;
 using namespace soci;
@@ -18,8 +20,8 @@ namespace stellar
 const char* TrustFrame::kSQLCreateStatement1 =
     "CREATE TABLE TrustLines"
     "("
-    "accountID     VARCHAR(51)     NOT NULL,"
-    "issuer        VARCHAR(51)     NOT NULL,"
+    "accountID     CHARACTER(44)    NOT NULL,"
+    "issuer        CHARACTER(44)    NOT NULL,"
     "AlphaNumCurrency   VARCHAR(4) NOT NULL,"
     "tlimit        BIGINT          NOT NULL DEFAULT 0 CHECK (tlimit >= 0),"
     "balance       BIGINT          NOT NULL DEFAULT 0 CHECK (balance >= 0),"
@@ -27,9 +29,6 @@ const char* TrustFrame::kSQLCreateStatement1 =
     "PRIMARY KEY (accountID, issuer, AlphaNumCurrency)"
     ");";
 
-const char* TrustFrame::kSQLCreateStatement2 =
-    "CREATE INDEX accountLines ON TrustLines (accountID);";
-
 TrustFrame::TrustFrame()
     : EntryFrame(TRUSTLINE), mTrustLine(mEntry.trustLine()), mIsIssuer(false)
 {
@@ -57,13 +56,12 @@ TrustFrame& TrustFrame::operator=(TrustFrame const& other)
 }
 
 void
-TrustFrame::getKeyFields(LedgerKey const& key, std::string& base58AccountID,
-                         std::string& base58Issuer, std::string& currencyCode)
+TrustFrame::getKeyFields(LedgerKey const& key, std::string& sqlAccountID,
+                         std::string& sqlIssuer, std::string& currencyCode)
 {
-    base58AccountID = toBase58Check(VER_ACCOUNT_ID, key.trustLine().accountID);
-    base58Issuer = toBase58Check(VER_ACCOUNT_ID,
-                                 key.trustLine().currency.alphaNum().issuer);
-    if (base58AccountID == base58Issuer)
+    sqlAccountID = toSQLKey(key.trustLine().accountID);
+    sqlIssuer = toSQLKey(key.trustLine().currency.alphaNum().issuer);
+    if (sqlAccountID == sqlIssuer)
         throw std::runtime_error("Issuer's own trustline should not be used "
                                  "outside of OperationFrame");
     currencyCodeToStr(key.trustLine().currency.alphaNum().currencyCode,
@@ -151,13 +149,19 @@ TrustFrame::isValid() const
 bool
 TrustFrame::exists(Database& db, LedgerKey const& key)
 {
-    std::string b58AccountID, b58Issuer, currencyCode;
-    getKeyFields(key, b58AccountID, b58Issuer, currencyCode);
+    std::shared_ptr<LedgerEntry const> cached;
+    if (lookupEntry(db, key, cached))
+    {
+        return cached != nullptr;
+    }
+
+    std::string sqlAccountID, sqlIssuer, currencyCode;
+    getKeyFields(key, sqlAccountID, sqlIssuer, currencyCode);
     int exists = 0;
     auto timer = db.getSelectTimer("trust-exists");
     db.getSession() << "SELECT EXISTS (SELECT NULL FROM TrustLines \
              WHERE accountID=:v1 and issuer=:v2 and AlphaNumCurrency=:v3)",
-        use(b58AccountID), use(b58Issuer), use(currencyCode), into(exists);
+        use(sqlAccountID), use(sqlIssuer), use(currencyCode), into(exists);
     return exists != 0;
 }
 
@@ -170,13 +174,21 @@ TrustFrame::storeDelete(LedgerDelta& delta, Database& db) const
 void
 TrustFrame::storeDelete(LedgerDelta& delta, Database& db, LedgerKey const& key)
 {
-    std::string b58AccountID, b58Issuer, currencyCode;
-    getKeyFields(key, b58AccountID, b58Issuer, currencyCode);
+    if (delta.defersWrites())
+    {
+        delta.deleteEntry(key);
+        return;
+    }
+
+    std::string sqlAccountID, sqlIssuer, currencyCode;
+    getKeyFields(key, sqlAccountID, sqlIssuer, currencyCode);
+
+    db.getEntryCache().invalidate(key);
 
     auto timer = db.getDeleteTimer("trust");
     db.getSession() << "DELETE from TrustLines \
              WHERE accountID=:v1 and issuer=:v2 and AlphaNumCurrency=:v3",
-        use(b58AccountID), use(b58Issuer), use(currencyCode);
+        use(sqlAccountID), use(sqlIssuer), use(currencyCode);
 
     delta.deleteEntry(key);
 }
@@ -189,16 +201,24 @@ TrustFrame::storeChange(LedgerDelta& delta, Database& db) const
     if (mIsIssuer)
         return;
 
-    std::string b58AccountID, b58Issuer, currencyCode;
-    getKeyFields(getKey(), b58AccountID, b58Issuer, currencyCode);
+    if (delta.defersWrites())
+    {
+        delta.modEntry(*this);
+        return;
+    }
+
+    std::string sqlAccountID, sqlIssuer, currencyCode;
+    getKeyFields(getKey(), sqlAccountID, sqlIssuer, currencyCode);
+
+    db.getEntryCache().invalidate(getKey());
 
     auto timer = db.getUpdateTimer("trust");
     statement st = (db.getSession().prepare << "UPDATE TrustLines \
               SET balance=:b, tlimit=:tl, flags=:a \
               WHERE accountID=:v1 and issuer=:v2 and AlphaNumCurrency=:v3",
                     use(mTrustLine.balance), use(mTrustLine.limit),
-                    use((int)mTrustLine.flags), use(b58AccountID),
-                    use(b58Issuer), use(currencyCode));
+                    use((int)mTrustLine.flags), use(sqlAccountID),
+                    use(sqlIssuer), use(currencyCode));
 
     st.execute(true);
 
@@ -218,15 +238,23 @@ TrustFrame::storeAdd(LedgerDelta& delta, Database& db) const
     if (mIsIssuer)
         return;
 
-    std::string b58AccountID, b58Issuer, currencyCode;
-    getKeyFields(getKey(), b58AccountID, b58Issuer, currencyCode);
+    if (delta.defersWrites())
+    {
+        delta.addEntry(*this);
+        return;
+    }
+
+    std::string sqlAccountID, sqlIssuer, currencyCode;
+    getKeyFields(getKey(), sqlAccountID, sqlIssuer, currencyCode);
+
+    db.getEntryCache().invalidate(getKey());
 
     auto timer = db.getInsertTimer("trust");
     statement st =
         (db.getSession().prepare
              << "INSERT INTO TrustLines (accountID, issuer, AlphaNumCurrency, tlimit, flags) \
                  VALUES (:v1,:v2,:v3,:v4,:v5)",
-         use(b58AccountID), use(b58Issuer), use(currencyCode),
+         use(sqlAccountID), use(sqlIssuer), use(currencyCode),
          use(mTrustLine.limit), use((int)mTrustLine.flags));
 
     st.execute(true);
@@ -264,11 +292,27 @@ TrustFrame::loadTrustLine(AccountID const& accountID, Currency const& currency,
         return true;
     }
 
+    LedgerKey key;
+    key.type(TRUSTLINE);
+    key.trustLine().accountID = accountID;
+    key.trustLine().currency = currency;
+    LedgerEntryCache& cache = db.getEntryCache();
+    std::shared_ptr<LedgerEntry const> cached;
+    if (lookupEntry(db, key, cached))
+    {
+        if (!cached)
+        {
+            return false;
+        }
+        retLine = TrustFrame(*cached);
+        return true;
+    }
+
     std::string accStr, issuerStr, currencyStr;
 
-    accStr = toBase58Check(VER_ACCOUNT_ID, accountID);
+    accStr = toSQLKey(accountID);
     currencyCodeToStr(currency.alphaNum().currencyCode, currencyStr);
-    issuerStr = toBase58Check(VER_ACCOUNT_ID, currency.alphaNum().issuer);
+    issuerStr = toSQLKey(currency.alphaNum().issuer);
 
     session& session = db.getSession();
 
@@ -286,29 +330,121 @@ TrustFrame::loadTrustLine(AccountID const& accountID, Currency const& currency,
                   retLine = trust;
                   res = true;
               });
+    cache.put(key, res ? std::make_shared<LedgerEntry const>(retLine.mEntry)
+                       : nullptr);
     return res;
 }
 
+void
+TrustFrame::loadIntoCache(Database& db, std::vector<LedgerKey> const& keys)
+{
+    std::set<std::string> sqlAccountIDs;
+    for (auto const& k : keys)
+    {
+        sqlAccountIDs.insert(toSQLKey(k.trustLine().accountID));
+    }
+
+    std::ostringstream params;
+    for (size_t i = 0; i < sqlAccountIDs.size(); ++i)
+    {
+        params << (i == 0 ? ":v" : ",:v") << i;
+    }
+
+    session& session = db.getSession();
+    details::prepare_temp_type sql =
+        (session.prepare << trustLineColumnSelector << " WHERE accountID IN ("
+                         << params.str() << ")");
+    for (auto const& id : sqlAccountIDs)
+    {
+        sql, use(id);
+    }
+
+    // the query returns every line of the accounts: keep the ones asked for
+    std::set<LedgerKey, LedgerEntryIdCmp> wanted(keys.begin(), keys.end());
+    LedgerEntryCache& cache = db.getEntryCache();
+    {
+        auto timer = db.getSelectTimer("trust-prefetch");
+        loadLines(sql, [&wanted, &cache](TrustFrame const& cur)
+                  {
+                      auto it = wanted.find(LedgerEntryKey(cur.mEntry));
+                      if (it != wanted.end())
+                      {
+                          cache.put(*it, std::make_shared<LedgerEntry const>(
+                                             cur.mEntry));
+                          wanted.erase(it);
+                      }
+                  });
+    }
+    for (auto const& k : wanted)
+    {
+        cache.put(k, nullptr);
+    }
+}
+
 bool
 TrustFrame::hasIssued(AccountID const& issuerID, Database& db)
 {
     std::string accStr;
-    accStr = toBase58Check(VER_ACCOUNT_ID, issuerID);
+    accStr = toSQLKey(issuerID);
 
     session& session = db.getSession();
 
-    details::prepare_temp_type sql =
-        (session.prepare << "SELECT balance from TrustLines WHERE issuer=:id "
-                            "and balance>0 limit 1",
-         use(accStr));
+    auto pending = LedgerDelta::getPendingEntries(db, TRUSTLINE);
+    if (pending.empty())
+    {
+        details::prepare_temp_type sql =
+            (session.prepare << "SELECT balance from TrustLines WHERE "
+                                "issuer=:id and balance>0 limit 1",
+             use(accStr));
+
+        auto timer = db.getSelectTimer("trust");
+        int balance = 0;
+        statement st = (sql, into(balance));
+        st.execute(true);
+        if (st.got_data())
+        {
+            return true;
+        }
+        return false;
+    }
 
+    // lines changed by the ledger being closed replace their rows
+    for (auto const& p : pending)
+    {
+        if (p.second)
+        {
+            auto const& tl = static_cast<TrustFrame const&>(*p.second);
+            if (tl.mTrustLine.currency.alphaNum().issuer == issuerID &&
+                tl.mTrustLine.balance > 0)
+            {
+                return true;
+            }
+        }
+    }
+
+    size_t limit = pending.size() + 1;
+    std::string accountID, currencyCode;
     auto timer = db.getSelectTimer("trust");
-    int balance = 0;
-    statement st = (sql, into(balance));
+    statement st =
+        (session.prepare << "SELECT accountID, AlphaNumCurrency from "
+                            "TrustLines WHERE issuer=:id and balance>0 "
+                            "limit :n",
+         use(accStr), use(limit), into(accountID), into(currencyCode));
     st.execute(true);
-    if (st.got_data())
+    while (st.got_data())
     {
-        return true;
+        LedgerKey key;
+        key.type(TRUSTLINE);
+        key.trustLine().accountID = fromSQLKey(accountID);
+        key.trustLine().currency.type(CURRENCY_TYPE_ALPHANUM);
+        key.trustLine().currency.alphaNum().issuer = issuerID;
+        strToCurrencyCode(key.trustLine().currency.alphaNum().currencyCode,
+                          currencyCode);
+        if (pending.find(key) == pending.end())
+        {
+            return true;
+        }
+        st.fetch();
     }
     return false;
 }
@@ -330,10 +466,9 @@ TrustFrame::loadLines(details::prepare_temp_type& prep,
     st.execute(true);
     while (st.got_data())
     {
-        tl.accountID = fromBase58Check256(VER_ACCOUNT_ID, accountID);
+        tl.accountID = fromSQLKey(accountID);
         tl.currency.type(CURRENCY_TYPE_ALPHANUM);
-        tl.currency.alphaNum().issuer =
-            fromBase58Check256(VER_ACCOUNT_ID, issuer);
+        tl.currency.alphaNum().issuer = fromSQLKey(issuer);
         strToCurrencyCode(tl.currency.alphaNum().currencyCode, currency);
 
         assert(curTrustLine.isValid());
@@ -348,7 +483,7 @@ TrustFrame::loadLines(AccountID const& accountID,
                       std::vector<TrustFrame>& retLines, Database& db)
 {
     std::string accStr;
-    accStr = toBase58Check(VER_ACCOUNT_ID, accountID);
+    accStr = toSQLKey(accountID);
 
     session& session = db.getSession();
 
@@ -356,11 +491,95 @@ TrustFrame::loadLines(AccountID const& accountID,
         (session.prepare << trustLineColumnSelector << " WHERE accountID=:id",
          use(accStr));
 
+    auto pending = LedgerDelta::getPendingEntries(db, TRUSTLINE);
+
     auto timer = db.getSelectTimer("trust");
-    loadLines(sql, [&retLines](TrustFrame const& cur)
+    loadLines(sql, [&retLines, &pending](TrustFrame const& cur)
               {
-                  retLines.push_back(cur);
+                  if (pending.find(LedgerEntryKey(cur.mEntry)) ==
+                      pending.end())
+                  {
+                      retLines.push_back(cur);
+                  }
               });
+
+    for (auto const& p : pending)
+    {
+        if (p.second && p.first.trustLine().accountID == accountID)
+        {
+            retLines.push_back(static_cast<TrustFrame const&>(*p.second));
+        }
+    }
+}
+
+std::unique_ptr<BulkInserter>
+TrustFrame::makeBulkInserter(Database& db, soci::session& session,
+                             std::string const& suffix)
+{
+    return make_unique<BulkInserter>(
+        db, session, "TrustLines" + suffix,
+        std::vector<std::string>{"accountID", "issuer", "AlphaNumCurrency",
+                                 "tlimit", "balance", "flags"});
+}
+
+void
+TrustFrame::addBulkRows(BulkInserter& lines) const
+{
+    assert(isValid());
+    assert(!mIsIssuer);
+
+    std::string sqlAccountID, sqlIssuer, currencyCode;
+    getKeyFields(getKey(), sqlAccountID, sqlIssuer, currencyCode);
+
+    lines.addRow({sqlAccountID, sqlIssuer, currencyCode,
+                  to_string(mTrustLine.limit), to_string(mTrustLine.balance),
+                  to_string(mTrustLine.flags)});
+}
+
+void
+TrustFrame::deleteBulkRows(Database& db, std::vector<LedgerKey> const& keys)
+{
+    if (keys.empty())
+    {
+        return;
+    }
+
+    // three parameters per line; one conjunction per line, each matching
+    // the primary key
+    std::vector<std::string> fields(3 * keys.size());
+    std::ostringstream where;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        getKeyFields(keys[i], fields[3 * i], fields[3 * i + 1],
+                     fields[3 * i + 2]);
+        where << (i == 0 ? "" : " OR ") << "(accountID=:a" << i
+              << " AND issuer=:i" << i << " AND AlphaNumCurrency=:c" << i
+              << ")";
+    }
+
+    session& session = db.getSession();
+    details::prepare_temp_type sql =
+        (session.prepare << "DELETE FROM TrustLines WHERE " << where.str());
+    for (auto const& f : fields)
+    {
+        sql, use(f);
+    }
+    statement st(sql);
+    auto timer = db.getDeleteTimer("trust");
+    st.execute(true);
+}
+
+void
+TrustFrame::dropIndexes(soci::session& session)
+{
+    session << "DROP INDEX IF EXISTS accountLines;";
+}
+
+void
+TrustFrame::createIndexes(soci::session& session, std::string const& suffix)
+{
+    session << "CREATE INDEX accountLines" + suffix + " ON TrustLines" +
+                   suffix + " (accountID);";
 }
 
 void
@@ -368,6 +587,6 @@ TrustFrame::dropAll(Database& db)
 {
     db.getSession() << "DROP TABLE IF EXISTS TrustLines;";
     db.getSession() << kSQLCreateStatement1;
-    db.getSession() << kSQLCreateStatement2;
+    createIndexes(db.getSession());
 }
 }
@@ -6,9 +6,11 @@
 
 #include "ledger/EntryFrame.h"
 #include <functional>
+#include <memory>
 
 namespace soci
 {
+class session;
 namespace details
 {
 class prepare_temp_type;
@@ -18,12 +20,13 @@ class prepare_temp_type;
 namespace stellar
 {
 
+class BulkInserter;
 class TrustSetTx;
 
 class TrustFrame : public EntryFrame
 {
-    static void getKeyFields(LedgerKey const& key, std::string& base58AccountID,
-                             std::string& base58Issuer,
+    static void getKeyFields(LedgerKey const& key, std::string& sqlAccountID,
+                             std::string& sqlIssuer,
                              std::string& currencyCode);
 
     static void
@@ -71,6 +74,10 @@ class TrustFrame : public EntryFrame
 
     static bool hasIssued(AccountID const& issuerID, Database& db);
 
+    // load the trust lines keyed `keys` into the database's entry cache, with
+    // one query; see EntryFrame::prefetch
+    static void loadIntoCache(Database& db, std::vector<LedgerKey> const& keys);
+
     int64_t getBalance() const;
     bool addBalance(int64_t delta);
 
@@ -93,8 +100,25 @@ class TrustFrame : public EntryFrame
 
     bool isValid() const;
 
+    // bulk loading: an inserter for the TrustLines table (or one of the same
+    // shape named "TrustLines" + `suffix`), and the row describing this trust
+    // line
+    static std::unique_ptr<BulkInserter>
+    makeBulkInserter(Database& db, soci::session& session,
+                     std::string const& suffix = "");
+    void addBulkRows(BulkInserter& lines) const;
+    // delete the rows of the trust lines `keys`, in one statement; `keys`
+    // must be few enough to bind (see EntryFrame::storeBatch)
+    static void deleteBulkRows(Database& db,
+                               std::vector<LedgerKey> const& keys);
+
+    // secondary indexes, dropped while bulk loading; `suffix` names a
+    // staging copy of the tables to index instead, and its indexes
+    static void dropIndexes(soci::session& session);
+    static void createIndexes(soci::session& session,
+                              std::string const& suffix = "");
+
     static void dropAll(Database& db);
     static const char* kSQLCreateStatement1;
-    static const char* kSQLCreateStatement2;
 };
 }
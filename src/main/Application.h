@@ -183,7 +183,7 @@ class Application
     // Wait-on and join all the threads this application started; should only
     // return when there is no more work to do or someone has force-stopped the
     // worker io_service. Application can be safely destroyed after this
-    // returns.
+    // returns, which also joins them, so calling this first is harmless.
     virtual void joinAllThreads() = 0;
 
     // If config.MANUAL_MODE=true, force the current ledger to close and return
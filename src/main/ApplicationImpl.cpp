@@ -79,10 +79,14 @@ ApplicationImpl::ApplicationImpl(VirtualClock& clock, Config const& cfg)
         LOG(INFO) << "* The database has been" << wipeMsg;
         LOG(INFO) << "* ";
     }
-    else if (mPersistentState->getState(
-                 PersistentState::kForceSCPOnNextLaunch) == "true")
+    else
     {
-        mConfig.FORCE_SCP = true;
+        mDatabase->upgradeToCurrentSchema();
+        if (mPersistentState->getState(
+                PersistentState::kForceSCPOnNextLaunch) == "true")
+        {
+            mConfig.FORCE_SCP = true;
+        }
     }
 
     mTmpDirManager = make_unique<TmpDirManager>(cfg.TMP_DIR_PATH);
@@ -253,7 +257,10 @@ ApplicationImpl::joinAllThreads()
     LOG(DEBUG) << "Joining " << mWorkerThreads.size() << " worker threads";
     for (auto& w : mWorkerThreads)
     {
-        w.join();
+        if (w.joinable())
+        {
+            w.join();
+        }
     }
     LOG(DEBUG) << "Joined all " << mWorkerThreads.size() << " threads";
 }
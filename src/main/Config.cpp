@@ -31,9 +31,20 @@ Config::Config() : PEER_KEY(SecretKey::random())
     RUN_STANDALONE = false;
     MANUAL_CLOSE = false;
     CATCHUP_COMPLETE = false;
+    CATCHUP_BULK_APPLY = true;
     ARTIFICIALLY_ACCELERATE_TIME_FOR_TESTING = false;
     ARTIFICIALLY_PESSIMIZE_MERGES_FOR_TESTING = false;
+    ARTIFICIALLY_INTERRUPT_MERGES_FOR_TESTING = false;
     BREAK_ASIO_LOOP_FOR_FAST_TESTS = false;
+    BUCKET_MMAP_READS = true;
+    BUCKET_COMPRESS = false;
+    BUCKET_PREALLOCATE = false;
+    BUCKET_MAX_CONCURRENT_MERGES = 0;
+    BUCKET_MERGE_CHECKPOINT_BYTES = 64 * 1024 * 1024;
+    ENTRY_CACHE_SIZE = 16384;
+    DEFER_LEDGER_WRITES = false;
+    IN_MEMORY_ORDER_BOOK = true;
+    LEDGER_PERSIST_DEPTH = 0;
     TARGET_PEER_CONNECTIONS = 20;
     MAX_PEER_CONNECTIONS = 50;
     LOG_FILE_PATH = "stellar-core.log";
@@ -95,6 +106,8 @@ Config::load(std::string const& filename)
                 RUN_STANDALONE = item.second->as<bool>()->value();
             else if (item.first == "CATCHUP_COMPLETE")
                 CATCHUP_COMPLETE = item.second->as<bool>()->value();
+            else if (item.first == "CATCHUP_BULK_APPLY")
+                CATCHUP_BULK_APPLY = item.second->as<bool>()->value();
             else if (item.first == "ARTIFICIALLY_ACCELERATE_TIME_FOR_TESTING")
                 ARTIFICIALLY_ACCELERATE_TIME_FOR_TESTING =
                     item.second->as<bool>()->value();
@@ -106,6 +119,58 @@ Config::load(std::string const& filename)
                 TMP_DIR_PATH = item.second->as<std::string>()->value();
             else if (item.first == "BUCKET_DIR_PATH")
                 BUCKET_DIR_PATH = item.second->as<std::string>()->value();
+            else if (item.first == "BUCKET_MMAP_READS")
+                BUCKET_MMAP_READS = item.second->as<bool>()->value();
+            else if (item.first == "BUCKET_COMPRESS")
+            {
+                BUCKET_COMPRESS = item.second->as<bool>()->value();
+#ifndef USE_ZLIB
+                if (BUCKET_COMPRESS)
+                {
+                    throw std::invalid_argument(
+                        "BUCKET_COMPRESS requires a build with zlib");
+                }
+#endif
+            }
+            else if (item.first == "BUCKET_PREALLOCATE")
+                BUCKET_PREALLOCATE = item.second->as<bool>()->value();
+            else if (item.first == "BUCKET_MAX_CONCURRENT_MERGES")
+                BUCKET_MAX_CONCURRENT_MERGES =
+                    (uint32_t)item.second->as<int64_t>()->value();
+            else if (item.first == "BUCKET_MERGE_CHECKPOINT_BYTES")
+            {
+                int64_t n = item.second->as<int64_t>()->value();
+                if (n < 0)
+                {
+                    throw std::invalid_argument(
+                        "BUCKET_MERGE_CHECKPOINT_BYTES must not be negative");
+                }
+                BUCKET_MERGE_CHECKPOINT_BYTES = static_cast<uint64_t>(n);
+            }
+            else if (item.first == "ENTRY_CACHE_SIZE")
+            {
+                int64_t n = item.second->as<int64_t>()->value();
+                if (n < 0 || n > UINT32_MAX)
+                {
+                    throw std::invalid_argument(
+                        "ENTRY_CACHE_SIZE must be between 0 and 2^32-1");
+                }
+                ENTRY_CACHE_SIZE = static_cast<uint32_t>(n);
+            }
+            else if (item.first == "DEFER_LEDGER_WRITES")
+                DEFER_LEDGER_WRITES = item.second->as<bool>()->value();
+            else if (item.first == "IN_MEMORY_ORDER_BOOK")
+                IN_MEMORY_ORDER_BOOK = item.second->as<bool>()->value();
+            else if (item.first == "LEDGER_PERSIST_DEPTH")
+            {
+                int64_t n = item.second->as<int64_t>()->value();
+                if (n < 0 || n > UINT32_MAX)
+                {
+                    throw std::invalid_argument(
+                        "LEDGER_PERSIST_DEPTH must be between 0 and 2^32-1");
+                }
+                LEDGER_PERSIST_DEPTH = static_cast<uint32_t>(n);
+            }
             else if (item.first == "VALIDATION_SEED")
             {
                 std::string seed = item.second->as<std::string>()->value();
@@ -60,6 +60,12 @@ class Config : public std::enable_shared_from_this<Config>
     // meaning catchup "minimally", using deltas to the most recent snapshot.
     bool CATCHUP_COMPLETE;
 
+    // When minimal catchup has to apply buckets, reload the ledger-entry
+    // tables from the whole BucketList with bulk inserts (see
+    // Bucket::applyBulk) instead of applying the differing buckets entry by
+    // entry. Defaults to true.
+    bool CATCHUP_BULK_APPLY;
+
     // A config parameter that reduces ledger close time to 1s and checkpoint
     // frequency to every 8 ledgers. Do not ever set this in production, as it
     // will make your history archives incompatible with those of anyone else.
@@ -71,6 +77,12 @@ class Config : public std::enable_shared_from_this<Config>
     // and should be false in all normal cases.
     bool ARTIFICIALLY_PESSIMIZE_MERGES_FOR_TESTING;
 
+    // A config parameter that makes every checkpointed merge fail just after
+    // saving its first checkpoint (see MergeCheckpoint); this option exists
+    // only for testing the resumption of merges, and should be false in all
+    // normal cases.
+    bool ARTIFICIALLY_INTERRUPT_MERGES_FOR_TESTING;
+
     // With many `Application` running in the same process under the 
     // virtual clock, asio pooling never relinquishes the event loop.
     // This option inserts a VirtualClock event after each read to
@@ -78,6 +90,62 @@ class Config : public std::enable_shared_from_this<Config>
     // we are confortable doing this on prod as well.)
     bool BREAK_ASIO_LOOP_FOR_FAST_TESTS;
 
+    // Read bucket files through a read-only memory mapping instead of a
+    // buffered stream when merging, applying or scanning them. Defaults to
+    // true; set false to fall back to stream reads.
+    bool BUCKET_MMAP_READS;
+
+    // Write new bucket files as independently zlib-compressed blocks with a
+    // block index (see CompressedFileWriter) instead of plain XDR. Bucket
+    // hashes, and the files published to history archives, remain those of
+    // the plain XDR. Existing bucket files of either kind are read as they
+    // are. Defaults to false; requires a build with zlib.
+    bool BUCKET_COMPRESS;
+
+    // Reserve disk space for a merge's output, up to the size of its inputs,
+    // before writing it (fallocate, without changing the file size; space
+    // left unused is released when the file is closed). Best effort, Linux
+    // and Windows only. Defaults to false.
+    bool BUCKET_PREALLOCATE;
+
+    // Maximum number of merges for deeper BucketList levels that may run on
+    // the worker threads at once; further merges wait their turn, earliest
+    // deadline first. 0 (the default) means half the worker threads.
+    uint32_t BUCKET_MAX_CONCURRENT_MERGES;
+
+    // Bytes of output a bucket merge writes between checkpoints of its
+    // progress, from which it resumes if the process restarts before it
+    // finishes (see MergeCheckpoint). Merges of fewer input bytes than this
+    // are not checkpointed; 0 disables checkpoints. Defaults to 64MB.
+    uint64_t BUCKET_MERGE_CHECKPOINT_BYTES;
+
+    // Maximum number of ledger entries of each type (accounts, trust lines,
+    // offers) whose state is cached in memory in front of the database (see
+    // LedgerEntryCache). 0 disables the cache. Defaults to 16384.
+    uint32_t ENTRY_CACHE_SIZE;
+
+    // If true, transactions applied while closing a ledger only change the
+    // ledger entries held by its LedgerDelta, and the final state of every
+    // entry the ledger changed is written to the database once, in batches,
+    // when the ledger closes (see LedgerDelta). Defaults to false: each
+    // change is written as it is made.
+    bool DEFER_LEDGER_WRITES;
+
+    // If true, the offers of the currency pairs crossed are held in memory,
+    // in price order, so that crossing offers need not page through the
+    // database (see OrderBook). Defaults to true.
+    bool IN_MEMORY_ORDER_BOOK;
+
+    // Number of closed ledgers whose SQL commits may not have reached disk
+    // yet. If not 0, ledgers are committed without waiting for the disk, and
+    // made durable in the background; closing a ledger waits only when more
+    // than this many closed ledgers are not known to be durable. A crash may
+    // then lose up to as many ledgers, which are closed again on restart:
+    // every ledger commits atomically, so the database comes back to one of
+    // them. Ignored for in-memory databases. Defaults to 0: every ledger is
+    // durable once closed.
+    uint32_t LEDGER_PERSIST_DEPTH;
+
     uint32_t PROTOCOL_VERSION;
     std::string VERSION_STR;
     std::string LOG_FILE_PATH;
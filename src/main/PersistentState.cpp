@@ -14,7 +14,7 @@ using namespace std;
 
 string PersistentState::mapping[kLastEntry] = {
     "lastClosedLedger", "historyArchiveState", "forceSCPOnNextLaunch",
-    "databaseInitialized"};
+    "databaseInitialized", "databaseSchema"};
 
 string PersistentState::kSQLCreateStatement =
     "CREATE TABLE IF NOT EXISTS StoreState ("
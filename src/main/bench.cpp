@@ -0,0 +1,522 @@
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "util/asio.h"
+#include "main/bench.h"
+#include "bucket/Bucket.h"
+#include "bucket/BucketList.h"
+#include "bucket/BucketManager.h"
+#include "bucket/LedgerCmp.h"
+#include "crypto/Random.h"
+#include "database/Database.h"
+#include "generated/StellarCoreVersion.h"
+#include "lib/json/json.h"
+#include "main/Application.h"
+#include "main/Config.h"
+#include "util/Fs.h"
+#include "util/Math.h"
+#include "util/Timer.h"
+#include "util/types.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+/**
+ * Self-contained benchmarks of the bucket hot paths, for tracking their
+ * performance across builds without a live database server: run with
+ * --benchbuckets=SPEC (or `make bench`). Everything is generated in-process,
+ * the database is in-memory SQLite, and the results are written as JSON.
+ *
+ * SPEC is a comma-separated list of key=value settings, any of which may be
+ * omitted (an empty SPEC runs the defaults):
+ *
+ *   entries=N     live entries in each of the two buckets merged     (100000)
+ *   accounts=W    relative weight of accounts among entries              (60)
+ *   trustlines=W  ... of trust lines                                     (30)
+ *   offers=W      ... of offers                                          (10)
+ *   dead=P        percent of the older bucket's keys deleted by the
+ *                 newer one                                              (10)
+ *   shadows=N     merges are measured under 0..N shadow buckets           (4)
+ *   ledgers=N     ledgers closed into a BucketList by addBatch          (256)
+ *   batch=N       entries changed per ledger                            (100)
+ *   repeat=N      runs of each measurement                                (3)
+ *   out=FILE      where to write the JSON                          (stdout)
+ *
+ * Each measurement reports every run's wall-clock seconds, and the best and
+ * mean of them.
+ */
+
+namespace stellar
+{
+
+namespace
+{
+
+struct BucketBenchSpec
+{
+    size_t entries{100000};
+    uint32_t accounts{60};
+    uint32_t trustlines{30};
+    uint32_t offers{10};
+    uint32_t deadPercent{10};
+    size_t shadows{4};
+    uint32_t ledgers{256};
+    size_t batch{100};
+    size_t repeat{3};
+    std::string out;
+
+    explicit BucketBenchSpec(std::string const& spec)
+    {
+        std::istringstream in(spec);
+        std::string setting;
+        while (std::getline(in, setting, ','))
+        {
+            if (setting.empty())
+            {
+                continue;
+            }
+            auto eq = setting.find('=');
+            if (eq == std::string::npos)
+            {
+                throw std::invalid_argument("bad benchmark setting: " +
+                                            setting);
+            }
+            std::string key = setting.substr(0, eq);
+            std::string value = setting.substr(eq + 1);
+            if (key == "out")
+            {
+                out = value;
+                continue;
+            }
+            size_t n = number(setting, value);
+            if (key == "entries")
+            {
+                entries = n;
+            }
+            else if (key == "accounts")
+            {
+                accounts = static_cast<uint32_t>(n);
+            }
+            else if (key == "trustlines")
+            {
+                trustlines = static_cast<uint32_t>(n);
+            }
+            else if (key == "offers")
+            {
+                offers = static_cast<uint32_t>(n);
+            }
+            else if (key == "dead")
+            {
+                deadPercent = static_cast<uint32_t>(n);
+            }
+            else if (key == "shadows")
+            {
+                shadows = n;
+            }
+            else if (key == "ledgers")
+            {
+                ledgers = static_cast<uint32_t>(n);
+            }
+            else if (key == "batch")
+            {
+                batch = n;
+            }
+            else if (key == "repeat")
+            {
+                repeat = n;
+            }
+            else
+            {
+                throw std::invalid_argument("unknown benchmark setting: " +
+                                            setting);
+            }
+        }
+        if (accounts + trustlines + offers == 0 || deadPercent > 100 ||
+            repeat == 0)
+        {
+            throw std::invalid_argument("bad benchmark settings: " + spec);
+        }
+    }
+
+    Json::Value
+    toJson() const
+    {
+        Json::Value v;
+        v["entries"] = Json::UInt64(entries);
+        v["accounts"] = accounts;
+        v["trustlines"] = trustlines;
+        v["offers"] = offers;
+        v["dead"] = deadPercent;
+        v["shadows"] = Json::UInt64(shadows);
+        v["ledgers"] = ledgers;
+        v["batch"] = Json::UInt64(batch);
+        v["repeat"] = Json::UInt64(repeat);
+        return v;
+    }
+
+  private:
+    static size_t
+    number(std::string const& setting, std::string const& value)
+    {
+        if (value.empty() ||
+            value.find_first_not_of("0123456789") != std::string::npos)
+        {
+            throw std::invalid_argument("bad benchmark setting: " + setting);
+        }
+        return static_cast<size_t>(std::stoull(value));
+    }
+};
+
+class BucketBenchmark
+{
+    BucketBenchSpec const& mSpec;
+    Application& mApp;
+    uint64_t mNextOfferID{1};
+    Currency mCurrency;
+    Json::Value mResults{Json::arrayValue};
+
+    static AccountID
+    randomAccountID()
+    {
+        AccountID id;
+        auto bytes = randomBytes(id.size());
+        std::copy(bytes.begin(), bytes.end(), id.begin());
+        return id;
+    }
+
+    // A new entry, of a type drawn from the configured mix, for a new key.
+    LedgerEntry
+    makeEntry()
+    {
+        uint32_t total = mSpec.accounts + mSpec.trustlines + mSpec.offers;
+        auto pick = static_cast<uint32_t>(rand_fraction() * total);
+        LedgerEntry e;
+        if (pick < mSpec.accounts)
+        {
+            e.type(ACCOUNT);
+            auto& ae = e.account();
+            ae.accountID = randomAccountID();
+            ae.balance = 1000000000;
+            ae.seqNum = 1;
+            ae.thresholds[0] = 1;
+            ae.homeDomain = "example.com";
+        }
+        else if (pick < mSpec.accounts + mSpec.trustlines)
+        {
+            e.type(TRUSTLINE);
+            auto& tl = e.trustLine();
+            tl.accountID = randomAccountID();
+            tl.currency = mCurrency;
+            tl.limit = 1000000;
+            tl.flags = AUTHORIZED_FLAG;
+        }
+        else
+        {
+            e.type(OFFER);
+            auto& oe = e.offer();
+            oe.accountID = randomAccountID();
+            oe.offerID = mNextOfferID++;
+            oe.takerGets = mCurrency;
+            oe.takerPays.type(CURRENCY_TYPE_NATIVE);
+            oe.amount = 100;
+            oe.price.n = 3;
+            oe.price.d = 2;
+        }
+        return e;
+    }
+
+    std::vector<LedgerEntry>
+    makeEntries(size_t n)
+    {
+        std::vector<LedgerEntry> entries;
+        entries.reserve(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            entries.push_back(makeEntry());
+        }
+        return entries;
+    }
+
+    // New states of `n` randomly chosen entries of `entries`.
+    static std::vector<LedgerEntry>
+    update(std::vector<LedgerEntry> const& entries, size_t n)
+    {
+        std::vector<LedgerEntry> updated;
+        if (entries.empty())
+        {
+            return updated;
+        }
+        std::uniform_int_distribution<size_t> dist(0, entries.size() - 1);
+        for (size_t i = 0; i < n; ++i)
+        {
+            LedgerEntry e = entries[dist(gRandomEngine)];
+            switch (e.type())
+            {
+            case ACCOUNT:
+                e.account().balance += 1;
+                e.account().seqNum += 1;
+                break;
+            case TRUSTLINE:
+                e.trustLine().balance += 1;
+                break;
+            case OFFER:
+                e.offer().amount += 1;
+                break;
+            }
+            updated.push_back(e);
+        }
+        return updated;
+    }
+
+    // Keys of `n` randomly chosen entries of `entries`.
+    static std::vector<LedgerKey>
+    remove(std::vector<LedgerEntry> const& entries, size_t n)
+    {
+        std::vector<LedgerKey> keys;
+        if (entries.empty())
+        {
+            return keys;
+        }
+        std::uniform_int_distribution<size_t> dist(0, entries.size() - 1);
+        for (size_t i = 0; i < n; ++i)
+        {
+            keys.push_back(LedgerEntryKey(entries[dist(gRandomEngine)]));
+        }
+        return keys;
+    }
+
+    // Run `f` `repeat` times and record the times taken, with `result`'s
+    // other fields describing the measurement.
+    template <typename F>
+    void
+    measure(Json::Value result, F f)
+    {
+        double best = 0, total = 0;
+        Json::Value& seconds = result["seconds"];
+        seconds = Json::Value(Json::arrayValue);
+        for (size_t i = 0; i < mSpec.repeat; ++i)
+        {
+            auto start = std::chrono::steady_clock::now();
+            f();
+            std::chrono::duration<double> d =
+                std::chrono::steady_clock::now() - start;
+            seconds.append(d.count());
+            best = (i == 0) ? d.count() : std::min(best, d.count());
+            total += d.count();
+        }
+        result["best"] = best;
+        result["mean"] = total / mSpec.repeat;
+        LOG(INFO) << "Benchmark " << result["name"].asString() << ": best "
+                  << best << "s, mean " << total / mSpec.repeat << "s";
+        mResults.append(result);
+    }
+
+    static Json::Value
+    describe(std::string const& name, std::shared_ptr<Bucket> const& b)
+    {
+        Json::Value v;
+        v["name"] = name;
+        auto counts = b->countLiveAndDeadEntries();
+        v["live"] = Json::UInt64(counts.first);
+        v["dead"] = Json::UInt64(counts.second);
+        v["bytes"] = Json::UInt64(b->getSize());
+        return v;
+    }
+
+  public:
+    BucketBenchmark(BucketBenchSpec const& spec, Application& app)
+        : mSpec(spec), mApp(app)
+    {
+        mCurrency.type(CURRENCY_TYPE_ALPHANUM);
+        strToCurrencyCode(mCurrency.alphaNum().currencyCode, "USD");
+        mCurrency.alphaNum().issuer = randomAccountID();
+    }
+
+    void
+    run(std::string const& applyDir)
+    {
+        BucketManager& bm = mApp.getBucketManager();
+        std::vector<LedgerKey> noDead;
+
+        // Bucket::fresh, of the older of the buckets merged below.
+        auto oldLive = makeEntries(mSpec.entries);
+        std::shared_ptr<Bucket> oldBucket;
+        {
+            Json::Value v;
+            v["name"] = "fresh";
+            v["entries"] = Json::UInt64(oldLive.size());
+            measure(v, [&]()
+                    {
+                        oldBucket = Bucket::fresh(bm, oldLive, noDead);
+                    });
+        }
+
+        // A newer bucket updating half as many entries as it adds, and
+        // deleting some; and shadows each updating a tenth as many.
+        auto newLive = update(oldLive, mSpec.entries / 3);
+        auto added = makeEntries(mSpec.entries - newLive.size());
+        newLive.insert(newLive.end(), added.begin(), added.end());
+        auto newBucket = Bucket::fresh(
+            bm, newLive, remove(oldLive, mSpec.entries * mSpec.deadPercent / 100));
+        std::vector<std::shared_ptr<Bucket>> shadows;
+        for (size_t i = 0; i < mSpec.shadows; ++i)
+        {
+            shadows.push_back(
+                Bucket::fresh(bm, update(oldLive, mSpec.entries / 10), noDead));
+        }
+
+        // Bucket::merge, under 0..N of the shadows.
+        std::shared_ptr<Bucket> merged;
+        for (size_t n = 0; n <= mSpec.shadows; ++n)
+        {
+            std::vector<std::shared_ptr<Bucket>> someShadows(
+                shadows.begin(), shadows.begin() + n);
+            Json::Value v;
+            v["name"] = "merge";
+            v["shadows"] = Json::UInt64(n);
+            v["old"] = describe("old", oldBucket);
+            v["new"] = describe("new", newBucket);
+            measure(v, [&]()
+                    {
+                        auto b = Bucket::merge(bm, oldBucket, newBucket,
+                                               someShadows);
+                        if (n == 0)
+                        {
+                            merged = b;
+                        }
+                    });
+        }
+
+        // BucketList::addBatch, over many ledgers; each run starts from an
+        // empty list, and includes the time spent waiting on merges.
+        {
+            Json::Value v;
+            v["name"] = "addBatch";
+            v["ledgers"] = mSpec.ledgers;
+            v["batch"] = Json::UInt64(mSpec.batch);
+            std::vector<LedgerEntry> known;
+            measure(v, [&]()
+                    {
+                        BucketList bl;
+                        for (uint32_t i = 1; i <= mSpec.ledgers; ++i)
+                        {
+                            mApp.getClock().crank(false);
+                            auto live = update(known, mSpec.batch / 2);
+                            auto fresh =
+                                makeEntries(mSpec.batch - live.size());
+                            known.insert(known.end(), fresh.begin(),
+                                         fresh.end());
+                            live.insert(live.end(), fresh.begin(),
+                                        fresh.end());
+                            bl.addBatch(mApp, i, live, noDead);
+                        }
+                    });
+        }
+
+        // Bucket::apply of the merged bucket, and Bucket::applyBulk of its
+        // inputs, each into an empty in-memory SQLite database. The database
+        // belongs to an application of its own, whose bucket directory is
+        // wiped as it starts, so as not to disturb the buckets above.
+        Config cfg(mApp.getConfig());
+        cfg.DATABASE = "sqlite3://:memory:";
+        cfg.TMP_DIR_PATH = applyDir + "/tmp";
+        cfg.BUCKET_DIR_PATH = applyDir + "/buckets";
+        {
+            Json::Value v = describe("apply", merged);
+            measure(v, [&]()
+                    {
+                        VirtualClock clock;
+                        auto app = Application::create(clock, cfg);
+                        merged->apply(app->getDatabase());
+                    });
+        }
+        {
+            Json::Value v;
+            v["name"] = "applyBulk";
+            v["old"] = describe("old", oldBucket);
+            v["new"] = describe("new", newBucket);
+            measure(v, [&]()
+                    {
+                        VirtualClock clock;
+                        auto app = Application::create(clock, cfg);
+                        Database& db = app->getDatabase();
+                        soci::transaction tx(db.getSession());
+                        Bucket::applyBulk(db, {newBucket, oldBucket});
+                        tx.commit();
+                    });
+        }
+    }
+
+    Json::Value const&
+    getResults() const
+    {
+        return mResults;
+    }
+};
+
+void
+cleanDir(std::string const& path)
+{
+    if (fs::exists(path))
+    {
+        fs::deltree(path);
+    }
+}
+}
+
+void
+benchBuckets(std::string const& specString, el::Level logLevel)
+{
+    BucketBenchSpec spec(specString);
+
+    Logging::setFmt("<bench>", false);
+    Logging::setLogLevel(logLevel, nullptr);
+    LOG(INFO) << "Benchmarking buckets of stellar-core " << STELLAR_CORE_VERSION;
+
+    Config cfg;
+    cfg.RUN_STANDALONE = true;
+    cfg.LOG_FILE_PATH = "bench.log";
+    cfg.TMP_DIR_PATH = "bench-tmp";
+    cfg.BUCKET_DIR_PATH = "bench-buckets";
+    std::string applyDir = "bench-apply";
+    cleanDir(cfg.TMP_DIR_PATH);
+    cleanDir(cfg.BUCKET_DIR_PATH);
+    cleanDir(applyDir);
+
+    Json::Value root;
+    {
+        VirtualClock clock;
+        Application::pointer app = Application::create(clock, cfg);
+        BucketBenchmark bench(spec, *app);
+        bench.run(applyDir);
+        root["version"] = STELLAR_CORE_VERSION;
+        root["spec"] = spec.toJson();
+        root["results"] = bench.getResults();
+    }
+
+    cleanDir(cfg.TMP_DIR_PATH);
+    cleanDir(cfg.BUCKET_DIR_PATH);
+    cleanDir(applyDir);
+
+    if (spec.out.empty())
+    {
+        std::cout << root.toStyledString();
+    }
+    else
+    {
+        std::ofstream out(spec.out);
+        out << root.toStyledString();
+        if (!out)
+        {
+            throw std::runtime_error("failed to write benchmark results: " +
+                                     spec.out);
+        }
+        LOG(INFO) << "Wrote benchmark results to " << spec.out;
+    }
+}
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "util/Logging.h"
+#include <string>
+
+namespace stellar
+{
+
+// Run the bucket benchmarks described by `spec` -- comma-separated key=value
+// settings, see bench.cpp -- and write their results as JSON. Throws
+// std::invalid_argument if `spec` cannot be parsed.
+void benchBuckets(std::string const& spec, el::Level logLevel);
+}
@@ -8,6 +8,7 @@
 #include "util/Timer.h"
 #include "util/Fs.h"
 #include "lib/util/getopt.h"
+#include "main/bench.h"
 #include "main/fuzz.h"
 #include "main/test.h"
 #include "main/Config.h"
@@ -33,6 +34,7 @@ enum opttag
     OPT_HELP,
     OPT_TEST,
     OPT_FUZZ,
+    OPT_BENCHBUCKETS,
     OPT_CONF,
     OPT_CMD,
     OPT_FORCESCP,
@@ -49,6 +51,7 @@ static const struct option stellar_core_options[] = {
     {"help", no_argument, nullptr, OPT_HELP},
     {"test", no_argument, nullptr, OPT_TEST},
     {"fuzz", required_argument, nullptr, OPT_FUZZ},
+    {"benchbuckets", optional_argument, nullptr, OPT_BENCHBUCKETS},
     {"conf", required_argument, nullptr, OPT_CONF},
     {"c", required_argument, nullptr, OPT_CMD},
     {"genseed", no_argument, nullptr, OPT_GENSEED},
@@ -70,6 +73,8 @@ usage(int err = 1)
           "      --version       To print version information\n"
           "      --test          To run self-tests\n"
           "      --fuzz FILE     To run a single fuzz input and exit\n"
+          "      --benchbuckets[=SPEC] To run the bucket benchmarks and "
+          "write their results as JSON\n"
           "      --metric METRIC Report metric METRIC on exit\n"
           "      --newdb         Creates or restores the DB to the genesis "
           "ledger\n"
@@ -259,6 +264,18 @@ main(int argc, char* const* argv)
         case OPT_FUZZ:
             fuzz(std::string(optarg), logLevel, metrics);
             return 0;
+        case OPT_BENCHBUCKETS:
+            try
+            {
+                benchBuckets(optarg ? std::string(optarg) : std::string(),
+                             logLevel);
+            }
+            catch (std::exception& e)
+            {
+                LOG(FATAL) << "Bucket benchmark failed: " << e.what();
+                return 1;
+            }
+            return 0;
         case OPT_CONF:
             cfgFile = std::string(optarg);
             break;
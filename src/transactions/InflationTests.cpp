@@ -44,7 +44,7 @@ createTestAccounts(Application& app, int nbAccounts,
 
     int64 setupBalance = lm.getMinBalance(0);
 
-    LedgerDelta delta(lm.getCurrentLedgerHeader());
+    TestDelta delta(app);
     for (int i = 0; i < nbAccounts; i++)
     {
         int64 bal = getBalance(i);
@@ -234,7 +234,7 @@ doInflation(Application& app, int nbAccounts,
 
     // perform actual inflation
     {
-        LedgerDelta delta(lm.getCurrentLedgerHeader());
+        TestDelta delta(app);
         REQUIRE(txFrame->apply(delta, app));
         delta.commit();
     }
@@ -324,9 +324,11 @@ closeLedgerOn(Application& app, uint32 ledgerSeq, int day, int month, int year,
     REQUIRE(app.getLedgerManager().getLedgerNum() == (ledgerSeq + 1));
 }
 
-TEST_CASE("inflation", "[tx][inflation]")
+static void
+testInflation(bool deferWrites)
 {
-    Config const& cfg = getTestConfig(0, Config::TESTDB_ON_DISK_SQLITE);
+    Config cfg(getTestConfig(0, Config::TESTDB_ON_DISK_SQLITE));
+    cfg.DEFER_LEDGER_WRITES = deferWrites;
 
     VirtualClock::time_point inflationStart;
     // inflation starts on 1-jul-2014
@@ -522,3 +524,13 @@ TEST_CASE("inflation", "[tx][inflation]")
         }
     }
 }
+
+TEST_CASE("inflation", "[tx][inflation]")
+{
+    testInflation(false);
+}
+
+TEST_CASE("inflation with deferred writes", "[tx][inflation][deferwrites]")
+{
+    testInflation(true);
+}
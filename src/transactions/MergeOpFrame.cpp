@@ -3,12 +3,9 @@
 // of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
 
 #include "transactions/MergeOpFrame.h"
-#include "crypto/Base58.h"
 #include "database/Database.h"
 #include "ledger/TrustFrame.h"
 
-using namespace soci;
-
 namespace stellar
 {
 MergeOpFrame::MergeOpFrame(Operation const& op, OperationResult& res,
@@ -41,31 +38,21 @@ MergeOpFrame::doApply(LedgerDelta& delta, LedgerManager& ledgerManager)
         return false;
     }
 
-    // TODO: remove direct SQL statements, use *Frame objects instead
-
-    std::string b58Account = toBase58Check(VER_ACCOUNT_ID, getSourceID());
-    {
-        auto timer = db.getSelectTimer("trust");
-        db.getSession() << "SELECT trustIndex from TrustLines where issuer=:v1 "
-                           "and balance>0 limit 1",
-            use(b58Account);
-    }
-    if (db.getSession().got_data())
+    if (TrustFrame::hasIssued(getSourceID(), db))
     {
         innerResult().code(ACCOUNT_MERGE_CREDIT_HELD);
         return false;
     }
 
+    std::vector<TrustFrame> retLines;
+    TrustFrame::loadLines(getSourceID(), retLines, db);
+    for (auto const& line : retLines)
     {
-        auto timer = db.getSelectTimer("trust");
-        db.getSession() << "SELECT trustIndex from TrustLines where "
-                           "accountID=:v1 and balance>0 limit 1",
-            use(b58Account);
-    }
-    if (db.getSession().got_data())
-    {
-        innerResult().code(ACCOUNT_MERGE_HAS_CREDIT);
-        return false;
+        if (line.getBalance() > 0)
+        {
+            innerResult().code(ACCOUNT_MERGE_HAS_CREDIT);
+            return false;
+        }
     }
 
     // delete offers
@@ -77,8 +64,6 @@ MergeOpFrame::doApply(LedgerDelta& delta, LedgerManager& ledgerManager)
     }
 
     // delete trust lines
-    std::vector<TrustFrame> retLines;
-    TrustFrame::loadLines(getSourceID(), retLines, db);
     for (auto line : retLines)
     {
         line.storeDelete(delta, db);
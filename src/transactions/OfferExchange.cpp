@@ -212,16 +212,23 @@ OfferExchange::convertWithOffers(
 
     Database& db = mLedgerManager.getDatabase();
 
-    size_t offerOffset = 0;
+    // where the last page of offers ended: offers before it have been
+    // crossed, and taken ones deleted
+    OfferFrame::Position cursor;
+    OfferFrame::Position const* after = nullptr;
 
     bool needMore = (maxWheatReceive > 0 && maxSheepSend > 0);
 
     while (needMore)
     {
         std::vector<OfferFrame> retList;
-        OfferFrame::loadBestOffers(5, offerOffset, sheep, wheat, retList, db);
+        OfferFrame::loadBestOffers(5, after, sheep, wheat, retList, db);
 
-        offerOffset += retList.size();
+        if (!retList.empty())
+        {
+            cursor = retList.back().getPosition();
+            after = &cursor;
+        }
 
         for (auto wheatOffer : retList)
         {
@@ -247,8 +254,6 @@ OfferExchange::convertWithOffers(
             switch (cor)
             {
             case eOfferTaken:
-                assert(offerOffset > 0);
-                offerOffset--; // adjust offset as an offer was deleted
                 break;
             case eOfferPartial:
                 break;
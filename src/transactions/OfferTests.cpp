@@ -28,9 +28,11 @@ typedef std::unique_ptr<Application> appPtr;
 // Offer for something you can't hold
 // Offer with line full (both accounts)
 
-TEST_CASE("create offer", "[tx][offers]")
+static void
+testCreateOffer(bool deferWrites)
 {
-    Config const& cfg = getTestConfig();
+    Config cfg(getTestConfig());
+    cfg.DEFER_LEDGER_WRITES = deferWrites;
 
     VirtualClock clock;
     Application::pointer appPtr = Application::create(clock, cfg);
@@ -62,7 +64,7 @@ TEST_CASE("create offer", "[tx][offers]")
 
     const Price oneone(1, 1);
 
-    LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+    TestDelta delta(app);
 
     SECTION("account a1 does not exist")
     {
@@ -864,3 +866,13 @@ TEST_CASE("create offer", "[tx][offers]")
         }
     }
 }
+
+TEST_CASE("create offer", "[tx][offers]")
+{
+    testCreateOffer(false);
+}
+
+TEST_CASE("create offer with deferred writes", "[tx][offers][deferwrites]")
+{
+    testCreateOffer(true);
+}
@@ -30,9 +30,11 @@ typedef std::unique_ptr<Application> appPtr;
 // Credit -> Credit -> Credit -> Credit Payment
 // path payment where there isn't enough in the path
 // path payment with a transfer rate
-TEST_CASE("payment", "[tx][payment]")
+static void
+testPayment(bool deferWrites)
 {
-    Config const& cfg = getTestConfig();
+    Config cfg(getTestConfig());
+    cfg.DEFER_LEDGER_WRITES = deferWrites;
 
     VirtualClock clock;
     Application::pointer appPtr = Application::create(clock, cfg);
@@ -101,7 +103,7 @@ TEST_CASE("payment", "[tx][payment]")
     REQUIRE(rootAccount.getBalance() ==
             (100000000000000000 - paymentAmount - gatewayPayment - txfee * 2));
 
-    LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+    TestDelta delta(app);
     SECTION("send XLM to an existing account")
     {
         applyPaymentTx(app, root, a1, rootSeq++, morePayment);
@@ -413,6 +415,16 @@ TEST_CASE("payment", "[tx][payment]")
     }
 }
 
+TEST_CASE("payment", "[tx][payment]")
+{
+    testPayment(false);
+}
+
+TEST_CASE("payment with deferred writes", "[tx][payment][deferwrites]")
+{
+    testPayment(true);
+}
+
 TEST_CASE("single payment tx SQL", "[singlesql][paymentsql][hide]")
 {
     Config::TestDbMode mode = Config::TESTDB_ON_DISK_SQLITE;
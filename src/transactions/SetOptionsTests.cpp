@@ -25,9 +25,11 @@ typedef std::unique_ptr<Application> appPtr;
 // try setting high threshold ones without the correct sigs
 // make sure it doesn't allow us to add signers when we don't have the
 // minbalance
-TEST_CASE("set options", "[tx][setoptions]")
+static void
+testSetOptions(bool deferWrites)
 {
-    Config const& cfg = getTestConfig();
+    Config cfg(getTestConfig());
+    cfg.DEFER_LEDGER_WRITES = deferWrites;
 
     VirtualClock clock;
     Application::pointer appPtr = Application::create(clock, cfg);
@@ -127,3 +129,13 @@ TEST_CASE("set options", "[tx][setoptions]")
     // set thresholds
     // set signer
 }
+
+TEST_CASE("set options", "[tx][setoptions]")
+{
+    testSetOptions(false);
+}
+
+TEST_CASE("set options with deferred writes", "[tx][setoptions][deferwrites]")
+{
+    testSetOptions(true);
+}
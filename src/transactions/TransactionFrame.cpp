@@ -14,7 +14,8 @@
 #include "crypto/SecretKey.h"
 #include "database/Database.h"
 #include "crypto/Hex.h"
-#include <cereal/external/base64.hpp>
+#include "database/BulkInserter.h"
+#include "util/make_unique.h"
 
 namespace stellar
 {
@@ -408,6 +409,92 @@ TransactionFrame::apply(LedgerDelta& delta, Application& app)
     return true;
 }
 
+static void
+addAccountKey(AccountID const& accountID,
+              std::set<LedgerKey, LedgerEntryIdCmp>& keys)
+{
+    LedgerKey key;
+    key.type(ACCOUNT);
+    key.account().accountID = accountID;
+    keys.insert(key);
+}
+
+static void
+addTrustLineKey(AccountID const& accountID, Currency const& currency,
+                std::set<LedgerKey, LedgerEntryIdCmp>& keys)
+{
+    // issuers have no trust line of their own
+    if (currency.type() == CURRENCY_TYPE_NATIVE ||
+        currency.alphaNum().issuer == accountID)
+    {
+        return;
+    }
+    LedgerKey key;
+    key.type(TRUSTLINE);
+    key.trustLine().accountID = accountID;
+    key.trustLine().currency = currency;
+    keys.insert(key);
+}
+
+void
+TransactionFrame::addPrefetchKeys(
+    std::set<LedgerKey, LedgerEntryIdCmp>& keys) const
+{
+    addAccountKey(getSourceID(), keys);
+    for (auto const& op : mEnvelope.tx.operations)
+    {
+        AccountID const& source =
+            op.sourceAccount ? *op.sourceAccount : getSourceID();
+        addAccountKey(source, keys);
+        switch (op.body.type())
+        {
+        case PAYMENT:
+        {
+            auto const& payment = op.body.paymentOp();
+            addAccountKey(payment.destination, keys);
+            addTrustLineKey(payment.destination, payment.currency, keys);
+            addTrustLineKey(source, payment.path.empty() ? payment.currency
+                                                         : payment.path[0],
+                            keys);
+        }
+        break;
+        case CREATE_OFFER:
+        {
+            auto const& offer = op.body.createOfferOp();
+            addTrustLineKey(source, offer.takerGets, keys);
+            addTrustLineKey(source, offer.takerPays, keys);
+            if (offer.offerID != 0)
+            {
+                LedgerKey key;
+                key.type(OFFER);
+                key.offer().accountID = source;
+                key.offer().offerID = offer.offerID;
+                keys.insert(key);
+            }
+        }
+        break;
+        case CHANGE_TRUST:
+            addTrustLineKey(source, op.body.changeTrustOp().line, keys);
+            break;
+        case ALLOW_TRUST:
+        {
+            auto const& allow = op.body.allowTrustOp();
+            Currency currency;
+            currency.type(CURRENCY_TYPE_ALPHANUM);
+            currency.alphaNum().currencyCode = allow.currency.currencyCode();
+            currency.alphaNum().issuer = source;
+            addTrustLineKey(allow.trustor, currency, keys);
+        }
+        break;
+        case ACCOUNT_MERGE:
+            addAccountKey(op.body.destination(), keys);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
 StellarMessage
 TransactionFrame::toStellarMessage() const
 {
@@ -420,44 +507,35 @@ TransactionFrame::toStellarMessage() const
 void
 TransactionFrame::storeTransaction(LedgerManager& ledgerManager,
                                    LedgerDelta const& delta, int txindex,
-                                   SHA256& resultHasher) const
+                                   SHA256& resultHasher,
+                                   BulkInserter& history) const
 {
     auto txBytes(xdr::xdr_to_opaque(mEnvelope));
     auto txResultBytes(xdr::xdr_to_opaque(getResultPair()));
 
     resultHasher.add(txResultBytes);
 
-    std::string txBody = base64::encode(
-        reinterpret_cast<const unsigned char*>(txBytes.data()), txBytes.size());
-
-    std::string txResult = base64::encode(
-        reinterpret_cast<const unsigned char*>(txResultBytes.data()),
-        txResultBytes.size());
-
     xdr::opaque_vec<> txMeta(delta.getTransactionMeta());
 
-    std::string meta = base64::encode(
-        reinterpret_cast<const unsigned char*>(txMeta.data()), txMeta.size());
-
-    string txIDString(binToHex(getContentsHash()));
-
-    auto timer = ledgerManager.getDatabase().getInsertTimer("txhistory");
-    soci::statement st =
-        (ledgerManager.getDatabase().getSession().prepare
-             << "INSERT INTO TxHistory (txID, ledgerSeq, txindex, TxBody, "
-                "TxResult, TxMeta) VALUES "
-                "(:id,:seq,:txindex,:txb,:txres,:meta)",
-         soci::use(txIDString),
-         soci::use(ledgerManager.getCurrentLedgerHeader().ledgerSeq),
-         soci::use(txindex), soci::use(txBody), soci::use(txResult),
-         soci::use(meta));
-
-    st.execute(true);
+    history.addRow(
+        {binToHex(getContentsHash()),
+         std::to_string(ledgerManager.getCurrentLedgerHeader().ledgerSeq),
+         std::to_string(txindex),
+         BulkInserter::Value::binary(
+             std::string(txBytes.begin(), txBytes.end())),
+         BulkInserter::Value::binary(
+             std::string(txResultBytes.begin(), txResultBytes.end())),
+         BulkInserter::Value::binary(
+             std::string(txMeta.begin(), txMeta.end()))});
+}
 
-    if (st.get_affected_rows() != 1)
-    {
-        throw std::runtime_error("Could not update data in SQL");
-    }
+std::unique_ptr<BulkInserter>
+TransactionFrame::makeBulkInserter(Database& db, soci::session& session)
+{
+    return make_unique<BulkInserter>(
+        db, session, "TxHistory",
+        std::vector<std::string>{"txID", "ledgerSeq", "txindex", "TxBody",
+                                 "TxResult", "TxMeta"});
 }
 
 static void
@@ -491,7 +569,7 @@ TransactionFrame::copyTransactionsToStream(Database& db, soci::session& sess,
                                            XDROutputFileStream& txResultOut)
 {
     auto timer = db.getSelectTimer("txhistory");
-    std::string txBody, txResult, txMeta;
+    BinaryColumn txBody(db, sess), txResult(db, sess);
     uint32_t begin = ledgerSeq, end = ledgerSeq + ledgerCount;
     size_t n = 0;
 
@@ -500,10 +578,12 @@ TransactionFrame::copyTransactionsToStream(Database& db, soci::session& sess,
 
     assert(begin <= end);
     soci::statement st =
-        (sess.prepare << "SELECT ledgerSeq, TxBody, TxResult FROM TxHistory "
+        (sess.prepare << "SELECT ledgerSeq, " << txBody.select("TxBody")
+                      << ", " << txResult.select("TxResult")
+                      << " FROM TxHistory "
                          "WHERE ledgerSeq >= :begin AND ledgerSeq < :end ORDER "
                          "BY ledgerSeq ASC, txindex ASC",
-         soci::into(curLedgerSeq), soci::into(txBody), soci::into(txResult),
+         soci::into(curLedgerSeq), txBody.into(), txResult.into(),
          soci::use(begin), soci::use(end));
 
     Hash h;
@@ -528,8 +608,8 @@ TransactionFrame::copyTransactionsToStream(Database& db, soci::session& sess,
             lastLedgerSeq = curLedgerSeq;
         }
 
-        std::string body = base64::decode(txBody);
-        std::string result = base64::decode(txResult);
+        std::string body = txBody.get();
+        std::string result = txResult.get();
 
         xdr::xdr_get g1(body.data(), body.data() + body.size());
         xdr_argpack_archive(g1, tx);
@@ -560,19 +640,25 @@ TransactionFrame::copyTransactionsToStream(Database& db, soci::session& sess,
 }
 
 void
-TransactionFrame::dropAll(Database& db)
+TransactionFrame::createHistoryTable(Database& db)
 {
-    db.getSession() << "DROP TABLE IF EXISTS TxHistory";
-
+    std::string binary = BinaryColumn::sqlType(db);
     db.getSession() << "CREATE TABLE TxHistory ("
                        "txID          CHARACTER(64) NOT NULL,"
                        "ledgerSeq     INT NOT NULL CHECK (ledgerSeq >= 0),"
                        "txindex         INT NOT NULL,"
-                       "TxBody        TEXT NOT NULL,"
-                       "TxResult      TEXT NOT NULL,"
-                       "TxMeta        TEXT NOT NULL,"
+                       "TxBody        " << binary << " NOT NULL,"
+                       "TxResult      " << binary << " NOT NULL,"
+                       "TxMeta        " << binary << " NOT NULL,"
                        "PRIMARY KEY (txID, ledgerSeq),"
                        "UNIQUE      (ledgerSeq, txindex)"
                        ")";
 }
+
+void
+TransactionFrame::dropAll(Database& db)
+{
+    db.getSession() << "DROP TABLE IF EXISTS TxHistory";
+    createHistoryTable(db);
+}
 }
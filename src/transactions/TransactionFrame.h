@@ -22,6 +22,7 @@ We can get it in from the DB or from the wire
 namespace stellar
 {
 class Application;
+class BulkInserter;
 class OperationFrame;
 class LedgerDelta;
 class SecretKey;
@@ -133,15 +134,24 @@ class TransactionFrame
     // returns true if successfully applied
     bool apply(LedgerDelta& delta, Application& app);
 
+    // add to `keys` the entries that applying this transaction will load, as
+    // far as they can be told from the envelope; see EntryFrame::prefetch
+    void addPrefetchKeys(std::set<LedgerKey, LedgerEntryIdCmp>& keys) const;
+
     StellarMessage toStellarMessage() const;
 
     AccountFrame::pointer loadAccount(Application& app,
                                       AccountID const& accountID);
 
-    // transaction history
+    // transaction history: add this transaction's row, as applied through
+    // `delta`, to `history` (from makeBulkInserter), written once the ledger
+    // is closed
     void storeTransaction(LedgerManager& ledgerManager,
                           LedgerDelta const& delta, int txindex,
-                          SHA256& resultHasher) const;
+                          SHA256& resultHasher, BulkInserter& history) const;
+
+    static std::unique_ptr<BulkInserter>
+    makeBulkInserter(Database& db, soci::session& session);
 
     /*
     txOut: stream of TransactionHistoryEntry
@@ -152,6 +162,7 @@ class TransactionFrame
                                            uint32_t ledgerCount,
                                            XDROutputFileStream& txOut,
                                            XDROutputFileStream& txResultOut);
+    static void createHistoryTable(Database& db);
     static void dropAll(Database& db);
 };
 }
@@ -29,9 +29,11 @@ typedef std::unique_ptr<Application> appPtr;
     double spend
 */
 
-TEST_CASE("txenvelope", "[tx][envelope]")
+static void
+testTxEnvelope(bool deferWrites)
 {
-    Config const& cfg = getTestConfig();
+    Config cfg(getTestConfig());
+    cfg.DEFER_LEDGER_WRITES = deferWrites;
 
     VirtualClock clock;
     Application::pointer appPtr = Application::create(clock, cfg);
@@ -50,7 +52,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
     SECTION("outer envelope")
     {
         TransactionFramePtr txFrame;
-        LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+        TestDelta delta(app);
 
         SECTION("no signature")
         {
@@ -131,7 +133,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
             tx->getEnvelope().signatures.clear();
             tx->addSignature(s1);
 
-            LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+            TestDelta delta(app);
 
             tx->apply(delta, app);
             REQUIRE(tx->getResultCode() == txBAD_AUTH);
@@ -147,7 +149,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
             tx->getEnvelope().signatures.clear();
             tx->addSignature(s2);
 
-            LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+            TestDelta delta(app);
 
             tx->apply(delta, app);
             REQUIRE(tx->getResultCode() == txFAILED);
@@ -162,7 +164,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
             tx->addSignature(s1);
             tx->addSignature(s2);
 
-            LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+            TestDelta delta(app);
 
             tx->apply(delta, app);
             REQUIRE(tx->getResultCode() == txSUCCESS);
@@ -183,7 +185,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
             te.tx.seqNum = rootSeq++;
             TransactionFrame tx(te);
             tx.addSignature(root);
-            LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+            TestDelta delta(app);
 
             REQUIRE(!tx.checkValid(app, 0));
 
@@ -214,8 +216,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
 
                 SECTION("missing signature")
                 {
-                    LedgerDelta delta(
-                        app.getLedgerManager().getCurrentLedgerHeader());
+                    TestDelta delta(app);
 
                     REQUIRE(!tx->checkValid(app, 0));
                     tx->apply(delta, app);
@@ -227,8 +228,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
                 SECTION("success")
                 {
                     tx->addSignature(b1);
-                    LedgerDelta delta(
-                        app.getLedgerManager().getCurrentLedgerHeader());
+                    TestDelta delta(app);
 
                     REQUIRE(tx->checkValid(app, 0));
                     tx->apply(delta, app);
@@ -263,8 +263,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
                     tx->addSignature(a1);
                     tx->addSignature(b1);
 
-                    LedgerDelta delta(
-                        app.getLedgerManager().getCurrentLedgerHeader());
+                    TestDelta delta(app);
 
                     REQUIRE(!tx->checkValid(app, 0));
 
@@ -301,8 +300,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
                     tx->addSignature(a1);
                     tx->addSignature(b1);
 
-                    LedgerDelta delta(
-                        app.getLedgerManager().getCurrentLedgerHeader());
+                    TestDelta delta(app);
 
                     REQUIRE(tx->checkValid(app, 0));
 
@@ -338,8 +336,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
                     tx->addSignature(a1);
                     tx->addSignature(b1);
 
-                    LedgerDelta delta(
-                        app.getLedgerManager().getCurrentLedgerHeader());
+                    TestDelta delta(app);
 
                     REQUIRE(tx->checkValid(app, 0));
 
@@ -381,8 +378,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
                 tx->addSignature(b1);
                 tx->addSignature(c1);
 
-                LedgerDelta delta(
-                    app.getLedgerManager().getCurrentLedgerHeader());
+                TestDelta delta(app);
 
                 REQUIRE(tx->checkValid(app, 0));
 
@@ -421,7 +417,7 @@ TEST_CASE("txenvelope", "[tx][envelope]")
         REQUIRE(app.getLedgerManager().getLedgerNum() == 3);
 
         {
-            LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+            TestDelta delta(app);
 
             SECTION("Insufficient fee")
             {
@@ -473,3 +469,13 @@ TEST_CASE("txenvelope", "[tx][envelope]")
         }
     }
 }
+
+TEST_CASE("txenvelope", "[tx][envelope]")
+{
+    testTxEnvelope(false);
+}
+
+TEST_CASE("txenvelope with deferred writes", "[tx][envelope][deferwrites]")
+{
+    testTxEnvelope(true);
+}
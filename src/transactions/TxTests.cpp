@@ -13,12 +13,15 @@
 #include "util/types.h"
 #include "transactions/TransactionFrame.h"
 #include "ledger/LedgerDelta.h"
+#include "ledger/LedgerManager.h"
+#include "database/Database.h"
 #include "transactions/PaymentOpFrame.h"
 #include "transactions/ChangeTrustOpFrame.h"
 #include "transactions/CreateOfferOpFrame.h"
 #include "transactions/SetOptionsOpFrame.h"
 #include "transactions/AllowTrustOpFrame.h"
 #include "transactions/InflationOpFrame.h"
+#include <exception>
 
 using namespace stellar;
 using namespace stellar::txtest;
@@ -28,6 +31,44 @@ namespace stellar
 {
 namespace txtest
 {
+TestDelta::TestDelta(Application& app)
+    : mBase(&app.getLedgerManager().getCurrentLedgerHeader())
+    , mKeepChanges(app.getConfig().DEFER_LEDGER_WRITES)
+{
+    Database& db = app.getDatabase();
+    if (!mKeepChanges)
+    {
+        // changes to entries are written as they are made
+        mDelta = make_unique<LedgerDelta>(*mBase);
+    }
+    else if (db.getOpenDelta())
+    {
+        LedgerDelta& outer = db.getOpenDelta()->getInnermost();
+        mBase = &outer.getHeader();
+        mDelta = make_unique<LedgerDelta>(outer);
+    }
+    else
+    {
+        mDelta = make_unique<LedgerDelta>(*mBase, db, true);
+    }
+}
+
+TestDelta::~TestDelta()
+{
+    if (mKeepChanges && !std::uncaught_exception())
+    {
+        mDelta->getHeader() = *mBase;
+        mDelta->commit();
+    }
+}
+
+void
+TestDelta::commit()
+{
+    mDelta->commit();
+    mKeepChanges = false;
+}
+
 SecretKey
 getRoot()
 {
@@ -133,7 +174,7 @@ applyAllowTrust(Application& app, SecretKey& from, SecretKey& trustor,
     TransactionFramePtr txFrame;
     txFrame = createAllowTrust(from, trustor, seq, currencyCode, authorize);
 
-    LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+    TestDelta delta(app);
     txFrame->apply(delta, app);
 
     checkTransaction(*txFrame);
@@ -171,7 +212,7 @@ applyPaymentTx(Application& app, SecretKey& from, SecretKey& to,
 
     txFrame = createPaymentTx(from, to, seq, amount);
 
-    LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+    TestDelta delta(app);
     txFrame->apply(delta, app);
 
     checkTransaction(*txFrame);
@@ -211,7 +252,7 @@ applyChangeTrust(Application& app, SecretKey& from, SecretKey& to,
 
     txFrame = createChangeTrust(from, to, seq, currencyCode, limit);
 
-    LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+    TestDelta delta(app);
     txFrame->apply(delta, app);
 
     checkTransaction(*txFrame);
@@ -260,7 +301,7 @@ applyCreditPaymentTx(Application& app, SecretKey& from, SecretKey& to,
 
     txFrame = createCreditPaymentTx(from, to, ci, seq, amount, path);
 
-    LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+    TestDelta delta(app);
     txFrame->apply(delta, app);
 
     checkTransaction(*txFrame);
@@ -430,7 +471,7 @@ applySetOptions(Application& app, SecretKey& source, AccountID* inflationDest,
     txFrame = createSetOptions(source, inflationDest, setFlags, clearFlags,
                                thrs, signer, seq);
 
-    LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+    TestDelta delta(app);
     txFrame->apply(delta, app);
 
     checkTransaction(*txFrame);
@@ -453,7 +494,7 @@ applyInflation(Application& app, SecretKey& from, SequenceNumber seq,
 {
     TransactionFramePtr txFrame = createInflation(from, seq);
 
-    LedgerDelta delta(app.getLedgerManager().getCurrentLedgerHeader());
+    TestDelta delta(app);
     bool res = txFrame->apply(delta, app);
 
     checkTransaction(*txFrame);
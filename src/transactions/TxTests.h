@@ -6,16 +6,45 @@
 
 #include "generated/StellarXDR.h"
 #include "crypto/SecretKey.h"
+#include "ledger/LedgerDelta.h"
+#include <memory>
 
 namespace stellar
 {
 class TransactionFrame;
-class LedgerDelta;
 class OperationFrame;
 typedef std::shared_ptr<TransactionFrame> TransactionFramePtr;
 namespace txtest
 {
 
+// The delta to apply transactions with, over the current ledger: its changes
+// to ledger entries are kept, and those to the ledger header only if it is
+// committed. When the application defers ledger writes
+// (Config::DEFER_LEDGER_WRITES), it nests in the delta open in the database
+// if there is one, or else opens one, and keeps its changes by committing
+// when destroyed.
+class TestDelta
+{
+    std::unique_ptr<LedgerDelta> mDelta;
+    LedgerHeader* mBase; // the header mDelta commits to
+    bool mKeepChanges;   // commit when destroyed
+
+  public:
+    explicit TestDelta(Application& app);
+    ~TestDelta();
+
+    operator LedgerDelta&()
+    {
+        return *mDelta;
+    }
+    LedgerHeaderFrame&
+    getHeaderFrame()
+    {
+        return mDelta->getHeaderFrame();
+    }
+    void commit();
+};
+
 SecretKey getRoot();
 
 SecretKey getAccount(const char* n);
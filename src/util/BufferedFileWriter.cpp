@@ -0,0 +1,422 @@
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "util/BufferedFileWriter.h"
+#include "crypto/ByteSlice.h"
+#include "crypto/SHA.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <malloc.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace stellar
+{
+
+size_t const BufferedFileWriter::kDefaultBufferBytes;
+size_t const BufferedFileWriter::kBufferAlignment;
+
+static char*
+allocAligned(size_t n)
+{
+#ifdef _WIN32
+    void* p = _aligned_malloc(n, BufferedFileWriter::kBufferAlignment);
+#else
+    void* p = nullptr;
+    if (posix_memalign(&p, BufferedFileWriter::kBufferAlignment, n) != 0)
+    {
+        p = nullptr;
+    }
+#endif
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return static_cast<char*>(p);
+}
+
+static void
+freeAligned(char* p)
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+BufferedFileWriter::BufferedFileWriter(size_t bufferBytes)
+    : mCapacity(std::max(bufferBytes, kBufferAlignment))
+{
+    mBuf = allocAligned(mCapacity);
+}
+
+BufferedFileWriter::~BufferedFileWriter()
+{
+    closeFile();
+    freeAligned(mBuf);
+}
+
+void
+BufferedFileWriter::setHasher(SHA256* hasher)
+{
+    mHasher = hasher;
+}
+
+void
+BufferedFileWriter::growBuffer(size_t capacity)
+{
+    assert(mUsed == 0);
+    // Round up to the alignment, so buffer-sized writes stay aligned too.
+    capacity = (capacity + kBufferAlignment - 1) & ~(kBufferAlignment - 1);
+    char* buf = allocAligned(capacity);
+    freeAligned(mBuf);
+    mBuf = buf;
+    mCapacity = capacity;
+}
+
+char*
+BufferedFileWriter::reserve(size_t n)
+{
+    assert(isOpen());
+    if (mCapacity - mUsed < n)
+    {
+        flushBuffer();
+        if (mCapacity < n)
+        {
+            growBuffer(n);
+        }
+    }
+    return mBuf + mUsed;
+}
+
+void
+BufferedFileWriter::commit(size_t n)
+{
+    assert(mUsed + n <= mCapacity);
+    mUsed += n;
+}
+
+void
+BufferedFileWriter::write(char const* data, size_t n)
+{
+    while (n > 0)
+    {
+        if (mUsed == mCapacity)
+        {
+            flushBuffer();
+        }
+        size_t chunk = std::min(n, mCapacity - mUsed);
+        memcpy(mBuf + mUsed, data, chunk);
+        mUsed += chunk;
+        data += chunk;
+        n -= chunk;
+    }
+}
+
+void
+BufferedFileWriter::sync()
+{
+    assert(isOpen());
+    flushBuffer();
+    syncFile();
+}
+
+#ifdef _WIN32
+
+bool
+BufferedFileWriter::isOpen() const
+{
+    return mFile != nullptr;
+}
+
+void
+BufferedFileWriter::open(std::string const& filename, size_t preallocateBytes)
+{
+    closeFile();
+    HANDLE f = CreateFile(filename.c_str(), GENERIC_WRITE, 0, nullptr,
+                          CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (f == INVALID_HANDLE_VALUE)
+    {
+        throw std::runtime_error("failed to open file for writing: " +
+                                 filename);
+    }
+    mFile = f;
+    mFilename = filename;
+    mUsed = 0;
+    mBytesWritten = 0;
+    mPreallocated = 0;
+
+    if (preallocateBytes > 0)
+    {
+        FILE_ALLOCATION_INFO info;
+        info.AllocationSize.QuadPart = static_cast<LONGLONG>(preallocateBytes);
+        if (SetFileInformationByHandle(f, FileAllocationInfo, &info,
+                                       sizeof(info)))
+        {
+            mPreallocated = preallocateBytes;
+        }
+    }
+}
+
+void
+BufferedFileWriter::reopen(std::string const& filename, size_t keepBytes,
+                           size_t preallocateBytes)
+{
+    closeFile();
+    HANDLE f = CreateFile(filename.c_str(), GENERIC_WRITE, 0, nullptr,
+                          OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (f == INVALID_HANDLE_VALUE)
+    {
+        throw std::runtime_error("failed to open file for writing: " +
+                                 filename);
+    }
+    mFile = f;
+    mFilename = filename;
+    mUsed = 0;
+    mBytesWritten = keepBytes;
+    mPreallocated = 0;
+
+    LARGE_INTEGER size, offset;
+    offset.QuadPart = static_cast<LONGLONG>(keepBytes);
+    if (!GetFileSizeEx(f, &size) || size.QuadPart < offset.QuadPart ||
+        !SetFilePointerEx(f, offset, nullptr, FILE_BEGIN) || !SetEndOfFile(f))
+    {
+        closeFile();
+        throw std::runtime_error("failed to truncate file: " + filename);
+    }
+
+    if (preallocateBytes > keepBytes)
+    {
+        FILE_ALLOCATION_INFO info;
+        info.AllocationSize.QuadPart = static_cast<LONGLONG>(preallocateBytes);
+        if (SetFileInformationByHandle(f, FileAllocationInfo, &info,
+                                       sizeof(info)))
+        {
+            mPreallocated = preallocateBytes;
+        }
+    }
+}
+
+void
+BufferedFileWriter::flushBuffer()
+{
+    if (mUsed == 0)
+    {
+        return;
+    }
+    if (mHasher)
+    {
+        mHasher->add(ByteSlice(mBuf, mUsed));
+    }
+    DWORD written = 0;
+    if (!WriteFile(static_cast<HANDLE>(mFile), mBuf, static_cast<DWORD>(mUsed),
+                   &written, nullptr) ||
+        written != mUsed)
+    {
+        throw std::runtime_error("failed writing file: " + mFilename);
+    }
+    mBytesWritten += mUsed;
+    mUsed = 0;
+}
+
+void
+BufferedFileWriter::close(bool durable)
+{
+    assert(isOpen());
+    flushBuffer();
+    // Allocation beyond the end of file is released when the handle closes.
+    if (durable)
+    {
+        syncFile();
+    }
+    closeFile();
+}
+
+void
+BufferedFileWriter::syncFile()
+{
+    if (!FlushFileBuffers(static_cast<HANDLE>(mFile)))
+    {
+        throw std::runtime_error("failed to sync file: " + mFilename);
+    }
+}
+
+void
+BufferedFileWriter::closeFile()
+{
+    if (mFile)
+    {
+        CloseHandle(static_cast<HANDLE>(mFile));
+        mFile = nullptr;
+    }
+}
+
+#else
+
+bool
+BufferedFileWriter::isOpen() const
+{
+    return mFd != -1;
+}
+
+#ifdef __linux__
+// Reserve blocks for bytes [offset, offset + len) of `fd` without changing its
+// size. Best effort: unlike posix_fallocate, which glibc emulates by writing
+// zeros where the filesystem has no fallocate, this fails right away there.
+static bool
+preallocate(int fd, off_t offset, off_t len)
+{
+    return fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len) == 0;
+}
+#endif
+
+void
+BufferedFileWriter::open(std::string const& filename, size_t preallocateBytes)
+{
+    closeFile();
+    mFd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (mFd == -1)
+    {
+        std::string msg("failed to open file for writing: ");
+        throw std::runtime_error(msg + filename + ": " + strerror(errno));
+    }
+    mFilename = filename;
+    mUsed = 0;
+    mBytesWritten = 0;
+    mPreallocated = 0;
+
+#ifdef __linux__
+    if (preallocateBytes > 0 &&
+        preallocate(mFd, 0, static_cast<off_t>(preallocateBytes)))
+    {
+        mPreallocated = preallocateBytes;
+    }
+#endif
+}
+
+void
+BufferedFileWriter::reopen(std::string const& filename, size_t keepBytes,
+                           size_t preallocateBytes)
+{
+    closeFile();
+    mFd = ::open(filename.c_str(), O_WRONLY);
+    if (mFd == -1)
+    {
+        std::string msg("failed to open file for writing: ");
+        throw std::runtime_error(msg + filename + ": " + strerror(errno));
+    }
+    mFilename = filename;
+    mUsed = 0;
+    mBytesWritten = keepBytes;
+    mPreallocated = 0;
+
+    struct stat st;
+    auto keep = static_cast<off_t>(keepBytes);
+    if (fstat(mFd, &st) != 0 || st.st_size < keep ||
+        ftruncate(mFd, keep) != 0 || lseek(mFd, keep, SEEK_SET) != keep)
+    {
+        closeFile();
+        throw std::runtime_error("failed to truncate file: " + filename);
+    }
+
+#ifdef __linux__
+    if (preallocateBytes > keepBytes &&
+        preallocate(mFd, keep,
+                    static_cast<off_t>(preallocateBytes - keepBytes)))
+    {
+        mPreallocated = preallocateBytes;
+    }
+#endif
+}
+
+void
+BufferedFileWriter::flushBuffer()
+{
+    if (mUsed == 0)
+    {
+        return;
+    }
+    if (mHasher)
+    {
+        mHasher->add(ByteSlice(mBuf, mUsed));
+    }
+    size_t done = 0;
+    while (done < mUsed)
+    {
+        ssize_t n = ::write(mFd, mBuf + done, mUsed - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::string msg("failed writing file: ");
+            throw std::runtime_error(msg + mFilename + ": " + strerror(errno));
+        }
+        done += static_cast<size_t>(n);
+    }
+    mBytesWritten += mUsed;
+    mUsed = 0;
+}
+
+void
+BufferedFileWriter::close(bool durable)
+{
+    assert(isOpen());
+    flushBuffer();
+#ifdef __linux__
+    // Release the blocks preallocated beyond the end of the file; best effort,
+    // as they were reserved.
+    if (mPreallocated > mBytesWritten)
+    {
+        fallocate(mFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  static_cast<off_t>(mBytesWritten),
+                  static_cast<off_t>(mPreallocated - mBytesWritten));
+    }
+#endif
+    if (durable)
+    {
+        syncFile();
+    }
+    closeFile();
+}
+
+void
+BufferedFileWriter::syncFile()
+{
+#ifdef __linux__
+    int r = fdatasync(mFd);
+#else
+    int r = fsync(mFd);
+#endif
+    if (r != 0)
+    {
+        std::string msg("failed to sync file: ");
+        throw std::runtime_error(msg + mFilename + ": " + strerror(errno));
+    }
+}
+
+void
+BufferedFileWriter::closeFile()
+{
+    if (mFd != -1)
+    {
+        ::close(mFd);
+        mFd = -1;
+    }
+}
+
+#endif
+}
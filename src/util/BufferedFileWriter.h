@@ -0,0 +1,101 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "util/NonCopyable.h"
+#include <cstddef>
+#include <string>
+
+namespace stellar
+{
+
+class SHA256;
+
+/**
+ * Write-only file with a large, page-aligned buffer, for writing big files
+ * sequentially -- in particular bucket files -- with few system calls.
+ *
+ * Data is copied (or serialized in place, see `reserve`) into the buffer and
+ * written out a whole buffer at a time. If a hasher is attached, it is fed the
+ * same whole buffers just before they are written, rather than one record at a
+ * time. Blocks for the file's expected size can be reserved when it is opened,
+ * without changing its size, to limit fragmentation and metadata updates as it
+ * grows; those left unused are released by `close`. `close` can also make its
+ * contents durable (fdatasync) before the caller renames it into place.
+ */
+class BufferedFileWriter : NonMovableOrCopyable
+{
+    char* mBuf{nullptr};
+    size_t mCapacity;
+    size_t mUsed{0};
+    size_t mBytesWritten{0};
+    size_t mPreallocated{0};
+    SHA256* mHasher{nullptr};
+    std::string mFilename;
+#ifdef _WIN32
+    void* mFile{nullptr};
+#else
+    int mFd{-1};
+#endif
+
+    void flushBuffer();
+    void growBuffer(size_t capacity);
+    void closeFile();
+    void syncFile();
+
+  public:
+    static const size_t kDefaultBufferBytes = 4 * 1024 * 1024;
+    static const size_t kBufferAlignment = 4096;
+
+    explicit BufferedFileWriter(size_t bufferBytes = kDefaultBufferBytes);
+
+    // Closes the file if still open, without syncing or reporting errors.
+    ~BufferedFileWriter();
+
+    // Create or truncate `filename`, reserving `preallocateBytes` of space
+    // for it where the platform and filesystem support that (nothing is
+    // written to reserve it). Throws std::runtime_error on failure.
+    void open(std::string const& filename, size_t preallocateBytes = 0);
+
+    // Open the existing file `filename`, cut it to its first `keepBytes` bytes
+    // and continue writing after them, as if they had just been written (but
+    // without hashing them). Used to resume writing a file whose prefix is
+    // known to be good, after a restart. Throws std::runtime_error on failure,
+    // including if the file is shorter than `keepBytes`.
+    void reopen(std::string const& filename, size_t keepBytes,
+                size_t preallocateBytes = 0);
+
+    // Feed everything written from now on to `hasher` (which must outlive the
+    // writes), or stop hashing if null.
+    void setHasher(SHA256* hasher);
+
+    // Return space for `n` contiguous bytes in the buffer, to be filled by the
+    // caller and committed with `commit(n)` before any other call.
+    char* reserve(size_t n);
+    void commit(size_t n);
+
+    // Append `n` bytes from `data`.
+    void write(char const* data, size_t n);
+
+    // Write out buffered data, trim any unused preallocated space and, if
+    // `durable`, wait for the file's contents to reach stable storage. Throws
+    // std::runtime_error on failure.
+    void close(bool durable);
+
+    // Write out buffered data and wait for everything written so far to reach
+    // stable storage, leaving the file open. Throws std::runtime_error on
+    // failure.
+    void sync();
+
+    bool isOpen() const;
+
+    // Total bytes appended so far, including those still buffered.
+    size_t
+    getBytesWritten() const
+    {
+        return mBytesWritten + mUsed;
+    }
+};
+}
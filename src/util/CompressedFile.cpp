@@ -0,0 +1,366 @@
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "util/CompressedFile.h"
+#include "crypto/ByteSlice.h"
+#include "crypto/SHA.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace stellar
+{
+
+size_t const CompressedFileWriter::kBlockBytes;
+
+static char const kMagic[4] = {'S', 'C', 'Z', '1'};
+
+// Trailer: raw size, block count and magic.
+static const size_t kTrailerBytes = 8 + 4 + sizeof(kMagic);
+static const size_t kBlockHeaderBytes = 4 + 4;
+static const size_t kIndexEntryBytes = 8 + 8;
+
+// Bucket files are rewritten by every merge, so favour speed over ratio; the
+// repetitive records that dominate them compress well at low levels anyway.
+static const int kCompressionLevel = 3;
+
+static void
+putU32(char* p, uint32_t v)
+{
+    for (int i = 3; i >= 0; --i)
+    {
+        p[i] = static_cast<char>(v & 0xFF);
+        v >>= 8;
+    }
+}
+
+static void
+putU64(char* p, uint64_t v)
+{
+    for (int i = 7; i >= 0; --i)
+    {
+        p[i] = static_cast<char>(v & 0xFF);
+        v >>= 8;
+    }
+}
+
+static uint32_t
+getU32(char const* p)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        v = (v << 8) | static_cast<uint8_t>(p[i]);
+    }
+    return v;
+}
+
+static uint64_t
+getU64(char const* p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+        v = (v << 8) | static_cast<uint8_t>(p[i]);
+    }
+    return v;
+}
+
+static void
+checkZlibSupport(std::string const& filename)
+{
+#ifndef USE_ZLIB
+    throw std::runtime_error("compressed files not supported in this build: " +
+                             filename);
+#endif
+}
+
+CompressedFileWriter::CompressedFileWriter() : mRaw(kBlockBytes)
+{
+}
+
+void
+CompressedFileWriter::open(std::string const& filename,
+                           size_t preallocateBytes)
+{
+    checkZlibSupport(filename);
+    mOut.open(filename, preallocateBytes);
+    mOut.write(kMagic, sizeof(kMagic));
+    mUsed = 0;
+    mRawBytes = 0;
+    mBlocks.clear();
+}
+
+void
+CompressedFileWriter::setHasher(SHA256* hasher)
+{
+    mHasher = hasher;
+}
+
+bool
+CompressedFileWriter::isOpen() const
+{
+    return mOut.isOpen();
+}
+
+char*
+CompressedFileWriter::reserve(size_t n)
+{
+    assert(isOpen());
+    if (mRaw.size() - mUsed < n)
+    {
+        flushBlock();
+        if (mRaw.size() < n)
+        {
+            mRaw.resize(n);
+        }
+    }
+    return mRaw.data() + mUsed;
+}
+
+void
+CompressedFileWriter::commit(size_t n)
+{
+    assert(mUsed + n <= mRaw.size());
+    mUsed += n;
+    if (mUsed >= kBlockBytes)
+    {
+        flushBlock();
+    }
+}
+
+void
+CompressedFileWriter::write(char const* data, size_t n)
+{
+    while (n > 0)
+    {
+        // `commit` flushes full blocks, so there is always room here.
+        size_t chunk = std::min(n, kBlockBytes - mUsed);
+        memcpy(mRaw.data() + mUsed, data, chunk);
+        commit(chunk);
+        data += chunk;
+        n -= chunk;
+    }
+}
+
+void
+CompressedFileWriter::flushBlock()
+{
+    if (mUsed == 0)
+    {
+        return;
+    }
+    if (mHasher)
+    {
+        mHasher->add(ByteSlice(mRaw.data(), mUsed));
+    }
+#ifdef USE_ZLIB
+    uLongf compLen = compressBound(static_cast<uLong>(mUsed));
+    if (mCompressed.size() < compLen)
+    {
+        mCompressed.resize(compLen);
+    }
+    if (compress2(reinterpret_cast<Bytef*>(mCompressed.data()), &compLen,
+                  reinterpret_cast<Bytef const*>(mRaw.data()),
+                  static_cast<uLong>(mUsed), kCompressionLevel) != Z_OK)
+    {
+        throw std::runtime_error("failed to compress block");
+    }
+
+    mBlocks.emplace_back(mRawBytes, mOut.getBytesWritten());
+    char header[kBlockHeaderBytes];
+    putU32(header, static_cast<uint32_t>(mUsed));
+    putU32(header + 4, static_cast<uint32_t>(compLen));
+    mOut.write(header, sizeof(header));
+    mOut.write(mCompressed.data(), compLen);
+#endif
+    mRawBytes += mUsed;
+    mUsed = 0;
+}
+
+void
+CompressedFileWriter::close(bool durable)
+{
+    assert(isOpen());
+    flushBlock();
+    char entry[kIndexEntryBytes];
+    for (auto const& b : mBlocks)
+    {
+        putU64(entry, b.first);
+        putU64(entry + 8, b.second);
+        mOut.write(entry, sizeof(entry));
+    }
+    char trailer[kTrailerBytes];
+    putU64(trailer, mRawBytes);
+    putU32(trailer + 8, static_cast<uint32_t>(mBlocks.size()));
+    memcpy(trailer + 12, kMagic, sizeof(kMagic));
+    mOut.write(trailer, sizeof(trailer));
+    mOut.close(durable);
+}
+
+bool
+CompressedFileReader::isCompressed(std::string const& filename)
+{
+    std::ifstream in(filename, std::ifstream::binary);
+    char magic[sizeof(kMagic)];
+    return in.read(magic, sizeof(magic)) &&
+           memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+}
+
+void
+CompressedFileReader::open(std::string const& filename)
+{
+    checkZlibSupport(filename);
+    close();
+    mFilename = filename;
+    mIn.open(filename, std::ifstream::binary);
+    if (!mIn)
+    {
+        throw std::runtime_error("failed to open compressed file: " + filename);
+    }
+
+    char magic[sizeof(kMagic)];
+    char trailer[kTrailerBytes];
+    mIn.seekg(0, std::ifstream::end);
+    auto fileSize = static_cast<uint64_t>(mIn.tellg());
+    mIn.seekg(0);
+    if (fileSize < sizeof(kMagic) + kTrailerBytes ||
+        !mIn.read(magic, sizeof(magic)) ||
+        memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+        !mIn.seekg(fileSize - kTrailerBytes) ||
+        !mIn.read(trailer, sizeof(trailer)) ||
+        memcmp(trailer + 12, kMagic, sizeof(kMagic)) != 0)
+    {
+        throw std::runtime_error("malformed compressed file: " + filename);
+    }
+    mRawSize = getU64(trailer);
+    uint64_t nBlocks = getU32(trailer + 8);
+
+    uint64_t indexBytes = nBlocks * kIndexEntryBytes;
+    if (indexBytes > fileSize - sizeof(kMagic) - kTrailerBytes)
+    {
+        throw std::runtime_error("malformed compressed file: " + filename);
+    }
+    std::vector<char> index(static_cast<size_t>(indexBytes));
+    mIn.seekg(fileSize - kTrailerBytes - indexBytes);
+    if (!mIn.read(index.data(), index.size()))
+    {
+        throw std::runtime_error("malformed compressed file: " + filename);
+    }
+    for (size_t i = 0; i < nBlocks; ++i)
+    {
+        uint64_t rawOffset = getU64(index.data() + i * kIndexEntryBytes);
+        uint64_t fileOffset = getU64(index.data() + i * kIndexEntryBytes + 8);
+        bool ordered = mBlockRawOffsets.empty()
+                           ? rawOffset == 0
+                           : rawOffset > mBlockRawOffsets.back();
+        if (!ordered || rawOffset >= mRawSize)
+        {
+            throw std::runtime_error("malformed compressed file: " + filename);
+        }
+        mBlockRawOffsets.push_back(rawOffset);
+        mBlockFileOffsets.push_back(fileOffset);
+    }
+    if (nBlocks == 0 && mRawSize != 0)
+    {
+        throw std::runtime_error("malformed compressed file: " + filename);
+    }
+}
+
+void
+CompressedFileReader::close()
+{
+    mIn.close();
+    mIn.clear();
+    mBlockRawOffsets.clear();
+    mBlockFileOffsets.clear();
+    mRawSize = 0;
+    mBlock = SIZE_MAX;
+    mPos = 0;
+}
+
+bool
+CompressedFileReader::isOpen() const
+{
+    return mIn.is_open();
+}
+
+void
+CompressedFileReader::seek(size_t pos)
+{
+    mPos = pos;
+}
+
+void
+CompressedFileReader::loadBlock(size_t i)
+{
+    uint64_t expectedLen =
+        (i + 1 < mBlockRawOffsets.size() ? mBlockRawOffsets[i + 1] : mRawSize) -
+        mBlockRawOffsets[i];
+
+    char header[kBlockHeaderBytes];
+    mIn.clear();
+    if (!mIn.seekg(mBlockFileOffsets[i]) || !mIn.read(header, sizeof(header)))
+    {
+        throw std::runtime_error("malformed compressed file: " + mFilename);
+    }
+    uint32_t rawLen = getU32(header);
+    uint32_t compLen = getU32(header + 4);
+    if (rawLen != expectedLen)
+    {
+        throw std::runtime_error("malformed compressed file: " + mFilename);
+    }
+    if (mCompressed.size() < compLen)
+    {
+        mCompressed.resize(compLen);
+    }
+    if (!mIn.read(mCompressed.data(), compLen))
+    {
+        throw std::runtime_error("malformed compressed file: " + mFilename);
+    }
+
+    // Mark the buffer invalid until it holds the whole block.
+    mBlock = SIZE_MAX;
+    mRaw.resize(rawLen);
+#ifdef USE_ZLIB
+    uLongf destLen = rawLen;
+    if (uncompress(reinterpret_cast<Bytef*>(mRaw.data()), &destLen,
+                   reinterpret_cast<Bytef const*>(mCompressed.data()),
+                   compLen) != Z_OK ||
+        destLen != rawLen)
+    {
+        throw std::runtime_error("malformed compressed file: " + mFilename);
+    }
+#endif
+    mBlock = i;
+}
+
+size_t
+CompressedFileReader::read(char* buf, size_t n)
+{
+    assert(isOpen());
+    size_t done = 0;
+    while (done < n && mPos < mRawSize)
+    {
+        if (mBlock == SIZE_MAX || mPos < mBlockRawOffsets[mBlock] ||
+            mPos >= mBlockRawOffsets[mBlock] + mRaw.size())
+        {
+            auto i = std::upper_bound(mBlockRawOffsets.begin(),
+                                      mBlockRawOffsets.end(), mPos);
+            loadBlock((i - mBlockRawOffsets.begin()) - 1);
+        }
+        size_t offset = mPos - static_cast<size_t>(mBlockRawOffsets[mBlock]);
+        size_t chunk = std::min(n - done, mRaw.size() - offset);
+        memcpy(buf + done, mRaw.data() + offset, chunk);
+        done += chunk;
+        mPos += chunk;
+    }
+    return done;
+}
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "util/BufferedFileWriter.h"
+#include "util/NonCopyable.h"
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace stellar
+{
+
+class SHA256;
+
+/**
+ * Block-compressed files, used for bucket files when Config::BUCKET_COMPRESS
+ * is set. The file holds a byte stream -- its "raw" contents -- cut into
+ * blocks of about `kBlockBytes`, each compressed independently with zlib,
+ * followed by an index of the blocks so that a reader can seek to any raw
+ * offset by decompressing a single block:
+ *
+ *   magic      "SCZ1"
+ *   blocks     rawLen:u32 compLen:u32 followed by compLen bytes of zlib data
+ *   index      rawOffset:u64 fileOffset:u64 for each block
+ *   trailer    rawSize:u64 nBlocks:u32 magic "SCZ1"
+ *
+ * Integers are big-endian. Blocks are cut without regard to the structure of
+ * the raw contents; in bucket files, XDR records may span blocks. The magic's
+ * first byte has its high bit clear, whereas an XDR record stream begins with
+ * a record mark that has it set, so the two kinds of file can be told apart.
+ *
+ * Both classes throw std::runtime_error on I/O errors and malformed files,
+ * and in builds without zlib (see USE_ZLIB) when opening a file.
+ */
+
+class CompressedFileWriter : NonMovableOrCopyable
+{
+    BufferedFileWriter mOut;
+    std::vector<char> mRaw;
+    size_t mUsed{0};
+    std::vector<char> mCompressed;
+    std::vector<std::pair<uint64_t, uint64_t>> mBlocks;
+    uint64_t mRawBytes{0};
+    SHA256* mHasher{nullptr};
+
+    void flushBlock();
+
+  public:
+    static const size_t kBlockBytes = 256 * 1024;
+
+    CompressedFileWriter();
+
+    // Create or truncate `filename`; see BufferedFileWriter::open.
+    void open(std::string const& filename, size_t preallocateBytes = 0);
+
+    // Feed the raw contents written from now on to `hasher`, or stop hashing
+    // if null.
+    void setHasher(SHA256* hasher);
+
+    // Return space for `n` contiguous raw bytes, to be filled by the caller
+    // and committed with `commit(n)` before any other call.
+    char* reserve(size_t n);
+    void commit(size_t n);
+
+    // Append `n` raw bytes from `data`.
+    void write(char const* data, size_t n);
+
+    // Compress and write out the last block, the index and the trailer; see
+    // BufferedFileWriter::close.
+    void close(bool durable);
+
+    bool isOpen() const;
+
+    // Raw bytes appended so far.
+    size_t
+    getBytesWritten() const
+    {
+        return mRawBytes + mUsed;
+    }
+};
+
+class CompressedFileReader : NonMovableOrCopyable
+{
+    std::ifstream mIn;
+    std::string mFilename;
+    std::vector<uint64_t> mBlockRawOffsets;
+    std::vector<uint64_t> mBlockFileOffsets;
+    uint64_t mRawSize{0};
+    size_t mBlock{SIZE_MAX};
+    std::vector<char> mRaw;
+    std::vector<char> mCompressed;
+    size_t mPos{0};
+
+    void loadBlock(size_t i);
+
+  public:
+    // Whether `filename` starts with the magic of a block-compressed file.
+    static bool isCompressed(std::string const& filename);
+
+    // Open `filename` and read its block index.
+    void open(std::string const& filename);
+    void close();
+    bool isOpen() const;
+
+    // Size of the raw contents.
+    size_t
+    size() const
+    {
+        return static_cast<size_t>(mRawSize);
+    }
+
+    // Raw offset of the next byte to be read.
+    size_t
+    pos() const
+    {
+        return mPos;
+    }
+
+    void seek(size_t pos);
+
+    // Read up to `n` raw bytes into `buf`, returning how many were read; fewer
+    // than `n` only at the end of the file.
+    size_t read(char* buf, size_t n);
+};
+}
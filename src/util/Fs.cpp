@@ -71,6 +71,34 @@ deltree(std::string const& d)
     }
 }
 
+std::vector<std::string>
+findfiles(std::string const& path,
+          std::function<bool(std::string const& name)> predicate)
+{
+    std::vector<std::string> res;
+    WIN32_FIND_DATA data;
+    HANDLE h = FindFirstFile((path + "\\*").c_str(), &data);
+    if (h == INVALID_HANDLE_VALUE)
+    {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND)
+        {
+            return res;
+        }
+        throw std::runtime_error("FindFirstFile failed in findfiles");
+    }
+    do
+    {
+        std::string name(data.cFileName);
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+            predicate(name))
+        {
+            res.push_back(name);
+        }
+    } while (FindNextFile(h, &data));
+    FindClose(h);
+    return res;
+}
+
 long
 getCurrentPid()
 {
@@ -102,6 +130,7 @@ processExists(long pid)
 
 #else
 #include <ftw.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <cerrno>
@@ -163,6 +192,31 @@ deltree(std::string const& d)
     }
 }
 
+std::vector<std::string>
+findfiles(std::string const& path,
+          std::function<bool(std::string const& name)> predicate)
+{
+    std::vector<std::string> res;
+    DIR* dir = opendir(path.c_str());
+    if (!dir)
+    {
+        std::string msg("opendir failed in findfiles: ");
+        throw std::runtime_error(msg + path);
+    }
+    while (struct dirent* ent = readdir(dir))
+    {
+        std::string name(ent->d_name);
+        struct stat buf;
+        if (stat((path + "/" + name).c_str(), &buf) == 0 &&
+            S_ISREG(buf.st_mode) && predicate(name))
+        {
+            res.push_back(name);
+        }
+    }
+    closedir(dir);
+    return res;
+}
+
 long
 getCurrentPid()
 {
@@ -4,7 +4,9 @@
 // under the Apache License, Version 2.0. See the COPYING file at the root
 // of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
 
+#include <functional>
 #include <string>
+#include <vector>
 
 namespace stellar
 {
@@ -34,6 +36,12 @@ void deltree(std::string const& path);
 // Make a single dir; not mkdir-p, i.e. non-recursive
 bool mkdir(std::string const& path);
 
+// Names (not paths) of the regular files directly inside dir `path` for which
+// `predicate` returns true
+std::vector<std::string>
+findfiles(std::string const& path,
+          std::function<bool(std::string const& name)> predicate);
+
 ////
 // Utility functions for constructing path names
 ////
@@ -0,0 +1,134 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <map>
+#include <utility>
+
+namespace stellar
+{
+
+/**
+ * Bounded key-value cache with least-recently-used eviction. Keys are ordered
+ * by `Cmp`, so any type with a strict weak ordering can be used (in particular
+ * LedgerKeys, with LedgerEntryIdCmp). Not threadsafe.
+ */
+template <typename K, typename V, typename Cmp = std::less<K>> class LRUCache
+{
+    typedef std::list<std::pair<K, V>> List;
+    typedef std::map<K, typename List::iterator, Cmp> Map;
+
+    size_t mMaxSize;
+    List mList; // most recently used at front
+    Map mMap;
+
+    size_t mHits{0};
+    size_t mMisses{0};
+    size_t mEvictions{0};
+
+  public:
+    explicit LRUCache(size_t maxSize) : mMaxSize(maxSize)
+    {
+        assert(maxSize > 0);
+    }
+
+    size_t
+    size() const
+    {
+        return mMap.size();
+    }
+
+    size_t
+    getMaxSize() const
+    {
+        return mMaxSize;
+    }
+
+    size_t
+    getHits() const
+    {
+        return mHits;
+    }
+
+    size_t
+    getMisses() const
+    {
+        return mMisses;
+    }
+
+    size_t
+    getEvictions() const
+    {
+        return mEvictions;
+    }
+
+    // Insert or replace the value for `k`, evicting the least recently used
+    // entry if the cache is full.
+    void
+    put(K const& k, V const& v)
+    {
+        auto i = mMap.find(k);
+        if (i != mMap.end())
+        {
+            i->second->second = v;
+            mList.splice(mList.begin(), mList, i->second);
+            return;
+        }
+        if (mMap.size() >= mMaxSize)
+        {
+            mMap.erase(mList.back().first);
+            mList.pop_back();
+            ++mEvictions;
+        }
+        mList.emplace_front(k, v);
+        mMap.emplace(k, mList.begin());
+    }
+
+    // Return a pointer to the value for `k`, marking it most recently used, or
+    // nullptr if `k` is not cached. The pointer is valid until the next call
+    // that modifies the cache.
+    V*
+    get(K const& k)
+    {
+        auto i = mMap.find(k);
+        if (i == mMap.end())
+        {
+            ++mMisses;
+            return nullptr;
+        }
+        ++mHits;
+        mList.splice(mList.begin(), mList, i->second);
+        return &i->second->second;
+    }
+
+    bool
+    exists(K const& k) const
+    {
+        return mMap.find(k) != mMap.end();
+    }
+
+    void
+    erase(K const& k)
+    {
+        auto i = mMap.find(k);
+        if (i != mMap.end())
+        {
+            mList.erase(i->second);
+            mMap.erase(i);
+        }
+    }
+
+    void
+    clear()
+    {
+        mList.clear();
+        mMap.clear();
+    }
+};
+}
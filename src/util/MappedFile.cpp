@@ -0,0 +1,218 @@
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "util/MappedFile.h"
+#include "util/Logging.h"
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace stellar
+{
+
+MappedFile::MappedFile(MappedFile&& other)
+{
+    *this = std::move(other);
+}
+
+MappedFile&
+MappedFile::operator=(MappedFile&& other)
+{
+    if (this != &other)
+    {
+        close();
+        std::swap(mData, other.mData);
+        std::swap(mSize, other.mSize);
+#ifdef _WIN32
+        std::swap(mFile, other.mFile);
+        std::swap(mMapping, other.mMapping);
+#else
+        std::swap(mFd, other.mFd);
+#endif
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+#ifdef _WIN32
+
+void
+MappedFile::open(std::string const& filename)
+{
+    close();
+    HANDLE f = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                          nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                          nullptr);
+    if (f == INVALID_HANDLE_VALUE)
+    {
+        std::string msg("failed to open file for mapping: ");
+        throw std::runtime_error(msg + filename);
+    }
+    mFile = f;
+
+    LARGE_INTEGER sz;
+    if (!GetFileSizeEx(f, &sz))
+    {
+        close();
+        std::string msg("failed to get size of file: ");
+        throw std::runtime_error(msg + filename);
+    }
+    mSize = static_cast<size_t>(sz.QuadPart);
+    if (mSize == 0)
+    {
+        return;
+    }
+
+    HANDLE m = CreateFileMapping(f, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m == nullptr)
+    {
+        close();
+        std::string msg("failed to create mapping of file: ");
+        throw std::runtime_error(msg + filename);
+    }
+    mMapping = m;
+
+    void* p = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    if (p == nullptr)
+    {
+        close();
+        std::string msg("failed to map file: ");
+        throw std::runtime_error(msg + filename);
+    }
+    mData = static_cast<char const*>(p);
+}
+
+void
+MappedFile::close()
+{
+    if (mData)
+    {
+        UnmapViewOfFile(mData);
+        mData = nullptr;
+    }
+    if (mMapping)
+    {
+        CloseHandle(static_cast<HANDLE>(mMapping));
+        mMapping = nullptr;
+    }
+    if (mFile)
+    {
+        CloseHandle(static_cast<HANDLE>(mFile));
+        mFile = nullptr;
+    }
+    mSize = 0;
+}
+
+void
+MappedFile::advise(Advice a, size_t begin, size_t end)
+{
+    // Sequential access was already requested when opening the file; there is
+    // no per-mapping equivalent of madvise worth calling here.
+}
+
+#else
+
+void
+MappedFile::open(std::string const& filename)
+{
+    close();
+    mFd = ::open(filename.c_str(), O_RDONLY);
+    if (mFd == -1)
+    {
+        std::string msg("failed to open file for mapping: ");
+        throw std::runtime_error(msg + filename + ": " + strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(mFd, &st) != 0)
+    {
+        std::string msg("failed to stat file: ");
+        msg += filename + ": " + strerror(errno);
+        close();
+        throw std::runtime_error(msg);
+    }
+    mSize = static_cast<size_t>(st.st_size);
+    if (mSize == 0)
+    {
+        return;
+    }
+
+    void* p = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, mFd, 0);
+    if (p == MAP_FAILED)
+    {
+        std::string msg("failed to map file: ");
+        msg += filename + ": " + strerror(errno);
+        close();
+        throw std::runtime_error(msg);
+    }
+    mData = static_cast<char const*>(p);
+}
+
+void
+MappedFile::close()
+{
+    if (mData)
+    {
+        munmap(const_cast<char*>(mData), mSize);
+        mData = nullptr;
+    }
+    if (mFd != -1)
+    {
+        ::close(mFd);
+        mFd = -1;
+    }
+    mSize = 0;
+}
+
+void
+MappedFile::advise(Advice a, size_t begin, size_t end)
+{
+    end = std::min(end, mSize);
+    if (!mData || begin >= end)
+    {
+        return;
+    }
+    // madvise takes a page-aligned start
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    begin -= begin % page;
+    int adv = MADV_NORMAL;
+    switch (a)
+    {
+    case ADVICE_NORMAL:
+        adv = MADV_NORMAL;
+        break;
+    case ADVICE_SEQUENTIAL:
+        adv = MADV_SEQUENTIAL;
+        break;
+    case ADVICE_RANDOM:
+        adv = MADV_RANDOM;
+        break;
+    case ADVICE_WILLNEED:
+        adv = MADV_WILLNEED;
+        break;
+    }
+    if (madvise(const_cast<char*>(mData) + begin, end - begin, adv) != 0)
+    {
+        // Advice is only a hint; failing to give it is not an error.
+        CLOG(DEBUG, "Fs") << "madvise failed: " << strerror(errno);
+    }
+}
+
+#endif
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include "util/NonCopyable.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace stellar
+{
+
+/**
+ * Read-only memory mapping of an entire file. The mapping is established by
+ * `open` and released by `close` or on destruction. A zero-length file opens
+ * successfully and maps nothing (data() is null, size() is 0).
+ *
+ * This is intended for files that are immutable once written -- in particular
+ * bucket files -- so that readers can walk their contents in place rather than
+ * copying them through a stream buffer.
+ */
+class MappedFile : NonCopyable
+{
+    char const* mData{nullptr};
+    size_t mSize{0};
+#ifdef _WIN32
+    void* mFile{nullptr};
+    void* mMapping{nullptr};
+#else
+    int mFd{-1};
+#endif
+
+  public:
+    // Access pattern hints passed through to the OS (madvise on POSIX; ignored
+    // on platforms without an equivalent).
+    enum Advice
+    {
+        ADVICE_NORMAL,
+        ADVICE_SEQUENTIAL,
+        ADVICE_RANDOM,
+        ADVICE_WILLNEED
+    };
+
+    MappedFile() = default;
+    MappedFile(MappedFile&& other);
+    MappedFile& operator=(MappedFile&& other);
+    ~MappedFile();
+
+    // Map `filename` read-only; throws std::runtime_error on failure.
+    void open(std::string const& filename);
+    void close();
+
+    // Hint the expected access pattern for the bytes [begin, end) of the
+    // mapping, by default all of it.
+    void advise(Advice a, size_t begin = 0, size_t end = SIZE_MAX);
+
+    bool
+    isOpen() const
+    {
+#ifdef _WIN32
+        return mFile != nullptr;
+#else
+        return mFd != -1;
+#endif
+    }
+
+    char const*
+    data() const
+    {
+        return mData;
+    }
+
+    size_t
+    size() const
+    {
+        return mSize;
+    }
+};
+}